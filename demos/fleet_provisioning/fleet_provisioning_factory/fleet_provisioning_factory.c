@@ -0,0 +1,546 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Factory line provisioning of many devices from one host.
+ *
+ * Each device is a PKCS #11 slot holding the credentials of the device, and a
+ * serial number. A pool of worker threads, bounded by the concurrency limit,
+ * provisions the devices with the Fleet Provisioning workflow of
+ * fleet_provisioning_keys_cert_demo.c. For each device, a worker opens a
+ * session on the slot of the device, loads the claim credentials into it, and
+ * runs the workflow on its own MQTT agent instance connected with the claim
+ * credentials. The client identifier of the instance is the serial number of
+ * the device. The durations of the phases of each device are reported at the
+ * end.
+ *
+ * Usage: fleet_provisioning_factory <concurrency> <slot>:<serial> ...
+ */
+
+/* Standard includes. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* POSIX includes. */
+#include <pthread.h>
+
+/* Demo config. */
+#include "demo_config.h"
+
+/* corePKCS11 includes. */
+#include "core_pkcs11.h"
+#include "core_pkcs11_config.h"
+
+/* MQTT agent include. */
+#include "mqtt_agent.h"
+#include "mqtt_agent_scheduler.h"
+
+/* Transport includes. */
+#include "mbedtls_pkcs11_memory.h"
+#include "mbedtls_pkcs11_session_pool.h"
+#include "mbedtls_pkcs11_secure_arena.h"
+
+/* Clock for the durations. */
+#include "clock.h"
+
+/* Demo includes. */
+#include "pkcs11_operations.h"
+#include "fleet_provisioning_keys_cert_demo.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Maximum number of devices provisioned concurrently.
+ */
+#define FACTORY_MAX_CONCURRENCY    ( 64U )
+
+/**
+ * @brief A device to provision, and the result of its provisioning.
+ */
+typedef struct FactoryDevice
+{
+    CK_SLOT_ID slotId;            /**< @brief PKCS #11 slot of the device. */
+    char * pSerialNumber;         /**< @brief Serial number, also used as the MQTT client identifier. */
+
+    int result;                   /**< @brief 0 if the device is provisioned; -1 otherwise. */
+    ProvisioningTiming_t timing;
+} FactoryDevice_t;
+
+/**
+ * @brief Devices shared by the workers.
+ */
+typedef struct FactoryLine
+{
+    FactoryDevice_t * pDevices;
+    size_t deviceCount;
+    size_t nextDevice;            /**< @brief Index of the next device to provision. */
+    pthread_mutex_t mutex;        /**< @brief Protects #nextDevice. */
+} FactoryLine_t;
+
+/**
+ * @brief Parameters of the thread serving the agent instance of a device.
+ */
+typedef struct AgentThreadParam
+{
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    CK_SESSION_HANDLE p11Session;
+} AgentThreadParam_t;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief The provisioning template name, which the workflow does not modify.
+ */
+static char provisioningTemplateName[] = PROVISIONING_TEMPLATE_NAME;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Thread serving the agent instance of a device until it is stopped.
+ *
+ * @param[in] pParam #AgentThreadParam_t of the instance.
+ */
+static void * agentThread( void * pParam );
+
+/**
+ * @brief Open a session on the slot of a device and log in.
+ *
+ * @param[in] slotId Slot of the device.
+ * @param[out] pP11Session The opened session.
+ *
+ * @return true on success.
+ */
+static bool openDeviceSession( CK_SLOT_ID slotId,
+                               CK_SESSION_HANDLE * pP11Session );
+
+/**
+ * @brief Provision one device on its own session and agent instance.
+ *
+ * @param[in,out] pDevice The device. Its result and timing are set.
+ */
+static void provisionDevice( FactoryDevice_t * pDevice );
+
+/**
+ * @brief Worker provisioning the devices of the line one after the other
+ * until none is left.
+ *
+ * @param[in] pParam #FactoryLine_t of the devices.
+ */
+static void * workerThread( void * pParam );
+
+/**
+ * @brief Provision devices with at most @p maxConcurrency of them at once.
+ *
+ * @return Number of devices provisioned.
+ */
+static size_t provisionDevices( FactoryDevice_t * pDevices,
+                                size_t deviceCount,
+                                size_t maxConcurrency );
+
+/**
+ * @brief Parse a "<slot>:<serial>" argument.
+ *
+ * @return true on success.
+ */
+static bool parseDevice( char * pArgument,
+                         FactoryDevice_t * pDevice );
+
+/*-----------------------------------------------------------*/
+
+static void * agentThread( void * pParam )
+{
+    AgentThreadParam_t * pThreadParam = ( AgentThreadParam_t * ) pParam;
+
+    /* The loop returns when the worker stops the instance. */
+    ( void ) iotshdDev_MQTTAgentThreadLoop( pThreadParam->pInstance,
+                                            pThreadParam->p11Session );
+
+    return NULL;
+}
+/*-----------------------------------------------------------*/
+
+static bool openDeviceSession( CK_SLOT_ID slotId,
+                               CK_SESSION_HANDLE * pP11Session )
+{
+    CK_RV result;
+    CK_FUNCTION_LIST_PTR pFunctionList = NULL;
+
+    result = C_GetFunctionList( &pFunctionList );
+
+    if( result == CKR_OK )
+    {
+        result = pFunctionList->C_OpenSession( slotId,
+                                               CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                                               NULL,
+                                               NULL,
+                                               pP11Session );
+    }
+
+    if( result == CKR_OK )
+    {
+        result = pFunctionList->C_Login( *pP11Session,
+                                         CKU_USER,
+                                         ( CK_UTF8CHAR_PTR ) configPKCS11_DEFAULT_USER_PIN,
+                                         sizeof( configPKCS11_DEFAULT_USER_PIN ) - 1UL );
+
+        /* The token is already logged in by the session of another device on
+         * the same slot. */
+        if( result == CKR_USER_ALREADY_LOGGED_IN )
+        {
+            result = CKR_OK;
+        }
+        else if( result != CKR_OK )
+        {
+            ( void ) pFunctionList->C_CloseSession( *pP11Session );
+        }
+        else
+        {
+            /* Empty else MISRA 15.7 */
+        }
+    }
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Failed to open a PKCS #11 session on slot %lu with error code %lu.",
+                    ( unsigned long ) slotId,
+                    ( unsigned long ) result ) );
+    }
+
+    return( result == CKR_OK );
+}
+/*-----------------------------------------------------------*/
+
+static void provisionDevice( FactoryDevice_t * pDevice )
+{
+    bool status;
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+    CK_FUNCTION_LIST_PTR pFunctionList = NULL;
+    iotshdDev_MQTTAgentConfig_t agentConfig = { 0 };
+    iotshdDev_MQTTAgentInstance_t * pInstance = NULL;
+    AgentThreadParam_t threadParam;
+    pthread_t agentThreadId;
+    bool agentStarted = false;
+
+    pDevice->result = -1;
+
+    status = openDeviceSession( pDevice->slotId, &p11Session );
+
+    /* Each device connects with the claim credentials stored in its slot. */
+    if( status == true )
+    {
+        status = loadClaimCredentials( p11Session,
+                                       CLAIM_CERT_PATH,
+                                       pkcs11configLABEL_CLAIM_CERTIFICATE,
+                                       CLAIM_PRIVATE_KEY_PATH,
+                                       pkcs11configLABEL_CLAIM_PRIVATE_KEY );
+    }
+
+    if( status == true )
+    {
+        agentConfig.pEndpoint = AWS_IOT_ENDPOINT;
+        agentConfig.pClientIdentifier = pDevice->pSerialNumber;
+        agentConfig.pClientCertLabel = pkcs11configLABEL_CLAIM_CERTIFICATE;
+        agentConfig.pPrivateKeyLabel = pkcs11configLABEL_CLAIM_PRIVATE_KEY;
+        pInstance = iotshdDev_MQTTAgentCreateInstance( &agentConfig );
+        status = ( pInstance != NULL );
+    }
+
+    if( status == true )
+    {
+        threadParam.pInstance = pInstance;
+        threadParam.p11Session = p11Session;
+        agentStarted = ( pthread_create( &agentThreadId, NULL, agentThread, &threadParam ) == 0 );
+        status = agentStarted;
+    }
+
+    if( status == true )
+    {
+        pDevice->result = ProvisionDevicePKCS11WithFPTimed( pInstance,
+                                                            p11Session,
+                                                            pDevice->pSerialNumber,
+                                                            provisioningTemplateName,
+                                                            &( pDevice->timing ) );
+    }
+    else
+    {
+        LogError( ( "Failed to start the provisioning of device %s.", pDevice->pSerialNumber ) );
+    }
+
+    /* The connection is only used for the provisioning. */
+    if( agentStarted == true )
+    {
+        ( void ) iotshdDev_MQTTAgentStop( pInstance );
+        ( void ) pthread_join( agentThreadId, NULL );
+    }
+
+    if( pInstance != NULL )
+    {
+        iotshdDev_MQTTAgentDeleteInstance( pInstance );
+    }
+
+    if( p11Session != CK_INVALID_HANDLE )
+    {
+        if( C_GetFunctionList( &pFunctionList ) == CKR_OK )
+        {
+            ( void ) pFunctionList->C_CloseSession( p11Session );
+        }
+    }
+}
+/*-----------------------------------------------------------*/
+
+static void * workerThread( void * pParam )
+{
+    FactoryLine_t * pLine = ( FactoryLine_t * ) pParam;
+    FactoryDevice_t * pDevice;
+
+    do
+    {
+        pDevice = NULL;
+
+        pthread_mutex_lock( &( pLine->mutex ) );
+
+        if( pLine->nextDevice < pLine->deviceCount )
+        {
+            pDevice = &( pLine->pDevices[ pLine->nextDevice ] );
+            pLine->nextDevice++;
+        }
+
+        pthread_mutex_unlock( &( pLine->mutex ) );
+
+        if( pDevice != NULL )
+        {
+            provisionDevice( pDevice );
+
+            if( pDevice->result == 0 )
+            {
+                LogInfo( ( "Provisioned device %s on slot %lu in %lu ms.",
+                           pDevice->pSerialNumber,
+                           ( unsigned long ) pDevice->slotId,
+                           ( unsigned long ) pDevice->timing.totalMs ) );
+            }
+            else
+            {
+                LogError( ( "Failed to provision device %s on slot %lu.",
+                            pDevice->pSerialNumber,
+                            ( unsigned long ) pDevice->slotId ) );
+            }
+        }
+    } while( pDevice != NULL );
+
+    return NULL;
+}
+/*-----------------------------------------------------------*/
+
+static size_t provisionDevices( FactoryDevice_t * pDevices,
+                                size_t deviceCount,
+                                size_t maxConcurrency )
+{
+    FactoryLine_t line;
+    pthread_t workers[ FACTORY_MAX_CONCURRENCY ];
+    size_t workerCount = 0U;
+    size_t provisionedCount = 0U;
+    size_t i;
+
+    line.pDevices = pDevices;
+    line.deviceCount = deviceCount;
+    line.nextDevice = 0U;
+    ( void ) pthread_mutex_init( &( line.mutex ), NULL );
+
+    /* Workers beyond the number of devices would have nothing to do. */
+    while( ( workerCount < maxConcurrency ) &&
+           ( workerCount < deviceCount ) &&
+           ( pthread_create( &( workers[ workerCount ] ), NULL, workerThread, &line ) == 0 ) )
+    {
+        workerCount++;
+    }
+
+    if( workerCount == 0U )
+    {
+        LogError( ( "Failed to start the provisioning workers." ) );
+    }
+    else
+    {
+        LogInfo( ( "Provisioning %lu devices with %lu workers.",
+                   ( unsigned long ) deviceCount,
+                   ( unsigned long ) workerCount ) );
+    }
+
+    for( i = 0; i < workerCount; i++ )
+    {
+        ( void ) pthread_join( workers[ i ], NULL );
+    }
+
+    ( void ) pthread_mutex_destroy( &( line.mutex ) );
+
+    for( i = 0; i < deviceCount; i++ )
+    {
+        if( pDevices[ i ].result == 0 )
+        {
+            provisionedCount++;
+        }
+    }
+
+    return provisionedCount;
+}
+/*-----------------------------------------------------------*/
+
+static bool parseDevice( char * pArgument,
+                         FactoryDevice_t * pDevice )
+{
+    char * pEnd = NULL;
+    unsigned long slotId;
+    bool status = false;
+
+    slotId = strtoul( pArgument, &pEnd, 10 );
+
+    if( ( pEnd != pArgument ) && ( *pEnd == ':' ) && ( pEnd[ 1 ] != '\0' ) )
+    {
+        memset( pDevice, 0, sizeof( FactoryDevice_t ) );
+        pDevice->slotId = ( CK_SLOT_ID ) slotId;
+        pDevice->pSerialNumber = &( pEnd[ 1 ] );
+        pDevice->result = -1;
+        status = true;
+    }
+
+    return status;
+}
+/*-----------------------------------------------------------*/
+
+int main( int argc,
+          char ** argv )
+{
+    FactoryDevice_t * pDevices = NULL;
+    size_t deviceCount = 0U;
+    unsigned long maxConcurrency = 0UL;
+    size_t provisionedCount = 0U;
+    size_t workerCount;
+    uint32_t startMs;
+    uint32_t elapsedMs;
+    bool status = true;
+    int i;
+
+    if( argc < 3 )
+    {
+        LogError( ( "Usage: %s <concurrency> <slot>:<serial> ...", argv[ 0 ] ) );
+        status = false;
+    }
+
+    if( status == true )
+    {
+        maxConcurrency = strtoul( argv[ 1 ], NULL, 10 );
+
+        if( ( maxConcurrency == 0UL ) || ( maxConcurrency > FACTORY_MAX_CONCURRENCY ) )
+        {
+            LogError( ( "The concurrency must be between 1 and %u.", FACTORY_MAX_CONCURRENCY ) );
+            status = false;
+        }
+    }
+
+    if( status == true )
+    {
+        pDevices = ( FactoryDevice_t * ) malloc( ( size_t ) ( argc - 2 ) * sizeof( FactoryDevice_t ) );
+        status = ( pDevices != NULL );
+    }
+
+    for( i = 2; ( status == true ) && ( i < argc ); i++ )
+    {
+        status = parseDevice( argv[ i ], &( pDevices[ deviceCount ] ) );
+
+        if( status == true )
+        {
+            deviceCount++;
+        }
+        else
+        {
+            LogError( ( "Invalid device %s. Expected <slot>:<serial>.", argv[ i ] ) );
+        }
+    }
+
+    if( status == true )
+    {
+        /* Count the TLS memory of the connections. It must precede any
+         * MbedTLS allocation. The agent schedulers keep the account of each
+         * instance across their switches. */
+        Mbedtls_Pkcs11_MemoryInit();
+        iotshdDev_MQTTAgentSchedulerSetSwapFunction( Mbedtls_Pkcs11_MemorySwapContext );
+
+        /* The credentials of each worker are held in the secure arena. */
+        workerCount = ( deviceCount < ( size_t ) maxConcurrency ) ? deviceCount : ( size_t ) maxConcurrency;
+        status = Mbedtls_Pkcs11_SecureArenaInit( workerCount * SECURE_ARENA_DEVICE_SIZE );
+
+        if( status == false )
+        {
+            LogError( ( "Failed to initialize the secure arena." ) );
+        }
+    }
+
+    if( status == true )
+    {
+        status = ( xInitializePKCS11() == CKR_OK );
+
+        if( status == false )
+        {
+            LogError( ( "Failed to initialize the PKCS #11 module." ) );
+        }
+    }
+
+    if( status == true )
+    {
+        startMs = Clock_GetTimeMs();
+        provisionedCount = provisionDevices( pDevices, deviceCount, ( size_t ) maxConcurrency );
+        elapsedMs = Clock_GetTimeMs() - startMs;
+
+        printf( "%-32s %6s %8s %10s %10s %10s %10s %8s\r\n",
+                "serial", "slot", "result", "total_ms", "cert_ms", "thing_ms", "switch_ms", "attempts" );
+
+        for( i = 0; i < ( int ) deviceCount; i++ )
+        {
+            printf( "%-32s %6lu %8s %10lu %10lu %10lu %10lu %8d\r\n",
+                    pDevices[ i ].pSerialNumber,
+                    ( unsigned long ) pDevices[ i ].slotId,
+                    ( pDevices[ i ].result == 0 ) ? "ok" : "failed",
+                    ( unsigned long ) pDevices[ i ].timing.totalMs,
+                    ( unsigned long ) pDevices[ i ].timing.certificateMs,
+                    ( unsigned long ) pDevices[ i ].timing.registerThingMs,
+                    ( unsigned long ) pDevices[ i ].timing.switchCredentialsMs,
+                    pDevices[ i ].timing.attemptCount );
+        }
+
+        printf( "Provisioned %lu of %lu devices in %lu ms with a concurrency of %lu.\r\n",
+                ( unsigned long ) provisionedCount,
+                ( unsigned long ) deviceCount,
+                ( unsigned long ) elapsedMs,
+                maxConcurrency );
+
+        /* Close the signing sessions opened by the transport first. */
+        Mbedtls_Pkcs11_SessionPoolClose();
+        status = ( provisionedCount == deviceCount );
+    }
+
+    Mbedtls_Pkcs11_SecureArenaDeinit();
+    free( pDevices );
+
+    return ( status == true ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,56 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2020 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CORE_MQTT_AGENT_CONFIG_H_
+#define CORE_MQTT_AGENT_CONFIG_H_
+
+/**
+ * @brief The maximum number of pending acknowledgments to track for a single
+ * connection.
+ *
+ * The agent keeps a QoS1 publish command until its PUBACK arrives, so this is
+ * the upper bound of the in-flight window that can be passed to
+ * iotshdDev_MQTTAgentCreateInstance().
+ */
+#define MQTT_AGENT_MAX_OUTSTANDING_ACKS    ( 32U )
+
+/**
+ * @brief The number of command structures of an agent instance beyond its
+ * in-flight window, for the subscribe, unsubscribe, disconnect and terminate
+ * commands.
+ *
+ * Every in-flight publish holds one command structure. Each instance has its
+ * own pool and command queue, both sized with its in-flight window plus this
+ * headroom, so posting a command never blocks once a command structure has
+ * been obtained.
+ */
+#define MQTT_AGENT_COMMAND_POOL_HEADROOM    ( 8U )
+
+/**
+ * @brief Time the agent waits for a command before it receives from the network.
+ *
+ * The transport waits for the socket and the command queue together, so the
+ * command loop does not need to block on the queue.
+ */
+#define MQTT_AGENT_MAX_EVENT_QUEUE_WAIT_TIME    ( 0U )
+
+#endif /* ifndef CORE_MQTT_AGENT_CONFIG_H_ */
@@ -98,7 +98,9 @@
  * For information about provisioning by claim, see the following AWS documentation:
  * https://docs.aws.amazon.com/iot/latest/developerguide/provision-wo-cert.html#claim-based
  *
- * @note This certificate should be PEM-encoded. The certificate should be
+ * @note This certificate should be PEM or DER encoded. DER skips the base64
+ * decoding on boot, e.g. after
+ * `openssl x509 -in claim.pem.crt -outform der -out claim.der`. The certificate should be
  * registered on AWS IoT Core beforehand. It should have an AWS IoT policy to
  * allow it to access only the Fleet Provisioning APIs. An example policy for
  * the claim certificates for this demo is available in the
@@ -117,7 +119,8 @@
  * For information about provisioning by claim, see the following AWS documentation:
  * https://docs.aws.amazon.com/iot/latest/developerguide/provision-wo-cert.html#claim-based
  *
- * @note This private key should be PEM-encoded.
+ * @note This private key should be PEM or DER encoded, e.g. after
+ * `openssl pkey -in claim.pem.key -outform der -out claim-key.der`.
  *
  * #define CLAIM_PRIVATE_KEY_PATH    "...insert here..."
  */
@@ -162,6 +165,29 @@
     #define CSR_SUBJECT_NAME    "CN=Fleet Provisioning Demo"
 #endif
 
+/**
+ * @brief Set to 1 to provision the device certificate with the Fleet
+ * Provisioning CreateCertificateFromCsr API, or to 0 to use the
+ * CreateKeysAndCertificate API.
+ *
+ * With the CSR, the key pair is generated in the PKCS #11 module and only the
+ * certificate is received, so the private key never leaves the device. The
+ * claim policy must allow the topics of the selected API.
+ */
+#ifndef FLEET_PROV_USE_CSR
+    #define FLEET_PROV_USE_CSR    1
+#endif
+
+/**
+ * @brief Path of the file recording the completed provisioning: the Thing
+ * name, certificate ID and fingerprint of the device certificate. It is kept
+ * next to the files of the PKCS #11 objects. While it matches an unexpired
+ * device certificate, the device connects on boot without provisioning again.
+ */
+#ifndef PROVISIONED_STATE_PATH
+    #define PROVISIONED_STATE_PATH    "provisioned_state.dat"
+#endif
+
 /**
  * @brief MQTT client identifier.
  *
@@ -183,6 +209,15 @@
  */
 #define NETWORK_BUFFER_SIZE       ( 4096U )
 
+/**
+ * @brief Bytes of the secure arena used by the provisioning of one device: its
+ * provisioning context, about 9 KB with the network buffer, and the transient
+ * buffers of the credentials imported in PKCS #11.
+ */
+#ifndef SECURE_ARENA_DEVICE_SIZE
+    #define SECURE_ARENA_DEVICE_SIZE    ( 16U * 1024U )
+#endif
+
 /**
  * @brief The name of the operating system that the application is running on.
  * The current value is given as an example. Please update for your specific
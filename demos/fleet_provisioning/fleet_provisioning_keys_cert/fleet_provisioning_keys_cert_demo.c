@@ -31,21 +31,30 @@
  * The Fleet Provisioning library provides macros and helper functions for
  * assembling MQTT topics strings, and for determining whether an incoming MQTT
  * message is related to the Fleet Provisioning API of AWS IoT Core. The Fleet
- * Provisioning library does not depend on any particular MQTT library,
- * therefore the functionality for MQTT operations is placed in another file
- * (mqtt_operations.c). This demo uses the coreMQTT library. If needed,
- * mqtt_operations.c can be modified to replace coreMQTT with another MQTT
- * library. This demo requires using the AWS IoT Core broker as Fleet
- * Provisioning is an AWS IoT Core feature.
+ * Provisioning library does not depend on any particular MQTT library. This
+ * demo runs the MQTT operations on the MQTT agent instance that the
+ * application uses afterwards. This demo requires using the AWS IoT Core
+ * broker as Fleet Provisioning is an AWS IoT Core feature.
  *
  * This demo provisions a device certificate using the provisioning by claim
- * workflow with a Keys and Certificate Request. The demo connects to AWS
+ * workflow with a Certificate Signing Request, or with a Keys and Certificate
+ * Request if #FLEET_PROV_USE_CSR is 0. The agent instance is connected to AWS
  * IoT Core using provided claim credentials (whose certificate needs to be
- * registered with IoT Core before running this demo), subscribes to the
- * CreateKeysAndCertificate topics, and obtains keys and certificate. It then
- * subscribes to the RegisterThing topics and activates the certificate and
- * obtains a Thing using the provisioning template. Finally, it reconnects to
- * AWS IoT Core using the new credentials.
+ * registered with IoT Core before running this demo). The demo subscribes to
+ * the certificate and RegisterThing response topics in one SUBSCRIBE packet
+ * sent ahead of the first request. With a CSR, it generates a key pair in the
+ * PKCS #11 module and obtains a certificate for a CSR signed by the module, so
+ * the private key never leaves the device. Otherwise, it obtains keys and a
+ * certificate from CreateKeysAndCertificate. It then activates the certificate and
+ * obtains a Thing using the provisioning template. Finally, the agent instance
+ * reconnects once to AWS IoT Core using the new credentials, and stays
+ * connected for the application. The subscriptions end with the claim
+ * session, so they are not removed on success.
+ *
+ * The workflow is a state machine. A state waiting for a response blocks on
+ * the incoming publish queue of the agent user context until the response
+ * arrives or the deadline of the state passes, so a response is handled as
+ * soon as it is received and no CPU is used while waiting.
  */
 
 /* Standard includes. */
@@ -53,6 +62,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 /* POSIX includes. */
 #include <unistd.h>
@@ -72,10 +82,19 @@
 /* AWS IoT Fleet Provisioning Library. */
 #include "fleet_provisioning.h"
 
+/* MQTT agent include. */
+#include "mqtt_agent.h"
+
+/* Clock for the deadlines. */
+#include "clock.h"
+
+/* Secure arena of the credentials. */
+#include "mbedtls_pkcs11_secure_arena.h"
+
 /* Demo includes. */
-#include "mqtt_operations.h"
 #include "pkcs11_operations.h"
 #include "fleet_provisioning_serializer.h"
+#include "fleet_provisioning_keys_cert_demo.h"
 
 /**
  * These configurations are required. Throw compilation error if it is not
@@ -111,21 +130,45 @@
  */
 #define MAX_THING_NAME_LENGTH                128
 
+
 /**
- * @brief The maximum number of times to run the loop in this demo.
+ * @brief The maximum number of times to run the provisioning workflow.
  *
- * @note The demo loop is attempted to re-run only if it fails in an iteration.
- * Once the demo loop succeeds in an iteration, the demo exits successfully.
+ * @note The workflow is attempted to re-run only if it fails. Once the
+ * workflow succeeds, the demo exits successfully.
  */
 #ifndef FLEET_PROV_MAX_DEMO_LOOP_COUNT
     #define FLEET_PROV_MAX_DEMO_LOOP_COUNT    ( 3 )
 #endif
 
 /**
- * @brief Time in seconds to wait between retries of the demo loop if
- * demo loop fails.
+ * @brief Time in milliseconds to wait before a failed workflow is retried.
+ */
+#define PROVISIONING_RETRY_DELAY_MS                    ( 5000U )
+
+/**
+ * @brief Time in milliseconds to wait for each of the agent commands.
+ */
+#define PROVISIONING_COMMAND_TIMEOUT_MS                ( 5000U )
+
+/**
+ * @brief Deadline in milliseconds of the certificate response, counted from
+ * the request.
  */
-#define DELAY_BETWEEN_DEMO_RETRY_ITERATIONS_SECONDS    ( 5 )
+#define PROVISIONING_CERTIFICATE_TIMEOUT_MS            ( 10000U )
+
+/**
+ * @brief Deadline in milliseconds of the RegisterThing response, counted from
+ * the request. It is longer than the certificate one, as the
+ * template may run a pre-provisioning hook.
+ */
+#define PROVISIONING_REGISTER_THING_TIMEOUT_MS         ( 20000U )
+
+/**
+ * @brief Number of incoming publishes that can wait in the queue of the
+ * provisioning user context. A request has one accepted or rejected response.
+ */
+#define PROVISIONING_RESPONSE_QUEUE_SIZE               ( 2U )
 
 /**
  * @brief Size of buffer in which to hold the private key.
@@ -138,16 +181,31 @@
 #define CERT_BUFFER_LENGTH                             2048
 
 /**
- * @brief Size of buffer in which to hold the certificate id.
- *
- * See https://docs.aws.amazon.com/iot/latest/apireference/API_Certificate.html#iot-Type-Certificate-certificateId
- */
-#define CERT_ID_BUFFER_LENGTH                          64
-
-/**
- * @brief Size of buffer in which to hold the certificate ownership token.
+ * @brief Size of buffer in which to hold the certificate signing request (CSR).
  */
-#define OWNERSHIP_TOKEN_BUFFER_LENGTH                  512
+#define CSR_BUFFER_LENGTH                              2048
+
+/* Topics and responses of the certificate request selected by
+ * #FLEET_PROV_USE_CSR. */
+#if ( FLEET_PROV_USE_CSR == 1 )
+    #define CERTIFICATE_REQUEST_TOPIC      FP_CBOR_CREATE_CERT_PUBLISH_TOPIC
+    #define CERTIFICATE_REQUEST_LENGTH     FP_CBOR_CREATE_CERT_PUBLISH_LENGTH
+    #define CERTIFICATE_ACCEPTED_TOPIC     FP_CBOR_CREATE_CERT_ACCEPTED_TOPIC
+    #define CERTIFICATE_ACCEPTED_LENGTH    FP_CBOR_CREATE_CERT_ACCEPTED_LENGTH
+    #define CERTIFICATE_REJECTED_TOPIC     FP_CBOR_CREATE_CERT_REJECTED_TOPIC
+    #define CERTIFICATE_REJECTED_LENGTH    FP_CBOR_CREATE_CERT_REJECTED_LENGTH
+    #define CERTIFICATE_ACCEPTED_API       FleetProvCborCreateCertFromCsrAccepted
+    #define CERTIFICATE_REJECTED_API       FleetProvCborCreateCertFromCsrRejected
+#else
+    #define CERTIFICATE_REQUEST_TOPIC      FP_CBOR_CREATE_KEYS_PUBLISH_TOPIC
+    #define CERTIFICATE_REQUEST_LENGTH     FP_CBOR_CREATE_KEYS_PUBLISH_LENGTH
+    #define CERTIFICATE_ACCEPTED_TOPIC     FP_CBOR_CREATE_KEYS_ACCEPTED_TOPIC
+    #define CERTIFICATE_ACCEPTED_LENGTH    FP_CBOR_CREATE_KEYS_ACCEPTED_LENGTH
+    #define CERTIFICATE_REJECTED_TOPIC     FP_CBOR_CREATE_KEYS_REJECTED_TOPIC
+    #define CERTIFICATE_REJECTED_LENGTH    FP_CBOR_CREATE_KEYS_REJECTED_LENGTH
+    #define CERTIFICATE_ACCEPTED_API       FleetProvCborCreateKeysAndCertAccepted
+    #define CERTIFICATE_REJECTED_API       FleetProvCborCreateKeysAndCertRejected
+#endif /* if ( FLEET_PROV_USE_CSR == 1 ) */
 
 /**
  * @brief Status values of the Fleet Provisioning response.
@@ -159,86 +217,216 @@ typedef enum
     ResponseRejected
 } ResponseStatus_t;
 
-/*-----------------------------------------------------------*/
+/**
+ * @brief States of the provisioning workflow.
+ */
+typedef enum
+{
+    ProvisioningStateRequestCertificate,   /**< @brief Subscribe to the response topics and send the certificate request. */
+    ProvisioningStateWaitCertificate,      /**< @brief Wait for the certificate response. */
+    ProvisioningStateRequestRegisterThing, /**< @brief Store the credentials and send the RegisterThing request. */
+    ProvisioningStateWaitRegisterThing,    /**< @brief Wait for the RegisterThing response. */
+    ProvisioningStateSwitchCredentials,    /**< @brief Reconnect the agent instance with the provisioned credentials. */
+    ProvisioningStateRetryDelay,           /**< @brief Wait before the workflow is retried. */
+    ProvisioningStateDone,                 /**< @brief The device is provisioned. */
+    ProvisioningStateFailed                /**< @brief All the attempts failed. */
+} ProvisioningState_t;
 
 /**
- * @brief Status reported from the MQTT publish callback.
+ * @brief Context of the provisioning workflow.
  */
-static ResponseStatus_t responseStatus;
+typedef struct ProvisioningContext
+{
+    ProvisioningState_t state;
+    uint32_t deadlineMs; /**< @brief Time at which the current state fails. */
+    int attemptCount;
+
+    uint32_t startMs;      /**< @brief Time at which the provisioning started. */
+    uint32_t phaseStartMs; /**< @brief Time at which the current phase of the attempt started. */
+    ProvisioningTiming_t timing;
+    bool subscribed; /**< @brief The response topics are subscribed. */
+
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    iotshdDev_MQTTAgentUserContext_t * pUserContext;
+    CK_SESSION_HANDLE p11Session;
+    const char * pDeviceSerialNumber;
+    const char * pStatePath; /**< @brief Record of the provisioning, or NULL. */
+
+    /* Buffer holding the payload of the last request. */
+    uint8_t payloadBuffer[ NETWORK_BUFFER_SIZE ];
+    size_t payloadLength;
+
+    /* The accepted response being handled. It is held from the queue of the
+     * user context until it is released, as the values of the certificate
+     * response point into its payload. */
+    iotshdDev_MQTTAgentQueueItem_t * pResponseItem;
+    CertificateResponse_t certificateResponse;
+
+    #if ( FLEET_PROV_USE_CSR == 1 )
+        /* The CSR of the key pair generated in the PKCS #11 module. */
+        char csr[ CSR_BUFFER_LENGTH ];
+        size_t csrLength;
+    #endif
+
+    /* Null-terminated copies of the received credentials, as the PKCS #11
+     * import parses them as PEM. */
+    char certificate[ CERT_BUFFER_LENGTH ];
+    size_t certificateLength;
+    #if ( FLEET_PROV_USE_CSR == 0 )
+        char privatekey[ PRIV_KEY_BUFFER_LENGTH ];
+        size_t privatekeyLength;
+    #endif
+
+    /* The ID of the received certificate, kept for the provisioned state. */
+    char certificateId[ PROVISIONED_STATE_CERTIFICATE_ID_LENGTH + 1 ];
+    size_t certificateIdLength;
+
+    /* The provisioned AWS IoT Thing name. */
+    char thingName[ MAX_THING_NAME_LENGTH ];
+    size_t thingNameLength;
+} ProvisioningContext_t;
+
+/*-----------------------------------------------------------*/
 
 /**
- * @brief Buffer to hold the provisioned AWS IoT Thing name.
+ * @brief Response topics of the Fleet Provisioning requests. They are
+ * subscribed in one SUBSCRIBE packet.
  */
-static char thingName[ MAX_THING_NAME_LENGTH ];
+static const MQTTSubscribeInfo_t responseSubscriptions[] =
+{
+    { MQTTQoS1, CERTIFICATE_ACCEPTED_TOPIC,                                      CERTIFICATE_ACCEPTED_LENGTH                                         },
+    { MQTTQoS1, CERTIFICATE_REJECTED_TOPIC,                                      CERTIFICATE_REJECTED_LENGTH                                         },
+    { MQTTQoS1, FP_CBOR_REGISTER_ACCEPTED_TOPIC( PROVISIONING_TEMPLATE_NAME ), FP_CBOR_REGISTER_ACCEPTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) },
+    { MQTTQoS1, FP_CBOR_REGISTER_REJECTED_TOPIC( PROVISIONING_TEMPLATE_NAME ), FP_CBOR_REGISTER_REJECTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) }
+};
 
 /**
- * @brief Length of the AWS IoT Thing name.
+ * @brief Number of response topics.
  */
-static size_t thingNameLength;
+#define NUM_RESPONSE_SUBSCRIPTIONS    ( sizeof( responseSubscriptions ) / sizeof( responseSubscriptions[ 0 ] ) )
+
+/*-----------------------------------------------------------*/
 
 /**
- * @brief Buffer to hold responses received from the AWS IoT Fleet Provisioning
- * APIs. When the MQTT publish callback receives an expected Fleet Provisioning
- * accepted payload, it copies it into this buffer.
+ * @brief Check a publish message received on a Fleet Provisioning response
+ * topic.
+ *
+ * @param[in] pPublishInfo Pointer to publish info of the incoming publish.
+ * @param[in] acceptedApi Accepted response topic of the pending request.
+ * @param[in] rejectedApi Rejected response topic of the pending request.
+ *
+ * @return ResponseNotReceived if the publish is not a response to the pending
+ * request; otherwise the status of the response.
  */
-static uint8_t payloadBuffer[ NETWORK_BUFFER_SIZE ];
+static ResponseStatus_t handleProvisioningResponse( MQTTPublishInfo_t * pPublishInfo,
+                                                    FleetProvisioningTopic_t acceptedApi,
+                                                    FleetProvisioningTopic_t rejectedApi );
 
 /**
- * @brief Length of the payload stored in #payloadBuffer. This is set by the
- * MQTT publish callback when it copies a received payload into #payloadBuffer.
+ * @brief Wait for the response to the pending request until the deadline of
+ * the current state. An accepted response is held as the response item of the
+ * context until #releaseResponse.
+ *
+ * @return ResponseNotReceived if the deadline passed; otherwise the status of
+ * the response.
  */
-static size_t payloadLength;
+static ResponseStatus_t waitForResponse( ProvisioningContext_t * pContext,
+                                         FleetProvisioningTopic_t acceptedApi,
+                                         FleetProvisioningTopic_t rejectedApi );
 
-/*-----------------------------------------------------------*/
+/**
+ * @brief Return the response item of the context to the queue of the user
+ * context.
+ */
+static void releaseResponse( ProvisioningContext_t * pContext );
 
 /**
- * @brief Callback to receive the incoming publish messages from the MQTT
- * broker. Sets responseStatus if an expected CreateKeysAndCertificate or
- * RegisterThing response is received, and copies the response into
- * responseBuffer if the response is an accepted one.
+ * @brief End the current phase of the attempt and start the next one.
  *
- * @param[in] pPublishInfo Pointer to publish info of the incoming publish.
- * @param[in] packetIdentifier Packet identifier of the incoming publish.
+ * @param[out] pPhaseMs Duration of the ended phase.
+ */
+static void endPhase( ProvisioningContext_t * pContext,
+                      uint32_t * pPhaseMs );
+
+/**
+ * @brief Get the time left until the deadline of the current state.
  */
-static void provisioningPublishCallback( MQTTPublishInfo_t * pPublishInfo,
-                                         uint16_t packetIdentifier );
+static uint32_t getRemainingTimeMs( const ProvisioningContext_t * pContext );
 
 /**
- * @brief Run the MQTT process loop to get a response.
+ * @brief Move to a state with a deadline.
  */
-static bool waitForResponse( void );
+static void enterState( ProvisioningContext_t * pContext,
+                        ProvisioningState_t state,
+                        uint32_t timeoutMs );
 
 /**
- * @brief Subscribe to the CreateKeysAndCertificate accepted and rejected topics.
+ * @brief Handle a failed state. The workflow is retried after a delay until
+ * #FLEET_PROV_MAX_DEMO_LOOP_COUNT attempts are made.
  */
-static bool subscribeToKeysCertResponseTopics( void );
+static void failAttempt( ProvisioningContext_t * pContext );
 
 /**
- * @brief Unsubscribe from the CreateKeysAndCertificate accepted and rejected topics.
+ * @brief Run the current state until it moves to another state.
  */
-static bool unsubscribeFromKeysCertResponseTopics( void );
+static void provisioningStep( ProvisioningContext_t * pContext );
 
 /**
- * @brief Subscribe to the RegisterThing accepted and rejected topics.
+ * @brief Unsubscribe from a topic through the MQTT agent.
  */
-static bool subscribeToRegisterThingResponseTopics( void );
+static bool unsubscribeFromTopic( ProvisioningContext_t * pContext,
+                                  const char * pTopicFilter,
+                                  uint16_t topicFilterLength );
 
 /**
- * @brief Unsubscribe from the RegisterThing accepted and rejected topics.
+ * @brief Publish a message to a topic with QoS1 through the MQTT agent.
  */
-static bool unsubscribeFromRegisterThingResponseTopics( void );
+static bool publishToTopic( ProvisioningContext_t * pContext,
+                            const char * pTopic,
+                            uint16_t topicLength,
+                            const char * pMessage,
+                            size_t messageLength );
+
+/**
+ * @brief Subscribe to all the response topics in one SUBSCRIBE packet and send
+ * the first request without waiting for the SUBACK. The broker handles the
+ * packets in order, so the subscriptions are in place when it handles the
+ * request.
+ */
+static bool subscribeAndPublish( ProvisioningContext_t * pContext,
+                                 const char * pTopic,
+                                 uint16_t topicLength,
+                                 const char * pMessage,
+                                 size_t messageLength );
+
+/**
+ * @brief Unsubscribe from all the response topics.
+ */
+static void unsubscribeFromResponseTopics( ProvisioningContext_t * pContext );
+
+/**
+ * @brief Run the provisioning workflow on an MQTT agent instance.
+ *
+ * @param[in] pStatePath Path to record the provisioning at, or NULL.
+ * @param[out] pTiming Durations of the provisioning, or NULL.
+ *
+ * @return 0 on success; -1 otherwise.
+ */
+static int provisionDevice( iotshdDev_MQTTAgentInstance_t * pInstance,
+                            CK_SESSION_HANDLE p11Session,
+                            const char * pDeviceSerialNumber,
+                            const char * pStatePath,
+                            ProvisioningTiming_t * pTiming );
 
 /*-----------------------------------------------------------*/
 
-static void provisioningPublishCallback( MQTTPublishInfo_t * pPublishInfo,
-                                         uint16_t packetIdentifier )
+static ResponseStatus_t handleProvisioningResponse( MQTTPublishInfo_t * pPublishInfo,
+                                                    FleetProvisioningTopic_t acceptedApi,
+                                                    FleetProvisioningTopic_t rejectedApi )
 {
+    ResponseStatus_t responseStatus = ResponseNotReceived;
     FleetProvisioningStatus_t status;
     FleetProvisioningTopic_t api;
-    const char * cborDump;
-
-    /* Silence compiler warnings about unused variables. */
-    ( void ) packetIdentifier;
 
     status = FleetProvisioning_MatchTopic( pPublishInfo->pTopicName,
                                            pPublishInfo->topicNameLength, &api );
@@ -249,500 +437,671 @@ static void provisioningPublishCallback( MQTTPublishInfo_t * pPublishInfo,
                    ( int ) pPublishInfo->topicNameLength,
                    ( const char * ) pPublishInfo->pTopicName ) );
     }
-    else
+    else if( api == acceptedApi )
     {
-        if( api == FleetProvCborCreateKeysAndCertAccepted )
-        {
-            LogInfo( ( "Received accepted response from Fleet Provisioning CreateKeysAndCertificate API." ) );
-
-            cborDump = getStringFromCbor( ( const uint8_t * ) pPublishInfo->pPayload, pPublishInfo->payloadLength );
-            LogDebug( ( "Payload: %s", cborDump ) );
-            free( ( void * ) cborDump );
-
-            responseStatus = ResponseAccepted;
-
-            /* Copy the payload from the MQTT library's buffer to #payloadBuffer. */
-            ( void ) memcpy( ( void * ) payloadBuffer,
-                             ( const void * ) pPublishInfo->pPayload,
-                             ( size_t ) pPublishInfo->payloadLength );
-
-            payloadLength = pPublishInfo->payloadLength;
-        }
-        else if( api == FleetProvCborCreateKeysAndCertRejected )
-        {
-            LogError( ( "Received rejected response from Fleet Provisioning CreateKeysAndCertificate API." ) );
-
-            cborDump = getStringFromCbor( ( const uint8_t * ) pPublishInfo->pPayload, pPublishInfo->payloadLength );
-            LogError( ( "Payload: %s", cborDump ) );
-            free( ( void * ) cborDump );
-
-            responseStatus = ResponseRejected;
-        }
-        else if( api == FleetProvCborRegisterThingAccepted )
-        {
-            LogInfo( ( "Received accepted response from Fleet Provisioning RegisterThing API." ) );
-
-            cborDump = getStringFromCbor( ( const uint8_t * ) pPublishInfo->pPayload, pPublishInfo->payloadLength );
-            LogDebug( ( "Payload: %s", cborDump ) );
-            free( ( void * ) cborDump );
-
-            responseStatus = ResponseAccepted;
-
-            /* Copy the payload from the MQTT library's buffer to #payloadBuffer. */
-            ( void ) memcpy( ( void * ) payloadBuffer,
-                             ( const void * ) pPublishInfo->pPayload,
-                             ( size_t ) pPublishInfo->payloadLength );
-
-            payloadLength = pPublishInfo->payloadLength;
-        }
-        else if( api == FleetProvCborRegisterThingRejected )
-        {
-            LogError( ( "Received rejected response from Fleet Provisioning RegisterThing API." ) );
-
-            cborDump = getStringFromCbor( ( const uint8_t * ) pPublishInfo->pPayload, pPublishInfo->payloadLength );
-            LogError( ( "Payload: %s", cborDump ) );
-            free( ( void * ) cborDump );
+        LogInfo( ( "Received accepted response on topic %.*s.",
+                   ( int ) pPublishInfo->topicNameLength,
+                   ( const char * ) pPublishInfo->pTopicName ) );
+        LogDebugWithFormatter( ( "Payload: " ), logCborPayload,
+                               pPublishInfo->pPayload, pPublishInfo->payloadLength );
 
-            responseStatus = ResponseRejected;
-        }
-        else
-        {
-            LogError( ( "Received message on unexpected Fleet Provisioning topic. Topic: %.*s.",
-                        ( int ) pPublishInfo->topicNameLength,
-                        ( const char * ) pPublishInfo->pTopicName ) );
-        }
+        responseStatus = ResponseAccepted;
     }
-}
-/*-----------------------------------------------------------*/
-
-static bool waitForResponse( void )
-{
-    bool status = false;
-
-    responseStatus = ResponseNotReceived;
+    else if( api == rejectedApi )
+    {
+        LogError( ( "Received rejected response on topic %.*s.",
+                    ( int ) pPublishInfo->topicNameLength,
+                    ( const char * ) pPublishInfo->pTopicName ) );
 
-    /* responseStatus is updated from the MQTT publish callback. */
-    ( void ) ProcessLoopWithTimeout();
+        LogErrorWithFormatter( ( "Payload: " ), logCborPayload,
+                               pPublishInfo->pPayload, pPublishInfo->payloadLength );
 
-    if( responseStatus == ResponseNotReceived )
-    {
-        LogError( ( "Timed out waiting for response." ) );
+        responseStatus = ResponseRejected;
     }
-
-    if( responseStatus == ResponseAccepted )
+    else
     {
-        status = true;
+        /* A late response of a previous attempt. */
+        LogWarn( ( "Ignored response on Fleet Provisioning topic %.*s.",
+                   ( int ) pPublishInfo->topicNameLength,
+                   ( const char * ) pPublishInfo->pTopicName ) );
     }
 
-    return status;
+    return responseStatus;
 }
 /*-----------------------------------------------------------*/
 
-static bool subscribeToKeysCertResponseTopics( void )
+static ResponseStatus_t waitForResponse( ProvisioningContext_t * pContext,
+                                         FleetProvisioningTopic_t acceptedApi,
+                                         FleetProvisioningTopic_t rejectedApi )
 {
-    bool status;
-
-    status = SubscribeToTopic( FP_CBOR_CREATE_KEYS_ACCEPTED_TOPIC,
-                               FP_CBOR_CREATE_KEYS_ACCEPTED_LENGTH );
+    ResponseStatus_t responseStatus = ResponseNotReceived;
+    iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
 
-    if( status == false )
-    {
-        LogError( ( "Failed to subscribe to fleet provisioning topic: %.*s.",
-                    FP_CBOR_CREATE_KEYS_ACCEPTED_LENGTH,
-                    FP_CBOR_CREATE_KEYS_ACCEPTED_TOPIC ) );
-    }
-
-    if( status == true )
+    /* The responses are queued by the agent thread, which wakes this thread
+     * up. Publishes on other topics are logged and skipped. */
+    do
     {
-        status = SubscribeToTopic( FP_CBOR_CREATE_KEYS_REJECTED_TOPIC,
-                                   FP_CBOR_CREATE_KEYS_REJECTED_LENGTH );
+        pQueueItem = iotshdDev_MQTTAgentDequeueIncommingPublish( pContext->pUserContext,
+                                                                 getRemainingTimeMs( pContext ) );
 
-        if( status == false )
+        if( pQueueItem != NULL )
         {
-            LogError( ( "Failed to subscribe to fleet provisioning topic: %.*s.",
-                        FP_CBOR_CREATE_KEYS_REJECTED_LENGTH,
-                        FP_CBOR_CREATE_KEYS_REJECTED_TOPIC ) );
+            responseStatus = handleProvisioningResponse( &( pQueueItem->publishInfo ),
+                                                         acceptedApi,
+                                                         rejectedApi );
+
+            /* The accepted response is parsed in place. */
+            if( responseStatus == ResponseAccepted )
+            {
+                pContext->pResponseItem = pQueueItem;
+            }
+            else
+            {
+                iotshdDev_MQTTAgentFreeIncommingPublish( pContext->pUserContext, pQueueItem, false );
+            }
         }
+    } while( ( pQueueItem != NULL ) && ( responseStatus == ResponseNotReceived ) );
+
+    if( responseStatus == ResponseNotReceived )
+    {
+        LogError( ( "Timed out waiting for response." ) );
     }
 
-    return status;
+    return responseStatus;
 }
 /*-----------------------------------------------------------*/
 
-static bool unsubscribeFromKeysCertResponseTopics( void )
+static void releaseResponse( ProvisioningContext_t * pContext )
 {
-    bool status;
-
-    status = UnsubscribeFromTopic( FP_CBOR_CREATE_KEYS_ACCEPTED_TOPIC,
-                                   FP_CBOR_CREATE_KEYS_ACCEPTED_LENGTH );
-
-    if( status == false )
-    {
-        LogError( ( "Failed to unsubscribe from fleet provisioning topic: %.*s.",
-                    FP_CBOR_CREATE_KEYS_ACCEPTED_LENGTH,
-                    FP_CBOR_CREATE_KEYS_ACCEPTED_TOPIC ) );
-    }
-
-    if( status == true )
+    if( pContext->pResponseItem != NULL )
     {
-        status = UnsubscribeFromTopic( FP_CBOR_CREATE_KEYS_REJECTED_TOPIC,
-                                       FP_CBOR_CREATE_KEYS_REJECTED_LENGTH );
-
-        if( status == false )
-        {
-            LogError( ( "Failed to unsubscribe from fleet provisioning topic: %.*s.",
-                        FP_CBOR_CREATE_KEYS_REJECTED_LENGTH,
-                        FP_CBOR_CREATE_KEYS_REJECTED_TOPIC ) );
-        }
+        iotshdDev_MQTTAgentFreeIncommingPublish( pContext->pUserContext, pContext->pResponseItem, false );
+        pContext->pResponseItem = NULL;
     }
 
-    return status;
+    memset( &( pContext->certificateResponse ), 0, sizeof( CertificateResponse_t ) );
 }
 /*-----------------------------------------------------------*/
 
-static bool subscribeToRegisterThingResponseTopics( void )
+static void endPhase( ProvisioningContext_t * pContext,
+                      uint32_t * pPhaseMs )
 {
-    bool status;
-
-    status = SubscribeToTopic( FP_CBOR_REGISTER_ACCEPTED_TOPIC( PROVISIONING_TEMPLATE_NAME ),
-                               FP_CBOR_REGISTER_ACCEPTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) );
+    uint32_t nowMs = Clock_GetTimeMs();
 
-    if( status == false )
-    {
-        LogError( ( "Failed to subscribe to fleet provisioning topic: %.*s.",
-                    FP_CBOR_REGISTER_ACCEPTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                    FP_CBOR_REGISTER_ACCEPTED_TOPIC( PROVISIONING_TEMPLATE_NAME ) ) );
-    }
-
-    if( status == true )
-    {
-        status = SubscribeToTopic( FP_CBOR_REGISTER_REJECTED_TOPIC( PROVISIONING_TEMPLATE_NAME ),
-                                   FP_CBOR_REGISTER_REJECTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) );
+    *pPhaseMs = nowMs - pContext->phaseStartMs;
+    pContext->phaseStartMs = nowMs;
+}
+/*-----------------------------------------------------------*/
 
-        if( status == false )
-        {
-            LogError( ( "Failed to subscribe to fleet provisioning topic: %.*s.",
-                        FP_CBOR_REGISTER_REJECTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                        FP_CBOR_REGISTER_REJECTED_TOPIC( PROVISIONING_TEMPLATE_NAME ) ) );
-        }
-    }
+static uint32_t getRemainingTimeMs( const ProvisioningContext_t * pContext )
+{
+    int32_t remainingTimeMs = ( int32_t ) ( pContext->deadlineMs - Clock_GetTimeMs() );
 
-    return status;
+    return ( remainingTimeMs > 0 ) ? ( uint32_t ) remainingTimeMs : 0U;
 }
 /*-----------------------------------------------------------*/
 
-static bool unsubscribeFromRegisterThingResponseTopics( void )
+static void enterState( ProvisioningContext_t * pContext,
+                        ProvisioningState_t state,
+                        uint32_t timeoutMs )
 {
-    bool status;
-
-    status = UnsubscribeFromTopic( FP_CBOR_REGISTER_ACCEPTED_TOPIC( PROVISIONING_TEMPLATE_NAME ),
-                                   FP_CBOR_REGISTER_ACCEPTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) );
+    pContext->state = state;
+    pContext->deadlineMs = Clock_GetTimeMs() + timeoutMs;
+}
+/*-----------------------------------------------------------*/
 
-    if( status == false )
+static void failAttempt( ProvisioningContext_t * pContext )
+{
+    pContext->attemptCount++;
+    releaseResponse( pContext );
+
+    /* The subscriptions are kept for the next attempt. They are removed if
+     * their state is unknown, or if the user context is about to be deleted
+     * while the connection stays up. */
+    if( ( pContext->subscribed == false ) ||
+        ( pContext->attemptCount >= FLEET_PROV_MAX_DEMO_LOOP_COUNT ) )
     {
-        LogError( ( "Failed to unsubscribe from fleet provisioning topic: %.*s.",
-                    FP_CBOR_REGISTER_ACCEPTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                    FP_CBOR_REGISTER_ACCEPTED_TOPIC( PROVISIONING_TEMPLATE_NAME ) ) );
+        unsubscribeFromResponseTopics( pContext );
     }
 
-    if( status == true )
+    /* Attempt to retry a failed workflow for up to #FLEET_PROV_MAX_DEMO_LOOP_COUNT times. */
+    if( pContext->attemptCount < FLEET_PROV_MAX_DEMO_LOOP_COUNT )
     {
-        status = UnsubscribeFromTopic( FP_CBOR_REGISTER_REJECTED_TOPIC( PROVISIONING_TEMPLATE_NAME ),
-                                       FP_CBOR_REGISTER_REJECTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ) );
-
-        if( status == false )
-        {
-            LogError( ( "Failed to unsubscribe from fleet provisioning topic: %.*s.",
-                        FP_CBOR_REGISTER_REJECTED_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                        FP_CBOR_REGISTER_REJECTED_TOPIC( PROVISIONING_TEMPLATE_NAME ) ) );
-        }
+        LogWarn( ( "Provisioning attempt %d failed. Retrying...", pContext->attemptCount ) );
+        enterState( pContext, ProvisioningStateRetryDelay, PROVISIONING_RETRY_DELAY_MS );
+    }
+    else
+    {
+        LogError( ( "All %d provisioning attempts failed.", FLEET_PROV_MAX_DEMO_LOOP_COUNT ) );
+        enterState( pContext, ProvisioningStateFailed, 0U );
     }
-
-    return status;
 }
 /*-----------------------------------------------------------*/
 
-/* This example uses a single application task, which shows that how to use
- * the Fleet Provisioning library to generate and validate AWS IoT Fleet
- * Provisioning MQTT topics, and use the coreMQTT library to communicate with
- * the AWS IoT Fleet Provisioning APIs. */
-int ProvisionDevicePKCS11WithFP( NetworkContext_t * pNetworkContext,
-                                 CK_SESSION_HANDLE p11Session,
-                                 char * pDeviceSerialNumber,
-                                 char * pMqttEndpoint,
-                                 char * pProvisioningTemplateName )
+static void provisioningStep( ProvisioningContext_t * pContext )
 {
     bool status = true;
-    /* Buffer for holding received certificate until it is saved. */
-    char certificate[ CERT_BUFFER_LENGTH ];
-    size_t certificateLength;
-    /* Buffer for holding received private key until it is saved. */
-    char privatekey[ PRIV_KEY_BUFFER_LENGTH ];
-    size_t privatekeyLength;
-    /* Buffer for holding the certificate ID. */
-    char certificateId[ CERT_ID_BUFFER_LENGTH ];
-    size_t certificateIdLength;
-    /* Buffer for holding the certificate ownership token. */
-    char ownershipToken[ OWNERSHIP_TOKEN_BUFFER_LENGTH ];
-    size_t ownershipTokenLength;
-    bool connectionEstablished = false;
-    int demoRunCount = 0;
-    CK_RV pkcs11ret = CKR_OK;
+    ResponseStatus_t responseStatus;
+    MQTTStatus_t mqttStatus;
+    iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
 
-    do
+    switch( pContext->state )
     {
-        /* Initialize the buffer lengths to their max lengths. */
-        certificateLength = CERT_BUFFER_LENGTH;
-        privatekeyLength = PRIV_KEY_BUFFER_LENGTH;
-        certificateIdLength = CERT_ID_BUFFER_LENGTH;
-        ownershipTokenLength = OWNERSHIP_TOKEN_BUFFER_LENGTH;
-
-        /**** Connect to AWS IoT Core with provisioning claim credentials *****/
+        case ProvisioningStateRequestCertificate:
+            pContext->phaseStartMs = Clock_GetTimeMs();
+
+            /* In this demo we use CBOR encoding for the payloads, so we use
+             * the CBOR variants of the topics. */
+            #if ( FLEET_PROV_USE_CSR == 1 )
+
+                /* We use the CreateCertificateFromCsr API to obtain a client
+                 * certificate for a key pair generated in the PKCS #11 module.
+                 * The key pair and the CSR are kept for the retries. */
+                if( pContext->csrLength == 0U )
+                {
+                    status = generateKeyAndCsr( pContext->p11Session,
+                                                pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS,
+                                                pkcs11configLABEL_DEVICE_PUBLIC_KEY_FOR_TLS,
+                                                pContext->csr,
+                                                CSR_BUFFER_LENGTH,
+                                                &( pContext->csrLength ) );
+                }
+
+                if( status == true )
+                {
+                    status = generateCsrRequest( pContext->payloadBuffer,
+                                                 NETWORK_BUFFER_SIZE,
+                                                 pContext->csr,
+                                                 pContext->csrLength,
+                                                 &( pContext->payloadLength ) );
+                }
+
+                if( status == true )
+                {
+                    status = subscribeAndPublish( pContext,
+                                                  CERTIFICATE_REQUEST_TOPIC,
+                                                  CERTIFICATE_REQUEST_LENGTH,
+                                                  ( char * ) pContext->payloadBuffer,
+                                                  pContext->payloadLength );
+                }
+            #else /* if ( FLEET_PROV_USE_CSR == 1 ) */
+
+                /* We use the CreateKeysAndCertificate API to obtain a client
+                 * certificate and private key. Publish an empty payload to the
+                 * CreateKeysAndCertificate API. */
+                status = subscribeAndPublish( pContext,
+                                              CERTIFICATE_REQUEST_TOPIC,
+                                              CERTIFICATE_REQUEST_LENGTH,
+                                              "",
+                                              0 );
+            #endif /* if ( FLEET_PROV_USE_CSR == 1 ) */
 
-        /* We first use the claim credentials to connect to the broker. These
-         * credentials should allow use of the RegisterThing API and one of the
-         * CreateCertificatefromCsr or CreateKeysAndCertificate.
-         * In this demo we use CreateKeysAndCertificate. */
-
-        if( status == true )
-        {
-            /* Attempts to connect to the AWS IoT MQTT broker. If the
-             * connection fails, retries after a timeout. Timeout value will
-             * exponentially increase until maximum attempts are reached. */
-            LogInfo( ( "Establishing MQTT session with claim certificate..." ) );
-            status = EstablishMqttSession( pNetworkContext,
-                                           pMqttEndpoint,
-                                           provisioningPublishCallback,
-                                           p11Session,
-                                           pkcs11configLABEL_CLAIM_CERTIFICATE,
-                                           pkcs11configLABEL_CLAIM_PRIVATE_KEY );
-
-            if( status == false )
-            {
-                LogError( ( "Failed to establish MQTT session." ) );
-            }
-            else
+            if( status == true )
             {
-                LogInfo( ( "Established connection with claim credentials." ) );
-                connectionEstablished = true;
+                enterState( pContext, ProvisioningStateWaitCertificate, PROVISIONING_CERTIFICATE_TIMEOUT_MS );
             }
-        }
 
-        /**** Call the CreateKeysAndCertificate API ***************************/
+            break;
 
-        /* We use the CreateKeysAndCertificate API to obtain a client certificate
-         * and private key. */
-        if( status == true )
-        {
-            /* Subscribe to the CreateKeysAndCertificate accepted and rejected
-             * topics. In this demo we use CBOR encoding for the payloads,
-             * so we use the CBOR variants of the topics. */
-            status = subscribeToKeysCertResponseTopics();
-        }
+        case ProvisioningStateWaitCertificate:
+            responseStatus = waitForResponse( pContext,
+                                              CERTIFICATE_ACCEPTED_API,
+                                              CERTIFICATE_REJECTED_API );
+            status = ( responseStatus == ResponseAccepted );
 
-        if( status == true )
-        {
-            /* Publish an empty payload to the CreateKeysAndCertificate API. */
-            status = PublishToTopic( FP_CBOR_CREATE_KEYS_PUBLISH_TOPIC,
-                                     FP_CBOR_CREATE_KEYS_PUBLISH_LENGTH,
-                                     "",
-                                     0 );
-
-            if( status == false )
+            if( status == true )
             {
-                LogError( ( "Failed to publish to fleet provisioning topic: %.*s.",
-                            FP_CBOR_CREATE_KEYS_PUBLISH_LENGTH,
-                            FP_CBOR_CREATE_KEYS_PUBLISH_TOPIC ) );
+                /* From the response, extract the certificate, certificate ID,
+                 * certificate ownership token, and the private key if it is
+                 * not generated on the device. The values point into the
+                 * response until it is released. */
+                status = parseCertificateResponse( ( const uint8_t * ) pContext->pResponseItem->publishInfo.pPayload,
+                                                   pContext->pResponseItem->publishInfo.payloadLength,
+                                                   &( pContext->certificateResponse ) );
             }
-        }
 
-        if( status == true )
-        {
-            /* Get the response to the CreateKeysAndCertificate request. */
-            status = waitForResponse();
-        }
+            #if ( FLEET_PROV_USE_CSR == 0 )
+                if( ( status == true ) && ( pContext->certificateResponse.privateKey.pString == NULL ) )
+                {
+                    LogError( ( "\"privateKey\" not found in CreateKeysAndCertificate response." ) );
+                    status = false;
+                }
+            #endif
 
-        if( status == true )
-        {
-            /* From the response, extract the certificate, certificate ID, and
-             * certificate ownership token. */
-            status = parseKeyCertResponse( payloadBuffer,
-                                           payloadLength,
-                                           certificate,
-                                           &certificateLength,
-                                           privatekey,
-                                           &privatekeyLength,
-                                           certificateId,
-                                           &certificateIdLength,
-                                           ownershipToken,
-                                           &ownershipTokenLength );
+            if( status == true )
+            {
+                status = copyResponseString( &( pContext->certificateResponse.certificateId ),
+                                             pContext->certificateId,
+                                             sizeof( pContext->certificateId ),
+                                             &( pContext->certificateIdLength ) );
+            }
 
             if( status == true )
             {
-                LogInfo( ( "Received privatekey and certificate with Id: %.*s", ( int ) certificateIdLength, certificateId ) );
+                endPhase( pContext, &( pContext->timing.certificateMs ) );
+                LogInfo( ( "Received certificate with Id: %s", pContext->certificateId ) );
+                enterState( pContext, ProvisioningStateRequestRegisterThing, PROVISIONING_COMMAND_TIMEOUT_MS );
             }
-        }
 
-        if( status == true )
-        {
-            /* Save the private key into PKCS #11. */
-            status = loadPrivateKey( p11Session,
-                                     privatekey,
-                                     pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS,
-                                     privatekeyLength );
-        }
+            break;
 
-        if( status == true )
-        {
-            /* Save the certificate into PKCS #11. */
-            status = loadCertificate( p11Session,
-                                      certificate,
-                                      pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
-                                      certificateLength );
-        }
+        case ProvisioningStateRequestRegisterThing:
+
+            /* Save the certificate into PKCS #11. With a CSR, the private key
+             * is already in the module. */
+            #if ( FLEET_PROV_USE_CSR == 0 )
+                status = copyResponseString( &( pContext->certificateResponse.privateKey ),
+                                             pContext->privatekey,
+                                             PRIV_KEY_BUFFER_LENGTH,
+                                             &( pContext->privatekeyLength ) );
+
+                /* Do not leave the private key in the response, whose buffer
+                 * is reused for the next incoming publishes. */
+                memset( ( void * ) pContext->certificateResponse.privateKey.pString,
+                        0,
+                        pContext->certificateResponse.privateKey.length );
+
+                if( status == true )
+                {
+                    status = loadPrivateKey( pContext->p11Session,
+                                             pContext->privatekey,
+                                             pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS,
+                                             pContext->privatekeyLength );
+                }
+
+                memset( pContext->privatekey, 0, sizeof( pContext->privatekey ) );
+            #endif /* if ( FLEET_PROV_USE_CSR == 0 ) */
 
-        if( status == true )
-        {
-            /* Unsubscribe from the CreateKeysAndCertificate topics. */
-            status = unsubscribeFromKeysCertResponseTopics();
-        }
+            if( status == true )
+            {
+                status = copyResponseString( &( pContext->certificateResponse.certificatePem ),
+                                             pContext->certificate,
+                                             CERT_BUFFER_LENGTH,
+                                             &( pContext->certificateLength ) );
+            }
 
-        /**** Call the RegisterThing API **************************************/
+            if( status == true )
+            {
+                status = loadCertificate( pContext->p11Session,
+                                          pContext->certificate,
+                                          pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
+                                          pContext->certificateLength );
+            }
 
-        /* We then use the RegisterThing API to activate the received certificate,
-         * provision AWS IoT resources according to the provisioning template, and
-         * receive device configuration. */
-        if( status == true )
-        {
-            /* Create the request payload to publish to the RegisterThing API. */
-            status = generateRegisterThingRequest( payloadBuffer,
-                                                   NETWORK_BUFFER_SIZE,
-                                                   ownershipToken,
-                                                   ownershipTokenLength,
-                                                   pDeviceSerialNumber,
-                                                   strnlen( pDeviceSerialNumber, 32 ),
-                                                   &payloadLength );
-        }
+            /* We then use the RegisterThing API to activate the received
+             * certificate, provision AWS IoT resources according to the
+             * provisioning template, and receive device configuration. */
+            if( status == true )
+            {
+                status = generateRegisterThingRequest( pContext->payloadBuffer,
+                                                       NETWORK_BUFFER_SIZE,
+                                                       pContext->certificateResponse.certificateOwnershipToken.pString,
+                                                       pContext->certificateResponse.certificateOwnershipToken.length,
+                                                       pContext->pDeviceSerialNumber,
+                                                       strnlen( pContext->pDeviceSerialNumber, 32 ),
+                                                       &( pContext->payloadLength ) );
+            }
 
-        if( status == true )
-        {
-            /* Subscribe to the RegisterThing response topics. */
-            status = subscribeToRegisterThingResponseTopics();
-        }
+            /* The certificate response is no longer needed. */
+            releaseResponse( pContext );
 
-        if( status == true )
-        {
-            /* Publish the RegisterThing request. */
-            status = PublishToTopic( FP_CBOR_REGISTER_PUBLISH_TOPIC( PROVISIONING_TEMPLATE_NAME ),
-                                     FP_CBOR_REGISTER_PUBLISH_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                                     ( char * ) payloadBuffer,
-                                     payloadLength );
+            if( status == true )
+            {
+                status = publishToTopic( pContext,
+                                         FP_CBOR_REGISTER_PUBLISH_TOPIC( PROVISIONING_TEMPLATE_NAME ),
+                                         FP_CBOR_REGISTER_PUBLISH_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
+                                         ( char * ) pContext->payloadBuffer,
+                                         pContext->payloadLength );
+            }
 
-            if( status == false )
+            if( status == true )
             {
-                LogError( ( "Failed to publish to fleet provisioning topic: %.*s.",
-                            FP_CBOR_REGISTER_PUBLISH_LENGTH( PROVISIONING_TEMPLATE_NAME_LENGTH ),
-                            FP_CBOR_REGISTER_PUBLISH_TOPIC( PROVISIONING_TEMPLATE_NAME ) ) );
+                enterState( pContext, ProvisioningStateWaitRegisterThing, PROVISIONING_REGISTER_THING_TIMEOUT_MS );
             }
-        }
 
-        if( status == true )
-        {
-            /* Get the response to the RegisterThing request. */
-            status = waitForResponse();
-        }
+            break;
 
-        if( status == true )
-        {
-            /* Extract the Thing name from the response. */
-            thingNameLength = MAX_THING_NAME_LENGTH;
-            status = parseRegisterThingResponse( payloadBuffer,
-                                                 payloadLength,
-                                                 thingName,
-                                                 &thingNameLength );
+        case ProvisioningStateWaitRegisterThing:
+            responseStatus = waitForResponse( pContext,
+                                              FleetProvCborRegisterThingAccepted,
+                                              FleetProvCborRegisterThingRejected );
+            status = ( responseStatus == ResponseAccepted );
 
             if( status == true )
             {
-                LogInfo( ( "Received AWS IoT Thing name: %.*s", ( int ) thingNameLength, thingName ) );
+                /* Extract the Thing name from the response. */
+                pContext->thingNameLength = MAX_THING_NAME_LENGTH;
+                status = parseRegisterThingResponse( ( const uint8_t * ) pContext->pResponseItem->publishInfo.pPayload,
+                                                     pContext->pResponseItem->publishInfo.payloadLength,
+                                                     pContext->thingName,
+                                                     &( pContext->thingNameLength ) );
+                releaseResponse( pContext );
             }
-        }
 
-        if( status == true )
-        {
-            /* Unsubscribe from the RegisterThing topics. */
-            unsubscribeFromRegisterThingResponseTopics();
-        }
+            if( status == true )
+            {
+                endPhase( pContext, &( pContext->timing.registerThingMs ) );
+                LogInfo( ( "Received AWS IoT Thing name: %.*s",
+                           ( int ) pContext->thingNameLength,
+                           pContext->thingName ) );
+                enterState( pContext, ProvisioningStateSwitchCredentials, PROVISIONING_COMMAND_TIMEOUT_MS );
+            }
 
-        /**** Disconnect from AWS IoT Core ************************************/
+            break;
 
-        /* As we have completed the provisioning workflow, we disconnect from
-         * the connection using the provisioning claim credentials. We will
-         * establish a new MQTT connection with the newly provisioned
-         * credentials. */
-        if( connectionEstablished == true )
-        {
-            DisconnectMqttSession( pNetworkContext );
-            connectionEstablished = false;
-        }
+        case ProvisioningStateSwitchCredentials:
 
-        /**** Connect to AWS IoT Core with provisioned certificate ************/
+            /* As we have completed the provisioning workflow, the agent
+             * instance replaces the connection using the provisioning claim
+             * credentials with one using the newly provisioned credentials.
+             * The application keeps using the same instance. */
+            LogInfo( ( "Switching the MQTT session to the provisioned certificate..." ) );
+            mqttStatus = iotshdDev_MQTTAgentSwitchCredentials( pContext->pInstance,
+                                                               NULL,
+                                                               pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
+                                                               pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS,
+                                                               getRemainingTimeMs( pContext ) );
 
-        if( status == true )
-        {
-            LogInfo( ( "Establishing MQTT session with provisioned certificate..." ) );
-            status = EstablishMqttSession( pNetworkContext,
-                                           pMqttEndpoint,
-                                           provisioningPublishCallback,
-                                           p11Session,
-                                           pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
-                                           pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS );
-
-            if( status != true )
+            /* The subscriptions of the claim session are dropped by the
+             * switch, so they are not removed one by one. */
+            pContext->subscribed = false;
+
+            if( mqttStatus != MQTTSuccess )
             {
                 LogError( ( "Failed to establish MQTT session with provisioned "
                             "credentials. Verify on your AWS account that the "
                             "new certificate is active and has an attached IoT "
                             "Policy that allows the \"iot:Connect\" action." ) );
+
+                /* The provisioning is not repeated for a connection failure. */
+                enterState( pContext, ProvisioningStateFailed, 0U );
             }
             else
             {
+                endPhase( pContext, &( pContext->timing.switchCredentialsMs ) );
                 LogInfo( ( "Sucessfully established connection with provisioned credentials." ) );
-                connectionEstablished = true;
+
+                /* The credentials are known to work, so the next boots can
+                 * skip the provisioning. Without the record, the device is
+                 * only provisioned again. */
+                if( ( pContext->pStatePath != NULL ) &&
+                    ( saveProvisionedState( pContext->p11Session,
+                                            pContext->pStatePath,
+                                            pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
+                                            pContext->thingName,
+                                            pContext->thingNameLength,
+                                            pContext->certificateId,
+                                            pContext->certificateIdLength ) == false ) )
+                {
+                    LogWarn( ( "Failed to record the provisioned state." ) );
+                }
+
+                enterState( pContext, ProvisioningStateDone, 0U );
             }
-        }
 
-        /**** Finish **********************************************************/
+            break;
+
+        case ProvisioningStateRetryDelay:
+
+            /* Drop the late responses of the failed attempt while waiting. */
+            pQueueItem = iotshdDev_MQTTAgentDequeueIncommingPublish( pContext->pUserContext,
+                                                                     getRemainingTimeMs( pContext ) );
+
+            if( pQueueItem != NULL )
+            {
+                iotshdDev_MQTTAgentFreeIncommingPublish( pContext->pUserContext, pQueueItem, false );
+            }
+            else
+            {
+                enterState( pContext, ProvisioningStateRequestCertificate, PROVISIONING_COMMAND_TIMEOUT_MS );
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    if( status == false )
+    {
+        failAttempt( pContext );
+    }
+}
+/*-----------------------------------------------------------*/
+
+static bool subscribeAndPublish( ProvisioningContext_t * pContext,
+                                 const char * pTopic,
+                                 uint16_t topicLength,
+                                 const char * pMessage,
+                                 size_t messageLength )
+{
+    bool status = true;
+    bool subscribePending = false;
+    MQTTStatus_t mqttStatus;
 
-        if( connectionEstablished == true )
+    if( pContext->subscribed == false )
+    {
+        mqttStatus = iotshdDev_MQTTAgentAddSubscriptionsWithQueueAsync( pContext->pInstance,
+                                                                        pContext->pUserContext,
+                                                                        responseSubscriptions,
+                                                                        NUM_RESPONSE_SUBSCRIPTIONS,
+                                                                        getRemainingTimeMs( pContext ) );
+
+        if( mqttStatus != MQTTSuccess )
+        {
+            LogError( ( "Failed to subscribe to fleet provisioning topics with status %s.",
+                        MQTT_Status_strerror( mqttStatus ) ) );
+            status = false;
+        }
+        else
         {
-            /* Close the connection. */
-            DisconnectMqttSession( pNetworkContext );
-            connectionEstablished = false;
+            subscribePending = true;
         }
+    }
 
-        /**** Retry in case of failure ****************************************/
+    if( status == true )
+    {
+        status = publishToTopic( pContext, pTopic, topicLength, pMessage, messageLength );
+    }
 
-        /* Increment the demo run count. */
-        demoRunCount++;
+    /* The user context reports the SUBACK, so wait for it even if the publish
+     * failed. */
+    if( subscribePending == true )
+    {
+        mqttStatus = iotshdDev_MQTTAgentWaitForSubscriptions( pContext->pUserContext,
+                                                              getRemainingTimeMs( pContext ) );
 
-        if( status == true )
+        if( mqttStatus != MQTTSuccess )
         {
-            LogInfo( ( "Demo iteration %d is successful.", demoRunCount ) );
-            break;
+            LogError( ( "Failed to subscribe to fleet provisioning topics with status %s.",
+                        MQTT_Status_strerror( mqttStatus ) ) );
+            status = false;
         }
-        /* Attempt to retry a failed iteration of demo for up to #FLEET_PROV_MAX_DEMO_LOOP_COUNT times. */
-        else if( demoRunCount < FLEET_PROV_MAX_DEMO_LOOP_COUNT )
+        else
+        {
+            pContext->subscribed = true;
+        }
+    }
+
+    return status;
+}
+/*-----------------------------------------------------------*/
+
+static bool unsubscribeFromTopic( ProvisioningContext_t * pContext,
+                                  const char * pTopicFilter,
+                                  uint16_t topicFilterLength )
+{
+    MQTTStatus_t mqttStatus;
+
+    /* The status of the UNSUBACK is returned. */
+    mqttStatus = iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( pContext->pInstance,
+                                                                 pContext->pUserContext,
+                                                                 pTopicFilter,
+                                                                 topicFilterLength,
+                                                                 PROVISIONING_COMMAND_TIMEOUT_MS );
+
+    if( mqttStatus != MQTTSuccess )
+    {
+        LogError( ( "Failed to unsubscribe from fleet provisioning topic: %.*s with status %s.",
+                    topicFilterLength,
+                    pTopicFilter,
+                    MQTT_Status_strerror( mqttStatus ) ) );
+    }
+
+    return( mqttStatus == MQTTSuccess );
+}
+/*-----------------------------------------------------------*/
+
+static bool publishToTopic( ProvisioningContext_t * pContext,
+                            const char * pTopic,
+                            uint16_t topicLength,
+                            const char * pMessage,
+                            size_t messageLength )
+{
+    MQTTStatus_t mqttStatus;
+    MQTTPublishInfo_t publishInfo = { 0 };
+
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = pTopic;
+    publishInfo.topicNameLength = topicLength;
+    publishInfo.pPayload = pMessage;
+    publishInfo.payloadLength = messageLength;
+
+    /* The publish waits for its PUBACK, so a publish refused or lost by the
+     * broker fails here rather than as a response timeout. */
+    mqttStatus = iotshdDev_MQTTAgentPublish( pContext->pInstance,
+                                             pContext->pUserContext,
+                                             &publishInfo,
+                                             PROVISIONING_COMMAND_TIMEOUT_MS );
+
+    if( mqttStatus != MQTTSuccess )
+    {
+        LogError( ( "Failed to publish to fleet provisioning topic: %.*s.",
+                    topicLength,
+                    pTopic ) );
+    }
+
+    return( mqttStatus == MQTTSuccess );
+}
+/*-----------------------------------------------------------*/
+
+static void unsubscribeFromResponseTopics( ProvisioningContext_t * pContext )
+{
+    size_t i;
+
+    for( i = 0; i < NUM_RESPONSE_SUBSCRIPTIONS; i++ )
+    {
+        ( void ) unsubscribeFromTopic( pContext,
+                                       responseSubscriptions[ i ].pTopicFilter,
+                                       responseSubscriptions[ i ].topicFilterLength );
+    }
+
+    pContext->subscribed = false;
+}
+/*-----------------------------------------------------------*/
+
+/* This example runs the provisioning on the MQTT agent instance of the
+ * application, which shows how to use the Fleet Provisioning library to
+ * generate and validate AWS IoT Fleet Provisioning MQTT topics, and use the
+ * MQTT agent to communicate with the AWS IoT Fleet Provisioning APIs. The
+ * instance must be connected with the claim credentials. */
+int ProvisionDevicePKCS11WithFP( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                 CK_SESSION_HANDLE p11Session,
+                                 char * pDeviceSerialNumber,
+                                 char * pProvisioningTemplateName )
+{
+    ( void ) pProvisioningTemplateName;
+
+    return provisionDevice( pInstance,
+                            p11Session,
+                            pDeviceSerialNumber,
+                            PROVISIONED_STATE_PATH,
+                            NULL );
+}
+/*-----------------------------------------------------------*/
+
+int ProvisionDevicePKCS11WithFPTimed( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                      CK_SESSION_HANDLE p11Session,
+                                      char * pDeviceSerialNumber,
+                                      char * pProvisioningTemplateName,
+                                      ProvisioningTiming_t * pTiming )
+{
+    ( void ) pProvisioningTemplateName;
+
+    /* The tokens are provisioned for other devices, so the state of this
+     * host is not recorded. */
+    return provisionDevice( pInstance,
+                            p11Session,
+                            pDeviceSerialNumber,
+                            NULL,
+                            pTiming );
+}
+/*-----------------------------------------------------------*/
+
+static int provisionDevice( iotshdDev_MQTTAgentInstance_t * pInstance,
+                            CK_SESSION_HANDLE p11Session,
+                            const char * pDeviceSerialNumber,
+                            const char * pStatePath,
+                            ProvisioningTiming_t * pTiming )
+{
+    ProvisioningContext_t * pContext;
+    bool status = false;
+
+    /* The context of each call is allocated, so that devices can be
+     * provisioned concurrently. It is kept out of the stack of the calling
+     * thread because of the size of the buffers, and in the secure arena
+     * because it holds the received private key. */
+    pContext = ( ProvisioningContext_t * ) Mbedtls_Pkcs11_SecureArenaAlloc( sizeof( ProvisioningContext_t ) );
+
+    if( pContext == NULL )
+    {
+        LogError( ( "Failed to allocate the provisioning context." ) );
+    }
+    else
+    {
+        pContext->pInstance = pInstance;
+        pContext->p11Session = p11Session;
+        pContext->pDeviceSerialNumber = pDeviceSerialNumber;
+        pContext->pStatePath = pStatePath;
+        pContext->startMs = Clock_GetTimeMs();
+        pContext->pUserContext = iotshdDev_MQTTAgentCreateUserContext( PROVISIONING_RESPONSE_QUEUE_SIZE );
+
+        if( pContext->pUserContext == NULL )
         {
-            LogWarn( ( "Demo iteration %d failed. Retrying...", demoRunCount ) );
-            sleep( DELAY_BETWEEN_DEMO_RETRY_ITERATIONS_SECONDS );
+            LogError( ( "Failed to create the MQTT agent user context." ) );
+            enterState( pContext, ProvisioningStateFailed, 0U );
         }
-        /* Failed all #FLEET_PROV_MAX_DEMO_LOOP_COUNT demo iterations. */
         else
         {
-            LogError( ( "All %d demo iterations failed.", FLEET_PROV_MAX_DEMO_LOOP_COUNT ) );
-            break;
+            enterState( pContext, ProvisioningStateRequestCertificate, PROVISIONING_COMMAND_TIMEOUT_MS );
+        }
+
+        /* Each step returns when its state moves on, either on a response or
+         * on the deadline of the state. */
+        while( ( pContext->state != ProvisioningStateDone ) &&
+               ( pContext->state != ProvisioningStateFailed ) )
+        {
+            provisioningStep( pContext );
+        }
+
+        status = ( pContext->state == ProvisioningStateDone );
+
+        if( pTiming != NULL )
+        {
+            *pTiming = pContext->timing;
+            pTiming->totalMs = Clock_GetTimeMs() - pContext->startMs;
+            pTiming->attemptCount = ( status == true ) ? ( pContext->attemptCount + 1 ) : pContext->attemptCount;
         }
-    } while( status != true );
+
+        releaseResponse( pContext );
+
+        /* The responses are no longer queued once the subscriptions are
+         * removed. */
+        iotshdDev_MQTTAgentDeleteUserContext( pContext->pUserContext );
+
+        /* The context is wiped, so that the private key is not kept in memory. */
+        Mbedtls_Pkcs11_SecureArenaFree( pContext );
+    }
 
     return ( status == true ) ? 0 : -1;
 }
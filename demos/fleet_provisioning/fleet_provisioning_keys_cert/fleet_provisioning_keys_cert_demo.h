@@ -0,0 +1,88 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FLEET_PROVISIONING_KEYS_CERT_DEMO_H_
+#define FLEET_PROVISIONING_KEYS_CERT_DEMO_H_
+
+/* Standard includes. */
+#include <stdint.h>
+
+/* corePKCS11 include. */
+#include "core_pkcs11.h"
+
+/* MQTT agent include. */
+#include "mqtt_agent.h"
+
+/**
+ * @brief Durations of the phases of a provisioning, in milliseconds. The
+ * phases are those of the successful attempt.
+ */
+typedef struct ProvisioningTiming
+{
+    uint32_t certificateMs;       /**< @brief Certificate request until the accepted response, including the CSR generation. */
+    uint32_t registerThingMs;     /**< @brief Storage of the credentials and RegisterThing request until the accepted response. */
+    uint32_t switchCredentialsMs; /**< @brief Reconnection with the provisioned credentials. */
+    uint32_t totalMs;             /**< @brief Whole provisioning, including the failed attempts. */
+    int attemptCount;             /**< @brief Number of attempts made. */
+} ProvisioningTiming_t;
+
+/**
+ * @brief Provision a device with Fleet Provisioning on an MQTT agent
+ * instance connected with the claim credentials. The instance is switched to
+ * the provisioned credentials on success, and the provisioning is recorded at
+ * PROVISIONED_STATE_PATH for the next boots.
+ *
+ * The function only uses the state of the call, so devices can be provisioned
+ * concurrently, each on its own instance and PKCS #11 session.
+ *
+ * The state of the call holds the received credentials and is allocated from
+ * the secure arena, which must be initialized with
+ * #Mbedtls_Pkcs11_SecureArenaInit and hold #SECURE_ARENA_DEVICE_SIZE bytes for
+ * each concurrent provisioning.
+ *
+ * @param[in] pInstance MQTT agent instance served by another thread.
+ * @param[in] p11Session PKCS #11 session of the token of the device.
+ * @param[in] pDeviceSerialNumber Serial number sent to RegisterThing.
+ * @param[in] pProvisioningTemplateName Unused. The template is
+ * PROVISIONING_TEMPLATE_NAME.
+ *
+ * @return 0 on success; -1 otherwise.
+ */
+int ProvisionDevicePKCS11WithFP( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                 CK_SESSION_HANDLE p11Session,
+                                 char * pDeviceSerialNumber,
+                                 char * pProvisioningTemplateName );
+
+/**
+ * @brief Same as #ProvisionDevicePKCS11WithFP, and report the durations of
+ * the provisioning. The provisioning is not recorded, as the token is
+ * provisioned for another device.
+ *
+ * @param[out] pTiming Durations of the provisioning. Can be NULL.
+ */
+int ProvisionDevicePKCS11WithFPTimed( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                      CK_SESSION_HANDLE p11Session,
+                                      char * pDeviceSerialNumber,
+                                      char * pProvisioningTemplateName,
+                                      ProvisioningTiming_t * pTiming );
+
+#endif /* ifndef FLEET_PROVISIONING_KEYS_CERT_DEMO_H_ */
@@ -23,6 +23,7 @@
 
 /* Standard includes */
 #include <stdarg.h>
+#include <string.h>
 
 /* TinyCBOR library for CBOR encoding and decoding operations. */
 #include "cbor.h"
@@ -39,13 +40,18 @@
 /*-----------------------------------------------------------*/
 
 /**
- * @brief Context passed to tinyCBOR for #cborPrinter. Initial
- * state should be zeroed.
+ * @brief Size of the buffer in which #cborPrinter formats each piece of the
+ * textual CBOR representation.
+ */
+#define CBOR_PRINT_CHUNK_LENGTH    64
+
+/**
+ * @brief Context passed to tinyCBOR for #cborPrinter.
  */
 typedef struct
 {
-    const char * str;
-    size_t length;
+    size_t remaining; /**< @brief Characters that can still be written. */
+    bool truncated;   /**< @brief The output reached the length limit. */
 } CborPrintContext_t;
 
 /*-----------------------------------------------------------*/
@@ -54,7 +60,8 @@ typedef struct
  * @brief Printing function to pass to tinyCBOR.
  *
  * cbor_value_to_pretty_stream calls it multiple times to print a textual CBOR
- * representation.
+ * representation. Each piece is written to the log output as it comes, until
+ * #CBOR_DUMP_MAX_LENGTH characters are written.
  *
  * @param token Context for the function.
  * @param fmt Printf style format string.
@@ -64,6 +71,131 @@ static CborError cborPrinter( void * token,
                               const char * fmt,
                               ... );
 
+/**
+ * @brief Get the text string at the current position of a CBOR iterator in
+ * place, without copying it.
+ *
+ * @param[in] pValue The iterator. It is not advanced.
+ * @param[in] pPayloadEnd The end of the CBOR payload.
+ * @param[out] pOutString The text string, pointing into the payload.
+ */
+static CborError getTextString( const CborValue * pValue,
+                                const uint8_t * pPayloadEnd,
+                                ResponseString_t * pOutString );
+
+/**
+ * @brief Check whether a response string equals a null-terminated string.
+ */
+static bool responseStringEquals( const ResponseString_t * pString,
+                                  const char * pExpected );
+
+/*-----------------------------------------------------------*/
+
+static CborError getTextString( const CborValue * pValue,
+                                const uint8_t * pPayloadEnd,
+                                ResponseString_t * pOutString )
+{
+    CborError cborRet = CborNoError;
+    const uint8_t * pItem;
+    uint8_t additionalInfo;
+    size_t headerLength;
+    size_t length = 0;
+
+    if( !cbor_value_is_text_string( pValue ) || !cbor_value_is_length_known( pValue ) )
+    {
+        /* A chunked string is not contiguous in the payload. */
+        cborRet = CborErrorIllegalType;
+    }
+    else
+    {
+        cborRet = cbor_value_get_string_length( pValue, &length );
+    }
+
+    if( cborRet == CborNoError )
+    {
+        /* The initial byte is followed by the length in 0, 1, 2, 4 or 8
+         * bytes, then by the string. */
+        pItem = cbor_value_get_next_byte( pValue );
+        additionalInfo = pItem[ 0 ] & 0x1FU;
+        headerLength = ( additionalInfo < 24U ) ? 1U : ( 1U + ( ( size_t ) 1U << ( additionalInfo - 24U ) ) );
+
+        if( ( ( size_t ) ( pPayloadEnd - pItem ) < headerLength ) ||
+            ( length > ( ( size_t ) ( pPayloadEnd - pItem ) - headerLength ) ) )
+        {
+            cborRet = CborErrorUnexpectedEOF;
+        }
+        else
+        {
+            pOutString->pString = ( const char * ) ( pItem + headerLength );
+            pOutString->length = length;
+        }
+    }
+
+    return cborRet;
+}
+/*-----------------------------------------------------------*/
+
+static bool responseStringEquals( const ResponseString_t * pString,
+                                  const char * pExpected )
+{
+    size_t expectedLength = strlen( pExpected );
+
+    return( ( pString->length == expectedLength ) &&
+            ( memcmp( pString->pString, pExpected, expectedLength ) == 0 ) );
+}
+/*-----------------------------------------------------------*/
+
+bool generateCsrRequest( uint8_t * pBuffer,
+                         size_t bufferLength,
+                         const char * pCsr,
+                         size_t csrLength,
+                         size_t * pOutLengthWritten )
+{
+    CborEncoder encoder, mapEncoder;
+    CborError cborRet;
+
+    assert( pBuffer != NULL );
+    assert( pCsr != NULL );
+    assert( pOutLengthWritten != NULL );
+
+    /* For details on the CreateCertificatefromCsr request payload format, see:
+     * https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#create-cert-csr-request-payload
+     */
+    cbor_encoder_init( &encoder, pBuffer, bufferLength, 0 );
+    /* The CreateCertificatefromCsr request payload is a map with one key. */
+    cborRet = cbor_encoder_create_map( &encoder, &mapEncoder, 1 );
+
+    if( cborRet == CborNoError )
+    {
+        cborRet = cbor_encode_text_stringz( &mapEncoder, "certificateSigningRequest" );
+    }
+
+    if( cborRet == CborNoError )
+    {
+        cborRet = cbor_encode_text_string( &mapEncoder, pCsr, csrLength );
+    }
+
+    if( cborRet == CborNoError )
+    {
+        cborRet = cbor_encoder_close_container( &encoder, &mapEncoder );
+    }
+
+    if( cborRet == CborNoError )
+    {
+        *pOutLengthWritten = cbor_encoder_get_buffer_size( &encoder, ( uint8_t * ) pBuffer );
+    }
+    else
+    {
+        LogError( ( "Error during CBOR encoding: %s", cbor_error_string( cborRet ) ) );
+
+        if( ( cborRet & CborErrorOutOfMemory ) != 0 )
+        {
+            LogError( ( "Cannot fit CreateCertificateFromCsr request payload into buffer." ) );
+        }
+    }
+
+    return( cborRet == CborNoError );
+}
 /*-----------------------------------------------------------*/
 
 bool generateRegisterThingRequest( uint8_t * pBuffer,
@@ -148,179 +280,158 @@ bool generateRegisterThingRequest( uint8_t * pBuffer,
 }
 /*-----------------------------------------------------------*/
 
-bool parseKeyCertResponse( const uint8_t * pResponse,
-                           size_t length,
-                           char * pCertificateBuffer,
-                           size_t * pCertificateBufferLength,
-                           char * pPrivateKeyBuffer,
-                           size_t * pPrivateKeyBufferLength,
-                           char * pCertificateIdBuffer,
-                           size_t * pCertificateIdBufferLength,
-                           char * pOwnershipTokenBuffer,
-                           size_t * pOwnershipTokenBufferLength )
+bool parseCertificateResponse( const uint8_t * pResponse,
+                               size_t length,
+                               CertificateResponse_t * pOutResponse )
 {
     CborError cborRet;
     CborParser parser;
     CborValue map;
-    CborValue value;
+    CborValue element;
+    ResponseString_t key;
+    ResponseString_t * pValueString;
+    const uint8_t * pPayloadEnd = pResponse + length;
+    bool status = false;
 
     assert( pResponse != NULL );
-    assert( pCertificateBuffer != NULL );
-    assert( pCertificateBufferLength != NULL );
-    assert( pPrivateKeyBuffer != NULL );
-    assert( pPrivateKeyBufferLength != NULL );
-    assert( pCertificateIdBuffer != NULL );
-    assert( pCertificateIdBufferLength != NULL );
-    assert( *pCertificateIdBufferLength >= 64 );
-    assert( pOwnershipTokenBuffer != NULL );
-    assert( pOwnershipTokenBufferLength != NULL );
-
-    /* For details on the CreateCertificatefromCsr response payload format, see:
-     * https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#register-thing-response-payload
+    assert( pOutResponse != NULL );
+
+    memset( pOutResponse, 0, sizeof( CertificateResponse_t ) );
+
+    /* For details on the response payload formats, see:
+     * https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#create-cert-csr-response-payload
+     * https://docs.aws.amazon.com/iot/latest/developerguide/fleet-provision-api.html#create-keys-cert-response-payload
      */
     cborRet = cbor_parser_init( pResponse, length, 0, &parser, &map );
 
     if( cborRet != CborNoError )
     {
-        LogError( ( "Error initializing parser for CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
+        LogError( ( "Error initializing parser for certificate response: %s.", cbor_error_string( cborRet ) ) );
     }
     else if( !cbor_value_is_map( &map ) )
     {
-        LogError( ( "CreateKeysAndCertificate response is not a valid map container type." ) );
+        LogError( ( "Certificate response is not a valid map container type." ) );
+        cborRet = CborErrorIllegalType;
     }
     else
     {
-        cborRet = cbor_value_map_find_value( &map, "certificatePem", &value );
+        cborRet = cbor_value_enter_container( &map, &element );
+    }
 
-        if( cborRet != CborNoError )
-        {
-            LogError( ( "Error searching CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
-        }
-        else if( value.type == CborInvalidType )
-        {
-            LogError( ( "\"certificatePem\" not found in CreateKeysAndCertificate response." ) );
-        }
-        else if( value.type != CborTextStringType )
+    /* Walk the map once. Each key is followed by its value, and the values of
+     * unknown keys are skipped. */
+    while( ( cborRet == CborNoError ) && !cbor_value_at_end( &element ) )
+    {
+        pValueString = NULL;
+        cborRet = getTextString( &element, pPayloadEnd, &key );
+
+        if( cborRet == CborNoError )
         {
-            LogError( ( "Value for \"certificatePem\" key in CreateKeysAndCertificate response is not a text string type." ) );
+            cborRet = cbor_value_advance( &element );
         }
-        else
-        {
-            cborRet = cbor_value_copy_text_string( &value, pCertificateBuffer, pCertificateBufferLength, NULL );
 
-            if( cborRet == CborErrorOutOfMemory )
+        if( cborRet == CborNoError )
+        {
+            if( responseStringEquals( &key, "certificatePem" ) )
             {
-                size_t requiredLen = 0;
-                ( void ) cbor_value_calculate_string_length( &value, &requiredLen );
-                LogError( ( "Certificate buffer insufficiently large. Certificate length: %lu", ( unsigned long ) requiredLen ) );
+                pValueString = &( pOutResponse->certificatePem );
             }
-            else if( cborRet != CborNoError )
+            else if( responseStringEquals( &key, "privateKey" ) )
             {
-                LogError( ( "Failed to parse \"certificatePem\" value from CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
+                pValueString = &( pOutResponse->privateKey );
             }
-        }
-    }
-
-    if( cborRet == CborNoError )
-    {
-        cborRet = cbor_value_map_find_value( &map, "certificateId", &value );
-
-        if( cborRet != CborNoError )
-        {
-            LogError( ( "Error searching CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
-        }
-        else if( value.type == CborInvalidType )
-        {
-            LogError( ( "\"certificateId\" not found in CreateKeysAndCertificate response." ) );
-        }
-        else if( value.type != CborTextStringType )
-        {
-            LogError( ( "\"certificateId\" is an unexpected type in CreateKeysAndCertificate response." ) );
-        }
-        else
-        {
-            cborRet = cbor_value_copy_text_string( &value, pCertificateIdBuffer, pCertificateIdBufferLength, NULL );
-
-            if( cborRet == CborErrorOutOfMemory )
+            else if( responseStringEquals( &key, "certificateId" ) )
             {
-                size_t requiredLen = 0;
-                ( void ) cbor_value_calculate_string_length( &value, &requiredLen );
-                LogError( ( "Certificate ID buffer insufficiently large. Certificate ID length: %lu", ( unsigned long ) requiredLen ) );
+                pValueString = &( pOutResponse->certificateId );
             }
-            else if( cborRet != CborNoError )
+            else if( responseStringEquals( &key, "certificateOwnershipToken" ) )
+            {
+                pValueString = &( pOutResponse->certificateOwnershipToken );
+            }
+            else
             {
-                LogError( ( "Failed to parse \"certificateId\" value from CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
+                /* Not used by the demo. */
             }
         }
-    }
-
-    if( cborRet == CborNoError )
-    {
-        cborRet = cbor_value_map_find_value( &map, "privateKey", &value );
 
-        if( cborRet != CborNoError )
-        {
-            LogError( ( "Error searching CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
-        }
-        else if( value.type == CborInvalidType )
+        if( ( cborRet == CborNoError ) && ( pValueString != NULL ) && ( pValueString->pString != NULL ) )
         {
-            LogError( ( "\"privateKey\" not found in CreateKeysAndCertificate response." ) );
+            /* A repeated key would make the response ambiguous. */
+            LogError( ( "\"%.*s\" appears more than once in certificate response.",
+                        ( int ) key.length, key.pString ) );
+            cborRet = CborErrorMapKeysNotUnique;
         }
-        else if( value.type != CborTextStringType )
+        else if( ( cborRet == CborNoError ) && ( pValueString != NULL ) )
         {
-            LogError( ( "\"privateKey\" is an unexpected type in CreateKeysAndCertificate response." ) );
-        }
-        else
-        {
-            cborRet = cbor_value_copy_text_string( &value, pPrivateKeyBuffer, pPrivateKeyBufferLength, NULL );
+            cborRet = getTextString( &element, pPayloadEnd, pValueString );
 
-            if( cborRet == CborErrorOutOfMemory )
+            if( cborRet != CborNoError )
             {
-                size_t requiredLen = 0;
-                ( void ) cbor_value_calculate_string_length( &value, &requiredLen );
-                LogError( ( "Certificate ID buffer insufficiently large. Certificate ID length: %lu", ( unsigned long ) requiredLen ) );
-            }
-            else if( cborRet != CborNoError )
-            {
-                LogError( ( "Failed to parse \"certificateId\" value from CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
+                LogError( ( "\"%.*s\" is an unexpected type in certificate response.",
+                            ( int ) key.length, key.pString ) );
             }
         }
+
+        if( cborRet == CborNoError )
+        {
+            cborRet = cbor_value_advance( &element );
+        }
     }
 
-    if( cborRet == CborNoError )
+    if( cborRet != CborNoError )
     {
-        cborRet = cbor_value_map_find_value( &map, "certificateOwnershipToken", &value );
+        LogError( ( "Failed to parse certificate response: %s.", cbor_error_string( cborRet ) ) );
+    }
+    else if( pOutResponse->certificatePem.pString == NULL )
+    {
+        LogError( ( "\"certificatePem\" not found in certificate response." ) );
+    }
+    else if( pOutResponse->certificateId.pString == NULL )
+    {
+        LogError( ( "\"certificateId\" not found in certificate response." ) );
+    }
+    else if( pOutResponse->certificateOwnershipToken.pString == NULL )
+    {
+        LogError( ( "\"certificateOwnershipToken\" not found in certificate response." ) );
+    }
+    else
+    {
+        status = true;
+    }
 
-        if( cborRet != CborNoError )
-        {
-            LogError( ( "Error searching CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
-        }
-        else if( value.type == CborInvalidType )
-        {
-            LogError( ( "\"certificateOwnershipToken\" not found in CreateKeysAndCertificate response." ) );
-        }
-        else if( value.type != CborTextStringType )
-        {
-            LogError( ( "\"certificateOwnershipToken\" is an unexpected type in CreateKeysAndCertificate response." ) );
-        }
-        else
-        {
-            cborRet = cbor_value_copy_text_string( &value, pOwnershipTokenBuffer, pOwnershipTokenBufferLength, NULL );
+    return status;
+}
+/*-----------------------------------------------------------*/
 
-            if( cborRet == CborErrorOutOfMemory )
-            {
-                size_t requiredLen = 0;
-                ( void ) cbor_value_calculate_string_length( &value, &requiredLen );
-                LogError( ( "Certificate ownership token buffer insufficiently large. Certificate ownership token buffer length: %lu", ( unsigned long ) requiredLen ) );
-            }
-            else if( cborRet != CborNoError )
-            {
-                LogError( ( "Failed to parse \"certificateOwnershipToken\" value from CreateKeysAndCertificate response: %s.", cbor_error_string( cborRet ) ) );
-            }
-        }
+bool copyResponseString( const ResponseString_t * pString,
+                         char * pBuffer,
+                         size_t bufferLength,
+                         size_t * pOutLength )
+{
+    bool status = false;
+
+    assert( pString != NULL );
+    assert( pBuffer != NULL );
+    assert( pOutLength != NULL );
+
+    if( pString->pString == NULL )
+    {
+        LogError( ( "Response string is not set." ) );
+    }
+    else if( pString->length >= bufferLength )
+    {
+        LogError( ( "Buffer insufficiently large. Response string length: %lu",
+                    ( unsigned long ) pString->length ) );
+    }
+    else
+    {
+        ( void ) memcpy( pBuffer, pString->pString, pString->length );
+        pBuffer[ pString->length ] = '\0';
+        *pOutLength = pString->length;
+        status = true;
     }
 
-    return( cborRet == CborNoError );
+    return status;
 }
 /*-----------------------------------------------------------*/
 
@@ -393,76 +504,75 @@ static CborError cborPrinter( void * token,
                               ... )
 {
     int result;
+    size_t writeLength;
     va_list args;
+    char chunk[ CBOR_PRINT_CHUNK_LENGTH ];
     CborPrintContext_t * ctx = ( CborPrintContext_t * ) token;
 
     va_start( args, fmt );
 
-    /* Compute length to write. */
-    result = vsnprintf( NULL, 0, fmt, args );
+    result = vsnprintf( chunk, sizeof( chunk ), fmt, args );
 
     va_end( args );
 
-    if( result < 0 )
+    /* Nothing is logged on error, as the output is in the middle of a log
+     * message. */
+    if( result >= 0 )
     {
-        LogError( ( "Error formatting CBOR string." ) );
-    }
-    else
-    {
-        size_t newLen = ( unsigned ) result;
-        size_t oldLen = ctx->length;
-        char * newPtr;
-
-        ctx->length = oldLen + newLen;
-        newPtr = ( char * ) realloc( ( void * ) ctx->str, ctx->length + 1 );
+        writeLength = ( size_t ) result;
 
-        if( newPtr == NULL )
+        /* The pieces are single values, so only a long number or escape
+         * sequence can exceed the chunk. */
+        if( writeLength >= sizeof( chunk ) )
         {
-            LogError( ( "Failed to reallocate CBOR string." ) );
-            result = -1;
+            writeLength = sizeof( chunk ) - 1U;
+            ctx->truncated = true;
         }
-        else
-        {
-            va_start( args, fmt );
-
-            result = vsnprintf( newPtr + oldLen, newLen + 1, fmt, args );
-
-            va_end( args );
 
-            ctx->str = newPtr;
-
-            if( result < 0 )
-            {
-                LogError( ( "Error printing CBOR string." ) );
-            }
+        if( writeLength > ctx->remaining )
+        {
+            writeLength = ctx->remaining;
+            ctx->truncated = true;
         }
+
+        SdkLog( ( "%.*s", ( int ) writeLength, chunk ) );
+        ctx->remaining -= writeLength;
     }
 
-    return ( result < 0 ) ? CborErrorIO : CborNoError;
+    /* Stop the pretty printer once the output is cut. */
+    return ( ( result < 0 ) || ( ctx->truncated == true ) ) ? CborErrorIO : CborNoError;
 }
 /*-----------------------------------------------------------*/
 
-const char * getStringFromCbor( const uint8_t * cbor,
-                                size_t length )
+void logCborPayload( const void * pData,
+                     size_t dataLength )
 {
-    CborPrintContext_t printCtx = { 0 };
+    CborPrintContext_t printCtx;
     CborParser parser;
     CborValue value;
     CborError error;
 
-    error = cbor_parser_init( cbor, length, 0, &parser, &value );
+    printCtx.remaining = CBOR_DUMP_MAX_LENGTH;
+    printCtx.truncated = false;
+
+    error = cbor_parser_init( ( const uint8_t * ) pData, dataLength, 0, &parser, &value );
 
     if( error == CborNoError )
     {
         error = cbor_value_to_pretty_stream( cborPrinter, &printCtx, &value, CborPrettyDefaultFlags );
     }
 
-    if( error != CborNoError )
+    if( printCtx.truncated == true )
     {
-        LogError( ( "Error printing CBOR payload." ) );
-        printCtx.str = "";
+        SdkLog( ( "..." ) );
+    }
+    else if( error != CborNoError )
+    {
+        SdkLog( ( "<invalid CBOR: %s>", cbor_error_string( error ) ) );
+    }
+    else
+    {
+        /* Empty else MISRA 15.7 */
     }
-
-    return printCtx.str;
 }
 /*-----------------------------------------------------------*/
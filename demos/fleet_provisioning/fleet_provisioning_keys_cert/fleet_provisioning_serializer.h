@@ -31,6 +31,28 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * @brief A text string of a response payload. It points into the payload and
+ * is not null terminated.
+ */
+typedef struct ResponseString
+{
+    const char * pString;
+    size_t length;
+} ResponseString_t;
+
+/**
+ * @brief Values of a CreateKeysAndCertificate or CreateCertificateFromCsr
+ * accepted response.
+ */
+typedef struct CertificateResponse
+{
+    ResponseString_t certificatePem;
+    ResponseString_t privateKey;
+    ResponseString_t certificateId;
+    ResponseString_t certificateOwnershipToken;
+} CertificateResponse_t;
+
 /**
  * @brief Creates the request payload to be published to the RegisterThing API
  * in order to activate the provisioned certificate and receive a Thing name.
@@ -52,35 +74,54 @@ bool generateRegisterThingRequest( uint8_t * pBuffer,
                                    size_t * pOutLengthWritten );
 
 /**
- * @brief Extracts the certificate, certificate ID, and certificate ownership
- * token from a CreateCertificateFromCsr accepted response. These are copied
- * to the provided buffers so that they can outlive the data in the response
- * buffer and as CBOR strings may be chunked.
+ * @brief Creates the request payload to be published to the
+ * CreateCertificateFromCsr API in order to request a certificate from AWS IoT
+ * for the included Certificate Signing Request (CSR).
+ *
+ * @param[in] pBuffer Buffer into which to write the publish request payload.
+ * @param[in] bufferLength Length of #pBuffer.
+ * @param[in] pCsr The CSR to include in the request payload.
+ * @param[in] csrLength The length of #pCsr.
+ * @param[out] pOutLengthWritten The length of the publish request payload.
+ */
+bool generateCsrRequest( uint8_t * pBuffer,
+                         size_t bufferLength,
+                         const char * pCsr,
+                         size_t csrLength,
+                         size_t * pOutLengthWritten );
+
+/**
+ * @brief Extracts the certificate, private key, certificate ID, and
+ * certificate ownership token from a CreateKeysAndCertificate or
+ * CreateCertificateFromCsr accepted response. The map is walked once and the
+ * values are not copied: they point into #pResponse, so they are valid only as
+ * long as the response buffer. Use #copyResponseString to keep a value.
  *
  * @param[in] pResponse The response payload.
  * @param[in] length Length of #pResponse.
- * @param[in] pCertificateBuffer The buffer to which to write the certificate.
- * @param[in,out] pCertificateBufferLength The length of #pCertificateBuffer.
- * The length written is output here.
- * @param[in] pCertificateIdBuffer The buffer to which to write the certificate
- * ID.
- * @param[in,out] pCertificateIdBufferLength The length of
- * #pCertificateIdBuffer. The length written is output here.
- * @param[in] pOwnershipTokenBuffer The buffer to which to write the
- * certificate ownership token.
- * @param[in,out] pOwnershipTokenBufferLength The length of
- * #pOwnershipTokenBuffer. The length written is output here.
+ * @param[out] pOutResponse The values of the response. The private key is only
+ * in a CreateKeysAndCertificate response; it has a NULL string otherwise.
+ *
+ * @return True if the certificate, certificate ID and certificate ownership
+ * token are found.
+ */
+bool parseCertificateResponse( const uint8_t * pResponse,
+                               size_t length,
+                               CertificateResponse_t * pOutResponse );
+
+/**
+ * @brief Copies a response string into a buffer and null terminates it.
+ *
+ * @param[in] pString The response string.
+ * @param[in] pBuffer The buffer to which to write the string.
+ * @param[in] bufferLength The length of #pBuffer.
+ * @param[out] pOutLength The length of the string, excluding the null
+ * terminator.
  */
-bool parseKeyCertResponse( const uint8_t * pResponse,
-                           size_t length,
-                           char * pCertificateBuffer,
-                           size_t * pCertificateBufferLength,
-                           char * pPrivateKeyBuffer,
-                           size_t * pPrivateKeyBufferLength,
-                           char * pCertificateIdBuffer,
-                           size_t * pCertificateIdBufferLength,
-                           char * pOwnershipTokenBuffer,
-                           size_t * pOwnershipTokenBufferLength );
+bool copyResponseString( const ResponseString_t * pString,
+                         char * pBuffer,
+                         size_t bufferLength,
+                         size_t * pOutLength );
 
 /**
  * @brief Extracts the Thing name from a RegisterThing accepted response.
@@ -97,12 +138,22 @@ bool parseRegisterThingResponse( const uint8_t * pResponse,
                                  size_t * pThingNameBufferLength );
 
 /**
- * @brief Converts a CBOR document into a pretty printed string.
+ * @brief Maximum number of characters written by #logCborPayload.
+ */
+#ifndef CBOR_DUMP_MAX_LENGTH
+    #define CBOR_DUMP_MAX_LENGTH    512
+#endif
+
+/**
+ * @brief Writes a CBOR document to the log output in diagnostic notation.
  *
- * @param[in] cbor The CBOR document.
- * @param[in] length The length of the CBOR document.
+ * It is a #LogFormatter_t, to be passed to the logging interfaces with a
+ * formatter so that the document is only rendered when the log level is
+ * enabled. The output is streamed without allocation and cut after
+ * #CBOR_DUMP_MAX_LENGTH characters.
  *
- * @returns The pretty printed string on success. "" on error.
+ * @param[in] pData The CBOR document.
+ * @param[in] dataLength The length of the CBOR document.
  */
-const char * getStringFromCbor( const uint8_t * cbor,
-                                size_t length );
+void logCborPayload( const void * pData,
+                     size_t dataLength );
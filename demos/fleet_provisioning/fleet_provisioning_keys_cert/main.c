@@ -8,27 +8,42 @@
 #include "pkcs11_operations.h"
 
 #include "mbedtls_pkcs11_posix.h"
+#include "mbedtls_pkcs11_session_pool.h"
+#include "mbedtls_pkcs11_secure_arena.h"
 
 #include "mqtt_agent.h"
+#include "mqtt_agent_scheduler.h"
 
 #include "demo_config.h"
+#include "fleet_provisioning_keys_cert_demo.h"
 
 /*-----------------------------------------------------------*/
 
 #define DEVICE_SERIAL_NUMBER_MAX    32
 
+/**
+ * @brief Time in milliseconds to wait for the first connection of a
+ * provisioned device, including the retries of the agent.
+ */
+#define PROVISIONED_CONNECT_TIMEOUT_MS    ( 60000U )
+
 /*-----------------------------------------------------------*/
 
-static struct NetworkContext networkContext = { 0 };
 static char mqttEndpoint[] = AWS_IOT_ENDPOINT;
 static char provisioningTemplateName[] = PROVISIONING_TEMPLATE_NAME;
 
 extern bool pkcs11CloseSession( CK_SESSION_HANDLE p11Session );
-extern int ProvisionDevicePKCS11WithFP( NetworkContext_t * pNetworkContext,
-                                        CK_SESSION_HANDLE p11Session,
-                                        char * pDeviceSerialNumber,
-                                        char * pMqttEndpoint,
-                                        char * pProvisioningTemplateName );
+
+/**
+ * @brief Parameters of the application thread.
+ */
+typedef struct ApplicationThreadParam
+{
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    CK_SESSION_HANDLE p11Session;
+    char * pDeviceSerialNumber;
+    bool provisioned; /* The instance connects with the provisioned credentials. */
+} ApplicationThreadParam_t;
 
 /*-----------------------------------------------------------*/
 
@@ -56,11 +71,26 @@ FRTestThreadHandle_t FRTest_ThreadCreate( FRTestThreadFunction_t threadFunc, voi
     err = pthread_create( pThreadid, NULL, threadFunc, pParam );
     if( err != 0 )
     {
+        free( pThreadid );
         return NULL;
     }
     return threadHandle;
 }
 
+/**
+ * @brief Wait for the thread created by FRTest_ThreadCreate to return and free
+ * its handle.
+ *
+ * @param[in] threadHandle Handle returned by FRTest_ThreadCreate.
+ */
+void FRTest_ThreadJoin( FRTestThreadHandle_t threadHandle )
+{
+    pthread_t * pThreadid = threadHandle;
+
+    pthread_join( *pThreadid, NULL );
+    free( pThreadid );
+}
+
 /*-----------------------------------------------------------*/
 
 static void devicePlatformInitialize( void )
@@ -97,6 +127,7 @@ void prvDataModelHandlerThread( void * pParam )
     iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
 
     iotshdDev_MQTTAgentUserContext_t * pUserContext;
+    iotshdDev_MQTTAgentInstance_t * pInstance = ( iotshdDev_MQTTAgentInstance_t * ) pParam;
 
     xPublishInfo.qos = 1;
     xPublishInfo.pTopicName = "test";
@@ -110,7 +141,8 @@ void prvDataModelHandlerThread( void * pParam )
     while( 1 )
     {
         /* Subscribe the message topic. */
-        iotshdDev_MQTTAgentAddSubscription( pUserContext,
+        iotshdDev_MQTTAgentAddSubscription( pInstance,
+                                            pUserContext,
                                             "test",
                                             4,
                                             prvDataModelHandlerIncommingPublish,
@@ -119,7 +151,7 @@ void prvDataModelHandlerThread( void * pParam )
         /* Publish the message. */
         printf( "publish message\r\n" );
         messageReceiveFlag = false;
-        iotshdDev_MQTTAgentPublish( pUserContext, &xPublishInfo, 100 );
+        iotshdDev_MQTTAgentPublish( pInstance, pUserContext, &xPublishInfo, 100 );
 
         /* Waiting for the message received. */
         sleep( 3 );
@@ -133,7 +165,8 @@ void prvDataModelHandlerThread( void * pParam )
         }
 
         /* Unsubscribe the message topic. */
-        iotshdDev_MQTTAgentRemoveSubscription( pUserContext,
+        iotshdDev_MQTTAgentRemoveSubscription( pInstance,
+                                               pUserContext,
                                                "test",
                                                4,
                                                prvDataModelHandlerIncommingPublish,
@@ -143,7 +176,7 @@ void prvDataModelHandlerThread( void * pParam )
         /* Publish the message. */
         printf( "publish message\r\n" );
         messageReceiveFlag = false;
-        iotshdDev_MQTTAgentPublish( pUserContext, &xPublishInfo, 100 );
+        iotshdDev_MQTTAgentPublish( pInstance, pUserContext, &xPublishInfo, 100 );
 
         /* Waiting for the message received. */
         sleep( 3 );
@@ -157,15 +190,16 @@ void prvDataModelHandlerThread( void * pParam )
         }
 
         /* subscription with queue. */
-        iotshdDev_MQTTAgentAddSubscriptionWithQueue( pUserContext,
+        iotshdDev_MQTTAgentAddSubscriptionWithQueue( pInstance,
+                                                     pUserContext,
                                                      "test",
                                                      4,
                                                      5000 );
 
         /* Publish the message. */
         printf( "publish message\r\n" );
-        iotshdDev_MQTTAgentPublish( pUserContext, &xPublishInfo, 100 );
-        iotshdDev_MQTTAgentPublish( pUserContext, &xPublishInfo, 100 );
+        iotshdDev_MQTTAgentPublish( pInstance, pUserContext, &xPublishInfo, 100 );
+        iotshdDev_MQTTAgentPublish( pInstance, pUserContext, &xPublishInfo, 100 );
 
         /* We should be able to receive from queue twice. */
         pQueueItem = iotshdDev_MQTTAgentDequeueIncommingPublish( pUserContext, 5000 );
@@ -177,7 +211,8 @@ void prvDataModelHandlerThread( void * pParam )
         iotshdDev_MQTTAgentFreeIncommingPublish( pUserContext, pQueueItem, false );
 
         /* subscription with queue. */
-        iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( pUserContext,
+        iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( pInstance,
+                                                        pUserContext,
                                                         "test",
                                                         4,
                                                         5000 );
@@ -197,24 +232,115 @@ void prvDataModelHandlerThread( void * pParam )
     }
 }
 
-static int applicationLoop( CK_SESSION_HANDLE p11Session )
+void prvApplicationThread( void * pParam )
+{
+    int retFPResult;
+    MQTTStatus_t mqttStatus;
+    ApplicationThreadParam_t * pThreadParam = ( ApplicationThreadParam_t * ) pParam;
+
+    if( pThreadParam->provisioned == true )
+    {
+        /* Only a TLS alert of the broker rejecting the provisioned certificate
+         * is a reason to provision again. Timeouts, dropped connections and
+         * other failures are retried by the agent, and the record is kept. */
+        mqttStatus = iotshdDev_MQTTAgentWaitConnected( pThreadParam->pInstance,
+                                                       PROVISIONED_CONNECT_TIMEOUT_MS );
+
+        if( mqttStatus == MQTTServerRefused )
+        {
+            LogWarn( ( "The provisioned credentials are refused. Provisioning the device again." ) );
+            ( void ) clearProvisionedState( PROVISIONED_STATE_PATH );
+            pThreadParam->provisioned = false;
+            iotshdDev_MQTTAgentStop( pThreadParam->pInstance );
+        }
+        else
+        {
+            prvDataModelHandlerThread( pThreadParam->pInstance );
+        }
+    }
+    else
+    {
+        /* Provision the device on the claim connection of the agent. The agent
+         * then reconnects once with the provisioned credentials. */
+        retFPResult = ProvisionDevicePKCS11WithFP( pThreadParam->pInstance,
+                                                   pThreadParam->p11Session,
+                                                   pThreadParam->pDeviceSerialNumber,
+                                                   provisioningTemplateName );
+        if( 0 == retFPResult )
+        {
+            printf( "Successfully provision the device.\r\n" );
+            pThreadParam->provisioned = true;
+
+            /* At this point, MQTT is connected with the provisioned credentials. */
+            prvDataModelHandlerThread( pThreadParam->pInstance );
+        }
+        else
+        {
+            iotshdDev_MQTTAgentStop( pThreadParam->pInstance );
+        }
+    }
+}
+
+static int applicationLoop( CK_SESSION_HANDLE p11Session,
+                            char * pDeviceSerialNumber,
+                            bool provisioned )
 {
     MQTTStatus_t mqttStatus;
-    FRTestThreadHandle_t dataModelHandlerThread;
+    FRTestThreadHandle_t applicationThread;
+    iotshdDev_MQTTAgentConfig_t agentConfig = { 0 };
+    iotshdDev_MQTTAgentInstance_t * pAgentInstance;
+    ApplicationThreadParam_t threadParam;
 
     printf( "======================== application loop =================\r\n" );
 
-    /* Initialize the MQTT agent. */
-    mqttStatus = iotshdDev_MQTTAgentInit( &networkContext );
+    /* Create the MQTT agent instance with the provisioned credentials, or
+     * with the claim credentials whose connection is then used for
+     * provisioning. Other connection parameters use the defaults of
+     * demo_config.h. */
+    agentConfig.pEndpoint = mqttEndpoint;
 
-    /* Create another task for MQTT commands. */
-    dataModelHandlerThread = FRTest_ThreadCreate( prvDataModelHandlerThread, NULL );
+    if( provisioned == true )
+    {
+        agentConfig.pClientCertLabel = pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS;
+        agentConfig.pPrivateKeyLabel = pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS;
+    }
+    else
+    {
+        agentConfig.pClientCertLabel = pkcs11configLABEL_CLAIM_CERTIFICATE;
+        agentConfig.pPrivateKeyLabel = pkcs11configLABEL_CLAIM_PRIVATE_KEY;
+    }
+
+    agentConfig.inflightWindowSize = MQTT_AGENT_INFLIGHT_WINDOW_SIZE;
+    pAgentInstance = iotshdDev_MQTTAgentCreateInstance( &agentConfig );
+
+    if( pAgentInstance == NULL )
+    {
+        return -1;
+    }
 
-    /* Create another application task here. */
-    mqttStatus = iotshdDev_MQTTAgentThreadLoop( &networkContext,
-                                                mqttEndpoint,
+    /* Create another task for provisioning and MQTT commands. */
+    threadParam.pInstance = pAgentInstance;
+    threadParam.p11Session = p11Session;
+    threadParam.pDeviceSerialNumber = pDeviceSerialNumber;
+    threadParam.provisioned = provisioned;
+    applicationThread = FRTest_ThreadCreate( prvApplicationThread, &threadParam );
+
+    if( applicationThread == NULL )
+    {
+        iotshdDev_MQTTAgentDeleteInstance( pAgentInstance );
+        return -1;
+    }
+
+    /* Serve the instance in this thread. The loop returns when the application
+     * thread stops the instance. */
+    mqttStatus = iotshdDev_MQTTAgentThreadLoop( pAgentInstance,
                                                 p11Session );
 
+    /* The application thread uses the instance and its parameter on this
+     * stack until it returns. */
+    FRTest_ThreadJoin( applicationThread );
+    iotshdDev_MQTTAgentDeleteInstance( pAgentInstance );
+
     return 0;
 }
 
@@ -226,17 +352,34 @@ static void deviceInitializePKCS11Session( CK_SESSION_HANDLE * p11Session )
 
 static void deviceClosePKCS11Session( CK_SESSION_HANDLE p11Session )
 {
+    /* Close the signing sessions opened by the transport first. */
+    Mbedtls_Pkcs11_SessionPoolClose();
     pkcs11CloseSession( p11Session );
 }
 
 void main( void )
 {
     int retApplication;
-    int retFPResult;
     char deviceSerialNumber[ DEVICE_SERIAL_NUMBER_MAX ];
     CK_SESSION_HANDLE p11Session;
+    ProvisionedState_t provisionedState;
+    bool provisioned;
     bool status;
     
+    /* Count the TLS memory of the connections. It must precede any MbedTLS
+     * allocation. The agent schedulers keep the account of each instance
+     * across their switches. */
+    Mbedtls_Pkcs11_MemoryInit();
+    iotshdDev_MQTTAgentSchedulerSetSwapFunction( Mbedtls_Pkcs11_MemorySwapContext );
+
+    /* Reserve the locked memory of the credentials handled outside the
+     * PKCS #11 module. */
+    if( Mbedtls_Pkcs11_SecureArenaInit( SECURE_ARENA_DEVICE_SIZE ) == false )
+    {
+        LogError( ( "Failed to initialize the secure arena." ) );
+        return;
+    }
+
     /* Device platform initialization code. */
     devicePlatformInitialize();
 
@@ -246,17 +389,6 @@ void main( void )
     /* Check device provisioned. */
     deviceWifiProvisioning();
 
-    /* Insert the claim credentials into the PKCS #11 module */
-    status = loadClaimCredentials( p11Session,
-                                   CLAIM_CERT_PATH,
-                                   pkcs11configLABEL_CLAIM_CERTIFICATE,
-                                   CLAIM_PRIVATE_KEY_PATH,
-                                   pkcs11configLABEL_CLAIM_PRIVATE_KEY );
-    if( status == false )
-    {
-        LogError( ( "Failed to provision PKCS #11 with claim credentials." ) );
-    }
-
     /* Network connection. */
     deviceWIFIConnect();
 
@@ -266,18 +398,36 @@ void main( void )
 
     for(;;)
     {
-        retFPResult = ProvisionDevicePKCS11WithFP( &networkContext,
-                                                   p11Session,
-                                                   deviceSerialNumber,
-                                                   mqttEndpoint,
-                                                   provisioningTemplateName );
-        if( 0 == retFPResult )
+        /* A device provisioned before with a valid certificate connects
+         * directly, without the claim connection. The record is removed when
+         * the broker refuses the certificate. */
+        provisioned = loadProvisionedState( p11Session,
+                                            PROVISIONED_STATE_PATH,
+                                            pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
+                                            &provisionedState );
+
+        if( provisioned == true )
         {
-            printf( "Successfully provision the device.\r\n" );
+            LogInfo( ( "Device is provisioned as %s with certificate %s.",
+                       provisionedState.thingName,
+                       provisionedState.certificateId ) );
+        }
+        else
+        {
+            /* Insert the claim credentials into the PKCS #11 module */
+            status = loadClaimCredentials( p11Session,
+                                           CLAIM_CERT_PATH,
+                                           pkcs11configLABEL_CLAIM_CERTIFICATE,
+                                           CLAIM_PRIVATE_KEY_PATH,
+                                           pkcs11configLABEL_CLAIM_PRIVATE_KEY );
+            if( status == false )
+            {
+                LogError( ( "Failed to provision PKCS #11 with claim credentials." ) );
+            }
         }
 
-        /* At this point, MQTT is connected. */
-        retApplication = applicationLoop( p11Session );
+        /* Provisioning and the application share one MQTT connection. */
+        retApplication = applicationLoop( p11Session, deviceSerialNumber, provisioned );
 
         /*
         switch( retApplication )
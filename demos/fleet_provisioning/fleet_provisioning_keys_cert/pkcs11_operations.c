@@ -30,6 +30,12 @@
 #include <errno.h>
 #include <assert.h>
 
+/* POSIX includes. */
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /* Config include. */
 #include "demo_config.h"
 
@@ -41,8 +47,13 @@
 #include "core_pki_utils.h"
 #include "mbedtls_utils.h"
 
+/* Transport includes. */
+#include "mbedtls_pkcs11_credential_cache.h"
+#include "mbedtls_pkcs11_secure_arena.h"
+
 /* MbedTLS include. */
 #include "mbedtls/ctr_drbg.h"
+#include "mbedtls/ecdsa.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/entropy_poll.h"
 #include "mbedtls/error.h"
@@ -54,14 +65,10 @@
 #include "mbedtls/x509_csr.h"
 
 /**
- * @brief Size of buffer in which to hold the certificate signing request (CSR).
- */
-#define CLAIM_CERT_BUFFER_LENGTH           2048
-
-/**
- * @brief Size of buffer in which to hold the certificate signing request (CSR).
+ * @brief Start of a PEM encoded object. A claim credential file without it is
+ * taken as DER.
  */
-#define CLAIM_PRIVATE_KEY_BUFFER_LENGTH    2048
+#define PEM_BEGIN_MARKER                   "-----BEGIN "
 
 /* Length parameters for importing RSA-2048 private keys. */
 #define MODULUS_LENGTH                     pkcs11RSA_2048_MODULUS_BITS / 8
@@ -76,6 +83,24 @@
 #define EC_PARAMS_LENGTH                   10
 #define EC_D_LENGTH                        32
 
+/**
+ * @brief Length of the DER encoded CKA_EC_POINT of a P-256 public key: a
+ * 2-byte OCTET STRING header followed by the uncompressed point.
+ */
+#define EC_POINT_LENGTH                    67
+
+/**
+ * @brief Identifies the format of #ProvisionedState_t. It is changed when the
+ * layout of the record changes.
+ */
+#define PROVISIONED_STATE_MAGIC            0x46505331UL
+
+/**
+ * @brief Suffix of the temporary file the record is written to before it
+ * replaces the previous one.
+ */
+#define PROVISIONED_STATE_TEMP_SUFFIX      ".tmp"
+
 /**
  * @brief Struct for holding parsed RSA-2048 private keys.
  */
@@ -93,27 +118,106 @@ typedef struct RsaParams_t
 
 /**
  * @brief Struct containing parameters needed by the signing callback.
+ *
+ * MbedTLS uses the context of an EC key as #mbedtls_ecdsa_context, so the
+ * ECDSA context holding the public key must be the first member.
  */
 typedef struct SigningCallbackContext
 {
+    mbedtls_ecdsa_context ecdsaContext;
     CK_SESSION_HANDLE p11Session;
     CK_OBJECT_HANDLE p11PrivateKey;
 } SigningCallbackContext_t;
 
+/**
+ * @brief Read-only mapping of a claim credential file.
+ */
+typedef struct MappedFile
+{
+    const uint8_t * pData;
+    size_t length;
+} MappedFile_t;
+
 /*-----------------------------------------------------------*/
 
 /**
- * @brief Reads a file into the given buffer.
+ * @brief Map a file into memory for reading. The contents are paged in from
+ * the file on access, without being copied into a buffer.
  *
  * @param[in] path Path of the file.
- * @param[out] pBuffer Buffer to read file contents into.
- * @param[in] bufferLength Length of #pBuffer.
- * @param[out] pOutWrittenLength Length of contents written to #pBuffer.
+ * @param[out] pFile The mapping.
+ *
+ * @return True on success.
+ */
+static bool mapFile( const char * path,
+                     MappedFile_t * pFile );
+
+/**
+ * @brief Unmap a file mapped with #mapFile.
+ *
+ * @param[in] pFile The mapping. It is ignored if the file is not mapped.
+ */
+static void unmapFile( MappedFile_t * pFile );
+
+/**
+ * @brief Check whether a claim credential file is PEM encoded.
+ *
+ * @param[in] pFile The mapped file.
+ *
+ * @return True for PEM; false for DER.
+ */
+static bool isPemObject( const MappedFile_t * pFile );
+
+/**
+ * @brief Copy a PEM object with the null terminator that MbedTLS requires.
+ *
+ * @param[in] pFile The mapped PEM file.
+ *
+ * @return The copy, allocated from the secure arena; NULL on failure.
+ */
+static char * copyPemObject( const MappedFile_t * pFile );
+
+/**
+ * @brief Import a claim private key from a DER or PEM file, unless the token
+ * already holds the same key.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] pFile The mapped key file.
+ * @param[in] label The label to store the key.
+ * @param[out] pWritten Whether the key object was written.
+ */
+static CK_RV importClaimPrivateKey( CK_SESSION_HANDLE session,
+                                    const MappedFile_t * pFile,
+                                    const char * label,
+                                    bool * pWritten );
+
+/**
+ * @brief Import a claim certificate from a DER or PEM file, unless the token
+ * already holds the same certificate. The certificate in the token is then
+ * parsed once through the credential cache, which the TLS connection reuses.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] pFile The mapped certificate file.
+ * @param[in] label The label to store the certificate.
+ */
+static CK_RV importClaimCertificate( CK_SESSION_HANDLE session,
+                                     const MappedFile_t * pFile,
+                                     const char * label );
+
+/**
+ * @brief Check whether the private key object with a label is the given key.
+ * Only the public point of a key can be read from the token, so only EC keys
+ * are compared.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] label The label of the key.
+ * @param[in] pPrivateKey The parsed key.
+ *
+ * @return True if the token holds the key.
  */
-static bool readFile( const char * path,
-                      char * pBuffer,
-                      size_t bufferLength,
-                      size_t * pOutWrittenLength );
+static bool isPrivateKeyInToken( CK_SESSION_HANDLE session,
+                                 const char * label,
+                                 mbedtls_pk_context * pPrivateKey );
 
 /**
  * @brief Delete the specified crypto object from storage.
@@ -154,6 +258,17 @@ static CK_RV provisionPrivateRSAKey( CK_SESSION_HANDLE session,
                                      mbedtls_pk_context * mbedPkContext );
 
 
+/**
+ * @brief Import the specified parsed private key into storage.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] label The label to store the key.
+ * @param[in] mbedPkContext The private key to store.
+ */
+static CK_RV provisionParsedPrivateKey( CK_SESSION_HANDLE session,
+                                        const char * label,
+                                        mbedtls_pk_context * mbedPkContext );
+
 /**
  * @brief Import the specified private key into storage.
  *
@@ -180,21 +295,119 @@ static CK_RV provisionCertificate( CK_SESSION_HANDLE session,
                                    size_t certificateLength,
                                    const char * label );
 
+/**
+ * @brief Import the specified DER encoded X.509 certificate into storage.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] pDer The certificate to store, in DER format.
+ * @param[in] derLength The length of #pDer.
+ * @param[in] label The label to store the certificate.
+ */
+static CK_RV provisionDerCertificate( CK_SESSION_HANDLE session,
+                                      const uint8_t * pDer,
+                                      size_t derLength,
+                                      const char * label );
+
+/**
+ * @brief Generate a new EC P-256 key pair in the PKCS #11 module. Existing
+ * objects with the same labels are replaced.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[in] privateKeyLabel The label to store the private key.
+ * @param[in] publicKeyLabel The label to store the public key.
+ * @param[out] privateKeyHandlePtr The handle of the private key.
+ * @param[out] publicKeyHandlePtr The handle of the public key.
+ */
+static CK_RV generateKeyPairEC( CK_SESSION_HANDLE session,
+                                const char * privateKeyLabel,
+                                const char * publicKeyLabel,
+                                CK_OBJECT_HANDLE_PTR privateKeyHandlePtr,
+                                CK_OBJECT_HANDLE_PTR publicKeyHandlePtr );
+
+/**
+ * @brief Read the public key of an EC P-256 key pair into an MbedTLS ECDSA
+ * context.
+ *
+ * @param[in] session The PKCS #11 session.
+ * @param[out] pEcdsaContext The initialized ECDSA context to load the key into.
+ * @param[in] publicKey The handle of the public key.
+ *
+ * @return 0 on success; otherwise an MbedTLS error code.
+ */
+static int extractEcPublicKey( CK_SESSION_HANDLE session,
+                               mbedtls_ecdsa_context * pEcdsaContext,
+                               CK_OBJECT_HANDLE publicKey );
+
+/**
+ * @brief MbedTLS signing function that signs a hash with the private key in
+ * the PKCS #11 module. It has the signature of the sign_func of
+ * #mbedtls_pk_info_t.
+ *
+ * @param[in] pContext The #SigningCallbackContext_t of the key.
+ * @param[in] mdAlg The hash algorithm.
+ * @param[in] pHash The hash to sign.
+ * @param[in] hashLen The length of #pHash.
+ * @param[out] pSig The buffer for the DER encoded signature.
+ * @param[out] pSigLen The length of the signature.
+ * @param[in] pRng Unused.
+ * @param[in] pRngContext Unused.
+ *
+ * @return 0 on success; otherwise -1.
+ */
+static int privateKeySigningCallback( void * pContext,
+                                      mbedtls_md_type_t mdAlg,
+                                      const unsigned char * pHash,
+                                      size_t hashLen,
+                                      unsigned char * pSig,
+                                      size_t * pSigLen,
+                                      int ( * pRng )( void *, unsigned char *, size_t ),
+                                      void * pRngContext );
+
+/**
+ * @brief MbedTLS random number callback that uses the PKCS #11 module.
+ *
+ * @param[in] pCtx Pointer to the PKCS #11 session handle.
+ * @param[out] pRandom The buffer to fill with random bytes.
+ * @param[in] randomLength The length of #pRandom.
+ *
+ * @return 0 on success.
+ */
+static int randomCallback( void * pCtx,
+                           unsigned char * pRandom,
+                           size_t randomLength );
+
+/**
+ * @brief Get the SHA-256 fingerprint and the expiry of a certificate in the
+ * PKCS #11 module.
+ *
+ * @param[in] p11Session The PKCS #11 session to use.
+ * @param[in] pCertLabel PKCS #11 label of the certificate.
+ * @param[out] pFingerprint Buffer of #PROVISIONED_STATE_FINGERPRINT_LENGTH bytes.
+ * @param[out] pExpired Whether the certificate has expired.
+ *
+ * @return True on success.
+ */
+static bool getCertificateFingerprint( CK_SESSION_HANDLE p11Session,
+                                       const char * pCertLabel,
+                                       uint8_t * pFingerprint,
+                                       bool * pExpired );
+
 /*-----------------------------------------------------------*/
 
-static bool readFile( const char * path,
-                      char * pBuffer,
-                      size_t bufferLength,
-                      size_t * pOutWrittenLength )
+static bool mapFile( const char * path,
+                     MappedFile_t * pFile )
 {
-    FILE * file;
-    size_t length = 0;
+    int fd;
+    struct stat fileStat;
+    void * pMapping = MAP_FAILED;
     bool status = true;
 
-    /* Get the file descriptor for the CSR file. */
-    file = fopen( path, "rb" );
+    pFile->pData = NULL;
+    pFile->length = 0;
 
-    if( file == NULL )
+    fd = open( path, O_RDONLY );
+
+    if( fd == -1 )
     {
         LogError( ( "Error opening file at path: %s. Error: %s.",
                     path, strerror( errno ) ) );
@@ -202,79 +415,81 @@ static bool readFile( const char * path,
     }
     else
     {
-        int result;
-        /* Seek to the end of the file, so that we can get the file size. */
-        result = fseek( file, 0L, SEEK_END );
-
-        if( result == -1 )
+        if( fstat( fd, &fileStat ) == -1 )
         {
-            LogError( ( "Failed while moving to end of file. Path: %s. Error: %s.",
-                        path, strerror( errno ) ) );
+            LogError( ( "Failed to get length of file. Path: %s. Error: %s.", path,
+                        strerror( errno ) ) );
+            status = false;
+        }
+        else if( fileStat.st_size <= 0 )
+        {
+            LogError( ( "File is empty. Path: %s.", path ) );
             status = false;
         }
         else
         {
-            long lenResult = -1;
-            /* Get the current position which is the file size. */
-            lenResult = ftell( file );
+            pMapping = mmap( NULL, ( size_t ) fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
 
-            if( lenResult == -1 )
+            if( pMapping == MAP_FAILED )
             {
-                LogError( ( "Failed to get length of file. Path: %s. Error: %s.", path,
+                LogError( ( "Failed to map file. Path: %s. Error: %s.", path,
                             strerror( errno ) ) );
                 status = false;
             }
-            else
-            {
-                length = ( size_t ) lenResult;
-            }
         }
 
-        if( status == true )
-        {
-            if( length > bufferLength )
-            {
-                LogError( ( "Buffer too small for file. Buffer size: %ld. Required size: %ld.",
-                            bufferLength, length ) );
-                status = false;
-            }
-        }
+        /* The mapping stays valid once the descriptor is closed. */
+        ( void ) close( fd );
+    }
 
-        if( status == true )
-        {
-            /* Return to the beginning of the file. */
-            result = fseek( file, 0L, SEEK_SET );
+    if( status == true )
+    {
+        pFile->pData = ( const uint8_t * ) pMapping;
+        pFile->length = ( size_t ) fileStat.st_size;
+    }
 
-            if( result == -1 )
-            {
-                LogError( ( "Failed to move to beginning of file. Path: %s. Error: %s.",
-                            path, strerror( errno ) ) );
-                status = false;
-            }
-        }
+    return status;
+}
 
-        if( status == true )
-        {
-            size_t written = 0;
-            /* Read the CSR into our buffer. */
-            written = fread( pBuffer, 1, length, file );
+/*-----------------------------------------------------------*/
 
-            if( written != length )
-            {
-                LogError( ( "Failed reading file. Path: %s. Error: %s.", path,
-                            strerror( errno ) ) );
-                status = false;
-            }
-            else
-            {
-                *pOutWrittenLength = length;
-            }
-        }
+static void unmapFile( MappedFile_t * pFile )
+{
+    if( pFile->pData != NULL )
+    {
+        ( void ) munmap( ( void * ) pFile->pData, pFile->length );
+        pFile->pData = NULL;
+        pFile->length = 0;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool isPemObject( const MappedFile_t * pFile )
+{
+    return ( pFile->length > ( sizeof( PEM_BEGIN_MARKER ) - 1U ) ) &&
+           ( memcmp( pFile->pData, PEM_BEGIN_MARKER, sizeof( PEM_BEGIN_MARKER ) - 1U ) == 0 );
+}
+
+/*-----------------------------------------------------------*/
 
-        fclose( file );
+static char * copyPemObject( const MappedFile_t * pFile )
+{
+    char * pCopy;
+
+    pCopy = ( char * ) Mbedtls_Pkcs11_SecureArenaAlloc( pFile->length + 1U );
+
+    if( pCopy == NULL )
+    {
+        LogError( ( "Failed to allocate buffer for the PEM object." ) );
+    }
+    else
+    {
+        memcpy( pCopy, pFile->pData, pFile->length );
+        pCopy[ pFile->length ] = '\0';
     }
 
-    return status;
+    return pCopy;
 }
 
 /*-----------------------------------------------------------*/
@@ -356,7 +571,7 @@ static CK_RV provisionPrivateECKey( CK_SESSION_HANDLE session,
     }
     else
     {
-        DPtr = ( CK_BYTE * ) malloc( EC_D_LENGTH );
+        DPtr = ( CK_BYTE * ) Mbedtls_Pkcs11_SecureArenaAlloc( EC_D_LENGTH );
 
         if( DPtr == NULL )
         {
@@ -414,10 +629,7 @@ static CK_RV provisionPrivateECKey( CK_SESSION_HANDLE session,
                                                &objectHandle );
     }
 
-    if( DPtr != NULL )
-    {
-        free( DPtr );
-    }
+    Mbedtls_Pkcs11_SecureArenaFree( DPtr );
 
     return result;
 }
@@ -446,7 +658,7 @@ static CK_RV provisionPrivateRSAKey( CK_SESSION_HANDLE session,
     }
     else
     {
-        rsaParams = ( RsaParams_t * ) malloc( sizeof( RsaParams_t ) );
+        rsaParams = ( RsaParams_t * ) Mbedtls_Pkcs11_SecureArenaAlloc( sizeof( RsaParams_t ) );
 
         if( rsaParams == NULL )
         {
@@ -456,8 +668,6 @@ static CK_RV provisionPrivateRSAKey( CK_SESSION_HANDLE session,
 
     if( result == CKR_OK )
     {
-        memset( rsaParams, 0, sizeof( RsaParams_t ) );
-
         mbedResult = mbedtls_rsa_export_raw( rsaContext,
                                              rsaParams->modulus, MODULUS_LENGTH + 1,
                                              rsaParams->prime1, PRIME_1_LENGTH + 1,
@@ -518,10 +728,7 @@ static CK_RV provisionPrivateRSAKey( CK_SESSION_HANDLE session,
                                                &objectHandle );
     }
 
-    if( NULL != rsaParams )
-    {
-        free( rsaParams );
-    }
+    Mbedtls_Pkcs11_SecureArenaFree( rsaParams );
 
     return result;
 }
@@ -534,7 +741,6 @@ static CK_RV provisionPrivateKey( CK_SESSION_HANDLE session,
                                   const char * label )
 {
     CK_RV result = CKR_OK;
-    mbedtls_pk_type_t mbedKeyType = MBEDTLS_PK_NONE;
     int mbedResult = 0;
     mbedtls_pk_context mbedPkContext = { 0 };
 
@@ -548,27 +754,9 @@ static CK_RV provisionPrivateKey( CK_SESSION_HANDLE session,
         result = CKR_ARGUMENTS_BAD;
     }
 
-    /* Determine whether the key to be imported is RSA or EC. */
     if( result == CKR_OK )
     {
-        mbedKeyType = mbedtls_pk_get_type( &mbedPkContext );
-
-        if( mbedKeyType == MBEDTLS_PK_RSA )
-        {
-            result = provisionPrivateRSAKey( session, label, &mbedPkContext );
-        }
-        else if( ( mbedKeyType == MBEDTLS_PK_ECDSA ) ||
-                 ( mbedKeyType == MBEDTLS_PK_ECKEY ) ||
-                 ( mbedKeyType == MBEDTLS_PK_ECKEY_DH ) )
-        {
-            result = provisionPrivateECKey( session, label, &mbedPkContext );
-        }
-        else
-        {
-            LogError( ( "Invalid private key type provided. Only RSA-2048 and "
-                        "EC P-256 keys are supported." ) );
-            result = CKR_ARGUMENTS_BAD;
-        }
+        result = provisionParsedPrivateKey( session, label, &mbedPkContext );
     }
 
     mbedtls_pk_free( &mbedPkContext );
@@ -578,42 +766,47 @@ static CK_RV provisionPrivateKey( CK_SESSION_HANDLE session,
 
 /*-----------------------------------------------------------*/
 
+static CK_RV provisionParsedPrivateKey( CK_SESSION_HANDLE session,
+                                        const char * label,
+                                        mbedtls_pk_context * mbedPkContext )
+{
+    CK_RV result;
+    mbedtls_pk_type_t mbedKeyType;
+
+    /* Determine whether the key to be imported is RSA or EC. */
+    mbedKeyType = mbedtls_pk_get_type( mbedPkContext );
+
+    if( mbedKeyType == MBEDTLS_PK_RSA )
+    {
+        result = provisionPrivateRSAKey( session, label, mbedPkContext );
+    }
+    else if( ( mbedKeyType == MBEDTLS_PK_ECDSA ) ||
+             ( mbedKeyType == MBEDTLS_PK_ECKEY ) ||
+             ( mbedKeyType == MBEDTLS_PK_ECKEY_DH ) )
+    {
+        result = provisionPrivateECKey( session, label, mbedPkContext );
+    }
+    else
+    {
+        LogError( ( "Invalid private key type provided. Only RSA-2048 and "
+                    "EC P-256 keys are supported." ) );
+        result = CKR_ARGUMENTS_BAD;
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
 static CK_RV provisionCertificate( CK_SESSION_HANDLE session,
                                    const char * certificate,
                                    size_t certificateLength,
                                    const char * label )
 {
-    PKCS11_CertificateTemplate_t certificateTemplate;
-    CK_OBJECT_CLASS certificateClass = CKO_CERTIFICATE;
-    CK_CERTIFICATE_TYPE certificateType = CKC_X_509;
-    CK_FUNCTION_LIST_PTR functionList = NULL;
     CK_RV result = CKR_OK;
     uint8_t * derObject = NULL;
     int32_t conversion = 0;
     size_t derLen = 0;
-    CK_BBOOL tokenStorage = CK_TRUE;
-    CK_BYTE subject[] = "TestSubject";
-    CK_OBJECT_HANDLE objectHandle = CK_INVALID_HANDLE;
-
-    /* Initialize the client certificate template. */
-    certificateTemplate.xObjectClass.type = CKA_CLASS;
-    certificateTemplate.xObjectClass.pValue = &certificateClass;
-    certificateTemplate.xObjectClass.ulValueLen = sizeof( certificateClass );
-    certificateTemplate.xSubject.type = CKA_SUBJECT;
-    certificateTemplate.xSubject.pValue = subject;
-    certificateTemplate.xSubject.ulValueLen = strlen( ( const char * ) subject );
-    certificateTemplate.xValue.type = CKA_VALUE;
-    certificateTemplate.xValue.pValue = ( CK_VOID_PTR ) certificate;
-    certificateTemplate.xValue.ulValueLen = ( CK_ULONG ) certificateLength;
-    certificateTemplate.xLabel.type = CKA_LABEL;
-    certificateTemplate.xLabel.pValue = ( CK_VOID_PTR ) label;
-    certificateTemplate.xLabel.ulValueLen = strlen( label );
-    certificateTemplate.xCertificateType.type = CKA_CERTIFICATE_TYPE;
-    certificateTemplate.xCertificateType.pValue = &certificateType;
-    certificateTemplate.xCertificateType.ulValueLen = sizeof( CK_CERTIFICATE_TYPE );
-    certificateTemplate.xTokenObject.type = CKA_TOKEN;
-    certificateTemplate.xTokenObject.pValue = &tokenStorage;
-    certificateTemplate.xTokenObject.ulValueLen = sizeof( tokenStorage );
 
     if( certificate == NULL )
     {
@@ -621,28 +814,18 @@ static CK_RV provisionCertificate( CK_SESSION_HANDLE session,
         result = CKR_ATTRIBUTE_VALUE_INVALID;
     }
 
-    if( result == CKR_OK )
-    {
-        result = C_GetFunctionList( &functionList );
-
-        if( result != CKR_OK )
-        {
-            LogError( ( "Could not get a PKCS #11 function pointer." ) );
-        }
-    }
-
     if( result == CKR_OK )
     {
         /* Convert the certificate to DER format from PEM. The DER key should
-         * be about 3/4 the size of the PEM key, so mallocing the PEM key size
+         * be about 3/4 the size of the PEM key, so allocating the PEM key size
          * is sufficient. */
-        derObject = ( uint8_t * ) malloc( certificateTemplate.xValue.ulValueLen );
-        derLen = certificateTemplate.xValue.ulValueLen;
+        derObject = ( uint8_t * ) Mbedtls_Pkcs11_SecureArenaAlloc( certificateLength );
+        derLen = certificateLength;
 
         if( derObject != NULL )
         {
-            conversion = convert_pem_to_der( ( unsigned char * ) certificateTemplate.xValue.pValue,
-                                             certificateTemplate.xValue.ulValueLen,
+            conversion = convert_pem_to_der( ( unsigned char * ) certificate,
+                                             certificateLength,
                                              derObject, &derLen );
 
             if( 0 != conversion )
@@ -660,75 +843,597 @@ static CK_RV provisionCertificate( CK_SESSION_HANDLE session,
 
     if( result == CKR_OK )
     {
-        /* Set the template pointers to refer to the DER converted objects. */
-        certificateTemplate.xValue.pValue = derObject;
-        certificateTemplate.xValue.ulValueLen = derLen;
-
-        /* Best effort clean-up of the existing object, if it exists. */
-        destroyProvidedObjects( session, ( CK_BYTE_PTR * ) &label, &certificateClass, 1 );
-
-        /* Create an object using the encoded client certificate. */
-        LogInfo( ( "Writing certificate into label \"%s\".", label ) );
-
-        result = functionList->C_CreateObject( session,
-                                               ( CK_ATTRIBUTE_PTR ) &certificateTemplate,
-                                               sizeof( certificateTemplate ) / sizeof( CK_ATTRIBUTE ),
-                                               &objectHandle );
+        result = provisionDerCertificate( session, derObject, derLen, label );
     }
 
-    if( derObject != NULL )
-    {
-        free( derObject );
-    }
+    Mbedtls_Pkcs11_SecureArenaFree( derObject );
 
     return result;
 }
 
 /*-----------------------------------------------------------*/
 
-bool loadClaimCredentials( CK_SESSION_HANDLE p11Session,
-                           const char * pClaimCertPath,
-                           const char * pClaimCertLabel,
-                           const char * pClaimPrivKeyPath,
-                           const char * pClaimPrivKeyLabel )
+static CK_RV provisionDerCertificate( CK_SESSION_HANDLE session,
+                                      const uint8_t * pDer,
+                                      size_t derLength,
+                                      const char * label )
 {
-    bool status;
-    char claimCert[ CLAIM_CERT_BUFFER_LENGTH ] = { 0 };
-    size_t claimCertLength = 0;
-    char claimPrivateKey[ CLAIM_PRIVATE_KEY_BUFFER_LENGTH ] = { 0 };
-    size_t claimPrivateKeyLength = 0;
-    CK_RV ret;
-
-    assert( pClaimCertPath != NULL );
-    assert( pClaimCertLabel != NULL );
-    assert( pClaimPrivKeyPath != NULL );
-    assert( pClaimPrivKeyLabel != NULL );
-
-    status = readFile( pClaimCertPath, claimCert, CLAIM_CERT_BUFFER_LENGTH,
-                       &claimCertLength );
-
-    if( status == true )
-    {
-        status = readFile( pClaimPrivKeyPath, claimPrivateKey,
-                           CLAIM_PRIVATE_KEY_BUFFER_LENGTH, &claimPrivateKeyLength );
-    }
+    PKCS11_CertificateTemplate_t certificateTemplate;
+    CK_OBJECT_CLASS certificateClass = CKO_CERTIFICATE;
+    CK_CERTIFICATE_TYPE certificateType = CKC_X_509;
+    CK_FUNCTION_LIST_PTR functionList = NULL;
+    CK_RV result = CKR_OK;
+    CK_BBOOL tokenStorage = CK_TRUE;
+    CK_BYTE subject[] = "TestSubject";
+    CK_OBJECT_HANDLE objectHandle = CK_INVALID_HANDLE;
 
-    if( status == true )
-    {
-        ret = provisionPrivateKey( p11Session, claimPrivateKey,
-                                   claimPrivateKeyLength + 1, /* MbedTLS includes null character in length for PEM objects. */
-                                   pClaimPrivKeyLabel );
+    /* Initialize the client certificate template. */
+    certificateTemplate.xObjectClass.type = CKA_CLASS;
+    certificateTemplate.xObjectClass.pValue = &certificateClass;
+    certificateTemplate.xObjectClass.ulValueLen = sizeof( certificateClass );
+    certificateTemplate.xSubject.type = CKA_SUBJECT;
+    certificateTemplate.xSubject.pValue = subject;
+    certificateTemplate.xSubject.ulValueLen = strlen( ( const char * ) subject );
+    certificateTemplate.xValue.type = CKA_VALUE;
+    certificateTemplate.xValue.pValue = ( CK_VOID_PTR ) pDer;
+    certificateTemplate.xValue.ulValueLen = ( CK_ULONG ) derLength;
+    certificateTemplate.xLabel.type = CKA_LABEL;
+    certificateTemplate.xLabel.pValue = ( CK_VOID_PTR ) label;
+    certificateTemplate.xLabel.ulValueLen = strlen( label );
+    certificateTemplate.xCertificateType.type = CKA_CERTIFICATE_TYPE;
+    certificateTemplate.xCertificateType.pValue = &certificateType;
+    certificateTemplate.xCertificateType.ulValueLen = sizeof( CK_CERTIFICATE_TYPE );
+    certificateTemplate.xTokenObject.type = CKA_TOKEN;
+    certificateTemplate.xTokenObject.pValue = &tokenStorage;
+    certificateTemplate.xTokenObject.ulValueLen = sizeof( tokenStorage );
+
+    result = C_GetFunctionList( &functionList );
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Could not get a PKCS #11 function pointer." ) );
+    }
+    else
+    {
+        /* Best effort clean-up of the existing object, if it exists. */
+        destroyProvidedObjects( session, ( CK_BYTE_PTR * ) &label, &certificateClass, 1 );
+
+        /* Create an object using the encoded client certificate. */
+        LogInfo( ( "Writing certificate into label \"%s\".", label ) );
+
+        result = functionList->C_CreateObject( session,
+                                               ( CK_ATTRIBUTE_PTR ) &certificateTemplate,
+                                               sizeof( certificateTemplate ) / sizeof( CK_ATTRIBUTE ),
+                                               &objectHandle );
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV generateKeyPairEC( CK_SESSION_HANDLE session,
+                                const char * privateKeyLabel,
+                                const char * publicKeyLabel,
+                                CK_OBJECT_HANDLE_PTR privateKeyHandlePtr,
+                                CK_OBJECT_HANDLE_PTR publicKeyHandlePtr )
+{
+    CK_RV result;
+    CK_MECHANISM mechanism = { CKM_EC_KEY_PAIR_GEN, NULL_PTR, 0 };
+    CK_FUNCTION_LIST_PTR functionList;
+    CK_BYTE ecParams[] = pkcs11DER_ENCODED_OID_P256; /* prime256v1 */
+    CK_KEY_TYPE keyType = CKK_EC;
+    CK_BBOOL trueObject = CK_TRUE;
+    CK_ATTRIBUTE publicKeyTemplate[ 4 ];
+    CK_ATTRIBUTE privateKeyTemplate[ 5 ];
+    const char * labels[ 2 ];
+    CK_OBJECT_CLASS classes[ 2 ] = { CKO_PRIVATE_KEY, CKO_PUBLIC_KEY };
+
+    /* Aggregate initializers must not use the address of an automatic variable. */
+    publicKeyTemplate[ 0 ].type = CKA_KEY_TYPE;
+    publicKeyTemplate[ 0 ].pValue = &keyType;
+    publicKeyTemplate[ 0 ].ulValueLen = sizeof( keyType );
+    publicKeyTemplate[ 1 ].type = CKA_VERIFY;
+    publicKeyTemplate[ 1 ].pValue = &trueObject;
+    publicKeyTemplate[ 1 ].ulValueLen = sizeof( trueObject );
+    publicKeyTemplate[ 2 ].type = CKA_EC_PARAMS;
+    publicKeyTemplate[ 2 ].pValue = ecParams;
+    publicKeyTemplate[ 2 ].ulValueLen = sizeof( ecParams );
+    publicKeyTemplate[ 3 ].type = CKA_LABEL;
+    publicKeyTemplate[ 3 ].pValue = ( CK_VOID_PTR ) publicKeyLabel;
+    publicKeyTemplate[ 3 ].ulValueLen = strnlen( publicKeyLabel, pkcs11configMAX_LABEL_LENGTH );
+
+    privateKeyTemplate[ 0 ].type = CKA_KEY_TYPE;
+    privateKeyTemplate[ 0 ].pValue = &keyType;
+    privateKeyTemplate[ 0 ].ulValueLen = sizeof( keyType );
+    privateKeyTemplate[ 1 ].type = CKA_TOKEN;
+    privateKeyTemplate[ 1 ].pValue = &trueObject;
+    privateKeyTemplate[ 1 ].ulValueLen = sizeof( trueObject );
+    privateKeyTemplate[ 2 ].type = CKA_PRIVATE;
+    privateKeyTemplate[ 2 ].pValue = &trueObject;
+    privateKeyTemplate[ 2 ].ulValueLen = sizeof( trueObject );
+    privateKeyTemplate[ 3 ].type = CKA_SIGN;
+    privateKeyTemplate[ 3 ].pValue = &trueObject;
+    privateKeyTemplate[ 3 ].ulValueLen = sizeof( trueObject );
+    privateKeyTemplate[ 4 ].type = CKA_LABEL;
+    privateKeyTemplate[ 4 ].pValue = ( CK_VOID_PTR ) privateKeyLabel;
+    privateKeyTemplate[ 4 ].ulValueLen = strnlen( privateKeyLabel, pkcs11configMAX_LABEL_LENGTH );
+
+    result = C_GetFunctionList( &functionList );
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Could not get a PKCS #11 function pointer." ) );
+    }
+    else
+    {
+        /* Best effort clean-up of the existing key pair, if it exists. */
+        labels[ 0 ] = privateKeyLabel;
+        labels[ 1 ] = publicKeyLabel;
+        ( void ) destroyProvidedObjects( session, ( CK_BYTE_PTR * ) labels, classes, 2 );
+
+        LogInfo( ( "Generating key pair into labels \"%s\" and \"%s\".",
+                   privateKeyLabel, publicKeyLabel ) );
+
+        result = functionList->C_GenerateKeyPair( session,
+                                                  &mechanism,
+                                                  publicKeyTemplate,
+                                                  sizeof( publicKeyTemplate ) / sizeof( CK_ATTRIBUTE ),
+                                                  privateKeyTemplate,
+                                                  sizeof( privateKeyTemplate ) / sizeof( CK_ATTRIBUTE ),
+                                                  publicKeyHandlePtr,
+                                                  privateKeyHandlePtr );
+
+        if( result != CKR_OK )
+        {
+            LogError( ( "Failed to generate key pair with error code %lu.", ( unsigned long ) result ) );
+        }
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static int extractEcPublicKey( CK_SESSION_HANDLE session,
+                               mbedtls_ecdsa_context * pEcdsaContext,
+                               CK_OBJECT_HANDLE publicKey )
+{
+    CK_ATTRIBUTE ecTemplate = { 0 };
+    int mbedtlsRet = -1;
+    CK_RV result;
+    CK_BYTE ecPoint[ EC_POINT_LENGTH ] = { 0 };
+    CK_FUNCTION_LIST_PTR functionList;
+
+    result = C_GetFunctionList( &functionList );
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Could not get a PKCS #11 function pointer." ) );
+    }
+    else
+    {
+        ecTemplate.type = CKA_EC_POINT;
+        ecTemplate.pValue = ecPoint;
+        ecTemplate.ulValueLen = sizeof( ecPoint );
+        result = functionList->C_GetAttributeValue( session, publicKey, &ecTemplate, 1 );
+
+        if( result != CKR_OK )
+        {
+            LogError( ( "Failed to read the public key with error code %lu.", ( unsigned long ) result ) );
+        }
+    }
+
+    if( result == CKR_OK )
+    {
+        mbedtlsRet = mbedtls_ecp_group_load( &( pEcdsaContext->grp ), MBEDTLS_ECP_DP_SECP256R1 );
+
+        if( mbedtlsRet != 0 )
+        {
+            LogError( ( "Failed to load the P-256 group with error code %d.", mbedtlsRet ) );
+        }
+    }
+
+    if( mbedtlsRet == 0 )
+    {
+        /* Skip the OCTET STRING header of the DER encoded point. */
+        mbedtlsRet = mbedtls_ecp_point_read_binary( &( pEcdsaContext->grp ),
+                                                    &( pEcdsaContext->Q ),
+                                                    &ecPoint[ 2 ],
+                                                    ecTemplate.ulValueLen - 2 );
+
+        if( mbedtlsRet != 0 )
+        {
+            LogError( ( "Failed to parse the public key with error code %d.", mbedtlsRet ) );
+        }
+    }
+
+    return mbedtlsRet;
+}
+
+/*-----------------------------------------------------------*/
+
+static int privateKeySigningCallback( void * pContext,
+                                      mbedtls_md_type_t mdAlg,
+                                      const unsigned char * pHash,
+                                      size_t hashLen,
+                                      unsigned char * pSig,
+                                      size_t * pSigLen,
+                                      int ( * pRng )( void *, unsigned char *, size_t ),
+                                      void * pRngContext )
+{
+    SigningCallbackContext_t * pSigningContext = ( SigningCallbackContext_t * ) pContext;
+    CK_RV result;
+    CK_MECHANISM mechanism = { CKM_ECDSA, NULL_PTR, 0 };
+    CK_FUNCTION_LIST_PTR functionList;
+    CK_ULONG signatureLength = pkcs11ECDSA_P256_SIGNATURE_LENGTH;
+
+    /* Unreferenced parameters. The hash is signed as is. */
+    ( void ) mdAlg;
+    ( void ) pRng;
+    ( void ) pRngContext;
+
+    result = C_GetFunctionList( &functionList );
+
+    if( result == CKR_OK )
+    {
+        result = functionList->C_SignInit( pSigningContext->p11Session,
+                                           &mechanism,
+                                           pSigningContext->p11PrivateKey );
+    }
+
+    if( result == CKR_OK )
+    {
+        result = functionList->C_Sign( pSigningContext->p11Session,
+                                       ( CK_BYTE_PTR ) pHash,
+                                       ( CK_ULONG ) hashLen,
+                                       pSig,
+                                       &signatureLength );
+    }
+
+    if( ( result == CKR_OK ) && ( signatureLength != pkcs11ECDSA_P256_SIGNATURE_LENGTH ) )
+    {
+        LogError( ( "Unexpected signature length %lu.", ( unsigned long ) signatureLength ) );
+        result = CKR_FUNCTION_FAILED;
+    }
+
+    if( result == CKR_OK )
+    {
+        /* PKCS #11 returns R and S of the P-256 signature as two 32-byte
+         * values. MbedTLS expects an ASN.1 encoded signature. */
+        *pSigLen = signatureLength;
+
+        if( PKI_pkcs11SignatureTombedTLSSignature( pSig, pSigLen ) != 0 )
+        {
+            result = CKR_FUNCTION_FAILED;
+        }
+    }
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Failed to sign the CSR with error code %lu.", ( unsigned long ) result ) );
+    }
+
+    return ( result == CKR_OK ) ? 0 : -1;
+}
+
+/*-----------------------------------------------------------*/
+
+static int randomCallback( void * pCtx,
+                           unsigned char * pRandom,
+                           size_t randomLength )
+{
+    CK_SESSION_HANDLE * pSession = ( CK_SESSION_HANDLE * ) pCtx;
+    CK_RV result;
+    CK_FUNCTION_LIST_PTR functionList;
+
+    result = C_GetFunctionList( &functionList );
+
+    if( result == CKR_OK )
+    {
+        result = functionList->C_GenerateRandom( *pSession, pRandom, ( CK_ULONG ) randomLength );
+    }
+
+    if( result != CKR_OK )
+    {
+        LogError( ( "Failed to generate random bytes with error code %lu.", ( unsigned long ) result ) );
+    }
+
+    return ( result == CKR_OK ) ? 0 : -1;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool getCertificateFingerprint( CK_SESSION_HANDLE p11Session,
+                                       const char * pCertLabel,
+                                       uint8_t * pFingerprint,
+                                       bool * pExpired )
+{
+    CK_RV result;
+    CK_FUNCTION_LIST_PTR functionList = NULL;
+    mbedtls_x509_crt * pCertificate = NULL;
+    bool status = false;
+
+    result = C_GetFunctionList( &functionList );
+
+    /* The transport connects with the same parsed certificate. */
+    if( result == CKR_OK )
+    {
+        pCertificate = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( functionList,
+                                                                         p11Session,
+                                                                         pCertLabel );
+    }
+
+    if( pCertificate != NULL )
+    {
+        status = ( mbedtls_sha256_ret( pCertificate->raw.p,
+                                       pCertificate->raw.len,
+                                       pFingerprint,
+                                       0 ) == 0 );
+        *pExpired = ( mbedtls_x509_time_is_past( &( pCertificate->valid_to ) ) != 0 );
+
+        Mbedtls_Pkcs11_CredentialCacheRelease( pCertificate );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV importClaimPrivateKey( CK_SESSION_HANDLE session,
+                                    const MappedFile_t * pFile,
+                                    const char * label,
+                                    bool * pWritten )
+{
+    CK_RV result = CKR_OK;
+    int mbedResult;
+    const uint8_t * pKey = pFile->pData;
+    size_t keyLength = pFile->length;
+    char * pPemCopy = NULL;
+    mbedtls_pk_context mbedPkContext;
+
+    *pWritten = false;
+    mbedtls_pk_init( &mbedPkContext );
+
+    /* A DER key is parsed in place. */
+    if( isPemObject( pFile ) == true )
+    {
+        pPemCopy = copyPemObject( pFile );
+        pKey = ( const uint8_t * ) pPemCopy;
+        keyLength = pFile->length + 1U; /* MbedTLS includes null character in length for PEM objects. */
+
+        if( pPemCopy == NULL )
+        {
+            result = CKR_HOST_MEMORY;
+        }
+    }
+
+    /* The key is parsed once, both to validate it and to compare it with the
+     * key in the token. */
+    if( result == CKR_OK )
+    {
+        mbedResult = mbedtls_pk_parse_key( &mbedPkContext, pKey, keyLength, NULL, 0 );
+
+        if( mbedResult != 0 )
+        {
+            LogError( ( "Unable to parse private key." ) );
+            result = CKR_ARGUMENTS_BAD;
+        }
+    }
+
+    if( result == CKR_OK )
+    {
+        if( isPrivateKeyInToken( session, label, &mbedPkContext ) == true )
+        {
+            LogInfo( ( "Private key \"%s\" is already in the token.", label ) );
+        }
+        else
+        {
+            *pWritten = true;
+            result = provisionParsedPrivateKey( session, label, &mbedPkContext );
+        }
+    }
+
+    mbedtls_pk_free( &mbedPkContext );
+
+    Mbedtls_Pkcs11_SecureArenaFree( pPemCopy );
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV importClaimCertificate( CK_SESSION_HANDLE session,
+                                     const MappedFile_t * pFile,
+                                     const char * label )
+{
+    CK_RV result = CKR_OK;
+    CK_FUNCTION_LIST_PTR functionList = NULL;
+    CK_OBJECT_HANDLE objectHandle = CK_INVALID_HANDLE;
+    const uint8_t * pDer = pFile->pData;
+    size_t derLength = pFile->length;
+    char * pPemCopy = NULL;
+    uint8_t * pDerCopy = NULL;
+    mbedtls_x509_crt * pCertificate = NULL;
+
+    /* A DER certificate is used in place. */
+    if( isPemObject( pFile ) == true )
+    {
+        pPemCopy = copyPemObject( pFile );
+        pDerCopy = ( uint8_t * ) Mbedtls_Pkcs11_SecureArenaAlloc( pFile->length );
+        derLength = pFile->length;
+
+        if( ( pPemCopy == NULL ) || ( pDerCopy == NULL ) )
+        {
+            LogError( ( "Failed to allocate buffer for converting certificate to DER." ) );
+            result = CKR_HOST_MEMORY;
+        }
+        else if( convert_pem_to_der( ( unsigned char * ) pPemCopy,
+                                     pFile->length + 1U,
+                                     pDerCopy, &derLength ) != 0 )
+        {
+            LogError( ( "Failed to convert provided certificate." ) );
+            result = CKR_ARGUMENTS_BAD;
+        }
+        else
+        {
+            pDer = pDerCopy;
+        }
+    }
+
+    if( result == CKR_OK )
+    {
+        result = C_GetFunctionList( &functionList );
+    }
+
+    /* Compare with the certificate in the token, if there is one. Its parse
+     * is kept by the credential cache for the TLS connection. */
+    if( ( result == CKR_OK ) &&
+        ( Mbedtls_Pkcs11_CredentialCacheFindObject( session, label, CKO_CERTIFICATE, &objectHandle ) == CKR_OK ) &&
+        ( objectHandle != CK_INVALID_HANDLE ) )
+    {
+        pCertificate = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( functionList, session, label );
+    }
+
+    if( ( pCertificate != NULL ) &&
+        ( pCertificate->raw.len == derLength ) &&
+        ( memcmp( pCertificate->raw.p, pDer, derLength ) == 0 ) )
+    {
+        LogInfo( ( "Certificate \"%s\" is already in the token.", label ) );
+    }
+    else if( result == CKR_OK )
+    {
+        result = provisionDerCertificate( session, pDer, derLength, label );
+
+        /* The certificate object is replaced even if the write failed. */
+        Mbedtls_Pkcs11_CredentialCacheInvalidate( label );
+
+        /* Validate the written certificate with the parse the TLS connection
+         * uses. */
+        if( result == CKR_OK )
+        {
+            Mbedtls_Pkcs11_CredentialCacheRelease( pCertificate );
+            pCertificate = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( functionList, session, label );
+
+            if( pCertificate == NULL )
+            {
+                LogError( ( "Unable to parse certificate." ) );
+                result = CKR_ARGUMENTS_BAD;
+            }
+        }
+    }
+    else
+    {
+        /* Empty else MISRA 15.7 */
+    }
+
+    Mbedtls_Pkcs11_CredentialCacheRelease( pCertificate );
+
+    Mbedtls_Pkcs11_SecureArenaFree( pPemCopy );
+    Mbedtls_Pkcs11_SecureArenaFree( pDerCopy );
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool isPrivateKeyInToken( CK_SESSION_HANDLE session,
+                                 const char * label,
+                                 mbedtls_pk_context * pPrivateKey )
+{
+    CK_RV result;
+    CK_FUNCTION_LIST_PTR functionList = NULL;
+    CK_OBJECT_HANDLE objectHandle = CK_INVALID_HANDLE;
+    CK_BYTE tokenPoint[ EC_POINT_LENGTH ];
+    CK_ATTRIBUTE pointTemplate;
+    uint8_t point[ EC_POINT_LENGTH - 2 ];
+    size_t pointLength = 0;
+    mbedtls_ecp_keypair * pKeyPair;
+    bool match = false;
+
+    if( mbedtls_pk_can_do( pPrivateKey, MBEDTLS_PK_ECKEY ) != 0 )
+    {
+        result = C_GetFunctionList( &functionList );
+
+        if( result == CKR_OK )
+        {
+            result = Mbedtls_Pkcs11_CredentialCacheFindObject( session, label, CKO_PRIVATE_KEY, &objectHandle );
+        }
+
+        /* The point is DER encoded as an OCTET STRING, behind a 2-byte header. */
+        if( ( result == CKR_OK ) && ( objectHandle != CK_INVALID_HANDLE ) )
+        {
+            pointTemplate.type = CKA_EC_POINT;
+            pointTemplate.pValue = tokenPoint;
+            pointTemplate.ulValueLen = sizeof( tokenPoint );
+            result = functionList->C_GetAttributeValue( session, objectHandle, &pointTemplate, 1 );
+
+            if( ( result == CKR_OK ) && ( pointTemplate.ulValueLen == sizeof( tokenPoint ) ) )
+            {
+                pKeyPair = mbedtls_pk_ec( *pPrivateKey );
+                match = ( mbedtls_ecp_point_write_binary( &( pKeyPair->grp ),
+                                                          &( pKeyPair->Q ),
+                                                          MBEDTLS_ECP_PF_UNCOMPRESSED,
+                                                          &pointLength,
+                                                          point,
+                                                          sizeof( point ) ) == 0 ) &&
+                        ( pointLength == sizeof( point ) ) &&
+                        ( memcmp( &( tokenPoint[ 2 ] ), point, sizeof( point ) ) == 0 );
+            }
+        }
+    }
+
+    return match;
+}
+
+/*-----------------------------------------------------------*/
+
+bool loadClaimCredentials( CK_SESSION_HANDLE p11Session,
+                           const char * pClaimCertPath,
+                           const char * pClaimCertLabel,
+                           const char * pClaimPrivKeyPath,
+                           const char * pClaimPrivKeyLabel )
+{
+    bool status;
+    bool written = false;
+    MappedFile_t claimCert = { 0 };
+    MappedFile_t claimPrivateKey = { 0 };
+    CK_RV ret;
+
+    assert( pClaimCertPath != NULL );
+    assert( pClaimCertLabel != NULL );
+    assert( pClaimPrivKeyPath != NULL );
+    assert( pClaimPrivKeyLabel != NULL );
+
+    status = mapFile( pClaimCertPath, &claimCert );
+
+    if( status == true )
+    {
+        status = mapFile( pClaimPrivKeyPath, &claimPrivateKey );
+    }
+
+    if( status == true )
+    {
+        ret = importClaimPrivateKey( p11Session, &claimPrivateKey,
+                                     pClaimPrivKeyLabel, &written );
         status = ( ret == CKR_OK );
+
+        /* The key object is replaced even if the write failed. */
+        if( written == true )
+        {
+            Mbedtls_Pkcs11_CredentialCacheInvalidate( pClaimPrivKeyLabel );
+        }
     }
 
     if( status == true )
     {
-        ret = provisionCertificate( p11Session, claimCert,
-                                    claimCertLength + 1, /* MbedTLS includes null character in length for PEM objects. */
-                                    pClaimCertLabel );
+        ret = importClaimCertificate( p11Session, &claimCert, pClaimCertLabel );
         status = ( ret == CKR_OK );
     }
 
+    unmapFile( &claimPrivateKey );
+    unmapFile( &claimCert );
+
     return status;
 }
 
@@ -749,6 +1454,9 @@ bool loadCertificate( CK_SESSION_HANDLE p11Session,
                                 certificateLength + 1, /* MbedTLS includes null character in length for PEM objects. */
                                 pLabel );
 
+    /* The certificate object is replaced even if the write failed. */
+    Mbedtls_Pkcs11_CredentialCacheInvalidate( pLabel );
+
     return( ret == CKR_OK );
 }
 
@@ -769,11 +1477,283 @@ bool loadPrivateKey( CK_SESSION_HANDLE p11Session,
                                privateKeyLength + 1, /* MbedTLS includes null character in length for PEM objects. */
                                pLabel );
 
+    /* The key object is replaced even if the write failed. */
+    Mbedtls_Pkcs11_CredentialCacheInvalidate( pLabel );
+
     return( ret == CKR_OK );
 }
 
 /*-----------------------------------------------------------*/
 
+bool generateKeyAndCsr( CK_SESSION_HANDLE p11Session,
+                        const char * pPrivKeyLabel,
+                        const char * pPubKeyLabel,
+                        char * pCsrBuffer,
+                        size_t csrBufferLength,
+                        size_t * pOutCsrLength )
+{
+    CK_OBJECT_HANDLE privKeyHandle = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE pubKeyHandle = CK_INVALID_HANDLE;
+    CK_RV result;
+    int mbedtlsRet = -1;
+    mbedtls_pk_context privKey;
+    mbedtls_pk_info_t ecdsaSignInfo;
+    mbedtls_x509write_csr req;
+    SigningCallbackContext_t signingContext;
+
+    assert( pPrivKeyLabel != NULL );
+    assert( pPubKeyLabel != NULL );
+    assert( pCsrBuffer != NULL );
+    assert( pOutCsrLength != NULL );
+
+    /* The key pair is generated in the module, so the private key never leaves it. */
+    result = generateKeyPairEC( p11Session,
+                                pPrivKeyLabel,
+                                pPubKeyLabel,
+                                &privKeyHandle,
+                                &pubKeyHandle );
+
+    /* The key object is replaced even if the generation failed. */
+    Mbedtls_Pkcs11_CredentialCacheInvalidate( pPrivKeyLabel );
+
+    if( result == CKR_OK )
+    {
+        mbedtls_x509write_csr_init( &req );
+        mbedtls_x509write_csr_set_md_alg( &req, MBEDTLS_MD_SHA256 );
+        mbedtls_ecdsa_init( &( signingContext.ecdsaContext ) );
+
+        mbedtlsRet = mbedtls_x509write_csr_set_key_usage( &req, MBEDTLS_X509_KU_DIGITAL_SIGNATURE );
+
+        if( mbedtlsRet == 0 )
+        {
+            mbedtlsRet = mbedtls_x509write_csr_set_ns_cert_type( &req, MBEDTLS_X509_NS_CERT_TYPE_SSL_CLIENT );
+        }
+
+        if( mbedtlsRet == 0 )
+        {
+            mbedtlsRet = mbedtls_x509write_csr_set_subject_name( &req, CSR_SUBJECT_NAME );
+        }
+
+        if( mbedtlsRet == 0 )
+        {
+            mbedtlsRet = extractEcPublicKey( p11Session, &( signingContext.ecdsaContext ), pubKeyHandle );
+        }
+
+        if( mbedtlsRet == 0 )
+        {
+            signingContext.p11Session = p11Session;
+            signingContext.p11PrivateKey = privKeyHandle;
+
+            /* Use the EC key functions of MbedTLS for the public key, and sign
+             * with the private key in the module. The context is not allocated
+             * by MbedTLS, so it is not freed with mbedtls_pk_free. */
+            ecdsaSignInfo = *mbedtls_pk_info_from_type( MBEDTLS_PK_ECKEY );
+            ecdsaSignInfo.sign_func = privateKeySigningCallback;
+            ecdsaSignInfo.decrypt_func = NULL;
+            ecdsaSignInfo.encrypt_func = NULL;
+            ecdsaSignInfo.check_pair_func = NULL;
+            ecdsaSignInfo.ctx_alloc_func = NULL;
+            ecdsaSignInfo.ctx_free_func = NULL;
+
+            mbedtls_pk_init( &privKey );
+            privKey.pk_info = &ecdsaSignInfo;
+            privKey.pk_ctx = &signingContext;
+
+            mbedtls_x509write_csr_set_key( &req, &privKey );
+
+            mbedtlsRet = mbedtls_x509write_csr_pem( &req,
+                                                    ( unsigned char * ) pCsrBuffer,
+                                                    csrBufferLength,
+                                                    randomCallback,
+                                                    &p11Session );
+
+            if( mbedtlsRet != 0 )
+            {
+                LogError( ( "Failed to write the CSR with error code %d.", mbedtlsRet ) );
+            }
+        }
+
+        mbedtls_x509write_csr_free( &req );
+        mbedtls_ecdsa_free( &( signingContext.ecdsaContext ) );
+    }
+
+    if( mbedtlsRet == 0 )
+    {
+        *pOutCsrLength = strlen( pCsrBuffer );
+    }
+
+    return( mbedtlsRet == 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+bool saveProvisionedState( CK_SESSION_HANDLE p11Session,
+                           const char * pStatePath,
+                           const char * pCertLabel,
+                           const char * pThingName,
+                           size_t thingNameLength,
+                           const char * pCertificateId,
+                           size_t certificateIdLength )
+{
+    ProvisionedState_t state;
+    char tempPath[ FILENAME_MAX ];
+    FILE * file = NULL;
+    bool expired = false;
+    bool status = true;
+
+    assert( pStatePath != NULL );
+    assert( pCertLabel != NULL );
+    assert( pThingName != NULL );
+    assert( pCertificateId != NULL );
+
+    memset( &state, 0, sizeof( state ) );
+    state.magic = PROVISIONED_STATE_MAGIC;
+
+    if( ( thingNameLength > PROVISIONED_STATE_THING_NAME_LENGTH ) ||
+        ( certificateIdLength > PROVISIONED_STATE_CERTIFICATE_ID_LENGTH ) ||
+        ( ( strlen( pStatePath ) + sizeof( PROVISIONED_STATE_TEMP_SUFFIX ) ) > sizeof( tempPath ) ) )
+    {
+        LogError( ( "The provisioned state does not fit in the record." ) );
+        status = false;
+    }
+    else
+    {
+        memcpy( state.thingName, pThingName, thingNameLength );
+        memcpy( state.certificateId, pCertificateId, certificateIdLength );
+        status = getCertificateFingerprint( p11Session,
+                                            pCertLabel,
+                                            state.certificateFingerprint,
+                                            &expired );
+    }
+
+    /* Write a temporary file first, so that a reset during the write leaves
+     * either the previous record or the new one. */
+    if( status == true )
+    {
+        ( void ) snprintf( tempPath, sizeof( tempPath ), "%s%s", pStatePath, PROVISIONED_STATE_TEMP_SUFFIX );
+        file = fopen( tempPath, "wb" );
+
+        if( file == NULL )
+        {
+            LogError( ( "Error opening file at path: %s. Error: %s.",
+                        tempPath, strerror( errno ) ) );
+            status = false;
+        }
+    }
+
+    if( status == true )
+    {
+        status = ( fwrite( &state, sizeof( state ), 1, file ) == 1U );
+
+        if( fclose( file ) != 0 )
+        {
+            status = false;
+        }
+
+        if( status == true )
+        {
+            status = ( rename( tempPath, pStatePath ) == 0 );
+        }
+
+        if( status == false )
+        {
+            LogError( ( "Failed to write the provisioned state to %s. Error: %s.",
+                        pStatePath, strerror( errno ) ) );
+            ( void ) remove( tempPath );
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+bool loadProvisionedState( CK_SESSION_HANDLE p11Session,
+                           const char * pStatePath,
+                           const char * pCertLabel,
+                           ProvisionedState_t * pState )
+{
+    FILE * file;
+    uint8_t fingerprint[ PROVISIONED_STATE_FINGERPRINT_LENGTH ];
+    bool expired = false;
+    bool status = true;
+
+    assert( pStatePath != NULL );
+    assert( pCertLabel != NULL );
+    assert( pState != NULL );
+
+    /* The record has a fixed size, so it is read in one go. A missing record
+     * means the device was never provisioned. */
+    file = fopen( pStatePath, "rb" );
+
+    if( file == NULL )
+    {
+        LogInfo( ( "No provisioned state at %s.", pStatePath ) );
+        status = false;
+    }
+    else
+    {
+        status = ( fread( pState, sizeof( ProvisionedState_t ), 1, file ) == 1U );
+        ( void ) fclose( file );
+
+        if( ( status == false ) || ( pState->magic != PROVISIONED_STATE_MAGIC ) )
+        {
+            LogWarn( ( "Ignoring the malformed provisioned state at %s.", pStatePath ) );
+            status = false;
+        }
+    }
+
+    if( status == true )
+    {
+        /* Do not trust the terminators read from the file. */
+        pState->thingName[ PROVISIONED_STATE_THING_NAME_LENGTH ] = '\0';
+        pState->certificateId[ PROVISIONED_STATE_CERTIFICATE_ID_LENGTH ] = '\0';
+
+        status = getCertificateFingerprint( p11Session, pCertLabel, fingerprint, &expired );
+
+        if( status == false )
+        {
+            LogWarn( ( "The provisioned device certificate is missing." ) );
+        }
+        else if( memcmp( fingerprint, pState->certificateFingerprint, sizeof( fingerprint ) ) != 0 )
+        {
+            LogWarn( ( "The provisioned state does not match the device certificate." ) );
+            status = false;
+        }
+        else if( expired == true )
+        {
+            LogWarn( ( "The device certificate %s has expired.", pState->certificateId ) );
+            status = false;
+        }
+        else
+        {
+            /* Empty else MISRA 15.7 */
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+bool clearProvisionedState( const char * pStatePath )
+{
+    bool status = true;
+
+    assert( pStatePath != NULL );
+
+    if( ( remove( pStatePath ) != 0 ) && ( errno != ENOENT ) )
+    {
+        LogError( ( "Failed to remove the provisioned state at %s. Error: %s.",
+                    pStatePath, strerror( errno ) ) );
+        status = false;
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
 bool pkcs11CloseSession( CK_SESSION_HANDLE p11Session )
 {
     CK_RV result = CKR_OK;
@@ -26,10 +26,38 @@
 /* Standard includes. */
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* corePKCS11 include. */
 #include "core_pkcs11.h"
 
+/**
+ * @brief Maximum length of an AWS IoT Thing name.
+ */
+#define PROVISIONED_STATE_THING_NAME_LENGTH        128
+
+/**
+ * @brief Length of an AWS IoT certificate ID.
+ */
+#define PROVISIONED_STATE_CERTIFICATE_ID_LENGTH    64
+
+/**
+ * @brief Length of the SHA-256 fingerprint of the device certificate.
+ */
+#define PROVISIONED_STATE_FINGERPRINT_LENGTH       32
+
+/**
+ * @brief Record of a completed provisioning. The fingerprint ties it to the
+ * device certificate it was written for.
+ */
+typedef struct ProvisionedState
+{
+    uint32_t magic; /**< @brief Identifies the format of the record. */
+    char thingName[ PROVISIONED_STATE_THING_NAME_LENGTH + 1 ];
+    char certificateId[ PROVISIONED_STATE_CERTIFICATE_ID_LENGTH + 1 ];
+    uint8_t certificateFingerprint[ PROVISIONED_STATE_FINGERPRINT_LENGTH ]; /**< @brief SHA-256 of the DER certificate. */
+} ProvisionedState_t;
+
 /**
  * @brief Loads the claim credentials into the PKCS #11 module. Claim
  * credentials are used in "Provisioning by Claim" workflow of Fleet
@@ -41,6 +69,11 @@
  * shared claim credentials could be loaded into a secure element on the devices
  * in your fleet at the time of manufacturing.
  *
+ * The files are mapped rather than read, and can be PEM or DER encoded. A DER
+ * file is used without a copy. Objects the token already holds are not written
+ * again: the certificate is compared with the one in the token, and an EC key
+ * with the public point of the key in the token.
+ *
  * @param[in] p11Session The PKCS #11 session to use.
  * @param[in] pClaimCertPath Path to the claim certificate.
  * @param[in] pClaimCertLabel PKCS #11 label for the claim certificate.
@@ -85,6 +118,78 @@ bool loadPrivateKey( CK_SESSION_HANDLE p11Session,
                      const char * pLabel,
                      size_t privateKeyLength );
 
+/**
+ * @brief Generate a new EC P-256 key pair in the PKCS #11 module and a
+ * certificate signing request (CSR) for it, signed with the private key in the
+ * module. The private key does not leave the module.
+ *
+ * @param[in] p11Session The PKCS #11 session to use.
+ * @param[in] pPrivKeyLabel PKCS #11 label for the private key.
+ * @param[in] pPubKeyLabel PKCS #11 label for the public key.
+ * @param[out] pCsrBuffer The buffer to write the CSR to, in PEM format.
+ * @param[in] csrBufferLength Length of #pCsrBuffer.
+ * @param[out] pOutCsrLength The length of the CSR written, excluding the null
+ * terminator.
+ *
+ * @return True on success.
+ */
+bool generateKeyAndCsr( CK_SESSION_HANDLE p11Session,
+                        const char * pPrivKeyLabel,
+                        const char * pPubKeyLabel,
+                        char * pCsrBuffer,
+                        size_t csrBufferLength,
+                        size_t * pOutCsrLength );
+
+/**
+ * @brief Record a completed provisioning for the certificate in the PKCS #11
+ * module. The file is replaced atomically.
+ *
+ * @param[in] p11Session The PKCS #11 session to use.
+ * @param[in] pStatePath Path of the record.
+ * @param[in] pCertLabel PKCS #11 label of the device certificate.
+ * @param[in] pThingName The provisioned Thing name.
+ * @param[in] thingNameLength Length of #pThingName.
+ * @param[in] pCertificateId The ID of the device certificate.
+ * @param[in] certificateIdLength Length of #pCertificateId.
+ *
+ * @return True on success.
+ */
+bool saveProvisionedState( CK_SESSION_HANDLE p11Session,
+                           const char * pStatePath,
+                           const char * pCertLabel,
+                           const char * pThingName,
+                           size_t thingNameLength,
+                           const char * pCertificateId,
+                           size_t certificateIdLength );
+
+/**
+ * @brief Load the record of a completed provisioning, and check that it was
+ * written for the certificate in the PKCS #11 module and that the certificate
+ * has not expired. The certificate is parsed through the credential cache of
+ * the transport, so the connection that follows does not parse it again.
+ *
+ * @param[in] p11Session The PKCS #11 session to use.
+ * @param[in] pStatePath Path of the record.
+ * @param[in] pCertLabel PKCS #11 label of the device certificate.
+ * @param[out] pState The record.
+ *
+ * @return True if the device is provisioned with a valid certificate.
+ */
+bool loadProvisionedState( CK_SESSION_HANDLE p11Session,
+                           const char * pStatePath,
+                           const char * pCertLabel,
+                           ProvisionedState_t * pState );
+
+/**
+ * @brief Remove the record of a completed provisioning, so that the device is
+ * provisioned again.
+ *
+ * @param[in] pStatePath Path of the record.
+ *
+ * @return True on success, or if there is no record.
+ */
+bool clearProvisionedState( const char * pStatePath );
+
 /**
  * @brief Close the PKCS #11 session.
  *
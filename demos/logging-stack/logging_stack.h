@@ -80,10 +80,31 @@
  * for logging functionality.
  */
     #define SdkLog( string )    printf string
+
+/**
+ * @brief Common macro that calls the formatter of a log argument from the
+ * logging interfaces with a formatter (#LogDebugWithFormatter, ...).
+ */
+    #define SdkLogFormatter( formatter, pData, dataLength )    ( formatter )( ( pData ), ( dataLength ) )
 #else
     #define SdkLog( string )
+    #define SdkLogFormatter( formatter, pData, dataLength )
 #endif
 
+/**
+ * @brief Formatter of a log argument that is expensive to render, such as a
+ * binary payload.
+ *
+ * The logging interfaces with a formatter (#LogDebugWithFormatter, ...) call
+ * it after the message only when the level is enabled, so the argument costs
+ * nothing otherwise. It writes its output with #SdkLog.
+ *
+ * @param[in] pData The argument to render.
+ * @param[in] dataLength The length of @p pData.
+ */
+typedef void ( * LogFormatter_t )( const void * pData,
+                                   size_t dataLength );
+
 /**
  * Disable definition of logging interface macros when generating doxygen output,
  * to avoid conflict with documentation of macros at the end of the file.
@@ -106,6 +127,11 @@
         #define LogInfo( message )     SdkLog( ( "[INFO] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
         #define LogDebug( message )    SdkLog( ( "[DEBUG] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
 
+        #define LogErrorWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogWarnWithFormatter( message, formatter, pData, dataLength )     SdkLog( ( "[WARN] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogInfoWithFormatter( message, formatter, pData, dataLength )     SdkLog( ( "[INFO] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogDebugWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[DEBUG] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+
     #elif LIBRARY_LOG_LEVEL == LOG_INFO
         /* Only INFO, WARNING and ERROR messages will be logged. */
         #define LogError( message )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
@@ -113,6 +139,11 @@
         #define LogInfo( message )     SdkLog( ( "[INFO] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
         #define LogDebug( message )
 
+        #define LogErrorWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogWarnWithFormatter( message, formatter, pData, dataLength )     SdkLog( ( "[WARN] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogInfoWithFormatter( message, formatter, pData, dataLength )     SdkLog( ( "[INFO] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogDebugWithFormatter( message, formatter, pData, dataLength )
+
     #elif LIBRARY_LOG_LEVEL == LOG_WARN
         /* Only WARNING and ERROR messages will be logged.*/
         #define LogError( message )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
@@ -120,6 +151,11 @@
         #define LogInfo( message )
         #define LogDebug( message )
 
+        #define LogErrorWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogWarnWithFormatter( message, formatter, pData, dataLength )     SdkLog( ( "[WARN] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogInfoWithFormatter( message, formatter, pData, dataLength )
+        #define LogDebugWithFormatter( message, formatter, pData, dataLength )
+
     #elif LIBRARY_LOG_LEVEL == LOG_ERROR
         /* Only ERROR messages will be logged. */
         #define LogError( message )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
@@ -127,6 +163,11 @@
         #define LogInfo( message )
         #define LogDebug( message )
 
+        #define LogErrorWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+        #define LogWarnWithFormatter( message, formatter, pData, dataLength )
+        #define LogInfoWithFormatter( message, formatter, pData, dataLength )
+        #define LogDebugWithFormatter( message, formatter, pData, dataLength )
+
     #else /* if LIBRARY_LOG_LEVEL == LOG_ERROR */
 
         #define LogError( message )
@@ -134,6 +175,11 @@
         #define LogInfo( message )
         #define LogDebug( message )
 
+        #define LogErrorWithFormatter( message, formatter, pData, dataLength )
+        #define LogWarnWithFormatter( message, formatter, pData, dataLength )
+        #define LogInfoWithFormatter( message, formatter, pData, dataLength )
+        #define LogDebugWithFormatter( message, formatter, pData, dataLength )
+
     #endif /* if LIBRARY_LOG_LEVEL == LOG_ERROR */
 #endif /* if !defined( LIBRARY_LOG_LEVEL ) || ( ( LIBRARY_LOG_LEVEL != LOG_NONE ) && ( LIBRARY_LOG_LEVEL != LOG_ERROR ) && ( LIBRARY_LOG_LEVEL != LOG_WARN ) && ( LIBRARY_LOG_LEVEL != LOG_INFO ) && ( LIBRARY_LOG_LEVEL != LOG_DEBUG ) ) */
 /** @endcond */
@@ -177,6 +223,16 @@
  */
     #define LogError( message )    SdkLog( ( "[ERROR] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLog( ( "\r\n" ) )
 
+/**
+ * @brief Definition of logging interface macro that logs a message at the
+ * "Debug" level followed by an argument rendered by a #LogFormatter_t.
+ *
+ * The formatter is only called when debug level logging is enabled.
+ * #LogInfoWithFormatter, #LogWarnWithFormatter and #LogErrorWithFormatter
+ * are the equivalents for the other levels.
+ */
+    #define LogDebugWithFormatter( message, formatter, pData, dataLength )    SdkLog( ( "[DEBUG] " LOG_METADATA_FORMAT, LOG_METADATA_ARGS ) ); SdkLog( message ); SdkLogFormatter( formatter, pData, dataLength ); SdkLog( ( "\r\n" ) )
+
 #endif /* ifdef DOXYGEN */
 
 #endif /* ifndef LOGGING_STACK_H_ */
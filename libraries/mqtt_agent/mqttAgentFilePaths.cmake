@@ -13,6 +13,7 @@ set( SDK_MQTT_AGENT_INCLUDE_PUBLIC_DIRS
 # MQTT Agent library source files.
 set( SDK_MQTT_AGENT_SOURCES
      "${CMAKE_CURRENT_LIST_DIR}/source/mqtt_agent.c"
+     "${CMAKE_CURRENT_LIST_DIR}/source/mqtt_agent_scheduler.c"
      "${CMAKE_CURRENT_LIST_DIR}/source/subscription_manager.c"
     "${CMAKE_CURRENT_LIST_DIR}/source/freertos_agent_message.c"
     "${CMAKE_CURRENT_LIST_DIR}/source/freertos_command_pool.c" )
@@ -32,6 +32,8 @@
 /* Standard includes. */
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 /* Header include. */
 #include "freertos_command_pool.h"
@@ -44,57 +46,123 @@
 
 /*-----------------------------------------------------------*/
 
-#define QUEUE_NOT_INITIALIZED    ( 0U )
-#define QUEUE_INITIALIZED        ( 1U )
+/**
+ * @brief Allocator of the pool.
+ */
+#ifndef iotshdPal_Malloc
+    #define iotshdPal_Malloc    malloc
+#endif
+#ifndef iotshdPal_Free
+    #define iotshdPal_Free      free
+#endif
 
-#define MQTT_COMMAND_CONTEXTS_POOL_SIZE     ( 10U )
+/*-----------------------------------------------------------*/
 
 /**
- * @brief The pool of command structures used to hold information on commands (such
- * as PUBLISH or SUBSCRIBE) between the command being created by an API call and
- * completion of the command by the execution of the command's callback.
+ * @brief Key of the pool Agent_GetCommand() takes the commands from in the
+ * calling thread. The getCommand hook of coreMQTT-Agent has no context
+ * argument, so the caller selects the pool of its instance with
+ * Agent_SetCurrentPool() before calling the coreMQTT-Agent API.
  */
-static MQTTAgentCommand_t commandStructurePool[ MQTT_COMMAND_CONTEXTS_POOL_SIZE ];
+static pthread_key_t currentPoolKey;
 
 /**
- * @brief The message context used to guard the pool of MQTTAgentCommand_t structures.
- * For FreeRTOS, this is implemented with a queue. Structures may be
- * obtained by receiving a pointer from the queue, and returned by
- * sending the pointer back into it.
+ * @brief Creates #currentPoolKey once for the process.
  */
-static MQTTAgentMessageContext_t commandStructMessageCtx;
+static pthread_once_t currentPoolKeyOnce = PTHREAD_ONCE_INIT;
 
 /**
- * @brief Initialization status of the queue.
+ * @brief Status of the creation of #currentPoolKey.
  */
-static volatile uint8_t initStatus = QUEUE_NOT_INITIALIZED;
+static int currentPoolKeyStatus = -1;
 
 /*-----------------------------------------------------------*/
 
-void Agent_InitializePool( void )
+static void prvCreateCurrentPoolKey( void )
+{
+    currentPoolKeyStatus = pthread_key_create( &currentPoolKey, NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+bool Agent_InitializePool( Agent_CommandPool_t * pPool,
+                           size_t commandCount )
 {
     size_t i;
     MQTTAgentCommand_t * pCommand;
-    bool commandAdded = false;
+    bool retStatus = true;
+
+    ( void ) pthread_once( &currentPoolKeyOnce, prvCreateCurrentPoolKey );
+
+    memset( pPool, 0x00, sizeof( Agent_CommandPool_t ) );
 
-    if( initStatus == QUEUE_NOT_INITIALIZED )
+    if( ( currentPoolKeyStatus != 0 ) || ( commandCount == 0U ) )
     {
-        memset( ( void * ) commandStructurePool, 0x00, sizeof( commandStructurePool ) );
-        commandStructMessageCtx.queue = iotshdPal_syncQueueCreate( MQTT_COMMAND_CONTEXTS_POOL_SIZE,
-                                                                   sizeof( MQTTAgentCommand_t * ) );
-        // configASSERT( commandStructMessageCtx.queue );
+        LogError( ( "Failed to initialize the command pool." ) );
+        retStatus = false;
+    }
+    else
+    {
+        pPool->pCommands = iotshdPal_Malloc( commandCount * sizeof( Agent_PoolCommand_t ) );
+        pPool->freeCommands.queue = iotshdPal_syncQueueCreate( commandCount,
+                                                               sizeof( MQTTAgentCommand_t * ) );
+
+        if( ( pPool->pCommands == NULL ) || ( pPool->freeCommands.queue == NULL ) )
+        {
+            LogError( ( "Failed to allocate the pool of %u commands.", ( unsigned int ) commandCount ) );
+            Agent_DeletePool( pPool );
+            retStatus = false;
+        }
+    }
+
+    if( retStatus == true )
+    {
+        memset( pPool->pCommands, 0x00, commandCount * sizeof( Agent_PoolCommand_t ) );
+        pPool->commandCount = commandCount;
 
         /* Populate the queue. */
-        for( i = 0; i < MQTT_COMMAND_CONTEXTS_POOL_SIZE; i++ )
+        for( i = 0; i < commandCount; i++ )
         {
+            pPool->pCommands[ i ].pPool = pPool;
+
             /* Store the address as a variable. */
-            pCommand = &commandStructurePool[ i ];
-            /* Send the pointer to the queue. */
-            commandAdded = Agent_MessageSend( &commandStructMessageCtx, &pCommand, 0U );
-            // configASSERT( commandAdded );
+            pCommand = &( pPool->pCommands[ i ].command );
+            /* Send the pointer to the queue. It holds every command of the pool. */
+            ( void ) Agent_MessageSend( &( pPool->freeCommands ), &pCommand, 0U );
         }
+    }
+
+    return retStatus;
+}
 
-        initStatus = QUEUE_INITIALIZED;
+/*-----------------------------------------------------------*/
+
+void Agent_DeletePool( Agent_CommandPool_t * pPool )
+{
+    if( pPool->freeCommands.queue != NULL )
+    {
+        iotshdPal_syncQueueDelete( pPool->freeCommands.queue );
+        pPool->freeCommands.queue = NULL;
+    }
+
+    if( pPool->pCommands != NULL )
+    {
+        iotshdPal_Free( pPool->pCommands );
+        pPool->pCommands = NULL;
+    }
+
+    pPool->commandCount = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+void Agent_SetCurrentPool( Agent_CommandPool_t * pPool )
+{
+    ( void ) pthread_once( &currentPoolKeyOnce, prvCreateCurrentPoolKey );
+
+    if( currentPoolKeyStatus == 0 )
+    {
+        ( void ) pthread_setspecific( currentPoolKey, pPool );
     }
 }
 
@@ -103,17 +171,28 @@ void Agent_InitializePool( void )
 MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs )
 {
     MQTTAgentCommand_t * structToUse = NULL;
+    Agent_CommandPool_t * pPool = NULL;
     bool structRetrieved = false;
 
-    /* Check queue has been created. */
-    // configASSERT( initStatus == QUEUE_INITIALIZED );
-
-    /* Retrieve a struct from the queue. */
-    structRetrieved = Agent_MessageReceive( &commandStructMessageCtx, &( structToUse ), blockTimeMs );
+    if( currentPoolKeyStatus == 0 )
+    {
+        pPool = pthread_getspecific( currentPoolKey );
+    }
 
-    if( !structRetrieved )
+    if( pPool == NULL )
+    {
+        LogError( ( "No command pool selected in the calling thread." ) );
+    }
+    else
     {
-        LogError( ( "No command structure available." ) );
+        /* Retrieve a struct from the queue. */
+        structRetrieved = Agent_MessageReceive( &( pPool->freeCommands ), &( structToUse ), blockTimeMs );
+
+        if( !structRetrieved )
+        {
+            LogError( ( "No command structure available." ) );
+            structToUse = NULL;
+        }
     }
 
     return structToUse;
@@ -124,20 +203,27 @@ MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs )
 bool Agent_ReleaseCommand( MQTTAgentCommand_t * pCommandToRelease )
 {
     bool structReturned = false;
+    Agent_PoolCommand_t * pPoolCommand = ( Agent_PoolCommand_t * ) pCommandToRelease;
+    Agent_CommandPool_t * pPool;
 
-    // configASSERT( initStatus == QUEUE_INITIALIZED );
-
-    /* See if the structure being returned is actually from the pool. */
-    if( ( pCommandToRelease >= commandStructurePool ) &&
-        ( pCommandToRelease < ( commandStructurePool + MQTT_COMMAND_CONTEXTS_POOL_SIZE ) ) )
+    if( pPoolCommand != NULL )
     {
-        structReturned = Agent_MessageSend( &commandStructMessageCtx, &pCommandToRelease, 0U );
+        /* The command is the first member of its pool entry, which refers to
+         * the pool of the instance the command was obtained from. */
+        pPool = pPoolCommand->pPool;
+
+        /* See if the structure being returned is actually from the pool. */
+        if( ( pPool != NULL ) &&
+            ( pPoolCommand >= pPool->pCommands ) &&
+            ( pPoolCommand < ( pPool->pCommands + pPool->commandCount ) ) )
+        {
+            structReturned = Agent_MessageSend( &( pPool->freeCommands ), &pCommandToRelease, 0U );
 
-        /* The send should not fail as the queue was created to hold every command
-         * in the pool. */
-        // configASSERT( structReturned );
-        LogDebug( ( "Returned Command Context %d to pool",
-                    ( int ) ( pCommandToRelease - commandStructurePool ) ) );
+            /* The send should not fail as the queue was created to hold every command
+             * in the pool. */
+            LogDebug( ( "Returned Command Context %d to pool",
+                        ( int ) ( pPoolCommand - pPool->pCommands ) ) );
+        }
     }
 
     return structReturned;
@@ -31,13 +31,68 @@
 #ifndef FREERTOS_COMMAND_POOL_H
 #define FREERTOS_COMMAND_POOL_H
 
+/* Standard includes. */
+#include <stddef.h>
+#include <stdbool.h>
+
 /* MQTT agent includes. */
 #include "core_mqtt_agent.h"
+#include "freertos_agent_message.h"
+
+/**
+ * @brief Entry of a command pool. The command is the first member, so that a
+ * command given back to the pool finds its entry.
+ */
+typedef struct Agent_PoolCommand
+{
+    MQTTAgentCommand_t command;
+    struct Agent_CommandPool * pPool;
+} Agent_PoolCommand_t;
+
+/**
+ * @brief Pool of command structures of one agent instance.
+ */
+typedef struct Agent_CommandPool
+{
+    Agent_PoolCommand_t * pCommands;
+    size_t commandCount;
+
+    /**
+     * @brief Queue of the free commands. Structures are obtained by receiving
+     * a pointer from the queue, and returned by sending the pointer back into
+     * it.
+     */
+    MQTTAgentMessageContext_t freeCommands;
+} Agent_CommandPool_t;
+
+/**
+ * @brief Initialize the command pool of an agent instance. The pool must not be
+ * in use.
+ *
+ * @param[out] pPool The pool to initialize.
+ * @param[in] commandCount The number of command structures of the pool.
+ *
+ * @return true if the pool is initialized, otherwise false.
+ */
+bool Agent_InitializePool( Agent_CommandPool_t * pPool,
+                           size_t commandCount );
 
 /**
- * @brief Initialize the common task pool. Not thread safe.
+ * @brief Free the command structures of a pool. No command of the pool may be
+ * in use.
+ *
+ * @param[in] pPool The pool to delete.
+ */
+void Agent_DeletePool( Agent_CommandPool_t * pPool );
+
+/**
+ * @brief Select the pool Agent_GetCommand() takes the commands from in the
+ * calling thread. It must be called before each coreMQTT-Agent API call that
+ * creates a command, since a thread may use several instances.
+ *
+ * @param[in] pPool The pool of the instance the command is created for.
  */
-void Agent_InitializePool( void );
+void Agent_SetCurrentPool( Agent_CommandPool_t * pPool );
 
 /**
  * @brief Obtain a MQTTAgentCommand_t structure from the pool of structures managed by the agent.
@@ -45,10 +100,8 @@ void Agent_InitializePool( void );
  * @note MQTTAgentCommand_t structures hold everything the MQTT agent needs to process a
  * command that originates from application.  Examples of commands are PUBLISH and
  * SUBSCRIBE.  The MQTTAgentCommand_t structure must persist for the duration of the command's
- * operation so are obtained from a pool of statically allocated structures when a
- * new command is created, and returned to the pool when the command is complete.
- * The MQTT_COMMAND_CONTEXTS_POOL_SIZE configuration file constant defines how many
- * structures the pool contains.
+ * operation so are obtained from the pool selected by Agent_SetCurrentPool() when
+ * a new command is created, and returned to the pool when the command is complete.
  *
  * @param[in] blockTimeMs The length of time the calling task should remain in the
  * Blocked state (so not consuming any CPU time) to wait for a MQTTAgentCommand_t structure to
@@ -66,10 +119,8 @@ MQTTAgentCommand_t * Agent_GetCommand( uint32_t blockTimeMs );
  * @note MQTTAgentCommand_t structures hold everything the MQTT agent needs to process a
  * command that originates from application.  Examples of commands are PUBLISH and
  * SUBSCRIBE.  The MQTTAgentCommand_t structure must persist for the duration of the command's
- * operation so are obtained from a pool of statically allocated structures when a
- * new command is created, and returned to the pool when the command is complete.
- * The MQTT_COMMAND_CONTEXTS_POOL_SIZE configuration file constant defines how many
- * structures the pool contains.
+ * operation so are obtained from the pool of their instance when a new command is
+ * created, and returned to the same pool when the command is complete.
  *
  * @param[in] pCommandToRelease A pointer to the MQTTAgentCommand_t structure to return to
  * the pool.  The structure must first have been obtained by calling
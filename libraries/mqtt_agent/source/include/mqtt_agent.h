@@ -2,6 +2,8 @@
 #ifndef MQTT_AGENT_H_
 #define MQTT_AGENT_H_
 
+#include <poll.h>
+
 #include "core_mqtt.h"
 #include "core_mqtt_agent.h"
 #include "core_pkcs11.h"
@@ -9,6 +11,55 @@
 #include "pal_event.h"
 #include "pal_queue.h"
 
+/**
+ * @brief Default number of QoS1 publishes that can wait for a PUBACK at the same
+ * time. It is used when the in-flight window of iotshdDev_MQTTAgentConfig_t is zero.
+ *
+ * @note The window can not be larger than MQTT_AGENT_MAX_OUTSTANDING_ACKS.
+ */
+#ifndef MQTT_AGENT_INFLIGHT_WINDOW_SIZE
+    #define MQTT_AGENT_INFLIGHT_WINDOW_SIZE    ( 10U )
+#endif
+
+/**
+ * @brief MQTT Agent instance handle. An instance owns one broker connection, its
+ * command queue, subscriptions and in-flight publish window. Instances are
+ * independent of each other, so each of them can be served by its own thread.
+ */
+typedef struct iotshdDev_MQTTAgentInstance iotshdDev_MQTTAgentInstance_t;
+
+/**
+ * @brief Parameters of an MQTT Agent instance. The strings must remain valid until
+ * the instance is deleted.
+ */
+typedef struct iotshdDev_MQTTAgentConfig
+{
+    const char * pEndpoint;         /**< @brief Broker endpoint. */
+    uint16_t port;                  /**< @brief Broker port. Zero selects AWS_MQTT_PORT. */
+    const char * pRootCaPath;       /**< @brief Root CA certificate path. NULL selects ROOT_CA_CERT_PATH. */
+    const char * pClientIdentifier; /**< @brief MQTT client identifier. NULL selects CLIENT_IDENTIFIER. */
+    char * pClientCertLabel;        /**< @brief PKCS #11 label of the client certificate. NULL selects the TLS certificate label. */
+    char * pPrivateKeyLabel;        /**< @brief PKCS #11 label of the private key. NULL selects the TLS private key label. */
+    uint32_t inflightWindowSize;    /**< @brief Maximum number of publishes waiting for completion. Zero selects MQTT_AGENT_INFLIGHT_WINDOW_SIZE. */
+} iotshdDev_MQTTAgentConfig_t;
+
+/**
+ * @brief Function waiting for file descriptors or a timeout on behalf of an
+ * instance. It has the semantics of poll(), and is called with no file descriptor
+ * to sleep.
+ *
+ * @param[in] pWaitContext The wait function context.
+ * @param[in,out] pPollFds File descriptors to wait for. The revents are updated.
+ * @param[in] pollFdCount Number of file descriptors in pPollFds.
+ * @param[in] timeoutMs Maximum time to wait.
+ *
+ * @return Number of ready file descriptors, zero on timeout or -1 on error.
+ */
+typedef int ( * iotshdDev_MQTTAgentWaitFunction_t )( void * pWaitContext,
+                                                     struct pollfd * pPollFds,
+                                                     nfds_t pollFdCount,
+                                                     int timeoutMs );
+
 typedef struct iotshdDev_MQTTAgentQueueItem
 {
     MQTTPublishInfo_t publishInfo;
@@ -21,6 +72,10 @@ typedef struct iotshdDev_MQTTAgentUserContext
     MQTTStatus_t xReturnStatus;
     iotshdPal_SyncEvent_t * pSyncEvent;
 
+    /* Completion of the subscriptions queued by
+     * iotshdDev_MQTTAgentAddSubscriptionsWithQueueAsync, until they are waited. */
+    struct iotshdDev_MQTTAgentCompletion * pSubscriptionsCompletion;
+
     iotshdPal_SyncQueue_t * pIncommingPublishQueue;
     iotshdPal_SyncQueue_t * pFreePublishMessageQueue;
     uint32_t queueSize;
@@ -37,33 +92,110 @@ typedef struct iotshdDev_MQTTAgentUserContext
 typedef void (* IncomingPubCallback_t )( void * pvIncomingPublishCallbackContext,
                                          MQTTPublishInfo_t * pxPublishInfo );
 
+/**
+ * @brief Callback function called when a publish is completed. For QoS1 publishes
+ * it is called after the PUBACK is received.
+ *
+ * @param[in] pvPublishCompleteCallbackContext The publish complete callback context.
+ * @param[in] xReturnStatus Result of the publish operation.
+ */
+typedef void (* PublishCompleteCallback_t )( void * pvPublishCompleteCallbackContext,
+                                             MQTTStatus_t xReturnStatus );
+
 
 /**
- * @brief MQTT Agent init function.
+ * @brief MQTT Agent create instance function. The outgoing and incoming publish
+ * records of the instance are sized with the in-flight window.
  *
- * @return Return MQTTSuccess to indicate success. Other value to indicate error.
+ * @param pConfig Parameters of the instance.
+ *
+ * @return Return pointer to created iotshdDev_MQTTAgentInstance_t when success.
+ * Otherwise, NULL is returned.
+ */
+iotshdDev_MQTTAgentInstance_t * iotshdDev_MQTTAgentCreateInstance( const iotshdDev_MQTTAgentConfig_t * pConfig );
+
+/**
+ * @brief MQTT Agent delete instance function. The thread loop of the instance
+ * must have returned.
+ *
+ * @param pInstance MQTT Agent instance to be deleted.
  */
-MQTTStatus_t iotshdDev_MQTTAgentInit( NetworkContext_t * pxNetworkContext );
+void iotshdDev_MQTTAgentDeleteInstance( iotshdDev_MQTTAgentInstance_t * pInstance );
 
 /**
- * @brief MQTT Agent init function.
+ * @brief MQTT Agent set wait function. All the waits of the thread loop of the
+ * instance go through the function, so that an event loop can serve the instance
+ * without blocking its thread. It must be called before the thread loop is started.
  *
- * @param pNetworkContext pointer to user defined network context.
- * @param pSmarthomeEndpoint pointer to smart home endpoint.
- * @param pxSession User created PKCS11 session.
+ * @param pInstance MQTT Agent instance.
+ * @param waitFunction Function to wait with, or NULL to block the calling thread.
+ * @param pWaitContext context passed to waitFunction.
+ */
+void iotshdDev_MQTTAgentSetWaitFunction( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                         iotshdDev_MQTTAgentWaitFunction_t waitFunction,
+                                         void * pWaitContext );
+
+/**
+ * @brief MQTT Agent thread loop. It connects the instance to the broker and serves
+ * the instance until iotshdDev_MQTTAgentStop() is called.
+ *
+ * @param pInstance MQTT Agent instance.
+ * @param p11Session User created PKCS11 session.
  *
  * @return Return MQTTSuccess to indicate success. Other value to indicate error.
  */
-MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( NetworkContext_t * pNetworkContext,
-                                            const char * pSmarthomeEndpoint,
-                                            CK_SESSION_HANDLE * pxSession );
+MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                            CK_SESSION_HANDLE p11Session );
 
 /**
  * @brief MQTT Agent thread loop stop function.
  *
+ * @param pInstance MQTT Agent instance.
+ *
  * @return Return MQTTSuccess to indicate success. Other value to indicate error.
  */
-MQTTStatus_t iotshdDev_MQTTAgentStop( void );
+MQTTStatus_t iotshdDev_MQTTAgentStop( iotshdDev_MQTTAgentInstance_t * pInstance );
+
+/**
+ * @brief Wait for the first connection of the thread loop of the instance, and
+ * get its status. MQTTServerRefused is only returned when the broker rejected
+ * the client certificate with a fatal TLS alert, such as bad_certificate or
+ * certificate_revoked, so that a device can tell revoked credentials from a
+ * network failure. A refused CONNACK is reported as MQTTBadResponse, and other
+ * TLS failures, such as timeouts, with the status of the CONNECT.
+ *
+ * @param pInstance MQTT Agent instance.
+ * @param blockTimeMs Maximum block time to wait for the connection attempt.
+ *
+ * @return Return MQTTSuccess when the instance connected. MQTTIllegalState when
+ * the connection was not attempted within blockTimeMs. Other value to indicate
+ * the connection error. A failed connection is retried by the thread loop.
+ */
+MQTTStatus_t iotshdDev_MQTTAgentWaitConnected( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                              uint32_t blockTimeMs );
+
+/**
+ * @brief MQTT Agent switch credentials function. The instance disconnects from the
+ * broker and connects once with the new credentials and a clean session, without
+ * leaving its thread loop. Subscriptions and pending acknowledgments of the previous
+ * connection are dropped. It is used to hand over from the claim credentials to
+ * the provisioned ones. The strings must remain valid until the instance is deleted.
+ *
+ * @param pInstance MQTT Agent instance.
+ * @param pClientIdentifier New MQTT client identifier, or NULL to keep the current one.
+ * @param pClientCertLabel PKCS #11 label of the new client certificate.
+ * @param pPrivateKeyLabel PKCS #11 label of the new private key.
+ * @param blockTimeMs Maximum block time to queue the disconnect and to wait for
+ * the new connection, each.
+ *
+ * @return Return MQTTSuccess when the instance is connected with the new credentials.
+ * Other value to indicate error. A failed connection is retried by the thread loop.
+ */
+MQTTStatus_t iotshdDev_MQTTAgentSwitchCredentials( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                   const char * pClientIdentifier,
+                                                   char * pClientCertLabel,
+                                                   char * pPrivateKeyLabel,
+                                                   uint32_t blockTimeMs );
 
 /**
  * @brief MQTT Agent create user context. User context keeps the data structure
@@ -85,21 +217,47 @@ iotshdDev_MQTTAgentUserContext_t * iotshdDev_MQTTAgentCreateUserContext( uint32_
 void iotshdDev_MQTTAgentDeleteUserContext( iotshdDev_MQTTAgentUserContext_t * pUserContext );
 
 /**
- * @brief MQTT Agent synchronous publish function.
+ * @brief MQTT Agent synchronous publish function. It waits until the publish is
+ * completed, which is after the PUBACK for QoS1. Use
+ * iotshdDev_MQTTAgentPublishAsync() to keep several publishes in flight.
  *
+ * @param pInstance MQTT Agent instance.
  * @param pUserContext pointer to MQTT Agent user context.
  * @param pPublishInfo publish info.
  * @param blockTimeMs Maximum block time to wait for operation complete.
  *
- * @return Return MQTTSuccess to indicate success. Other value to indicate error.
+ * @return Return MQTTSuccess to indicate success. MQTTIllegalState if the publish
+ * is not completed within the block time. Other value to indicate error.
  */
-MQTTStatus_t iotshdDev_MQTTAgentPublish( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentPublish( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                         iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                          MQTTPublishInfo_t * pPublishInfo,
                                          uint32_t blockTimeMs );
 
+/**
+ * @brief MQTT Agent asynchronous publish function. The topic and payload are copied
+ * into the in-flight window and the completion is reported with the callback.
+ *
+ * @param pInstance MQTT Agent instance.
+ * @param pPublishInfo publish info.
+ * @param pxPublishCompleteCallback callback function called when the publish is
+ * completed. Can be NULL.
+ * @param pvPublishCompleteCallbackContext context passed to callback function.
+ * @param blockTimeMs Maximum block time to wait for a free slot in the in-flight window.
+ *
+ * @return Return MQTTSuccess to indicate the publish is queued. Other value to indicate error.
+ * The callback is only called when MQTTSuccess is returned.
+ */
+MQTTStatus_t iotshdDev_MQTTAgentPublishAsync( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                              MQTTPublishInfo_t * pPublishInfo,
+                                              PublishCompleteCallback_t pxPublishCompleteCallback,
+                                              void * pvPublishCompleteCallbackContext,
+                                              uint32_t blockTimeMs );
+
 /**
  * @brief MQTT Agent synchronous subscription function. Qos1 will be used in this function.
  *
+ * @param pInstance MQTT Agent instance.
  * @param pUserContext pointer to MQTT Agent user context.
  * @param pcTopicFilterString Topic filter of the subscription.
  * @param usTopicFilterLength Topic filter length.
@@ -107,9 +265,11 @@ MQTTStatus_t iotshdDev_MQTTAgentPublish( iotshdDev_MQTTAgentUserContext_t * pUse
  * @param pvIncomingPublishCallbackContext context passed to callback function.
  * @param blockTimeMs Maximum block time to wait for operation complete.
  *
- * @return Return MQTTSuccess to indicate success. Other value to indicate error.
+ * @return Return the status of the SUBACK, which is also stored in the user
+ * context. MQTTIllegalState indicates the SUBACK is not received in time.
  */
-MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                 iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                  const char * pcTopicFilterString,
                                                  uint16_t usTopicFilterLength,
                                                  IncomingPubCallback_t pxIncomingPublishCallback,
@@ -119,6 +279,7 @@ MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentUserContext_
 /**
  * @brief MQTT Agent synchronous unsubscription function. Qos1 will be used in this function.
  *
+ * @param pInstance MQTT Agent instance.
  * @param pUserContext pointer to MQTT Agent user context.
  * @param pcTopicFilterString Topic filter of the unsubscription.
  * @param usTopicFilterLength Topic filter length.
@@ -126,9 +287,11 @@ MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentUserContext_
  * @param pvIncomingPublishCallbackContext context passed to callback function.
  * @param blockTimeMs Maximum block time to wait for operation complete.
  *
- * @return Return MQTTSuccess to indicate success. Other value to indicate error.
+ * @return Return the status of the UNSUBACK, which is also stored in the user
+ * context. MQTTIllegalState indicates the UNSUBACK is not received in time.
  */
-MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                    iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                     const char * pcTopicFilterString,
                                                     uint16_t usTopicFilterLength,
                                                     IncomingPubCallback_t pxIncomingPublishCallback,
@@ -138,6 +301,7 @@ MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentUserConte
 /**
  * @brief MQTT Agent subscrition with queue.
  *
+ * @param pInstance MQTT Agent instance.
  * @param pUserContext pointer to MQTT Agent user context.
  * @param pcTopicFilterString Topic filter of the unsubscription.
  * @param usTopicFilterLength Topic filter length.
@@ -145,7 +309,8 @@ MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentUserConte
  *
  * @return Return MQTTSuccess to indicate success. Other value to indicate error.
  */
-MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                          iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                           const char * pcTopicFilterString,
                                                           uint16_t usTopicFilterLength,
                                                           uint32_t blockTimeMs );
@@ -153,6 +318,7 @@ MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentUse
 /**
  * @brief MQTT Agent unsubscrition with queue.
  *
+ * @param pInstance MQTT Agent instance.
  * @param pUserContext pointer to MQTT Agent user context.
  * @param pcTopicFilterString Topic filter of the unsubscription.
  * @param usTopicFilterLength Topic filter length.
@@ -160,11 +326,50 @@ MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentUse
  *
  * @return Return MQTTSuccess to indicate success. Other value to indicate error.
  */
-MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                             iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                              const char * pcTopicFilterString,
                                                              uint16_t usTopicFilterLength,
                                                              uint32_t blockTimeMs );
 
+/**
+ * @brief MQTT Agent subscription of several topic filters with queue, sent in
+ * one SUBSCRIBE packet. The function returns once the command is queued, so
+ * that commands queued after it are sent without waiting for the SUBACK. Use
+ * #iotshdDev_MQTTAgentWaitForSubscriptions to get the result.
+ *
+ * @param pInstance MQTT Agent instance.
+ * @param pUserContext pointer to MQTT Agent user context. It must not be used for
+ * other subscriptions until the result is received. A result that was not waited
+ * for is discarded.
+ * @param pSubscribeInfo Array of topic filters. The array and the topic filter
+ * strings are copied for the command. The incoming publish callbacks refer to the
+ * strings, so they must persist for the duration of the subscriptions.
+ * @param numSubscriptions Number of topic filters in the array.
+ * @param blockTimeMs Maximum block time to wait for the command to be queued.
+ *
+ * @return Return MQTTSuccess if the command is queued. Other value to indicate error.
+ */
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionsWithQueueAsync( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                                iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                                const MQTTSubscribeInfo_t * pSubscribeInfo,
+                                                                size_t numSubscriptions,
+                                                                uint32_t blockTimeMs );
+
+/**
+ * @brief Wait for the result of #iotshdDev_MQTTAgentAddSubscriptionsWithQueueAsync.
+ *
+ * @param pUserContext pointer to MQTT Agent user context.
+ * @param blockTimeMs Maximum block time to wait for the SUBACK.
+ *
+ * @return Return MQTTSuccess if all the topic filters are subscribed. MQTTServerRefused
+ * if any of them is refused by the broker, MQTTIllegalState if no SUBACK is received
+ * in time. Other value to indicate error. After a timeout, a late SUBACK no longer
+ * uses the user context, and the topic filters it accepts are not routed to it.
+ */
+MQTTStatus_t iotshdDev_MQTTAgentWaitForSubscriptions( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                      uint32_t blockTimeMs );
+
 /**
  * @brief MQTT Agent dequeue incomming publish from queue.
  *
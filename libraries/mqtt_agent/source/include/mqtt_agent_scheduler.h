@@ -0,0 +1,134 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MQTT_AGENT_SCHEDULER_H_
+#define MQTT_AGENT_SCHEDULER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "mqtt_agent.h"
+
+/**
+ * @brief Default stack size of the thread loop of an instance served by a
+ * scheduler. The stack holds the MQTT agent and the MbedTLS handshake of the
+ * instance. The steps of the connect that can block, the profile set-up, the
+ * TCP connect and the PKCS #11 signature, run on worker threads with their own
+ * stacks.
+ *
+ * @note Each instance maps this much address space, plus a guard page that stops
+ * an overflow. The memory is only committed when used, so a scheduler serving N
+ * instances commits the stack depth actually reached by each instance, not N
+ * times this size. Pass a smaller size to iotshdDev_MQTTAgentSchedulerCreate()
+ * when the address space matters, or a larger one for a deeper TLS configuration.
+ */
+#ifndef MQTT_AGENT_SCHEDULER_STACK_SIZE
+    #define MQTT_AGENT_SCHEDULER_STACK_SIZE    ( 128U * 1024U )
+#endif
+
+/**
+ * @brief Maximum number of readiness events handled in one scheduler iteration.
+ */
+#ifndef MQTT_AGENT_SCHEDULER_MAX_EVENTS
+    #define MQTT_AGENT_SCHEDULER_MAX_EVENTS    ( 64U )
+#endif
+
+/**
+ * @brief MQTT Agent scheduler. A scheduler serves the thread loops of many
+ * instances on the thread calling iotshdDev_MQTTAgentSchedulerRun(). An instance
+ * is only resumed when its socket or command queue is ready, or when its wait
+ * times out. Run one scheduler on each core to spread the instances.
+ */
+typedef struct iotshdDev_MQTTAgentScheduler iotshdDev_MQTTAgentScheduler_t;
+
+/**
+ * @brief Context switch function of the schedulers, with the signature of
+ * swapcontext(). It saves the running context in pCurrentContext and resumes
+ * pNextContext.
+ */
+typedef int ( * iotshdDev_MQTTAgentSchedulerSwapFunction_t )( ucontext_t * pCurrentContext,
+                                                              const ucontext_t * pNextContext );
+
+/**
+ * @brief MQTT Agent scheduler swap function setter. The schedulers switch
+ * between themselves and the thread loops of their instances with this
+ * function. An application keeping per thread state across the switches, such
+ * as the memory accounting of the transport, registers its own switch here,
+ * e.g. Mbedtls_Pkcs11_MemorySwapContext(). It must be called before any
+ * scheduler runs.
+ *
+ * @param swapFunction Context switch function, or NULL for swapcontext().
+ */
+void iotshdDev_MQTTAgentSchedulerSetSwapFunction( iotshdDev_MQTTAgentSchedulerSwapFunction_t swapFunction );
+
+/**
+ * @brief MQTT Agent scheduler create function.
+ *
+ * @param stackSize Stack size of the thread loop of each instance, rounded up to
+ * whole pages. Zero selects MQTT_AGENT_SCHEDULER_STACK_SIZE.
+ *
+ * @return Return pointer to created iotshdDev_MQTTAgentScheduler_t when success.
+ * Otherwise, NULL is returned.
+ */
+iotshdDev_MQTTAgentScheduler_t * iotshdDev_MQTTAgentSchedulerCreate( uint32_t stackSize );
+
+/**
+ * @brief MQTT Agent scheduler delete function. iotshdDev_MQTTAgentSchedulerRun()
+ * must have returned.
+ *
+ * @param pScheduler Scheduler to be deleted.
+ */
+void iotshdDev_MQTTAgentSchedulerDelete( iotshdDev_MQTTAgentScheduler_t * pScheduler );
+
+/**
+ * @brief MQTT Agent scheduler add instance function. The thread loop of the
+ * instance is started by the scheduler. It can be called from any thread.
+ *
+ * @param pScheduler Scheduler to serve the instance.
+ * @param pInstance MQTT Agent instance. It must not be served by another thread.
+ * @param p11Session User created PKCS11 session.
+ *
+ * @return Return true to indicate success. Otherwise, return false.
+ */
+bool iotshdDev_MQTTAgentSchedulerAdd( iotshdDev_MQTTAgentScheduler_t * pScheduler,
+                                      iotshdDev_MQTTAgentInstance_t * pInstance,
+                                      CK_SESSION_HANDLE p11Session );
+
+/**
+ * @brief MQTT Agent scheduler loop. It serves the instances added to the scheduler
+ * until iotshdDev_MQTTAgentSchedulerStop() is called and the thread loops of all
+ * the instances have returned. The thread loop of an instance returns after
+ * iotshdDev_MQTTAgentStop() is called for the instance.
+ *
+ * @param pScheduler Scheduler to run.
+ */
+void iotshdDev_MQTTAgentSchedulerRun( iotshdDev_MQTTAgentScheduler_t * pScheduler );
+
+/**
+ * @brief MQTT Agent scheduler stop function. It can be called from any thread.
+ *
+ * @param pScheduler Scheduler to stop.
+ */
+void iotshdDev_MQTTAgentSchedulerStop( iotshdDev_MQTTAgentScheduler_t * pScheduler );
+
+#endif /* ifndef MQTT_AGENT_SCHEDULER_H_ */
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "mqtt_agent.h"
 #include "core_mqtt_agent.h"
 #include "mbedtls_pkcs11_posix.h"
@@ -35,37 +37,131 @@
 #define mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS   ( 1000U )
 
 /**
- * @brief The length of the queue used to hold commands for the agent.
+ * @brief The number of command structures of an instance beyond its in-flight
+ * window, for the subscribe, unsubscribe, disconnect and terminate commands.
  */
-#ifndef MQTT_AGENT_COMMAND_QUEUE_LENGTH
-    #define MQTT_AGENT_COMMAND_QUEUE_LENGTH    ( 10U )
+#ifndef MQTT_AGENT_COMMAND_POOL_HEADROOM
+    #define MQTT_AGENT_COMMAND_POOL_HEADROOM    ( 8U )
 #endif
 
-#define iotshdPal_Malloc    malloc
-#define iotshdPal_Free      free
+/**
+ * @brief Allocator of the agent. It can be replaced at build time, e.g. to count
+ * the allocations in the tests.
+ */
+#ifndef iotshdPal_Malloc
+    #define iotshdPal_Malloc    malloc
+#endif
+#ifndef iotshdPal_Free
+    #define iotshdPal_Free      free
+#endif
 
 /*-----------------------------------------------------------*/
 
-MQTTAgentContext_t xGlobalMqttAgentContext;
-static uint8_t xNetworkBuffer[ MQTT_AGENT_NETWORK_BUFFER_SIZE ];
-
 /**
- * @brief The parameters for MbedTLS operation.
+ * @brief A slot of the in-flight publish window. The topic and payload are copied
+ * into the slot so that the caller does not need to keep its buffers until the
+ * publish is completed.
  */
-static MbedtlsPkcs11Context_t tlsContext = { 0 };
+typedef struct iotshdDev_MQTTAgentPublishSlot
+{
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    MQTTPublishInfo_t publishInfo;
+    uint8_t * topicPayloadBuffer;
+    size_t topicPayloadBufferSize;
+    PublishCompleteCallback_t pxPublishCompleteCallback;
+    void * pvPublishCompleteCallbackContext;
+} iotshdDev_MQTTAgentPublishSlot_t;
 
 /**
- * @brief The global array of subscription elements.
- *
- * @note No thread safety is required to this array, since the updates the array
- * elements are done only from one task at a time. The subscription manager
- * implementation expects that the array of the subscription elements used for
- * storing subscriptions to be initialized to 0. As this is a global array, it
- * will be initialized to 0 by default.
+ * @brief An MQTT agent instance. Each instance owns one broker connection and
+ * everything the agent needs to serve it, so that a process can run several
+ * instances in different threads.
  */
-SubscriptionElement_t xGlobalSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+struct iotshdDev_MQTTAgentInstance
+{
+    MQTTAgentContext_t xMqttAgentContext;
+    uint8_t xNetworkBuffer[ MQTT_AGENT_NETWORK_BUFFER_SIZE ];
+
+    /**
+     * @brief The parameters for MbedTLS operation.
+     */
+    MbedtlsPkcs11Context_t tlsContext;
+    NetworkContext_t xNetworkContext;
+
+    /**
+     * @brief The array of subscription elements.
+     *
+     * @note No thread safety is required to this array, since the updates the array
+     * elements are done only from the agent thread of this instance. The subscription
+     * manager implementation expects that the array of the subscription elements used
+     * for storing subscriptions to be initialized to 0.
+     */
+    SubscriptionElement_t xSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+
+    MQTTAgentMessageContext_t xCommandQueue;
+
+    /**
+     * @brief Command structures of this instance. A QoS1 publish holds its
+     * command until the PUBACK is received, so the pool is sized with the
+     * in-flight window plus #MQTT_AGENT_COMMAND_POOL_HEADROOM. The command
+     * queue has the same length, so posting a command never blocks once a
+     * command structure has been obtained.
+     */
+    Agent_CommandPool_t xCommandPool;
+
+    /**
+     * @brief Connection parameters. NULL strings are replaced with the defaults of
+     * demo_config.h when the instance is created.
+     */
+    const char * pEndpoint;
+    uint16_t port;
+    const char * pRootCaPath;
+    const char * pClientIdentifier;
+    char * pClientCertLabel;
+    char * pPrivateKeyLabel;
+
+    /**
+     * @brief Credentials requested by iotshdDev_MQTTAgentSwitchCredentials(). They
+     * are written before the disconnect command is queued and applied by the agent
+     * thread once the command is processed, so the queue orders the accesses.
+     */
+    bool credentialSwitchPending;
+    const char * pPendingClientIdentifier;
+    char * pPendingClientCertLabel;
+    char * pPendingPrivateKeyLabel;
+    MQTTStatus_t credentialSwitchStatus;
+    iotshdPal_SyncEvent_t * pCredentialSwitchEvent;
+
+    /**
+     * @brief Status of the first connection of the thread loop, reported by
+     * iotshdDev_MQTTAgentWaitConnected(). The event stays set once the
+     * connection is attempted.
+     */
+    MQTTStatus_t initialConnectStatus;
+    iotshdPal_SyncEvent_t * pConnectEvent;
+
+    /**
+     * @brief Function used for all the waits of the thread loop. NULL blocks the
+     * thread.
+     */
+    iotshdDev_MQTTAgentWaitFunction_t waitFunction;
+    void * pWaitContext;
+
+    /**
+     * @brief State records of outgoing and incoming QoS1 publishes. They are allocated
+     * in iotshdDev_MQTTAgentCreateInstance() with the size of the in-flight window.
+     */
+    MQTTPubAckInfo_t * pOutgoingPublishRecords;
+    MQTTPubAckInfo_t * pIncomingPublishRecords;
 
-static MQTTAgentMessageContext_t xCommandQueue;
+    /**
+     * @brief The in-flight publish window. A slot is taken from the free slot queue
+     * when a publish is queued and returned when the publish is completed.
+     */
+    iotshdDev_MQTTAgentPublishSlot_t * pPublishSlots;
+    iotshdPal_SyncQueue_t * pFreePublishSlotQueue;
+    uint32_t publishSlotCount;
+};
 
 /*-----------------------------------------------------------*/
 
@@ -80,43 +176,44 @@ static uint32_t generateRandomNumber()
 
 /*-----------------------------------------------------------*/
 
-static bool DisconnectMqttSession( NetworkContext_t * pNetworkContext )
+static void prvSleepMs( iotshdDev_MQTTAgentInstance_t * pInstance,
+                        uint32_t sleepTimeMs )
 {
-    MQTTStatus_t mqttStatus = MQTTSuccess;
-    bool returnStatus = false;
-    MQTTContext_t * pMqttContext = &xGlobalMqttAgentContext.mqttContext;
-
-    /* End TLS session, then close TCP connection. */
-    ( void ) Mbedtls_Pkcs11_Disconnect( pNetworkContext );
-
-    return returnStatus;
+    if( pInstance->waitFunction != NULL )
+    {
+        ( void ) pInstance->waitFunction( pInstance->pWaitContext, NULL, 0U, ( int ) sleepTimeMs );
+    }
+    else
+    {
+        Clock_SleepMs( sleepTimeMs );
+    }
 }
 
 /*-----------------------------------------------------------*/
 
-static bool connectToBrokerWithBackoffRetries( NetworkContext_t * pNetworkContext,
-                                               char * pMqttEndpoint,
-                                               CK_SESSION_HANDLE p11Session,
-                                               char * pClientCertLabel,
-                                               char * pPrivateKeyLabel )
+static MbedtlsPkcs11Status_t connectToBrokerWithBackoffRetries( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                               CK_SESSION_HANDLE p11Session )
 {
-    bool returnStatus = false;
     BackoffAlgorithmStatus_t backoffAlgStatus = BackoffAlgorithmSuccess;
     MbedtlsPkcs11Status_t tlsStatus = MBEDTLS_PKCS11_SUCCESS;
     BackoffAlgorithmContext_t reconnectParams;
     MbedtlsPkcs11Credentials_t tlsCredentials = { 0 };
     uint16_t nextRetryBackOff = 0U;
     size_t xMqttEndpointLength;
+    NetworkContext_t * pNetworkContext = &( pInstance->xNetworkContext );
 
-    xMqttEndpointLength = strnlen( pMqttEndpoint, 128 );
+    xMqttEndpointLength = strnlen( pInstance->pEndpoint, 128 );
 
-    /* Set the pParams member of the network context with desired transport. */
-    pNetworkContext->pParams = &tlsContext;
+    /* Set the pParams member of the network context with desired transport. The
+     * agent waits for the socket and the command queue together, so the socket is
+     * used in non-blocking mode. */
+    pNetworkContext->pParams = &( pInstance->tlsContext );
+    Mbedtls_Pkcs11_SetNonBlocking( pNetworkContext, true );
 
     /* Initialize credentials for establishing TLS session. */
-    tlsCredentials.pRootCaPath = ROOT_CA_CERT_PATH;
-    tlsCredentials.pClientCertLabel = pClientCertLabel;
-    tlsCredentials.pPrivateKeyLabel = pPrivateKeyLabel;
+    tlsCredentials.pRootCaPath = pInstance->pRootCaPath;
+    tlsCredentials.pClientCertLabel = pInstance->pClientCertLabel;
+    tlsCredentials.pPrivateKeyLabel = pInstance->pPrivateKeyLabel;
     tlsCredentials.p11Session = p11Session;
 
     /* AWS IoT requires devices to send the Server Name Indication (SNI)
@@ -140,12 +237,12 @@ static bool connectToBrokerWithBackoffRetries( NetworkContext_t * pNetworkContex
          * at the demo config header. */
         LogInfo( ( "Establishing a TLS session to %.*s:%d.",
                     xMqttEndpointLength,
-                    pMqttEndpoint,
-                    AWS_MQTT_PORT ) );
+                    pInstance->pEndpoint,
+                    pInstance->port ) );
 
         tlsStatus = Mbedtls_Pkcs11_Connect( pNetworkContext,
-                                            pMqttEndpoint,
-                                            AWS_MQTT_PORT,
+                                            pInstance->pEndpoint,
+                                            pInstance->port,
                                             &tlsCredentials,
                                             TRANSPORT_SEND_RECV_TIMEOUT_MS );
 
@@ -153,7 +250,6 @@ static bool connectToBrokerWithBackoffRetries( NetworkContext_t * pNetworkContex
         {
             /* Connection successful. */
             printf( "TLS connected\r\n" );
-            returnStatus = true;
         }
         else
         {
@@ -169,17 +265,24 @@ static bool connectToBrokerWithBackoffRetries( NetworkContext_t * pNetworkContex
                 LogWarn( ( "Connection to the broker failed. Retrying connection "
                            "after %hu ms backoff.",
                            ( unsigned short ) nextRetryBackOff ) );
-                Clock_SleepMs( nextRetryBackOff );
+                prvSleepMs( pInstance, nextRetryBackOff );
             }
         }
-    } while( ( tlsStatus != MBEDTLS_PKCS11_SUCCESS ) && ( backoffAlgStatus == BackoffAlgorithmSuccess ) );
 
-    return returnStatus;
+        /* A rejected certificate is returned after the backoff delay, so that
+         * the caller knows it early without reconnecting in a tight loop. The
+         * same certificate would be rejected again. */
+    } while( ( tlsStatus != MBEDTLS_PKCS11_SUCCESS ) &&
+             ( tlsStatus != MBEDTLS_PKCS11_CERTIFICATE_REJECTED ) &&
+             ( backoffAlgStatus == BackoffAlgorithmSuccess ) );
+
+    return tlsStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static MQTTStatus_t prvMQTTConnect( bool xCleanSession )
+static MQTTStatus_t prvMQTTConnect( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                    bool xCleanSession )
 {
     MQTTStatus_t xResult;
     MQTTConnectInfo_t xConnectInfo;
@@ -197,8 +300,8 @@ static MQTTStatus_t prvMQTTConnect( bool xCleanSession )
     /* The client identifier is used to uniquely identify this MQTT client to
      * the MQTT broker. In a production device the identifier can be something
      * unique, such as a device serial number. */
-    xConnectInfo.pClientIdentifier = CLIENT_IDENTIFIER;
-    xConnectInfo.clientIdentifierLength = ( uint16_t ) strlen( CLIENT_IDENTIFIER );
+    xConnectInfo.pClientIdentifier = pInstance->pClientIdentifier;
+    xConnectInfo.clientIdentifierLength = ( uint16_t ) strlen( pInstance->pClientIdentifier );
 
     /* Set MQTT keep-alive period. It is the responsibility of the application
      * to ensure that the interval between Control Packets being sent does not
@@ -215,7 +318,7 @@ static MQTTStatus_t prvMQTTConnect( bool xCleanSession )
 
     /* Send MQTT CONNECT packet to broker. MQTT's Last Will and Testament feature
      * is not used in this demo, so it is passed as NULL. */
-    xResult = MQTT_Connect( &( xGlobalMqttAgentContext.mqttContext ),
+    xResult = MQTT_Connect( &( pInstance->xMqttAgentContext.mqttContext ),
                             &xConnectInfo,
                             NULL,
                             mqttexampleCONNACK_RECV_TIMEOUT_MS,
@@ -226,7 +329,7 @@ static MQTTStatus_t prvMQTTConnect( bool xCleanSession )
     /* Resume a session if desired. */
     if( ( xResult == MQTTSuccess ) && ( xCleanSession == false ) )
     {
-        xResult = MQTTAgent_ResumeSession( &xGlobalMqttAgentContext, xSessionPresent );
+        xResult = MQTTAgent_ResumeSession( &( pInstance->xMqttAgentContext ), xSessionPresent );
 
         /* Resubscribe to all the subscribed topics. */
         if( ( xResult == MQTTSuccess ) && ( xSessionPresent == false ) )
@@ -240,6 +343,60 @@ static MQTTStatus_t prvMQTTConnect( bool xCleanSession )
 
 /*-----------------------------------------------------------*/
 
+static void prvSetCommandQueueWakeup( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                      MQTTStatus_t xConnectStatus )
+{
+    /* The command queue only wakes up a receive after CONNACK, otherwise the
+     * commands waiting for the connection would make the CONNACK wait spin. */
+    if( xConnectStatus == MQTTSuccess )
+    {
+        Mbedtls_Pkcs11_SetWakeupFd( &( pInstance->xNetworkContext ),
+                                    iotshdPal_syncQueueGetWakeupFd( pInstance->xCommandQueue.queue ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static MQTTStatus_t prvSwitchCredentials( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                          CK_SESSION_HANDLE p11Session )
+{
+    MQTTStatus_t xConnectStatus;
+
+    if( pInstance->pPendingClientIdentifier != NULL )
+    {
+        pInstance->pClientIdentifier = pInstance->pPendingClientIdentifier;
+    }
+
+    pInstance->pClientCertLabel = pInstance->pPendingClientCertLabel;
+    pInstance->pPrivateKeyLabel = pInstance->pPendingPrivateKeyLabel;
+
+    /* The broker session belongs to the previous credentials. Its subscriptions
+     * are not valid for the new identity. */
+    memset( pInstance->xSubscriptionList, 0, sizeof( pInstance->xSubscriptionList ) );
+
+    if( connectToBrokerWithBackoffRetries( pInstance, p11Session ) == MBEDTLS_PKCS11_SUCCESS )
+    {
+        xConnectStatus = prvMQTTConnect( pInstance, true );
+
+        /* Fail the acknowledgments still pending on the previous session. */
+        if( xConnectStatus == MQTTSuccess )
+        {
+            xConnectStatus = MQTTAgent_ResumeSession( &( pInstance->xMqttAgentContext ), false );
+        }
+    }
+    else
+    {
+        /* The CONNECT can not be sent without a TLS session. */
+        xConnectStatus = MQTTSendFailed;
+    }
+
+    prvSetCommandQueueWakeup( pInstance, xConnectStatus );
+
+    return xConnectStatus;
+}
+
+/*-----------------------------------------------------------*/
+
 static void prvIncomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
                                         uint16_t packetId,
                                         MQTTPublishInfo_t * pxPublishInfo )
@@ -270,11 +427,151 @@ static void prvIncomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
 
 /*-----------------------------------------------------------*/
 
-MQTTStatus_t iotshdDev_MQTTAgentInit( NetworkContext_t * pxNetworkContext )
+static bool prvCopyTopicPayload( uint8_t ** ppTopicPayloadBuffer,
+                                 size_t * pTopicPayloadBufferSize,
+                                 MQTTPublishInfo_t * pDestPublishInfo,
+                                 const MQTTPublishInfo_t * pSrcPublishInfo )
+{
+    size_t requiredTopicPayloadSize = 0;
+    uint8_t * pBuffer;
+
+    /* Dup the publish info structure. */
+    memcpy( pDestPublishInfo, pSrcPublishInfo, sizeof( MQTTPublishInfo_t ) );
+
+    /* Calcualte required topic payload size. */
+    requiredTopicPayloadSize = pSrcPublishInfo->topicNameLength + 1U + pSrcPublishInfo->payloadLength + 1U;
+
+    if( *ppTopicPayloadBuffer != NULL )
+    {
+        if( *pTopicPayloadBufferSize < requiredTopicPayloadSize )
+        {
+            /* The buffer size is not enough. Re-allocate a new buffer. */
+            iotshdPal_Free( *ppTopicPayloadBuffer );
+            *ppTopicPayloadBuffer = NULL;
+            *pTopicPayloadBufferSize = 0;
+        }
+    }
+
+    if( *ppTopicPayloadBuffer == NULL )
+    {
+        *ppTopicPayloadBuffer = iotshdPal_Malloc( requiredTopicPayloadSize );
+
+        if( *ppTopicPayloadBuffer != NULL )
+        {
+            *pTopicPayloadBufferSize = requiredTopicPayloadSize;
+        }
+    }
+
+    pBuffer = *ppTopicPayloadBuffer;
+
+    if( pBuffer != NULL )
+    {
+        memcpy( pBuffer, pSrcPublishInfo->pTopicName, pSrcPublishInfo->topicNameLength );
+        pBuffer[ pSrcPublishInfo->topicNameLength ] = '\0';
+        pDestPublishInfo->pTopicName = ( char * ) pBuffer;
+
+        memcpy( &( pBuffer[ pSrcPublishInfo->topicNameLength + 1U ] ),
+                pSrcPublishInfo->pPayload,
+                pSrcPublishInfo->payloadLength );
+        pBuffer[ pSrcPublishInfo->topicNameLength + 1U + pSrcPublishInfo->payloadLength ] = '\0';
+        pDestPublishInfo->pPayload = ( char * ) ( &pBuffer[ pSrcPublishInfo->topicNameLength + 1U ] );
+    }
+
+    return ( pBuffer != NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvFreeInflightWindow( iotshdDev_MQTTAgentInstance_t * pInstance )
+{
+    uint32_t i;
+
+    if( pInstance->pFreePublishSlotQueue != NULL )
+    {
+        iotshdPal_syncQueueDelete( pInstance->pFreePublishSlotQueue );
+        pInstance->pFreePublishSlotQueue = NULL;
+    }
+
+    if( pInstance->pPublishSlots != NULL )
+    {
+        for( i = 0; i < pInstance->publishSlotCount; i++ )
+        {
+            if( pInstance->pPublishSlots[ i ].topicPayloadBuffer != NULL )
+            {
+                iotshdPal_Free( pInstance->pPublishSlots[ i ].topicPayloadBuffer );
+            }
+        }
+
+        iotshdPal_Free( pInstance->pPublishSlots );
+        pInstance->pPublishSlots = NULL;
+    }
+
+    if( pInstance->pOutgoingPublishRecords != NULL )
+    {
+        iotshdPal_Free( pInstance->pOutgoingPublishRecords );
+        pInstance->pOutgoingPublishRecords = NULL;
+    }
+
+    if( pInstance->pIncomingPublishRecords != NULL )
+    {
+        iotshdPal_Free( pInstance->pIncomingPublishRecords );
+        pInstance->pIncomingPublishRecords = NULL;
+    }
+
+    pInstance->publishSlotCount = 0U;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvInitializeInflightWindow( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                         uint32_t windowSize )
+{
+    bool retStatus = true;
+    uint32_t i;
+    iotshdDev_MQTTAgentPublishSlot_t * pPublishSlot;
+
+    /* Release the window of the previous initialization. */
+    prvFreeInflightWindow( pInstance );
+
+    pInstance->pOutgoingPublishRecords = iotshdPal_Malloc( windowSize * sizeof( MQTTPubAckInfo_t ) );
+    pInstance->pIncomingPublishRecords = iotshdPal_Malloc( windowSize * sizeof( MQTTPubAckInfo_t ) );
+    pInstance->pPublishSlots = iotshdPal_Malloc( windowSize * sizeof( iotshdDev_MQTTAgentPublishSlot_t ) );
+    pInstance->pFreePublishSlotQueue = iotshdPal_syncQueueCreate( windowSize, sizeof( iotshdDev_MQTTAgentPublishSlot_t * ) );
+
+    if( ( pInstance->pOutgoingPublishRecords == NULL ) || ( pInstance->pIncomingPublishRecords == NULL ) ||
+        ( pInstance->pPublishSlots == NULL ) || ( pInstance->pFreePublishSlotQueue == NULL ) )
+    {
+        LogError( ( "Failed to allocate the in-flight window of %u publishes.", ( unsigned int ) windowSize ) );
+        prvFreeInflightWindow( pInstance );
+        retStatus = false;
+    }
+    else
+    {
+        memset( pInstance->pOutgoingPublishRecords, 0, windowSize * sizeof( MQTTPubAckInfo_t ) );
+        memset( pInstance->pIncomingPublishRecords, 0, windowSize * sizeof( MQTTPubAckInfo_t ) );
+        memset( pInstance->pPublishSlots, 0, windowSize * sizeof( iotshdDev_MQTTAgentPublishSlot_t ) );
+        pInstance->publishSlotCount = windowSize;
+
+        for( i = 0; i < windowSize; i++ )
+        {
+            pPublishSlot = &pInstance->pPublishSlots[ i ];
+            pPublishSlot->pInstance = pInstance;
+            iotshdPal_syncQueueSend( pInstance->pFreePublishSlotQueue, &pPublishSlot, 0 );
+        }
+    }
+
+    return retStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+iotshdDev_MQTTAgentInstance_t * iotshdDev_MQTTAgentCreateInstance( const iotshdDev_MQTTAgentConfig_t * pConfig )
 {
+    iotshdDev_MQTTAgentInstance_t * pInstance = NULL;
     TransportInterface_t xTransport;
-    MQTTStatus_t xReturn;
-    MQTTFixedBuffer_t xFixedBuffer = { .pBuffer = xNetworkBuffer, .size = MQTT_AGENT_NETWORK_BUFFER_SIZE };
+    MQTTStatus_t xReturn = MQTTSuccess;
+    uint32_t windowSize;
+    MQTTFixedBuffer_t xFixedBuffer = { 0 };
 
     MQTTAgentMessageInterface_t messageInterface =
     {
@@ -285,51 +582,197 @@ MQTTStatus_t iotshdDev_MQTTAgentInit( NetworkContext_t * pxNetworkContext )
         .releaseCommand = Agent_ReleaseCommand
     };
 
-    xCommandQueue.queue = iotshdPal_syncQueueCreate( MQTT_AGENT_COMMAND_QUEUE_LENGTH,
-                                                     sizeof( MQTTAgentCommand_t * ) );
-    messageInterface.pMsgCtx = &xCommandQueue;
-    Agent_InitializePool();
-
-    /* Fill in Transport Interface send and receive function pointers. */
-    xTransport.pNetworkContext = pxNetworkContext;
-    xTransport.send = Mbedtls_Pkcs11_Send;
-    xTransport.recv = Mbedtls_Pkcs11_Recv;
-    xTransport.writev = NULL;    
-
-    /* Initialize MQTT library. */
-    xReturn = MQTTAgent_Init( &xGlobalMqttAgentContext,
-                              &messageInterface,
-                              &xFixedBuffer,
-                              &xTransport,
-                              Clock_GetTimeMs,
-                              prvIncomingPublishCallback,
-                              xGlobalSubscriptionList );
+    if( ( pConfig == NULL ) || ( pConfig->pEndpoint == NULL ) )
+    {
+        LogError( ( "Invalid MQTT agent configuration." ) );
+        xReturn = MQTTBadParameter;
+    }
+    else
+    {
+        pInstance = iotshdPal_Malloc( sizeof( iotshdDev_MQTTAgentInstance_t ) );
+
+        if( pInstance == NULL )
+        {
+            xReturn = MQTTNoMemory;
+        }
+    }
 
-    return xReturn;
+    if( xReturn == MQTTSuccess )
+    {
+        memset( pInstance, 0, sizeof( iotshdDev_MQTTAgentInstance_t ) );
+
+        pInstance->pEndpoint = pConfig->pEndpoint;
+        pInstance->port = ( pConfig->port != 0U ) ? pConfig->port : AWS_MQTT_PORT;
+        pInstance->pRootCaPath = ( pConfig->pRootCaPath != NULL ) ? pConfig->pRootCaPath : ROOT_CA_CERT_PATH;
+        pInstance->pClientIdentifier = ( pConfig->pClientIdentifier != NULL ) ? pConfig->pClientIdentifier : CLIENT_IDENTIFIER;
+        pInstance->pClientCertLabel = ( pConfig->pClientCertLabel != NULL ) ?
+                                      pConfig->pClientCertLabel : pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS;
+        pInstance->pPrivateKeyLabel = ( pConfig->pPrivateKeyLabel != NULL ) ?
+                                      pConfig->pPrivateKeyLabel : pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS;
+        pInstance->xNetworkContext.pParams = &( pInstance->tlsContext );
+
+        /* The agent keeps one pending acknowledgment for each in-flight publish. */
+        windowSize = pConfig->inflightWindowSize;
+
+        if( windowSize == 0U )
+        {
+            windowSize = MQTT_AGENT_INFLIGHT_WINDOW_SIZE;
+        }
+
+        if( windowSize > MQTT_AGENT_MAX_OUTSTANDING_ACKS )
+        {
+            LogWarn( ( "In-flight window %u is larger than MQTT_AGENT_MAX_OUTSTANDING_ACKS. Use %u instead.",
+                       ( unsigned int ) windowSize,
+                       ( unsigned int ) MQTT_AGENT_MAX_OUTSTANDING_ACKS ) );
+            windowSize = MQTT_AGENT_MAX_OUTSTANDING_ACKS;
+        }
+
+        pInstance->xCommandQueue.queue = iotshdPal_syncQueueCreate( windowSize + MQTT_AGENT_COMMAND_POOL_HEADROOM,
+                                                                    sizeof( MQTTAgentCommand_t * ) );
+        pInstance->pCredentialSwitchEvent = iotshdPal_syncEventCreate();
+        pInstance->pConnectEvent = iotshdPal_syncEventCreate();
+
+        if( ( pInstance->xCommandQueue.queue == NULL ) || ( pInstance->pCredentialSwitchEvent == NULL ) ||
+            ( pInstance->pConnectEvent == NULL ) ||
+            ( Agent_InitializePool( &( pInstance->xCommandPool ),
+                                    windowSize + MQTT_AGENT_COMMAND_POOL_HEADROOM ) != true ) )
+        {
+            xReturn = MQTTNoMemory;
+        }
+    }
+
+    if( xReturn == MQTTSuccess )
+    {
+        messageInterface.pMsgCtx = &( pInstance->xCommandQueue );
+
+        xFixedBuffer.pBuffer = pInstance->xNetworkBuffer;
+        xFixedBuffer.size = MQTT_AGENT_NETWORK_BUFFER_SIZE;
+
+        /* Fill in Transport Interface send and receive function pointers. */
+        xTransport.pNetworkContext = &( pInstance->xNetworkContext );
+        xTransport.send = Mbedtls_Pkcs11_Send;
+        xTransport.recv = Mbedtls_Pkcs11_Recv;
+        xTransport.writev = Mbedtls_Pkcs11_Writev;
+
+        /* Initialize MQTT library. */
+        xReturn = MQTTAgent_Init( &( pInstance->xMqttAgentContext ),
+                                  &messageInterface,
+                                  &xFixedBuffer,
+                                  &xTransport,
+                                  Clock_GetTimeMs,
+                                  prvIncomingPublishCallback,
+                                  pInstance->xSubscriptionList );
+    }
+
+    if( xReturn == MQTTSuccess )
+    {
+        if( prvInitializeInflightWindow( pInstance, windowSize ) != true )
+        {
+            xReturn = MQTTNoMemory;
+        }
+    }
+
+    if( xReturn == MQTTSuccess )
+    {
+        /* Size the QoS1 state records with the in-flight window. */
+        xReturn = MQTT_InitStatefulQoS( &( pInstance->xMqttAgentContext.mqttContext ),
+                                        pInstance->pOutgoingPublishRecords,
+                                        windowSize,
+                                        pInstance->pIncomingPublishRecords,
+                                        windowSize );
+    }
+
+    if( ( xReturn != MQTTSuccess ) && ( pInstance != NULL ) )
+    {
+        LogError( ( "Failed to create MQTT agent instance with status %s.", MQTT_Status_strerror( xReturn ) ) );
+        iotshdDev_MQTTAgentDeleteInstance( pInstance );
+        pInstance = NULL;
+    }
+
+    return pInstance;
 }
 
 /*-----------------------------------------------------------*/
 
+void iotshdDev_MQTTAgentDeleteInstance( iotshdDev_MQTTAgentInstance_t * pInstance )
+{
+    if( pInstance != NULL )
+    {
+        prvFreeInflightWindow( pInstance );
+
+        if( pInstance->xCommandQueue.queue != NULL )
+        {
+            iotshdPal_syncQueueDelete( pInstance->xCommandQueue.queue );
+            pInstance->xCommandQueue.queue = NULL;
+        }
+
+        Agent_DeletePool( &( pInstance->xCommandPool ) );
+
+        if( pInstance->pCredentialSwitchEvent != NULL )
+        {
+            iotshdPal_syncEventDelete( pInstance->pCredentialSwitchEvent );
+            pInstance->pCredentialSwitchEvent = NULL;
+        }
+
+        if( pInstance->pConnectEvent != NULL )
+        {
+            iotshdPal_syncEventDelete( pInstance->pConnectEvent );
+            pInstance->pConnectEvent = NULL;
+        }
+
+        iotshdPal_Free( pInstance );
+    }
+}
+
+/*-----------------------------------------------------------*/
 
-MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( NetworkContext_t * pNetworkContext,
-                                            const char * pSmarthomeEndpoint,
-                                            CK_SESSION_HANDLE * pxSession )
+void iotshdDev_MQTTAgentSetWaitFunction( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                         iotshdDev_MQTTAgentWaitFunction_t waitFunction,
+                                         void * pWaitContext )
 {
-    bool xNetworkResult;
-    MQTTStatus_t xMQTTStatus = MQTTSuccess, xConnectStatus = MQTTSuccess;
-    MQTTContext_t * pMqttContext = &( xGlobalMqttAgentContext.mqttContext );
+    pInstance->waitFunction = waitFunction;
+    pInstance->pWaitContext = pWaitContext;
+
+    /* The transport keeps the wait function across reconnects. */
+    Mbedtls_Pkcs11_SetWaitFunction( &( pInstance->xNetworkContext ), waitFunction, pWaitContext );
+}
 
-    ( void ) memset( pNetworkContext, 0U, sizeof( NetworkContext_t ) );
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                            CK_SESSION_HANDLE p11Session )
+{
+    MbedtlsPkcs11Status_t xTlsStatus;
+    bool xCredentialsSwitched;
+    MQTTStatus_t xMQTTStatus = MQTTSuccess, xConnectStatus = MQTTSuccess;
+    MQTTContext_t * pMqttContext = &( pInstance->xMqttAgentContext.mqttContext );
+    NetworkContext_t * pNetworkContext = &( pInstance->xNetworkContext );
 
-    xNetworkResult = connectToBrokerWithBackoffRetries( pNetworkContext,
-                                                        pSmarthomeEndpoint,
-                                                        pxSession,
-                                                        pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
-                                                        pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS );
+    xTlsStatus = connectToBrokerWithBackoffRetries( pInstance, p11Session );
     pMqttContext->connectStatus = MQTTNotConnected;
 
     /* MQTT Connect with a persistent session. */
-    xConnectStatus = prvMQTTConnect( true );
+    xConnectStatus = prvMQTTConnect( pInstance, true );
+    prvSetCommandQueueWakeup( pInstance, xConnectStatus );
+
+    /* Only a TLS alert of the broker about the client certificate is reported
+     * as refused. A refused CONNACK comes from a broker that accepted the
+     * certificate, and the other failures may be those of the network, so
+     * they are reported as retryable. */
+    if( xTlsStatus == MBEDTLS_PKCS11_CERTIFICATE_REJECTED )
+    {
+        pInstance->initialConnectStatus = MQTTServerRefused;
+    }
+    else if( xConnectStatus == MQTTServerRefused )
+    {
+        pInstance->initialConnectStatus = MQTTBadResponse;
+    }
+    else
+    {
+        pInstance->initialConnectStatus = xConnectStatus;
+    }
+
+    iotshdPal_syncEventSet( pInstance->pConnectEvent );
 
     do
     {
@@ -338,11 +781,24 @@ MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( NetworkContext_t * pNetworkContext,
          * which could be a disconnect.  If an error occurs the MQTT context on
          * which the error happened is returned so there can be an attempt to
          * clean up and reconnect however the application writer prefers. */
-        xMQTTStatus = MQTTAgent_CommandLoop( &xGlobalMqttAgentContext );
+        xMQTTStatus = MQTTAgent_CommandLoop( &( pInstance->xMqttAgentContext ) );
+        xCredentialsSwitched = false;
 
         /* Success is returned for disconnect or termination. The socket should
          * be disconnected. */
-        if( ( xMQTTStatus == MQTTSuccess ) && ( xGlobalMqttAgentContext.mqttContext.connectStatus == MQTTNotConnected ) )
+        if( ( xMQTTStatus == MQTTSuccess ) && ( pMqttContext->connectStatus == MQTTNotConnected ) &&
+            ( pInstance->credentialSwitchPending == true ) )
+        {
+            /* Disconnected by iotshdDev_MQTTAgentSwitchCredentials(). Reconnect once
+             * with the new credentials and keep serving the instance. A failed
+             * connection is retried by the next command loop error. */
+            ( void ) Mbedtls_Pkcs11_Disconnect( pNetworkContext );
+            pInstance->credentialSwitchPending = false;
+            pInstance->credentialSwitchStatus = prvSwitchCredentials( pInstance, p11Session );
+            iotshdPal_syncEventSet( pInstance->pCredentialSwitchEvent );
+            xCredentialsSwitched = true;
+        }
+        else if( ( xMQTTStatus == MQTTSuccess ) && ( pMqttContext->connectStatus == MQTTNotConnected ) )
         {
             /* MQTT Disconnect. Disconnect the socket. */
             ( void ) Mbedtls_Pkcs11_Disconnect( pNetworkContext );
@@ -350,7 +806,7 @@ MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( NetworkContext_t * pNetworkContext,
         else if( xMQTTStatus == MQTTSuccess )
         {
             /* MQTTAgent_Terminate() was called, but MQTT was not disconnected. */
-            xMQTTStatus = MQTT_Disconnect( &( xGlobalMqttAgentContext.mqttContext ) );
+            xMQTTStatus = MQTT_Disconnect( pMqttContext );
             ( void ) Mbedtls_Pkcs11_Disconnect( pNetworkContext );
         }
         /* Error. */
@@ -358,24 +814,100 @@ MQTTStatus_t iotshdDev_MQTTAgentThreadLoop( NetworkContext_t * pNetworkContext,
         {
             /* Reconnect TCP. */
             ( void ) Mbedtls_Pkcs11_Disconnect( pNetworkContext );
-            xNetworkResult = connectToBrokerWithBackoffRetries( pNetworkContext,
-                                                                pSmarthomeEndpoint,
-                                                                pxSession,
-                                                                pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
-                                                                pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS );
+            ( void ) connectToBrokerWithBackoffRetries( pInstance, p11Session );
             pMqttContext->connectStatus = MQTTNotConnected;
 
             /* MQTT Connect with a persistent session. */
-            xConnectStatus = prvMQTTConnect( false );
+            xConnectStatus = prvMQTTConnect( pInstance, false );
+            prvSetCommandQueueWakeup( pInstance, xConnectStatus );
         }
-    } while( xMQTTStatus != MQTTSuccess );
+    } while( ( xMQTTStatus != MQTTSuccess ) || ( xCredentialsSwitched == true ) );
 
     return MQTTSuccess;
 }
 
-MQTTStatus_t iotshdDev_MQTTAgentStop( void )
+MQTTStatus_t iotshdDev_MQTTAgentStop( iotshdDev_MQTTAgentInstance_t * pInstance )
 {
-    return MQTTSuccess;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+
+    /* The thread loop of the instance returns after the terminate command is processed. */
+    xCommandParams.blockTimeMs = mqttexampleMAX_COMMAND_SEND_BLOCK_TIME_MS;
+
+    Agent_SetCurrentPool( &( pInstance->xCommandPool ) );
+    return MQTTAgent_Terminate( &( pInstance->xMqttAgentContext ), &xCommandParams );
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t iotshdDev_MQTTAgentWaitConnected( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                              uint32_t blockTimeMs )
+{
+    MQTTStatus_t xReturn;
+
+    if( pInstance == NULL )
+    {
+        xReturn = MQTTBadParameter;
+    }
+    else if( iotshdPal_syncEventWait( pInstance->pConnectEvent, blockTimeMs ) != true )
+    {
+        xReturn = MQTTIllegalState;
+    }
+    else
+    {
+        xReturn = pInstance->initialConnectStatus;
+
+        /* Keep the event set for the other callers. */
+        iotshdPal_syncEventSet( pInstance->pConnectEvent );
+    }
+
+    return xReturn;
+}
+
+/*-----------------------------------------------------------*/
+
+MQTTStatus_t iotshdDev_MQTTAgentSwitchCredentials( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                   const char * pClientIdentifier,
+                                                   char * pClientCertLabel,
+                                                   char * pPrivateKeyLabel,
+                                                   uint32_t blockTimeMs )
+{
+    MQTTStatus_t xReturn;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+
+    if( ( pInstance == NULL ) || ( pClientCertLabel == NULL ) || ( pPrivateKeyLabel == NULL ) )
+    {
+        xReturn = MQTTBadParameter;
+    }
+    else
+    {
+        pInstance->pPendingClientIdentifier = pClientIdentifier;
+        pInstance->pPendingClientCertLabel = pClientCertLabel;
+        pInstance->pPendingPrivateKeyLabel = pPrivateKeyLabel;
+        pInstance->credentialSwitchPending = true;
+        ( void ) iotshdPal_syncEventWait( pInstance->pCredentialSwitchEvent, 0 );
+
+        /* The disconnect command ends the command loop. The thread loop then
+         * connects with the new credentials instead of returning. */
+        xCommandParams.blockTimeMs = blockTimeMs;
+        Agent_SetCurrentPool( &( pInstance->xCommandPool ) );
+        xReturn = MQTTAgent_Disconnect( &( pInstance->xMqttAgentContext ), &xCommandParams );
+
+        if( xReturn != MQTTSuccess )
+        {
+            pInstance->credentialSwitchPending = false;
+        }
+        else if( iotshdPal_syncEventWait( pInstance->pCredentialSwitchEvent, blockTimeMs ) != true )
+        {
+            LogError( ( "Timed out waiting for the connection with the new credentials." ) );
+            xReturn = MQTTIllegalState;
+        }
+        else
+        {
+            xReturn = pInstance->credentialSwitchStatus;
+        }
+    }
+
+    return xReturn;
 }
 
 
@@ -402,14 +934,32 @@ iotshdDev_MQTTAgentUserContext_t * iotshdDev_MQTTAgentCreateUserContext( uint32_
                 pUserContext->pFreePublishMessageQueue = iotshdPal_syncQueueCreate( incommingPublishQueueSize, sizeof( iotshdDev_MQTTAgentQueueItem_t * ) );
 
                 pUserContext->pQueueItems = iotshdPal_Malloc( incommingPublishQueueSize * sizeof( iotshdDev_MQTTAgentQueueItem_t ) );
+            }
+        }
+
+        if( ( pUserContext->pSyncEvent == NULL ) ||
+            ( ( incommingPublishQueueSize > 0 ) &&
+              ( ( pUserContext->pIncommingPublishQueue == NULL ) ||
+                ( pUserContext->pFreePublishMessageQueue == NULL ) ||
+                ( pUserContext->pQueueItems == NULL ) ) ) )
+        {
+            LogError( ( "Failed to allocate the user context." ) );
+            iotshdDev_MQTTAgentDeleteUserContext( pUserContext );
+            pUserContext = NULL;
+        }
+        else
+        {
+            if( incommingPublishQueueSize > 0 )
+            {
                 memset( pUserContext->pQueueItems, 0, incommingPublishQueueSize * sizeof( iotshdDev_MQTTAgentQueueItem_t ) );
-                for( i = 0; i < incommingPublishQueueSize; i++ )
-                {
-                    pQueueItem = &pUserContext->pQueueItems[ i ];
-                    iotshdPal_syncQueueSend( pUserContext->pFreePublishMessageQueue,
-                                             &pQueueItem,
-                                             0 );
-                }
+            }
+
+            for( i = 0; i < incommingPublishQueueSize; i++ )
+            {
+                pQueueItem = &pUserContext->pQueueItems[ i ];
+                iotshdPal_syncQueueSend( pUserContext->pFreePublishMessageQueue,
+                                         &pQueueItem,
+                                         0 );
             }
         }
     }
@@ -425,308 +975,590 @@ iotshdDev_MQTTAgentUserContext_t * iotshdDev_MQTTAgentCreateUserContext( uint32_
 void iotshdDev_MQTTAgentDeleteUserContext( iotshdDev_MQTTAgentUserContext_t * pUserContext )
 {
     iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
+    uint32_t i;
+
     if( pUserContext != NULL )
     {
-        if( pUserContext->pSyncEvent != NULL )
+        /* A late SUBACK of subscriptions not waited for must not use the
+         * context. */
+        if( pUserContext->pSubscriptionsCompletion != NULL )
         {
-            iotshdPal_Free( pUserContext->pSyncEvent );
-            pUserContext->pSyncEvent = NULL;
+            ( void ) iotshdDev_MQTTAgentWaitForSubscriptions( pUserContext, 0U );
         }
 
-        if( pUserContext->pFreePublishMessageQueue != NULL )
+        /* The queues only hold pointers to the items. They are emptied before
+         * they are deleted, and the buffers are freed from the items, which
+         * also covers the items dequeued and not given back. */
+        if( pUserContext->pIncommingPublishQueue != NULL )
         {
-            iotshdPal_syncQueueDelete( pUserContext->pFreePublishMessageQueue );
-            while( iotshdPal_syncQueueReceive( pUserContext->pFreePublishMessageQueue, ( void * ) &pQueueItem, 0 ) == true )
+            while( iotshdPal_syncQueueReceive( pUserContext->pIncommingPublishQueue, ( void * ) &pQueueItem, 0 ) == true )
             {
-                iotshdPal_Free( pQueueItem->topicPayloadBuffer );
-                pQueueItem->topicPayloadBuffer = NULL;
-                pQueueItem->topicPayloadBufferSize = 0;
+                /* Empty. */
             }
-            pUserContext->pFreePublishMessageQueue = NULL;
         }
 
-        if( pUserContext->pIncommingPublishQueue != NULL )
+        if( pUserContext->pFreePublishMessageQueue != NULL )
         {
-            iotshdPal_syncQueueDelete( pUserContext->pIncommingPublishQueue );
             while( iotshdPal_syncQueueReceive( pUserContext->pFreePublishMessageQueue, ( void * ) &pQueueItem, 0 ) == true )
             {
-                iotshdPal_Free( pQueueItem->topicPayloadBuffer );
-                pQueueItem->topicPayloadBuffer = NULL;
-                pQueueItem->topicPayloadBufferSize = 0;
+                /* Empty. */
             }
-            pUserContext->pIncommingPublishQueue = NULL;
         }
 
         if( pUserContext->pQueueItems != NULL )
         {
+            for( i = 0; i < pUserContext->queueSize; i++ )
+            {
+                if( pUserContext->pQueueItems[ i ].topicPayloadBuffer != NULL )
+                {
+                    iotshdPal_Free( pUserContext->pQueueItems[ i ].topicPayloadBuffer );
+                    pUserContext->pQueueItems[ i ].topicPayloadBuffer = NULL;
+                    pUserContext->pQueueItems[ i ].topicPayloadBufferSize = 0;
+                }
+            }
+
             iotshdPal_Free( pUserContext->pQueueItems );
             pUserContext->pQueueItems = NULL;
         }
 
+        if( pUserContext->pIncommingPublishQueue != NULL )
+        {
+            iotshdPal_syncQueueDelete( pUserContext->pIncommingPublishQueue );
+            pUserContext->pIncommingPublishQueue = NULL;
+        }
+
+        if( pUserContext->pFreePublishMessageQueue != NULL )
+        {
+            iotshdPal_syncQueueDelete( pUserContext->pFreePublishMessageQueue );
+            pUserContext->pFreePublishMessageQueue = NULL;
+        }
+
+        if( pUserContext->pSyncEvent != NULL )
+        {
+            iotshdPal_syncEventDelete( pUserContext->pSyncEvent );
+            pUserContext->pSyncEvent = NULL;
+        }
+
         iotshdPal_Free( pUserContext );
     }
 }
 
-static void prvAgentPublishCommandCallback( iotshdDev_MQTTAgentUserContext_t * pUserContext,
-                                           MQTTAgentReturnInfo_t * pxReturnInfo )
+/**
+ * @brief Completion of a command waited by the calling thread. The caller can give
+ * up waiting before the agent thread completes the command, so the record is freed
+ * by whichever of the two comes last.
+ */
+typedef struct iotshdDev_MQTTAgentCompletion
+{
+    iotshdPal_SyncEvent_t * pSyncEvent;
+    MQTTStatus_t xReturnStatus;
+    bool completed;
+    bool abandoned;
+} iotshdDev_MQTTAgentCompletion_t;
+
+/**
+ * @brief Protects the hand-off of the completion records.
+ */
+static pthread_mutex_t xCompletionMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static iotshdDev_MQTTAgentCompletion_t * prvCreateCompletion( void )
+{
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+
+    pCompletion = iotshdPal_Malloc( sizeof( iotshdDev_MQTTAgentCompletion_t ) );
+
+    if( pCompletion != NULL )
+    {
+        memset( pCompletion, 0, sizeof( iotshdDev_MQTTAgentCompletion_t ) );
+        pCompletion->xReturnStatus = MQTTIllegalState;
+        pCompletion->pSyncEvent = iotshdPal_syncEventCreate();
+
+        if( pCompletion->pSyncEvent == NULL )
+        {
+            iotshdPal_Free( pCompletion );
+            pCompletion = NULL;
+        }
+    }
+
+    return pCompletion;
+}
+
+static void prvDeleteCompletion( iotshdDev_MQTTAgentCompletion_t * pCompletion )
+{
+    iotshdPal_syncEventDelete( pCompletion->pSyncEvent );
+    iotshdPal_Free( pCompletion );
+}
+
+static void prvSignalCompletion( iotshdDev_MQTTAgentCompletion_t * pCompletion,
+                                 MQTTStatus_t xReturnStatus )
+{
+    bool abandoned;
+
+    pthread_mutex_lock( &xCompletionMutex );
+    abandoned = pCompletion->abandoned;
+
+    if( abandoned == false )
+    {
+        pCompletion->xReturnStatus = xReturnStatus;
+        pCompletion->completed = true;
+        iotshdPal_syncEventSet( pCompletion->pSyncEvent );
+    }
+
+    pthread_mutex_unlock( &xCompletionMutex );
+
+    /* Nobody waits for a command completed after its timeout. */
+    if( abandoned == true )
+    {
+        prvDeleteCompletion( pCompletion );
+    }
+}
+
+static MQTTStatus_t prvWaitCompletion( iotshdDev_MQTTAgentCompletion_t * pCompletion,
+                                       uint32_t blockTimeMs )
 {
-    /* Store the result in the application defined context so the task that
-     * initiated the publish can check the operation's status. */
-    pUserContext->xReturnStatus = pxReturnInfo->returnCode;
+    MQTTStatus_t xReturnStatus;
+    bool completed;
+
+    ( void ) iotshdPal_syncEventWait( pCompletion->pSyncEvent, blockTimeMs );
+
+    pthread_mutex_lock( &xCompletionMutex );
+    completed = pCompletion->completed;
+    xReturnStatus = pCompletion->xReturnStatus;
+
+    /* The agent thread frees the record when the command completes later. */
+    if( completed == false )
+    {
+        pCompletion->abandoned = true;
+    }
+
+    pthread_mutex_unlock( &xCompletionMutex );
 
-    if( pUserContext->pSyncEvent != NULL )
+    if( completed == true )
     {
-        /* Send the context's ulNotificationValue as the notification value so
-         * the receiving task can check the value it set in the context matches
-         * the value it receives in the notification. */
-        iotshdPal_syncEventSet( pUserContext->pSyncEvent );
+        prvDeleteCompletion( pCompletion );
     }
+
+    return xReturnStatus;
 }
 
-MQTTStatus_t iotshdDev_MQTTAgentPublish( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+static void prvAgentPublishCommandCallback( void * pxCommandContext,
+                                            MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    iotshdDev_MQTTAgentPublishSlot_t * pPublishSlot = ( iotshdDev_MQTTAgentPublishSlot_t * ) pxCommandContext;
+    PublishCompleteCallback_t pxPublishCompleteCallback;
+    void * pvPublishCompleteCallbackContext;
+
+    if( pPublishSlot != NULL )
+    {
+        pxPublishCompleteCallback = pPublishSlot->pxPublishCompleteCallback;
+        pvPublishCompleteCallbackContext = pPublishSlot->pvPublishCompleteCallbackContext;
+
+        if( pxReturnInfo->returnCode != MQTTSuccess )
+        {
+            LogError( ( "Publish to topic %.*s failed with status %s.",
+                        pPublishSlot->publishInfo.topicNameLength,
+                        pPublishSlot->publishInfo.pTopicName,
+                        MQTT_Status_strerror( pxReturnInfo->returnCode ) ) );
+        }
+
+        /* Return the slot to the in-flight window before calling back, so that
+         * the callback is able to publish the next message. */
+        pPublishSlot->pxPublishCompleteCallback = NULL;
+        pPublishSlot->pvPublishCompleteCallbackContext = NULL;
+        iotshdPal_syncQueueSend( pPublishSlot->pInstance->pFreePublishSlotQueue, &pPublishSlot, 0U );
+
+        if( pxPublishCompleteCallback != NULL )
+        {
+            pxPublishCompleteCallback( pvPublishCompleteCallbackContext, pxReturnInfo->returnCode );
+        }
+    }
+}
+
+MQTTStatus_t iotshdDev_MQTTAgentPublishAsync( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                              MQTTPublishInfo_t * pPublishInfo,
+                                              PublishCompleteCallback_t pxPublishCompleteCallback,
+                                              void * pvPublishCompleteCallbackContext,
+                                              uint32_t blockTimeMs )
+{
+    MQTTStatus_t xCommandAdded = MQTTSuccess;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    iotshdDev_MQTTAgentPublishSlot_t * pPublishSlot = NULL;
+    uint32_t startTimeMs = Clock_GetTimeMs();
+    uint32_t elapsedTimeMs;
+
+    if( ( pInstance == NULL ) || ( pPublishInfo == NULL ) || ( pInstance->pFreePublishSlotQueue == NULL ) )
+    {
+        xCommandAdded = MQTTBadParameter;
+    }
+    /* Only wait here when the in-flight window is full. */
+    else if( iotshdPal_syncQueueReceive( pInstance->pFreePublishSlotQueue, &pPublishSlot, blockTimeMs ) != true )
+    {
+        LogWarn( ( "In-flight publish window is full." ) );
+        xCommandAdded = MQTTNoMemory;
+    }
+    else if( prvCopyTopicPayload( &pPublishSlot->topicPayloadBuffer,
+                                  &pPublishSlot->topicPayloadBufferSize,
+                                  &pPublishSlot->publishInfo,
+                                  pPublishInfo ) != true )
+    {
+        xCommandAdded = MQTTNoMemory;
+    }
+    else
+    {
+        pPublishSlot->pxPublishCompleteCallback = pxPublishCompleteCallback;
+        pPublishSlot->pvPublishCompleteCallbackContext = pvPublishCompleteCallbackContext;
+
+        /* Spend the remaining block time for the command structure and queue. */
+        elapsedTimeMs = Clock_GetTimeMs() - startTimeMs;
+        xCommandParams.blockTimeMs = ( elapsedTimeMs < blockTimeMs ) ? ( blockTimeMs - elapsedTimeMs ) : 0U;
+        xCommandParams.cmdCompleteCallback = prvAgentPublishCommandCallback;
+        xCommandParams.pCmdCompleteCallbackContext = pPublishSlot;
+
+        Agent_SetCurrentPool( &( pInstance->xCommandPool ) );
+        xCommandAdded = MQTTAgent_Publish( &( pInstance->xMqttAgentContext ),
+                                           &pPublishSlot->publishInfo,
+                                           &xCommandParams );
+    }
+
+    /* Return the slot if the publish is not queued. */
+    if( ( xCommandAdded != MQTTSuccess ) && ( pPublishSlot != NULL ) )
+    {
+        pPublishSlot->pxPublishCompleteCallback = NULL;
+        pPublishSlot->pvPublishCompleteCallbackContext = NULL;
+        iotshdPal_syncQueueSend( pInstance->pFreePublishSlotQueue, &pPublishSlot, 0U );
+    }
+
+    return xCommandAdded;
+}
+
+static void prvAgentPublishSyncCallback( void * pvPublishCompleteCallbackContext,
+                                         MQTTStatus_t xReturnStatus )
+{
+    prvSignalCompletion( ( iotshdDev_MQTTAgentCompletion_t * ) pvPublishCompleteCallbackContext,
+                         xReturnStatus );
+}
+
+MQTTStatus_t iotshdDev_MQTTAgentPublish( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                         iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                          MQTTPublishInfo_t * pPublishInfo,
                                          uint32_t blockTimeMs )
 {
     MQTTStatus_t xCommandAdded;
-    MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    bool retStatus;
-
-    xCommandParams.blockTimeMs = blockTimeMs;
-    xCommandParams.cmdCompleteCallback = prvAgentPublishCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = pUserContext;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion = NULL;
+    uint32_t startTimeMs = Clock_GetTimeMs();
+    uint32_t elapsedTimeMs;
 
-    xCommandAdded = MQTTAgent_Publish( &xGlobalMqttAgentContext,
-                                       pPublishInfo,
-                                       &xCommandParams );
+    if( pUserContext == NULL )
+    {
+        xCommandAdded = MQTTBadParameter;
+    }
+    else
+    {
+        /* The publish has its own completion, so that it does not disturb a
+         * subscription pending on the user context. */
+        pCompletion = prvCreateCompletion();
+        xCommandAdded = ( pCompletion != NULL ) ? MQTTSuccess : MQTTNoMemory;
+    }
 
-    /* Waiting for callback notification. */
     if( xCommandAdded == MQTTSuccess )
     {
-        retStatus = iotshdPal_syncEventWait( pUserContext->pSyncEvent, 1000 );
+        xCommandAdded = iotshdDev_MQTTAgentPublishAsync( pInstance,
+                                                         pPublishInfo,
+                                                         prvAgentPublishSyncCallback,
+                                                         pCompletion,
+                                                         blockTimeMs );
 
-        if( retStatus == true )
+        if( xCommandAdded != MQTTSuccess )
+        {
+            prvDeleteCompletion( pCompletion );
+        }
+        else
         {
-            xCommandAdded = pUserContext->xReturnStatus;
+            /* Waiting for the PUBACK with the remaining block time. */
+            elapsedTimeMs = Clock_GetTimeMs() - startTimeMs;
+            xCommandAdded = prvWaitCompletion( pCompletion,
+                                               ( elapsedTimeMs < blockTimeMs ) ? ( blockTimeMs - elapsedTimeMs ) : 0U );
+
+            if( xCommandAdded == MQTTIllegalState )
+            {
+                LogError( ( "Timed out waiting for the publish to topic %.*s to complete.",
+                            pPublishInfo->topicNameLength,
+                            pPublishInfo->pTopicName ) );
+            }
         }
     }
 
     return xCommandAdded;
 }
 
+/**
+ * @brief Context of a synchronous subscribe or unsubscribe command. It is
+ * allocated for the command and freed by its callback in the agent thread, so
+ * that the command may complete after the caller stopped waiting.
+ */
 typedef struct iotshdDev_MQTTAgentSubscribeContext
 {
-    iotshdDev_MQTTAgentUserContext_t * pUserContext;
-    MQTTAgentSubscribeArgs_t * pxSubscribeArgs;
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+    MQTTAgentSubscribeArgs_t xSubscribeArgs;
+    MQTTSubscribeInfo_t xSubscribeInfo;
 
+    /* Topic filter of the caller, registered in the subscription list. */
     const char * pcTopicFilterString;
-    uint16_t usTopicFilterLength;
 
     IncomingPubCallback_t pxIncomingPublishCallback;
     void * pvIncomingPublishCallbackContext;
 
+    /* The copy of the topic filter sent to the broker follows the context in
+     * the same allocation. */
 } iotshdDev_MQTTAgentSubscribeContext_t;
 
 static void prvAgetSubscribeCommandCallback( void * pxCommandContext,
                                              MQTTAgentReturnInfo_t * pxReturnInfo )
 {
-    bool xSubscriptionAdded = false;
-    iotshdDev_MQTTAgentSubscribeContext_t * pSubscribeContext = ( iotshdDev_MQTTAgentSubscribeContext_t * )pxCommandContext;
-    iotshdDev_MQTTAgentUserContext_t * pUserContext;
-    MQTTAgentSubscribeArgs_t * pxSubscribeArgs;
-    
+    iotshdDev_MQTTAgentSubscribeContext_t * pSubscribeContext = ( iotshdDev_MQTTAgentSubscribeContext_t * ) pxCommandContext;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+    MQTTStatus_t xReturnStatus;
+    bool abandoned;
+
     if( pSubscribeContext != NULL )
     {
-        pUserContext = pSubscribeContext->pUserContext;
-        pxSubscribeArgs = pSubscribeContext->pxSubscribeArgs;
+        pCompletion = pSubscribeContext->pCompletion;
+        xReturnStatus = pxReturnInfo->returnCode;
 
-        /* Store the result in the application defined context so the task that
-         * initiated the subscribe can check the operation's status.  Also send the
-         * status as the notification value.  These things are just done for
-         * demonstration purposes. */
-        pUserContext->xReturnStatus = pxReturnInfo->returnCode;
+        /* The subscription is registered and completed atomically with respect
+         * to the timeout of the waiting thread, after which the callback
+         * context may be deleted. */
+        pthread_mutex_lock( &xCompletionMutex );
+        abandoned = pCompletion->abandoned;
 
-        /* Check if the subscribe operation is a success. Only one topic is
-         * subscribed by this demo. */
-        if( pxReturnInfo->returnCode == MQTTSuccess )
+        if( ( abandoned == false ) && ( xReturnStatus == MQTTSuccess ) )
         {
             /* Add subscription so that incoming publishes are routed to the application
              * callback. */
-            xSubscriptionAdded = addSubscription( xGlobalSubscriptionList,
-                                                  pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
-                                                  pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
-                                                  pSubscribeContext->pxIncomingPublishCallback,
-                                                  pSubscribeContext->pvIncomingPublishCallbackContext );
-
-            if( xSubscriptionAdded == false )
+            if( addSubscription( pSubscribeContext->pInstance->xSubscriptionList,
+                                 pSubscribeContext->pcTopicFilterString,
+                                 pSubscribeContext->xSubscribeInfo.topicFilterLength,
+                                 pSubscribeContext->pxIncomingPublishCallback,
+                                 pSubscribeContext->pvIncomingPublishCallbackContext ) == false )
             {
                 LogError( ( "Failed to register an incoming publish callback for topic %.*s.",
-                            pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
-                            pxSubscribeArgs->pSubscribeInfo->pTopicFilter ) );
+                            pSubscribeContext->xSubscribeInfo.topicFilterLength,
+                            pSubscribeContext->xSubscribeInfo.pTopicFilter ) );
+                xReturnStatus = MQTTNoMemory;
             }
         }
 
-        /* Notify the thread waiting for the response. */
-        iotshdPal_syncEventSet( pUserContext->pSyncEvent );
-    }
-}
-
-MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentUserContext_t * pUserContext,
-                                                 const char * pcTopicFilterString,
-                                                 uint16_t usTopicFilterLength,
-                                                 IncomingPubCallback_t pxIncomingPublishCallback,
-                                                 void * pvIncomingPublishCallbackContext,
-                                                 uint32_t blockTimeMs )
-{
-    /* Subscribe to the topic first. */
-    MQTTStatus_t xCommandAdded;
-    MQTTAgentSubscribeArgs_t xSubscribeArgs;
-    MQTTSubscribeInfo_t xSubscribeInfo;
-    MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    iotshdDev_MQTTAgentSubscribeContext_t xSubscribeContext = { 0 };
-    bool retStatus;
-
-    /* Complete the subscribe information.  The topic string must persist for
-     * duration of subscription! */
-    xSubscribeInfo.pTopicFilter = pcTopicFilterString;
-    xSubscribeInfo.topicFilterLength = ( uint16_t ) strlen( pcTopicFilterString );
-    xSubscribeInfo.qos = MQTTQoS1;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
-
-    xCommandParams.blockTimeMs = blockTimeMs;
-    xCommandParams.cmdCompleteCallback = prvAgetSubscribeCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = &xSubscribeContext;
+        if( abandoned == false )
+        {
+            /* Notify the thread waiting for the response. */
+            pCompletion->xReturnStatus = xReturnStatus;
+            pCompletion->completed = true;
+            iotshdPal_syncEventSet( pCompletion->pSyncEvent );
+        }
 
-    xSubscribeContext.pUserContext = pUserContext;
-    xSubscribeContext.pxSubscribeArgs = &xSubscribeArgs;
-    
-    xSubscribeContext.pcTopicFilterString = pcTopicFilterString;
-    xSubscribeContext.usTopicFilterLength = usTopicFilterLength;
-    
-    xSubscribeContext.pxIncomingPublishCallback = pxIncomingPublishCallback;
-    xSubscribeContext.pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+        pthread_mutex_unlock( &xCompletionMutex );
 
-    xCommandAdded = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
-                                         &xSubscribeArgs,
-                                         &xCommandParams );
-    if( xCommandAdded == MQTTSuccess )
-    {
-        /* Waiting for the command complete. */
-        printf( "command success\r\n" );
-        ( void ) iotshdPal_syncEventWait( pUserContext->pSyncEvent, 0 );
-        retStatus = iotshdPal_syncEventWait( pUserContext->pSyncEvent, blockTimeMs );
-        if( retStatus != true )
+        if( abandoned == true )
         {
-            /* TODO : handle if the callback is not called situation here.
-             * the stack memory should not be used in the callback. */
+            LogWarn( ( "Received the SUBACK of topic %.*s after the wait timed out. "
+                       "Its incoming publishes are not routed.",
+                       pSubscribeContext->xSubscribeInfo.topicFilterLength,
+                       pSubscribeContext->xSubscribeInfo.pTopicFilter ) );
+            prvDeleteCompletion( pCompletion );
         }
-    }
-    else
-    {
-        printf( "Add command fail\r\n" );
-    }
 
-    return xCommandAdded;
+        iotshdPal_Free( pSubscribeContext );
+    }
 }
 
 static void prvAgetUnsubscribeCommandCallback( void * pxCommandContext,
                                                MQTTAgentReturnInfo_t * pxReturnInfo )
 {
-    bool xUnsubscriptionAdded = false;
-    iotshdDev_MQTTAgentSubscribeContext_t * pSubscribeContext = ( iotshdDev_MQTTAgentSubscribeContext_t * )pxCommandContext;
-    iotshdDev_MQTTAgentUserContext_t * pUserContext;
-    MQTTAgentSubscribeArgs_t * pxSubscribeArgs;
-    
+    iotshdDev_MQTTAgentSubscribeContext_t * pSubscribeContext = ( iotshdDev_MQTTAgentSubscribeContext_t * ) pxCommandContext;
+
     if( pSubscribeContext != NULL )
     {
-        pUserContext = pSubscribeContext->pUserContext;
-        pxSubscribeArgs = pSubscribeContext->pxSubscribeArgs;
-
-        /* Store the result in the application defined context so the task that
-         * initiated the subscribe can check the operation's status.  Also send the
-         * status as the notification value.  These things are just done for
-         * demonstration purposes. */
-        pUserContext->xReturnStatus = pxReturnInfo->returnCode;
-
-        /* Check if the subscribe operation is a success. Only one topic is
-         * subscribed by this demo. */
+        /* The subscription is removed even after the wait timed out, so that
+         * no publish is routed to a callback context the caller released. */
         if( pxReturnInfo->returnCode == MQTTSuccess )
         {
-            /* Add subscription so that incoming publishes are routed to the application
-             * callback. */
-            removeSubscription( xGlobalSubscriptionList,
-                                pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
-                                pxSubscribeArgs->pSubscribeInfo->topicFilterLength );
+            removeSubscription( pSubscribeContext->pInstance->xSubscriptionList,
+                                pSubscribeContext->xSubscribeInfo.pTopicFilter,
+                                pSubscribeContext->xSubscribeInfo.topicFilterLength );
         }
 
-        /* Notify the thread waiting for the response. */
-        iotshdPal_syncEventSet( pUserContext->pSyncEvent );
+        prvSignalCompletion( pSubscribeContext->pCompletion, pxReturnInfo->returnCode );
+        iotshdPal_Free( pSubscribeContext );
     }
 }
 
-MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentUserContext_t * pUserContext,
-                                                    const char * pcTopicFilterString,
-                                                    uint16_t usTopicFilterLength,
-                                                    IncomingPubCallback_t pxIncomingPublishCallback,
-                                                    void * pvIncomingPublishCallbackContext,
-                                                    uint32_t blockTimeMs )
+/**
+ * @brief Queue a subscribe or unsubscribe command of one topic filter and wait
+ * for its acknowledgment.
+ */
+static MQTTStatus_t prvSubscriptionCommandSync( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                bool subscribe,
+                                                const char * pcTopicFilterString,
+                                                uint16_t usTopicFilterLength,
+                                                IncomingPubCallback_t pxIncomingPublishCallback,
+                                                void * pvIncomingPublishCallbackContext,
+                                                uint32_t blockTimeMs )
 {
-    /* Unubscribe to the topic first. */
-    MQTTStatus_t xCommandAdded;
-    MQTTAgentSubscribeArgs_t xSubscribeArgs;
-    MQTTSubscribeInfo_t xSubscribeInfo;
+    MQTTStatus_t xCommandAdded = MQTTSuccess;
     MQTTAgentCommandInfo_t xCommandParams = { 0 };
-    iotshdDev_MQTTAgentSubscribeContext_t xSubscribeContext = { 0 };
-    bool retStatus;
-
-    /* Complete the subscribe information.  The topic string must persist for
-     * duration of subscription! */
-    xSubscribeInfo.pTopicFilter = pcTopicFilterString;
-    xSubscribeInfo.topicFilterLength = ( uint16_t ) strlen( pcTopicFilterString );
-    xSubscribeInfo.qos = MQTTQoS1;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
+    iotshdDev_MQTTAgentSubscribeContext_t * pSubscribeContext = NULL;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion = NULL;
+    char * pTopicFilterCopy;
+    uint32_t startTimeMs = Clock_GetTimeMs();
+    uint32_t elapsedTimeMs;
 
-    xCommandParams.blockTimeMs = blockTimeMs;
-    xCommandParams.cmdCompleteCallback = prvAgetUnsubscribeCommandCallback;
-    xCommandParams.pCmdCompleteCallbackContext = &xSubscribeContext;
+    if( ( pInstance == NULL ) || ( pcTopicFilterString == NULL ) || ( usTopicFilterLength == 0U ) )
+    {
+        xCommandAdded = MQTTBadParameter;
+    }
+    else
+    {
+        pSubscribeContext = iotshdPal_Malloc( sizeof( iotshdDev_MQTTAgentSubscribeContext_t ) + usTopicFilterLength );
+        pCompletion = prvCreateCompletion();
 
-    xSubscribeContext.pUserContext = pUserContext;
-    xSubscribeContext.pxSubscribeArgs = &xSubscribeArgs;
-    
-    xSubscribeContext.pcTopicFilterString = pcTopicFilterString;
-    xSubscribeContext.usTopicFilterLength = usTopicFilterLength;
-    
-    xSubscribeContext.pxIncomingPublishCallback = pxIncomingPublishCallback;
-    xSubscribeContext.pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+        if( ( pSubscribeContext == NULL ) || ( pCompletion == NULL ) )
+        {
+            xCommandAdded = MQTTNoMemory;
+        }
+    }
 
-    xCommandAdded = MQTTAgent_Unsubscribe( &xGlobalMqttAgentContext,
-                                           &xSubscribeArgs,
-                                           &xCommandParams );
     if( xCommandAdded == MQTTSuccess )
     {
-        /* Waiting for the command complete. */
-        ( void ) iotshdPal_syncEventWait( pUserContext->pSyncEvent, 0 );
-        retStatus = iotshdPal_syncEventWait( pUserContext->pSyncEvent, blockTimeMs );
-        if( retStatus != true )
+        memset( pSubscribeContext, 0, sizeof( iotshdDev_MQTTAgentSubscribeContext_t ) );
+        pTopicFilterCopy = ( char * ) ( pSubscribeContext + 1 );
+        memcpy( pTopicFilterCopy, pcTopicFilterString, usTopicFilterLength );
+
+        pSubscribeContext->pInstance = pInstance;
+        pSubscribeContext->pCompletion = pCompletion;
+        pSubscribeContext->pcTopicFilterString = pcTopicFilterString;
+        pSubscribeContext->pxIncomingPublishCallback = pxIncomingPublishCallback;
+        pSubscribeContext->pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+
+        pSubscribeContext->xSubscribeInfo.pTopicFilter = pTopicFilterCopy;
+        pSubscribeContext->xSubscribeInfo.topicFilterLength = usTopicFilterLength;
+        pSubscribeContext->xSubscribeInfo.qos = MQTTQoS1;
+        pSubscribeContext->xSubscribeArgs.pSubscribeInfo = &( pSubscribeContext->xSubscribeInfo );
+        pSubscribeContext->xSubscribeArgs.numSubscriptions = 1;
+
+        xCommandParams.blockTimeMs = blockTimeMs;
+        xCommandParams.cmdCompleteCallback = ( subscribe == true ) ? prvAgetSubscribeCommandCallback :
+                                             prvAgetUnsubscribeCommandCallback;
+        xCommandParams.pCmdCompleteCallbackContext = pSubscribeContext;
+
+        Agent_SetCurrentPool( &( pInstance->xCommandPool ) );
+
+        if( subscribe == true )
+        {
+            xCommandAdded = MQTTAgent_Subscribe( &( pInstance->xMqttAgentContext ),
+                                                 &( pSubscribeContext->xSubscribeArgs ),
+                                                 &xCommandParams );
+        }
+        else
         {
-            /* TODO : handle if the callback is not called situation here.
-             * the stack memory should not be used in the callback. */
+            xCommandAdded = MQTTAgent_Unsubscribe( &( pInstance->xMqttAgentContext ),
+                                                   &( pSubscribeContext->xSubscribeArgs ),
+                                                   &xCommandParams );
+        }
+
+        if( xCommandAdded != MQTTSuccess )
+        {
+            LogError( ( "Failed to queue the %s command of topic %.*s with status %s.",
+                        ( subscribe == true ) ? "subscribe" : "unsubscribe",
+                        usTopicFilterLength,
+                        pcTopicFilterString,
+                        MQTT_Status_strerror( xCommandAdded ) ) );
+        }
+    }
+
+    if( xCommandAdded != MQTTSuccess )
+    {
+        if( pSubscribeContext != NULL )
+        {
+            iotshdPal_Free( pSubscribeContext );
+        }
+
+        if( pCompletion != NULL )
+        {
+            prvDeleteCompletion( pCompletion );
         }
     }
     else
     {
-        printf( "Add command fail\r\n" );
+        LogDebug( ( "Queued the %s command of topic %.*s.",
+                    ( subscribe == true ) ? "subscribe" : "unsubscribe",
+                    usTopicFilterLength,
+                    pcTopicFilterString ) );
+
+        /* Waiting for the acknowledgment with the remaining block time. The
+         * record is freed by the wait or, after a timeout, by the callback. */
+        elapsedTimeMs = Clock_GetTimeMs() - startTimeMs;
+        xCommandAdded = prvWaitCompletion( pCompletion,
+                                           ( elapsedTimeMs < blockTimeMs ) ? ( blockTimeMs - elapsedTimeMs ) : 0U );
+
+        if( xCommandAdded == MQTTIllegalState )
+        {
+            LogError( ( "Timed out waiting for the %s of topic %.*s to complete.",
+                        ( subscribe == true ) ? "subscribe" : "unsubscribe",
+                        usTopicFilterLength,
+                        pcTopicFilterString ) );
+        }
+    }
+
+    if( pUserContext != NULL )
+    {
+        pUserContext->xReturnStatus = xCommandAdded;
     }
 
     return xCommandAdded;
 }
 
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscription( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                 iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                 const char * pcTopicFilterString,
+                                                 uint16_t usTopicFilterLength,
+                                                 IncomingPubCallback_t pxIncomingPublishCallback,
+                                                 void * pvIncomingPublishCallbackContext,
+                                                 uint32_t blockTimeMs )
+{
+    return prvSubscriptionCommandSync( pInstance,
+                                       pUserContext,
+                                       true,
+                                       pcTopicFilterString,
+                                       usTopicFilterLength,
+                                       pxIncomingPublishCallback,
+                                       pvIncomingPublishCallbackContext,
+                                       blockTimeMs );
+}
+
+MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscription( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                    iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                    const char * pcTopicFilterString,
+                                                    uint16_t usTopicFilterLength,
+                                                    IncomingPubCallback_t pxIncomingPublishCallback,
+                                                    void * pvIncomingPublishCallbackContext,
+                                                    uint32_t blockTimeMs )
+{
+    return prvSubscriptionCommandSync( pInstance,
+                                       pUserContext,
+                                       false,
+                                       pcTopicFilterString,
+                                       usTopicFilterLength,
+                                       pxIncomingPublishCallback,
+                                       pvIncomingPublishCallbackContext,
+                                       blockTimeMs );
+}
+
 void mqttAgentEnqueuePublishCallback( void * pCallbackContext, MQTTPublishInfo_t * pPublsihInfo )
 {
     iotshdDev_MQTTAgentUserContext_t * pUserContext = ( iotshdDev_MQTTAgentUserContext_t * ) pCallbackContext;
     iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
-    size_t requiredTopicPayloadSize = 0;
     bool retStatus;
 
     /* Get the free slot from free incoming publish queue. */
@@ -734,50 +1566,32 @@ void mqttAgentEnqueuePublishCallback( void * pCallbackContext, MQTTPublishInfo_t
     
     if( retStatus == true )
     {
-        /* Dup the publish info structure. */
-        memcpy( &pQueueItem->publishInfo, pPublsihInfo, sizeof( MQTTPublishInfo_t ) );
-
-        /* Calcualte required topic payload size. */
-        requiredTopicPayloadSize = pPublsihInfo->topicNameLength + 1U + pPublsihInfo->payloadLength + 1U;
-
-        if( pQueueItem->topicPayloadBuffer != NULL )
+        if( prvCopyTopicPayload( &pQueueItem->topicPayloadBuffer,
+                                 &pQueueItem->topicPayloadBufferSize,
+                                 &pQueueItem->publishInfo,
+                                 pPublsihInfo ) == true )
         {
-            if( pQueueItem->topicPayloadBufferSize < requiredTopicPayloadSize )
-            {
-                /* The buffer size is not enough. Re-allocate a new buffer. */
-                iotshdPal_Free( pQueueItem->topicPayloadBuffer );
-                pQueueItem->topicPayloadBuffer = NULL;
-                pQueueItem->topicPayloadBufferSize = 0;
-            }
+            /* Enqueue the incomming publish. */
+            iotshdPal_syncQueueSend( pUserContext->pIncommingPublishQueue, &pQueueItem, 0U );
         }
-
-        if( pQueueItem->topicPayloadBuffer == NULL )
+        else
         {
-            pQueueItem->topicPayloadBuffer = iotshdPal_Malloc( requiredTopicPayloadSize );
-            pQueueItem->topicPayloadBufferSize = requiredTopicPayloadSize;
+            LogError( ( "Failed to allocate buffer for incoming publish on topic %.*s.",
+                        pPublsihInfo->topicNameLength,
+                        pPublsihInfo->pTopicName ) );
+            iotshdPal_syncQueueSend( pUserContext->pFreePublishMessageQueue, &pQueueItem, 0U );
         }
-
-        memcpy( pQueueItem->topicPayloadBuffer, pPublsihInfo->pTopicName, pPublsihInfo->topicNameLength );
-        pQueueItem->topicPayloadBuffer[ pPublsihInfo->topicNameLength ] = '\0';
-        pQueueItem->publishInfo.pTopicName = ( char * )pQueueItem->topicPayloadBuffer;
-
-        memcpy( &( pQueueItem->topicPayloadBuffer[ pPublsihInfo->topicNameLength + 1U ] ),
-                pPublsihInfo->pPayload,
-                pPublsihInfo->payloadLength );
-        pQueueItem->topicPayloadBuffer[ pPublsihInfo->topicNameLength + 1U + pPublsihInfo->payloadLength ] = '\0';
-        pQueueItem->publishInfo.pPayload = ( char * )( &pQueueItem->topicPayloadBuffer[ pPublsihInfo->topicNameLength + 1U ] );
-
-        /* Enqueue the incomming publish. */
-        iotshdPal_syncQueueSend( pUserContext->pIncommingPublishQueue, &pQueueItem, 0U );
     }
 }
 
-MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionWithQueue( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                          iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                   const char * pcTopicFilterString,
                                                   uint16_t usTopicFilterLength,
                                                   uint32_t blockTimeMs )
 {
-    return iotshdDev_MQTTAgentAddSubscription( pUserContext,
+    return iotshdDev_MQTTAgentAddSubscription( pInstance,
+                                               pUserContext,
                                                pcTopicFilterString,
                                                usTopicFilterLength,
                                                mqttAgentEnqueuePublishCallback,
@@ -812,15 +1626,236 @@ void iotshdDev_MQTTAgentFreeIncommingPublish( iotshdDev_MQTTAgentUserContext_t *
     iotshdPal_syncQueueSend( pUserContext->pFreePublishMessageQueue, &pQueueItem, 0 );
 }
 
-MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+MQTTStatus_t iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                             iotshdDev_MQTTAgentUserContext_t * pUserContext,
                                                              const char * pcTopicFilterString,
                                                              uint16_t usTopicFilterLength,
                                                              uint32_t blockTimeMs )
 {
-    return iotshdDev_MQTTAgentRemoveSubscription( pUserContext,
+    return iotshdDev_MQTTAgentRemoveSubscription( pInstance,
+                                                  pUserContext,
                                                   pcTopicFilterString,
                                                   usTopicFilterLength,
                                                   mqttAgentEnqueuePublishCallback,
                                                   pUserContext,
                                                   blockTimeMs );
 }
+
+typedef struct iotshdDev_MQTTAgentSubscriptionsContext
+{
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    iotshdDev_MQTTAgentUserContext_t * pUserContext;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+    MQTTAgentSubscribeArgs_t xSubscribeArgs;
+
+    /* Topic filters of the caller, registered in the subscription list. */
+    const char ** ppTopicFilters;
+
+    /* The subscribe information, the topic filters of the caller and the
+     * copies of the topic filters follow the context in the same allocation. */
+} iotshdDev_MQTTAgentSubscriptionsContext_t;
+
+static void prvAgentSubscriptionsCommandCallback( void * pxCommandContext,
+                                                  MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    iotshdDev_MQTTAgentSubscriptionsContext_t * pSubscriptionsContext = ( iotshdDev_MQTTAgentSubscriptionsContext_t * ) pxCommandContext;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+    MQTTSubscribeInfo_t * pSubscribeInfo;
+    MQTTStatus_t xReturnStatus;
+    bool abandoned;
+    size_t i;
+
+    if( pSubscriptionsContext != NULL )
+    {
+        pCompletion = pSubscriptionsContext->pCompletion;
+        pSubscribeInfo = pSubscriptionsContext->xSubscribeArgs.pSubscribeInfo;
+        xReturnStatus = pxReturnInfo->returnCode;
+
+        /* The subscriptions are registered and completed atomically with
+         * respect to the timeout of the waiting thread, after which the user
+         * context may be deleted. */
+        pthread_mutex_lock( &xCompletionMutex );
+        abandoned = pCompletion->abandoned;
+
+        /* The SUBACK is reported as refused if any of the filters is refused.
+         * The accepted filters are still registered. */
+        if( ( abandoned == false ) &&
+            ( ( xReturnStatus == MQTTSuccess ) || ( xReturnStatus == MQTTServerRefused ) ) &&
+            ( pxReturnInfo->pSubackCodes != NULL ) )
+        {
+            for( i = 0; i < pSubscriptionsContext->xSubscribeArgs.numSubscriptions; i++ )
+            {
+                if( pxReturnInfo->pSubackCodes[ i ] == MQTTSubAckFailure )
+                {
+                    LogError( ( "Subscription to topic %.*s is refused.",
+                                pSubscribeInfo[ i ].topicFilterLength,
+                                pSubscribeInfo[ i ].pTopicFilter ) );
+                }
+                else if( addSubscription( pSubscriptionsContext->pInstance->xSubscriptionList,
+                                          pSubscriptionsContext->ppTopicFilters[ i ],
+                                          pSubscribeInfo[ i ].topicFilterLength,
+                                          mqttAgentEnqueuePublishCallback,
+                                          pSubscriptionsContext->pUserContext ) == false )
+                {
+                    LogError( ( "Failed to register an incoming publish callback for topic %.*s.",
+                                pSubscribeInfo[ i ].topicFilterLength,
+                                pSubscribeInfo[ i ].pTopicFilter ) );
+                    xReturnStatus = MQTTNoMemory;
+                }
+            }
+        }
+
+        if( abandoned == false )
+        {
+            /* Notify the thread waiting for the response. */
+            pCompletion->xReturnStatus = xReturnStatus;
+            pCompletion->completed = true;
+            iotshdPal_syncEventSet( pCompletion->pSyncEvent );
+        }
+
+        pthread_mutex_unlock( &xCompletionMutex );
+
+        if( abandoned == true )
+        {
+            LogWarn( ( "Received the SUBACK of %lu topic filters after the wait timed out. "
+                       "Their incoming publishes are not routed.",
+                       ( unsigned long ) pSubscriptionsContext->xSubscribeArgs.numSubscriptions ) );
+            prvDeleteCompletion( pCompletion );
+        }
+
+        iotshdPal_Free( pSubscriptionsContext );
+    }
+}
+
+MQTTStatus_t iotshdDev_MQTTAgentAddSubscriptionsWithQueueAsync( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                                                iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                                const MQTTSubscribeInfo_t * pSubscribeInfo,
+                                                                size_t numSubscriptions,
+                                                                uint32_t blockTimeMs )
+{
+    MQTTStatus_t xCommandAdded = MQTTSuccess;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    iotshdDev_MQTTAgentSubscriptionsContext_t * pSubscriptionsContext = NULL;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion = NULL;
+    MQTTSubscribeInfo_t * pSubscribeInfoCopy;
+    char * pTopicFilterCopy;
+    size_t topicFiltersLength = 0U;
+    size_t i;
+
+    if( ( pInstance == NULL ) || ( pUserContext == NULL ) ||
+        ( pSubscribeInfo == NULL ) || ( numSubscriptions == 0U ) )
+    {
+        xCommandAdded = MQTTBadParameter;
+    }
+    else
+    {
+        /* Discard the result of previous subscriptions that was not waited
+         * for. */
+        if( pUserContext->pSubscriptionsCompletion != NULL )
+        {
+            ( void ) iotshdDev_MQTTAgentWaitForSubscriptions( pUserContext, 0U );
+        }
+
+        for( i = 0; i < numSubscriptions; i++ )
+        {
+            topicFiltersLength += pSubscribeInfo[ i ].topicFilterLength;
+        }
+
+        /* The command completes in the agent thread after this function
+         * returns, so the subscribe information and the topic filters are
+         * kept with the context. */
+        pSubscriptionsContext = iotshdPal_Malloc( sizeof( iotshdDev_MQTTAgentSubscriptionsContext_t ) +
+                                                  ( numSubscriptions * sizeof( MQTTSubscribeInfo_t ) ) +
+                                                  ( numSubscriptions * sizeof( const char * ) ) +
+                                                  topicFiltersLength );
+        pCompletion = prvCreateCompletion();
+
+        if( ( pSubscriptionsContext == NULL ) || ( pCompletion == NULL ) )
+        {
+            xCommandAdded = MQTTNoMemory;
+        }
+    }
+
+    if( xCommandAdded == MQTTSuccess )
+    {
+        pSubscribeInfoCopy = ( MQTTSubscribeInfo_t * ) ( pSubscriptionsContext + 1 );
+        pSubscriptionsContext->ppTopicFilters = ( const char ** ) ( pSubscribeInfoCopy + numSubscriptions );
+        pTopicFilterCopy = ( char * ) ( pSubscriptionsContext->ppTopicFilters + numSubscriptions );
+
+        for( i = 0; i < numSubscriptions; i++ )
+        {
+            pSubscribeInfoCopy[ i ] = pSubscribeInfo[ i ];
+            pSubscribeInfoCopy[ i ].pTopicFilter = pTopicFilterCopy;
+            pSubscriptionsContext->ppTopicFilters[ i ] = pSubscribeInfo[ i ].pTopicFilter;
+            memcpy( pTopicFilterCopy, pSubscribeInfo[ i ].pTopicFilter, pSubscribeInfo[ i ].topicFilterLength );
+            pTopicFilterCopy += pSubscribeInfo[ i ].topicFilterLength;
+        }
+
+        pSubscriptionsContext->pInstance = pInstance;
+        pSubscriptionsContext->pUserContext = pUserContext;
+        pSubscriptionsContext->pCompletion = pCompletion;
+        pSubscriptionsContext->xSubscribeArgs.pSubscribeInfo = pSubscribeInfoCopy;
+        pSubscriptionsContext->xSubscribeArgs.numSubscriptions = numSubscriptions;
+
+        xCommandParams.blockTimeMs = blockTimeMs;
+        xCommandParams.cmdCompleteCallback = prvAgentSubscriptionsCommandCallback;
+        xCommandParams.pCmdCompleteCallbackContext = pSubscriptionsContext;
+
+        Agent_SetCurrentPool( &( pInstance->xCommandPool ) );
+        xCommandAdded = MQTTAgent_Subscribe( &( pInstance->xMqttAgentContext ),
+                                             &( pSubscriptionsContext->xSubscribeArgs ),
+                                             &xCommandParams );
+
+        if( xCommandAdded == MQTTSuccess )
+        {
+            pUserContext->pSubscriptionsCompletion = pCompletion;
+        }
+    }
+
+    if( xCommandAdded != MQTTSuccess )
+    {
+        if( pSubscriptionsContext != NULL )
+        {
+            iotshdPal_Free( pSubscriptionsContext );
+        }
+
+        if( pCompletion != NULL )
+        {
+            prvDeleteCompletion( pCompletion );
+        }
+    }
+
+    return xCommandAdded;
+}
+
+MQTTStatus_t iotshdDev_MQTTAgentWaitForSubscriptions( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                                                      uint32_t blockTimeMs )
+{
+    MQTTStatus_t xReturnStatus = MQTTIllegalState;
+    iotshdDev_MQTTAgentCompletion_t * pCompletion;
+
+    if( pUserContext == NULL )
+    {
+        xReturnStatus = MQTTBadParameter;
+    }
+    else if( pUserContext->pSubscriptionsCompletion == NULL )
+    {
+        LogError( ( "No subscriptions are pending." ) );
+    }
+    else
+    {
+        /* The record is freed by the wait or, after a timeout, by the late
+         * SUBACK, so it is only waited once. */
+        pCompletion = pUserContext->pSubscriptionsCompletion;
+        pUserContext->pSubscriptionsCompletion = NULL;
+        xReturnStatus = prvWaitCompletion( pCompletion, blockTimeMs );
+
+        /* A wait of zero only discards the result. */
+        if( ( xReturnStatus == MQTTIllegalState ) && ( blockTimeMs > 0U ) )
+        {
+            LogError( ( "Timed out waiting for the SUBACK." ) );
+        }
+    }
+
+    return xReturnStatus;
+}
@@ -0,0 +1,658 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "mqtt_agent_scheduler.h"
+
+#include "demo_config.h"
+
+/* Clock for timer. */
+#include "clock.h"
+
+/*-----------------------------------------------------------*/
+
+#define iotshdPal_Malloc     malloc
+#define iotshdPal_Realloc    realloc
+#define iotshdPal_Free       free
+
+/**
+ * @brief Number of task slots added when the slot array is full.
+ */
+#define SCHEDULER_SLOT_INCREMENT    ( 64U )
+
+/**
+ * @brief Epoll data of the scheduler wakeup file descriptor. Task events carry the
+ * slot index and generation of the task, see #prvMakeEventData.
+ */
+#define SCHEDULER_WAKEUP_EVENT      ( UINT64_MAX )
+
+/*-----------------------------------------------------------*/
+
+typedef enum SchedulerTaskState
+{
+    SCHEDULER_TASK_READY = 0,
+    SCHEDULER_TASK_WAITING,
+    SCHEDULER_TASK_FINISHED
+} SchedulerTaskState_t;
+
+/**
+ * @brief The thread loop of an instance served by the scheduler. It runs on its
+ * own stack and returns to the scheduler whenever it waits.
+ */
+typedef struct SchedulerTask
+{
+    ucontext_t context;
+    uint8_t * pStack;
+    iotshdDev_MQTTAgentScheduler_t * pScheduler;
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    CK_SESSION_HANDLE p11Session;
+
+    SchedulerTaskState_t state;
+    bool hasDeadline;
+    uint32_t deadlineMs;
+
+    uint32_t slotIndex;
+    struct SchedulerTask * pNextPending;
+} SchedulerTask_t;
+
+/**
+ * @brief A task slot. Readiness events identify a task by its slot index and the
+ * generation of the slot, so that an event registered by a finished task is
+ * ignored instead of resuming a freed task.
+ */
+typedef struct SchedulerSlot
+{
+    SchedulerTask_t * pTask;
+    uint32_t generation;
+} SchedulerSlot_t;
+
+struct iotshdDev_MQTTAgentScheduler
+{
+    int epollFd;
+    int wakeupFd;
+    uint32_t stackSize;
+    size_t pageSize;
+    ucontext_t context;
+
+    /* Only accessed by the scheduler thread. */
+    SchedulerSlot_t * pSlots;
+    uint32_t slotCount;
+    uint32_t taskCount;
+
+    /* Shared with the threads adding tasks or stopping the scheduler. */
+    pthread_mutex_t mutex;
+    SchedulerTask_t * pPendingTasks;
+    bool stopRequested;
+};
+
+/**
+ * @brief Function switching between the schedulers and their tasks, see
+ * #iotshdDev_MQTTAgentSchedulerSetSwapFunction.
+ */
+static iotshdDev_MQTTAgentSchedulerSwapFunction_t schedulerSwapFunction = swapcontext;
+
+/*-----------------------------------------------------------*/
+
+static uint64_t prvMakeEventData( const SchedulerTask_t * pTask )
+{
+    return ( ( uint64_t ) pTask->pScheduler->pSlots[ pTask->slotIndex ].generation << 32 ) |
+           ( uint64_t ) pTask->slotIndex;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRegisterFd( SchedulerTask_t * pTask,
+                           const struct pollfd * pPollFd )
+{
+    struct epoll_event event;
+    int epollFd = pTask->pScheduler->epollFd;
+    int ret;
+
+    memset( &event, 0, sizeof( event ) );
+    event.events = EPOLLONESHOT;
+    event.events |= ( ( pPollFd->events & POLLIN ) != 0 ) ? EPOLLIN : 0U;
+    event.events |= ( ( pPollFd->events & POLLOUT ) != 0 ) ? EPOLLOUT : 0U;
+    event.data.u64 = prvMakeEventData( pTask );
+
+    /* A file descriptor stays in the epoll set until it is closed, so it is only
+     * added the first time it is waited for. */
+    ret = epoll_ctl( epollFd, EPOLL_CTL_MOD, pPollFd->fd, &event );
+
+    if( ( ret != 0 ) && ( errno == ENOENT ) )
+    {
+        ret = epoll_ctl( epollFd, EPOLL_CTL_ADD, pPollFd->fd, &event );
+    }
+
+    if( ret != 0 )
+    {
+        LogError( ( "Failed to wait for file descriptor %d with errno %d.", pPollFd->fd, errno ) );
+    }
+
+    return ( ret == 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+static int prvTaskWait( void * pWaitContext,
+                        struct pollfd * pPollFds,
+                        nfds_t pollFdCount,
+                        int timeoutMs )
+{
+    SchedulerTask_t * pTask = ( SchedulerTask_t * ) pWaitContext;
+    uint32_t deadlineMs = Clock_GetTimeMs() + ( uint32_t ) timeoutMs;
+    int readyCount = 0;
+    bool waiting = ( timeoutMs != 0 );
+    nfds_t i;
+
+    while( waiting == true )
+    {
+        for( i = 0U; i < pollFdCount; i++ )
+        {
+            if( prvRegisterFd( pTask, &pPollFds[ i ] ) != true )
+            {
+                readyCount = -1;
+                waiting = false;
+                break;
+            }
+        }
+
+        if( waiting == true )
+        {
+            /* Return to the scheduler until an event or the deadline. */
+            pTask->state = SCHEDULER_TASK_WAITING;
+            pTask->hasDeadline = ( timeoutMs >= 0 );
+            pTask->deadlineMs = deadlineMs;
+            ( void ) schedulerSwapFunction( &pTask->context, &pTask->pScheduler->context );
+
+            /* Events of an earlier wait can resume the task, so the readiness is
+             * checked here. */
+            if( pollFdCount > 0U )
+            {
+                readyCount = poll( pPollFds, pollFdCount, 0 );
+            }
+
+            if( ( readyCount != 0 ) ||
+                ( ( timeoutMs >= 0 ) && ( ( int32_t ) ( Clock_GetTimeMs() - deadlineMs ) >= 0 ) ) )
+            {
+                waiting = false;
+            }
+        }
+    }
+
+    if( ( timeoutMs == 0 ) && ( pollFdCount > 0U ) )
+    {
+        readyCount = poll( pPollFds, pollFdCount, 0 );
+    }
+
+    return readyCount;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvTaskEntry( unsigned int taskLow,
+                          unsigned int taskHigh )
+{
+    /* makecontext only passes int arguments, so the task pointer is split. */
+    SchedulerTask_t * pTask = ( SchedulerTask_t * ) ( ( ( ( uintptr_t ) taskHigh << 16 ) << 16 ) | ( uintptr_t ) taskLow );
+
+    ( void ) iotshdDev_MQTTAgentThreadLoop( pTask->pInstance, pTask->p11Session );
+
+    /* Returning resumes the scheduler through uc_link. */
+    pTask->state = SCHEDULER_TASK_FINISHED;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvAllocateSlot( iotshdDev_MQTTAgentScheduler_t * pScheduler,
+                             SchedulerTask_t * pTask )
+{
+    SchedulerSlot_t * pSlots;
+    uint32_t i;
+    bool retStatus = false;
+
+    for( i = 0U; i < pScheduler->slotCount; i++ )
+    {
+        if( pScheduler->pSlots[ i ].pTask == NULL )
+        {
+            break;
+        }
+    }
+
+    if( i == pScheduler->slotCount )
+    {
+        pSlots = iotshdPal_Realloc( pScheduler->pSlots,
+                                    ( pScheduler->slotCount + SCHEDULER_SLOT_INCREMENT ) * sizeof( SchedulerSlot_t ) );
+
+        if( pSlots != NULL )
+        {
+            memset( &pSlots[ pScheduler->slotCount ], 0, SCHEDULER_SLOT_INCREMENT * sizeof( SchedulerSlot_t ) );
+            pScheduler->pSlots = pSlots;
+            pScheduler->slotCount = pScheduler->slotCount + SCHEDULER_SLOT_INCREMENT;
+        }
+    }
+
+    if( i < pScheduler->slotCount )
+    {
+        pScheduler->pSlots[ i ].pTask = pTask;
+        pTask->slotIndex = i;
+        retStatus = true;
+    }
+
+    return retStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint8_t * prvAllocateStack( const iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    void * pMapping;
+    uint8_t * pStack = NULL;
+
+    /* The pages are only committed when the task touches them, and the guard page
+     * below the stack stops an overflow instead of corrupting the heap. */
+    pMapping = mmap( NULL,
+                     pScheduler->pageSize + pScheduler->stackSize,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                     -1,
+                     0 );
+
+    if( pMapping != MAP_FAILED )
+    {
+        pStack = ( uint8_t * ) pMapping;
+
+        if( mprotect( pStack, pScheduler->pageSize, PROT_NONE ) != 0 )
+        {
+            ( void ) munmap( pStack, pScheduler->pageSize + pScheduler->stackSize );
+            pStack = NULL;
+        }
+    }
+
+    return pStack;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvFreeTask( SchedulerTask_t * pTask )
+{
+    if( pTask->pStack != NULL )
+    {
+        ( void ) munmap( pTask->pStack, pTask->pScheduler->pageSize + pTask->pScheduler->stackSize );
+    }
+
+    iotshdPal_Free( pTask );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvStartPendingTasks( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    SchedulerTask_t * pTask;
+    SchedulerTask_t * pNextTask;
+
+    pthread_mutex_lock( &pScheduler->mutex );
+    pTask = pScheduler->pPendingTasks;
+    pScheduler->pPendingTasks = NULL;
+    pthread_mutex_unlock( &pScheduler->mutex );
+
+    while( pTask != NULL )
+    {
+        pNextTask = pTask->pNextPending;
+
+        if( prvAllocateSlot( pScheduler, pTask ) != true )
+        {
+            LogError( ( "Failed to allocate a scheduler slot. The instance is not served." ) );
+            iotshdDev_MQTTAgentSetWaitFunction( pTask->pInstance, NULL, NULL );
+            prvFreeTask( pTask );
+        }
+        else
+        {
+            ( void ) getcontext( &pTask->context );
+            pTask->context.uc_stack.ss_sp = pTask->pStack + pScheduler->pageSize;
+            pTask->context.uc_stack.ss_size = pScheduler->stackSize;
+            pTask->context.uc_link = &pScheduler->context;
+            makecontext( &pTask->context,
+                         ( void ( * )( void ) ) prvTaskEntry,
+                         2,
+                         ( unsigned int ) ( ( uintptr_t ) pTask & 0xFFFFFFFFU ),
+                         ( unsigned int ) ( ( ( uintptr_t ) pTask >> 16 ) >> 16 ) );
+            pTask->state = SCHEDULER_TASK_READY;
+            pScheduler->taskCount++;
+        }
+
+        pTask = pNextTask;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRunReadyTasks( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    SchedulerTask_t * pTask;
+    uint32_t i;
+
+    for( i = 0U; i < pScheduler->slotCount; i++ )
+    {
+        pTask = pScheduler->pSlots[ i ].pTask;
+
+        if( ( pTask != NULL ) && ( pTask->state == SCHEDULER_TASK_READY ) )
+        {
+            /* The task runs until it waits or its thread loop returns. */
+            ( void ) schedulerSwapFunction( &pScheduler->context, &pTask->context );
+
+            if( pTask->state == SCHEDULER_TASK_FINISHED )
+            {
+                /* The instance can be served by a thread again. */
+                iotshdDev_MQTTAgentSetWaitFunction( pTask->pInstance, NULL, NULL );
+                pScheduler->pSlots[ i ].pTask = NULL;
+                pScheduler->pSlots[ i ].generation++;
+                pScheduler->taskCount--;
+                prvFreeTask( pTask );
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static int prvGetWaitTimeout( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    SchedulerTask_t * pTask;
+    uint32_t nowMs = Clock_GetTimeMs();
+    int32_t remainingMs;
+    int timeoutMs = -1;
+    uint32_t i;
+
+    for( i = 0U; i < pScheduler->slotCount; i++ )
+    {
+        pTask = pScheduler->pSlots[ i ].pTask;
+
+        if( ( pTask != NULL ) && ( pTask->state == SCHEDULER_TASK_WAITING ) && ( pTask->hasDeadline == true ) )
+        {
+            remainingMs = ( int32_t ) ( pTask->deadlineMs - nowMs );
+
+            if( remainingMs < 0 )
+            {
+                remainingMs = 0;
+            }
+
+            if( ( timeoutMs < 0 ) || ( remainingMs < timeoutMs ) )
+            {
+                timeoutMs = ( int ) remainingMs;
+            }
+        }
+    }
+
+    return timeoutMs;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvResumeExpiredTasks( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    SchedulerTask_t * pTask;
+    uint32_t nowMs = Clock_GetTimeMs();
+    uint32_t i;
+
+    for( i = 0U; i < pScheduler->slotCount; i++ )
+    {
+        pTask = pScheduler->pSlots[ i ].pTask;
+
+        if( ( pTask != NULL ) && ( pTask->state == SCHEDULER_TASK_WAITING ) && ( pTask->hasDeadline == true ) &&
+            ( ( int32_t ) ( nowMs - pTask->deadlineMs ) >= 0 ) )
+        {
+            pTask->state = SCHEDULER_TASK_READY;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvHandleEvent( iotshdDev_MQTTAgentScheduler_t * pScheduler,
+                            const struct epoll_event * pEvent )
+{
+    eventfd_t value;
+    uint32_t slotIndex;
+    uint32_t generation;
+
+    if( pEvent->data.u64 == SCHEDULER_WAKEUP_EVENT )
+    {
+        ( void ) eventfd_read( pScheduler->wakeupFd, &value );
+    }
+    else
+    {
+        slotIndex = ( uint32_t ) ( pEvent->data.u64 & 0xFFFFFFFFU );
+        generation = ( uint32_t ) ( pEvent->data.u64 >> 32 );
+
+        if( ( slotIndex < pScheduler->slotCount ) &&
+            ( pScheduler->pSlots[ slotIndex ].generation == generation ) &&
+            ( pScheduler->pSlots[ slotIndex ].pTask != NULL ) &&
+            ( pScheduler->pSlots[ slotIndex ].pTask->state == SCHEDULER_TASK_WAITING ) )
+        {
+            pScheduler->pSlots[ slotIndex ].pTask->state = SCHEDULER_TASK_READY;
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void iotshdDev_MQTTAgentSchedulerSetSwapFunction( iotshdDev_MQTTAgentSchedulerSwapFunction_t swapFunction )
+{
+    schedulerSwapFunction = ( swapFunction != NULL ) ? swapFunction : swapcontext;
+}
+
+/*-----------------------------------------------------------*/
+
+iotshdDev_MQTTAgentScheduler_t * iotshdDev_MQTTAgentSchedulerCreate( uint32_t stackSize )
+{
+    iotshdDev_MQTTAgentScheduler_t * pScheduler;
+    struct epoll_event event;
+    bool retStatus = true;
+
+    pScheduler = iotshdPal_Malloc( sizeof( iotshdDev_MQTTAgentScheduler_t ) );
+
+    if( pScheduler != NULL )
+    {
+        memset( pScheduler, 0, sizeof( iotshdDev_MQTTAgentScheduler_t ) );
+        pScheduler->stackSize = ( stackSize != 0U ) ? stackSize : MQTT_AGENT_SCHEDULER_STACK_SIZE;
+        pScheduler->pageSize = ( size_t ) sysconf( _SC_PAGESIZE );
+
+        /* The stack is mapped in whole pages. */
+        pScheduler->stackSize = ( uint32_t ) ( ( ( pScheduler->stackSize + pScheduler->pageSize - 1U ) /
+                                                 pScheduler->pageSize ) * pScheduler->pageSize );
+        pthread_mutex_init( &pScheduler->mutex, NULL );
+
+        pScheduler->epollFd = epoll_create1( EPOLL_CLOEXEC );
+        pScheduler->wakeupFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+        if( ( pScheduler->epollFd < 0 ) || ( pScheduler->wakeupFd < 0 ) )
+        {
+            retStatus = false;
+        }
+        else
+        {
+            /* The wakeup file descriptor stays readable until it is read, so it is
+             * level triggered. */
+            memset( &event, 0, sizeof( event ) );
+            event.events = EPOLLIN;
+            event.data.u64 = SCHEDULER_WAKEUP_EVENT;
+            retStatus = ( epoll_ctl( pScheduler->epollFd, EPOLL_CTL_ADD, pScheduler->wakeupFd, &event ) == 0 );
+        }
+
+        if( retStatus != true )
+        {
+            LogError( ( "Failed to create MQTT agent scheduler with errno %d.", errno ) );
+            iotshdDev_MQTTAgentSchedulerDelete( pScheduler );
+            pScheduler = NULL;
+        }
+    }
+
+    return pScheduler;
+}
+
+/*-----------------------------------------------------------*/
+
+void iotshdDev_MQTTAgentSchedulerDelete( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    SchedulerTask_t * pTask;
+
+    if( pScheduler != NULL )
+    {
+        /* Tasks added after the scheduler stopped are never started. */
+        while( pScheduler->pPendingTasks != NULL )
+        {
+            pTask = pScheduler->pPendingTasks;
+            pScheduler->pPendingTasks = pTask->pNextPending;
+            iotshdDev_MQTTAgentSetWaitFunction( pTask->pInstance, NULL, NULL );
+            prvFreeTask( pTask );
+        }
+
+        if( pScheduler->pSlots != NULL )
+        {
+            iotshdPal_Free( pScheduler->pSlots );
+        }
+
+        if( pScheduler->epollFd >= 0 )
+        {
+            close( pScheduler->epollFd );
+        }
+
+        if( pScheduler->wakeupFd >= 0 )
+        {
+            close( pScheduler->wakeupFd );
+        }
+
+        pthread_mutex_destroy( &pScheduler->mutex );
+        iotshdPal_Free( pScheduler );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+bool iotshdDev_MQTTAgentSchedulerAdd( iotshdDev_MQTTAgentScheduler_t * pScheduler,
+                                      iotshdDev_MQTTAgentInstance_t * pInstance,
+                                      CK_SESSION_HANDLE p11Session )
+{
+    SchedulerTask_t * pTask = NULL;
+    bool retStatus = false;
+
+    if( ( pScheduler != NULL ) && ( pInstance != NULL ) )
+    {
+        pTask = iotshdPal_Malloc( sizeof( SchedulerTask_t ) );
+    }
+
+    if( pTask != NULL )
+    {
+        memset( pTask, 0, sizeof( SchedulerTask_t ) );
+        pTask->pScheduler = pScheduler;
+        pTask->pStack = prvAllocateStack( pScheduler );
+        pTask->pInstance = pInstance;
+        pTask->p11Session = p11Session;
+
+        if( pTask->pStack == NULL )
+        {
+            LogError( ( "Failed to allocate %u bytes of stack for an instance.", ( unsigned int ) pScheduler->stackSize ) );
+            prvFreeTask( pTask );
+        }
+        else
+        {
+            /* All the waits of the instance return to the scheduler. */
+            iotshdDev_MQTTAgentSetWaitFunction( pInstance, prvTaskWait, pTask );
+
+            pthread_mutex_lock( &pScheduler->mutex );
+            pTask->pNextPending = pScheduler->pPendingTasks;
+            pScheduler->pPendingTasks = pTask;
+            pthread_mutex_unlock( &pScheduler->mutex );
+
+            ( void ) eventfd_write( pScheduler->wakeupFd, 1 );
+            retStatus = true;
+        }
+    }
+
+    return retStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void iotshdDev_MQTTAgentSchedulerRun( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    struct epoll_event events[ MQTT_AGENT_SCHEDULER_MAX_EVENTS ];
+    int eventCount;
+    int i;
+    bool running = true;
+
+    while( running == true )
+    {
+        prvStartPendingTasks( pScheduler );
+        prvRunReadyTasks( pScheduler );
+
+        /* Every task is waiting now. Sleep until the first readiness event or
+         * deadline. */
+        eventCount = epoll_wait( pScheduler->epollFd,
+                                 events,
+                                 MQTT_AGENT_SCHEDULER_MAX_EVENTS,
+                                 prvGetWaitTimeout( pScheduler ) );
+
+        if( ( eventCount < 0 ) && ( errno != EINTR ) )
+        {
+            LogError( ( "Failed to wait for MQTT agent events with errno %d.", errno ) );
+        }
+
+        for( i = 0; i < eventCount; i++ )
+        {
+            prvHandleEvent( pScheduler, &events[ i ] );
+        }
+
+        prvResumeExpiredTasks( pScheduler );
+
+        pthread_mutex_lock( &pScheduler->mutex );
+
+        if( ( pScheduler->stopRequested == true ) &&
+            ( pScheduler->taskCount == 0U ) &&
+            ( pScheduler->pPendingTasks == NULL ) )
+        {
+            running = false;
+        }
+
+        pthread_mutex_unlock( &pScheduler->mutex );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void iotshdDev_MQTTAgentSchedulerStop( iotshdDev_MQTTAgentScheduler_t * pScheduler )
+{
+    pthread_mutex_lock( &pScheduler->mutex );
+    pScheduler->stopRequested = true;
+    pthread_mutex_unlock( &pScheduler->mutex );
+
+    ( void ) eventfd_write( pScheduler->wakeupFd, 1 );
+}
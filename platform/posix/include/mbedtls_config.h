@@ -33,6 +33,20 @@
 /* Place AES tables in ROM. */
 #define MBEDTLS_AES_ROM_TABLES
 
+/* Enable the CPU-accelerated paths of the build target unless
+ * MBEDTLS_CONFIG_NO_CPU_ACCELERATION is defined. On x86-64, AES and GCM use the
+ * AES-NI and PCLMULQDQ instructions after a runtime check of the CPU, and fall
+ * back to software otherwise. MBEDTLS_HAVE_ASM also selects the assembly bignum
+ * multiplication used by ECDHE and RSA. */
+#ifndef MBEDTLS_CONFIG_NO_CPU_ACCELERATION
+    #if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __amd64__ ) )
+        #define MBEDTLS_HAVE_ASM
+        #define MBEDTLS_AESNI_C
+    #elif defined( __GNUC__ ) && ( defined( __aarch64__ ) || defined( __arm__ ) )
+        #define MBEDTLS_HAVE_ASM
+    #endif
+#endif
+
 /* Enable the following cipher modes. */
 #define MBEDTLS_CIPHER_MODE_CBC
 #define MBEDTLS_CIPHER_MODE_CFB
@@ -61,6 +75,21 @@
 #define MBEDTLS_SSL_PROTO_TLS1_2
 #define MBEDTLS_SSL_ALPN
 #define MBEDTLS_SSL_SERVER_NAME_INDICATION
+#define MBEDTLS_SSL_SESSION_TICKETS
+
+/* Shrink the record buffers of a connection to the negotiated maximum fragment
+ * length after the handshake. Comment out to keep fixed-size buffers. */
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+
+/* Size of the record buffers. The input buffer must hold the largest record sent
+ * by servers that do not support the maximum fragment length extension. The
+ * output buffer only holds the records of this client. */
+#ifndef MBEDTLS_SSL_IN_CONTENT_LEN
+    #define MBEDTLS_SSL_IN_CONTENT_LEN     16384
+#endif
+#ifndef MBEDTLS_SSL_OUT_CONTENT_LEN
+    #define MBEDTLS_SSL_OUT_CONTENT_LEN    4096
+#endif
 
 /* Check certificate key usage. */
 #define MBEDTLS_X509_CHECK_KEY_USAGE
@@ -95,6 +124,7 @@
 #define MBEDTLS_PK_WRITE_C
 #define MBEDTLS_PKCS1_V15
 #define MBEDTLS_PLATFORM_C
+#define MBEDTLS_PLATFORM_MEMORY
 #define MBEDTLS_RSA_C
 #define MBEDTLS_SHA1_C
 #define MBEDTLS_SHA256_C
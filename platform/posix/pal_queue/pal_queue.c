@@ -4,6 +4,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/eventfd.h>
 
 #include "pal_queue.h"
 
@@ -23,6 +24,8 @@ struct iotshdPal_SyncQueue
 
     pthread_cond_t condEnqueue;         /**< Condition for enqueue event notification. */ 
     pthread_cond_t condDequeue;         /**< Condition for dequeue event notification. */ 
+
+    int wakeupFd;                       /**< Eventfd counting the items in queue. -1 if not created. */
 };
 
 iotshdPal_SyncQueue_t * iotshdPal_syncQueueCreate( uint32_t numberOfQueueItems,
@@ -46,6 +49,7 @@ iotshdPal_SyncQueue_t * iotshdPal_syncQueueCreate( uint32_t numberOfQueueItems,
         pSyncQueue->pBuffer = ( uint8_t * ) malloc( numberOfQueueItems * queueItemSize );
         pSyncQueue->numberOfQueueItems = numberOfQueueItems;
         pSyncQueue->queueItemSize = queueItemSize;    
+        pSyncQueue->wakeupFd = -1;
 
         /* Create the mutex and condition. */
         pthread_mutex_init( &pSyncQueue->mutex, NULL);
@@ -64,6 +68,10 @@ void iotshdPal_syncQueueDelete( iotshdPal_SyncQueue_t * pSyncQueue )
         {
             free( pSyncQueue->pBuffer );
         }
+        if( pSyncQueue->wakeupFd >= 0 )
+        {
+            close( pSyncQueue->wakeupFd );
+        }
         free( pSyncQueue );
     }
 }
@@ -113,6 +121,12 @@ bool iotshdPal_syncQueueSend( iotshdPal_SyncQueue_t * pSyncQueue ,
 
         pEnqueuePos = ( uint8_t * )( &pSyncQueue->pBuffer[ queueIndex * pSyncQueue->queueItemSize ] );
         memcpy( pEnqueuePos, pQueueItemToSend, pSyncQueue->queueItemSize );
+
+        /* Count the item in the wakeup file descriptor. */
+        if( pSyncQueue->wakeupFd >= 0 )
+        {
+            ( void ) eventfd_write( pSyncQueue->wakeupFd, 1U );
+        }
         
         retStatus = true;
     }
@@ -169,6 +183,13 @@ bool iotshdPal_syncQueueReceive( iotshdPal_SyncQueue_t * pSyncQueue,
 
         pSyncQueue->itemsInQueue = pSyncQueue->itemsInQueue - 1;
         pSyncQueue->dequeueIndex = ( pSyncQueue->dequeueIndex + 1 ) % pSyncQueue->numberOfQueueItems;
+
+        /* The wakeup file descriptor is a semaphore, reading it decrements the count by one. */
+        if( pSyncQueue->wakeupFd >= 0 )
+        {
+            eventfd_t count;
+            ( void ) eventfd_read( pSyncQueue->wakeupFd, &count );
+        }
         
         retStatus = true;
     }
@@ -182,3 +203,24 @@ bool iotshdPal_syncQueueReceive( iotshdPal_SyncQueue_t * pSyncQueue,
 
     return retStatus;
 }
+
+int iotshdPal_syncQueueGetWakeupFd( iotshdPal_SyncQueue_t * pSyncQueue )
+{
+    int wakeupFd = -1;
+
+    if( pSyncQueue != NULL )
+    {
+        pthread_mutex_lock( &( pSyncQueue->mutex ) );
+
+        if( pSyncQueue->wakeupFd < 0 )
+        {
+            /* Start with the items already in queue. */
+            pSyncQueue->wakeupFd = eventfd( pSyncQueue->itemsInQueue, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE );
+        }
+        wakeupFd = pSyncQueue->wakeupFd;
+
+        pthread_mutex_unlock( &( pSyncQueue->mutex ) );
+    }
+
+    return wakeupFd;
+}
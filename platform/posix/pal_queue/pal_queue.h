@@ -56,5 +56,16 @@ bool iotshdPal_syncQueueReceive( iotshdPal_SyncQueue_t * pSyncQueue,
                                  void * pvBuffer,
                                  uint32_t blockTimeMs );
 
+/**
+ * @brief Platform queue wakeup file descriptor API. The file descriptor is
+ * readable while the queue has items, so the queue can be waited together with
+ * sockets with poll or epoll. It is created on the first call.
+ *
+ * @param pSyncQueue pointer iotshd_deviceQueue_t structure.
+ *
+ * @return The file descriptor when success. Otherwise, return -1 to indicate failure.
+ */
+int iotshdPal_syncQueueGetWakeupFd( iotshdPal_SyncQueue_t * pSyncQueue );
+
 #endif
 
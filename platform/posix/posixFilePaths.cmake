@@ -19,7 +19,14 @@ set( OPENSSL_TRANSPORT_SOURCES
 
 # MbedTLS transport source files.
 set( MBEDTLS_PKCS11_TRANSPORT_SOURCES
-     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_posix.c )
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_posix.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_credential_cache.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_random.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_session_pool.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_sign.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_memory.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_offload.c
+     ${CMAKE_CURRENT_LIST_DIR}/transport/src/mbedtls_pkcs11_secure_arena.c )
 
 # Transport Public Include directories.
 set( COMMON_TRANSPORT_INCLUDE_PUBLIC_DIRS
@@ -0,0 +1,150 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_CREDENTIAL_CACHE_H_
+#define MBEDTLS_PKCS11_CREDENTIAL_CACHE_H_
+
+/**
+ * @file mbedtls_pkcs11_credential_cache.h
+ *
+ * @brief Process-wide cache of the parsed certificates used by the MbedTLS and
+ * corePKCS11 transport. Connections and reconnections to the same endpoint share
+ * one parsed root CA chain and one parsed client certificate instead of reading
+ * and parsing them on every connect.
+ *
+ * A cached chain is immutable and reference counted. An invalidated chain stays
+ * valid until the last connection using it releases it.
+ *
+ * The cache also maps the PKCS #11 labels of the credentials to their object
+ * handles and key types, so that repeated connections do not search the token.
+ * They are kept per slot of the session, as each token holds its credentials
+ * under the same labels.
+ * A PKCS #11 object written with a label must be followed by
+ * #Mbedtls_Pkcs11_CredentialCacheInvalidate for the label.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stdbool.h>
+
+/* MbedTLS includes. */
+#include "mbedtls/x509_crt.h"
+
+/* PKCS #11 includes. */
+#include "core_pkcs11.h"
+
+/**
+ * @brief Get the parsed root CA chain of a file. The cached chain is parsed again
+ * when the modification time, size or inode of the file changes.
+ *
+ * @param[in] pRootCaPath Path of the PEM or DER root CA file.
+ *
+ * @return The shared chain, which must be released with
+ * #Mbedtls_Pkcs11_CredentialCacheRelease; NULL on failure.
+ */
+mbedtls_x509_crt * Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( const char * pRootCaPath );
+
+/**
+ * @brief Get the handle of the PKCS #11 object with a label and class. The handle
+ * is searched on the token when it is not cached.
+ *
+ * @param[in] p11Session PKCS #11 session used to search the object.
+ * @param[in] pLabel PKCS #11 label of the object.
+ * @param[in] objectClass PKCS #11 class of the object.
+ * @param[out] pHandle Handle of the object; CK_INVALID_HANDLE if it is not found.
+ *
+ * @return CKR_OK if the search succeeded, even if no object is found;
+ * PKCS #11 error code otherwise.
+ */
+CK_RV Mbedtls_Pkcs11_CredentialCacheFindObject( CK_SESSION_HANDLE p11Session,
+                                                const char * pLabel,
+                                                CK_OBJECT_CLASS objectClass,
+                                                CK_OBJECT_HANDLE_PTR pHandle );
+
+/**
+ * @brief Get the handle and key type of the PKCS #11 private key with a label.
+ * They are read from the token when they are not cached.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list.
+ * @param[in] p11Session PKCS #11 session used to search the key.
+ * @param[in] pLabel PKCS #11 label of the private key.
+ * @param[out] pHandle Handle of the key; CK_INVALID_HANDLE if it is not found.
+ * @param[out] pKeyType Key type of the key.
+ *
+ * @return CKR_OK if the search succeeded, even if no key is found;
+ * PKCS #11 error code otherwise.
+ */
+CK_RV Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                                    CK_SESSION_HANDLE p11Session,
+                                                    const char * pLabel,
+                                                    CK_OBJECT_HANDLE_PTR pHandle,
+                                                    CK_KEY_TYPE * pKeyType );
+
+/**
+ * @brief Get the parsed certificate of a PKCS #11 certificate object. The cached
+ * certificate is exported again when the object handle of the label changes or
+ * the label is invalidated with #Mbedtls_Pkcs11_CredentialCacheInvalidate.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list.
+ * @param[in] p11Session PKCS #11 session used to find and export the object.
+ * @param[in] pLabel PKCS #11 label of the certificate.
+ *
+ * @return The shared certificate, which must be released with
+ * #Mbedtls_Pkcs11_CredentialCacheRelease; NULL on failure.
+ */
+mbedtls_x509_crt * Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                                                     CK_SESSION_HANDLE p11Session,
+                                                                     const char * pLabel );
+
+/**
+ * @brief Release a chain returned by the credential cache.
+ *
+ * @param[in] pCertificate Chain to release. NULL is ignored.
+ */
+void Mbedtls_Pkcs11_CredentialCacheRelease( mbedtls_x509_crt * pCertificate );
+
+/**
+ * @brief Invalidate the cached object handles, key type and certificate of a
+ * PKCS #11 label on all the slots. It must be called after an object with the
+ * label is written or destroyed.
+ *
+ * @param[in] pLabel PKCS #11 label of the certificate.
+ */
+void Mbedtls_Pkcs11_CredentialCacheInvalidate( const char * pLabel );
+
+/**
+ * @brief Invalidate all the cached chains and object handles.
+ */
+void Mbedtls_Pkcs11_CredentialCacheClear( void );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_CREDENTIAL_CACHE_H_ */
@@ -0,0 +1,123 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_MEMORY_H_
+#define MBEDTLS_PKCS11_MEMORY_H_
+
+/**
+ * @file mbedtls_pkcs11_memory.h
+ *
+ * @brief Accounting of the MbedTLS heap memory of the MbedTLS and corePKCS11
+ * transport connections.
+ *
+ * #Mbedtls_Pkcs11_MemoryInit installs MbedTLS calloc and free functions that
+ * record the size of each allocation. The allocations made by a thread while an
+ * account is selected with #Mbedtls_Pkcs11_MemorySetAccount are counted in the
+ * account until they are freed, by any thread.
+ *
+ * MbedTLS must be built with MBEDTLS_PLATFORM_MEMORY. Without it, or before
+ * #Mbedtls_Pkcs11_MemoryInit is called, nothing is counted.
+ *
+ * The account is selected per thread. Coroutines sharing a thread must switch
+ * with #Mbedtls_Pkcs11_MemorySwapContext, so that each one keeps its own
+ * account across the switches.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stddef.h>
+
+/* POSIX includes. */
+#include <ucontext.h>
+
+/**
+ * @brief Memory account. Its members are updated by the allocations and must be
+ * read with #Mbedtls_Pkcs11_MemoryRead.
+ */
+typedef struct MbedtlsPkcs11MemoryAccount
+{
+    size_t currentBytes; /**< @brief Bytes allocated and not freed. */
+    size_t peakBytes;    /**< @brief Largest value of #currentBytes. */
+} MbedtlsPkcs11MemoryAccount_t;
+
+/**
+ * @brief Install the accounting calloc and free functions in MbedTLS. It must
+ * be called before any MbedTLS allocation, because memory allocated before
+ * cannot be freed by the accounting free function. Later calls do nothing.
+ */
+void Mbedtls_Pkcs11_MemoryInit( void );
+
+/**
+ * @brief Select the account of the MbedTLS allocations made by the calling
+ * thread. An account must stay valid until all the memory counted in it is freed.
+ *
+ * @param[in] pAccount Account to select, or NULL to stop counting.
+ *
+ * @return The previously selected account, to be restored by the caller.
+ */
+MbedtlsPkcs11MemoryAccount_t * Mbedtls_Pkcs11_MemorySetAccount( MbedtlsPkcs11MemoryAccount_t * pAccount );
+
+/**
+ * @brief Switch the calling thread to another coroutine, like swapcontext().
+ * The account selected by the calling coroutine is put aside, so that the
+ * allocations of the other coroutines are not counted in it, and selected again
+ * when the calling coroutine is resumed. A coroutine entered for the first time
+ * starts without an account.
+ *
+ * @param[out] pCurrentContext Context in which the calling coroutine is saved.
+ * @param[in] pNextContext Context of the coroutine to resume.
+ *
+ * @return The value returned by swapcontext().
+ */
+int Mbedtls_Pkcs11_MemorySwapContext( ucontext_t * pCurrentContext,
+                                      const ucontext_t * pNextContext );
+
+/**
+ * @brief Read an account.
+ *
+ * @param[in] pAccount Account to read.
+ * @param[out] pCurrentBytes Bytes allocated and not freed. May be NULL.
+ * @param[out] pPeakBytes Largest number of bytes allocated. May be NULL.
+ */
+void Mbedtls_Pkcs11_MemoryRead( const MbedtlsPkcs11MemoryAccount_t * pAccount,
+                                size_t * pCurrentBytes,
+                                size_t * pPeakBytes );
+
+/**
+ * @brief Reset the peak of an account to its current value.
+ *
+ * @param[in] pAccount Account to reset.
+ */
+void Mbedtls_Pkcs11_MemoryResetPeak( MbedtlsPkcs11MemoryAccount_t * pAccount );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_MEMORY_H_ */
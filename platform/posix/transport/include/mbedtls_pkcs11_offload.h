@@ -0,0 +1,98 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_OFFLOAD_H_
+#define MBEDTLS_PKCS11_OFFLOAD_H_
+
+/**
+ * @file mbedtls_pkcs11_offload.h
+ *
+ * @brief Blocking calls of the MbedTLS and corePKCS11 transport connections run
+ * on worker threads.
+ *
+ * A connection served by an event loop waits through its wait function. When
+ * a step of the connection can block, such as a host name resolution, a TCP
+ * connect, a PKCS #11 signature or a lock shared by the connections,
+ * #Mbedtls_Pkcs11_RunBlocking runs it on a worker thread. The connection waits
+ * for the result through the wait function, so that the event loop keeps
+ * serving the other connections.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <poll.h>
+
+/**
+ * @brief Function waiting for the readiness of a non-blocking connection. It has
+ * the semantics of poll(), so that an event loop can suspend the connection
+ * instead of blocking the calling thread.
+ *
+ * @param[in] pWaitContext Context set with #Mbedtls_Pkcs11_SetWaitFunction.
+ * @param[in,out] pPollFds File descriptors to wait for. The revents are updated.
+ * @param[in] pollFdCount Number of file descriptors in pPollFds.
+ * @param[in] timeoutMs Maximum time to wait. A negative value waits without limit.
+ *
+ * @return Number of ready file descriptors, zero on timeout or -1 on error.
+ */
+typedef int ( * MbedtlsPkcs11WaitFunction_t )( void * pWaitContext,
+                                               struct pollfd * pPollFds,
+                                               nfds_t pollFdCount,
+                                               int timeoutMs );
+
+/**
+ * @brief Blocking call run by #Mbedtls_Pkcs11_RunBlocking.
+ *
+ * @param[in,out] pArgument Argument of the call, also holding its result.
+ */
+typedef void ( * MbedtlsPkcs11BlockingCall_t )( void * pArgument );
+
+/**
+ * @brief Run a blocking call without blocking the event loop of the caller.
+ *
+ * Without a wait function, the call runs on the calling thread. Otherwise it
+ * runs on a worker thread, with the memory account selected by the caller, and
+ * the caller waits for its completion with the wait function. The function
+ * returns once the call has completed in both cases, so the argument can live
+ * on the stack of the caller.
+ *
+ * @param[in] waitFunction Wait function of the connection, or NULL.
+ * @param[in] pWaitContext Context passed to waitFunction.
+ * @param[in] blockingCall Call to run.
+ * @param[in,out] pArgument Argument passed to blockingCall.
+ */
+void Mbedtls_Pkcs11_RunBlocking( MbedtlsPkcs11WaitFunction_t waitFunction,
+                                 void * pWaitContext,
+                                 MbedtlsPkcs11BlockingCall_t blockingCall,
+                                 void * pArgument );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_OFFLOAD_H_ */
@@ -65,6 +65,7 @@
 
 /* Standard includes. */
 #include <stdbool.h>
+#include <poll.h>
 
 /* MbedTLS includes. */
 #include "mbedtls/net_sockets.h"
@@ -78,6 +79,12 @@
 /* PKCS #11 includes. */
 #include "core_pkcs11.h"
 
+/* Memory accounting include. */
+#include "mbedtls_pkcs11_memory.h"
+
+/* Blocking call include, defining the wait function. */
+#include "mbedtls_pkcs11_offload.h"
+
 /**
  * @brief Debug logging level to use for MbedTLS.
  *
@@ -87,6 +94,135 @@
  */
 #define MBEDTLS_DEBUG_LOG_LEVEL    0
 
+/**
+ * @brief Maximum fragment length requested from the server when the credentials
+ * do not select one. It must be 512, 1024, 2048 or 4096.
+ *
+ * @note The record buffer sizes are MBEDTLS_SSL_IN_CONTENT_LEN and
+ * MBEDTLS_SSL_OUT_CONTENT_LEN of the MbedTLS configuration. With
+ * MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH, they are shrunk to the negotiated maximum
+ * fragment length after the handshake.
+ */
+#ifndef MBEDTLS_PKCS11_DEFAULT_MAX_FRAGMENT_LENGTH
+    #define MBEDTLS_PKCS11_DEFAULT_MAX_FRAGMENT_LENGTH    ( 4096U )
+#endif
+
+/**
+ * @brief Size of the write-combining buffer of a connection.
+ *
+ * Data passed to #Mbedtls_Pkcs11_Send and #Mbedtls_Pkcs11_Writev is collected
+ * in this buffer so that back-to-back MQTT packets are sent in one TLS record.
+ * It should not be larger than the maximum fragment length of the connection.
+ */
+#ifndef MBEDTLS_PKCS11_WRITE_BUFFER_SIZE
+    #define MBEDTLS_PKCS11_WRITE_BUFFER_SIZE    ( 4096U )
+#endif
+
+/**
+ * @brief Number of buffered bytes that triggers a flush of the write-combining
+ * buffer. It must be smaller than #MBEDTLS_PKCS11_WRITE_BUFFER_SIZE, otherwise
+ * only a full buffer is flushed by a write.
+ */
+#ifndef MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD
+    #define MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD    ( ( MBEDTLS_PKCS11_WRITE_BUFFER_SIZE * 3U ) / 4U )
+#endif
+
+#if ( MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD >= MBEDTLS_PKCS11_WRITE_BUFFER_SIZE )
+    #error "MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD must be smaller than MBEDTLS_PKCS11_WRITE_BUFFER_SIZE."
+#endif
+
+/**
+ * @brief Maximum time in microseconds that data is kept in the write-combining
+ * buffer.
+ *
+ * @note The deadline is checked by the writes and by the receives: a receive
+ * of a non-blocking connection waiting for the peer wakes up at the deadline,
+ * rounded up to a millisecond, to flush the buffer. A blocking connection
+ * flushes the buffer before any receive. The buffer is also flushed on
+ * disconnect.
+ */
+#ifndef MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US
+    #define MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US    ( 500U )
+#endif
+
+/**
+ * @brief Maximum number of consecutive retries of a TLS write that does not make
+ * progress, e.g. because the socket is not ready or the send timed out, before
+ * the write fails.
+ */
+#ifndef MBEDTLS_PKCS11_WRITE_MAX_RETRIES
+    #define MBEDTLS_PKCS11_WRITE_MAX_RETRIES    ( 10U )
+#endif
+
+/**
+ * @brief Number of buckets of the connect phase histograms. Bucket 0 counts the
+ * phases shorter than 1 ms, bucket i the phases of [2^(i-1), 2^i) ms, and the
+ * last bucket the longer phases.
+ */
+#ifndef MBEDTLS_PKCS11_CONNECT_HISTOGRAM_BUCKETS
+    #define MBEDTLS_PKCS11_CONNECT_HISTOGRAM_BUCKETS    ( 16U )
+#endif
+
+/**
+ * @brief Phases of #Mbedtls_Pkcs11_Connect. The handshake phases are measured
+ * around the MbedTLS handshake steps, including the time waiting for the server.
+ */
+typedef enum MbedtlsPkcs11ConnectPhase
+{
+    MBEDTLS_PKCS11_CONNECT_PHASE_SETUP = 0,          /**< TLS profile and SSL context setup. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_TCP_CONNECT,        /**< Name resolution and TCP connect. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_HELLO,       /**< ClientHello until the ServerHello is received. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_CERTIFICATE, /**< Server certificate parsing and verification. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_KEY_EXCHANGE,       /**< Server key exchange until the ClientKeyExchange. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_SIGN,               /**< CertificateVerify, i.e. the PKCS #11 signature. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_FINISHED,           /**< ChangeCipherSpec and Finished messages. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_TOTAL,              /**< Whole connect. */
+    MBEDTLS_PKCS11_CONNECT_PHASE_COUNT               /**< Number of phases. */
+} MbedtlsPkcs11ConnectPhase_t;
+
+/**
+ * @brief Duration of the phases of the last connect of a connection.
+ */
+typedef struct MbedtlsPkcs11ConnectTiming
+{
+    uint64_t phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_COUNT ]; /**< @brief Duration of each phase in microseconds. Zero for a phase not reached. */
+    bool resumed;                                           /**< @brief The server resumed a previous session. */
+} MbedtlsPkcs11ConnectTiming_t;
+
+/**
+ * @brief Process-wide histograms of the connect phases.
+ */
+typedef struct MbedtlsPkcs11ConnectHistogram
+{
+    uint32_t connects;    /**< @brief Number of successful connects counted in #counts. */
+    uint32_t failures;    /**< @brief Number of failed connects. They are not counted in #counts. */
+    uint32_t resumptions; /**< @brief Number of successful connects that resumed a session. */
+
+    /**
+     * @brief Number of successful connects per phase and duration bucket.
+     */
+    uint32_t counts[ MBEDTLS_PKCS11_CONNECT_PHASE_COUNT ][ MBEDTLS_PKCS11_CONNECT_HISTOGRAM_BUCKETS ];
+} MbedtlsPkcs11ConnectHistogram_t;
+
+/**
+ * @brief TLS memory of a connection.
+ */
+typedef struct MbedtlsPkcs11MemoryStats
+{
+    size_t inRecordLength;  /**< @brief Maximum length of a received record payload. */
+    size_t outRecordLength; /**< @brief Maximum length of a sent record payload. */
+    size_t currentBytes;    /**< @brief MbedTLS heap memory of the connection. */
+    size_t peakBytes;       /**< @brief Largest MbedTLS heap memory of the connection since it was connected. */
+} MbedtlsPkcs11MemoryStats_t;
+
+/**
+ * @brief TLS client profile. It holds the MbedTLS SSL configuration, the
+ * certificates and the private key of a set of credentials. It is built on the
+ * first connection with the credentials and shared by the later connections,
+ * which only set up their SSL context.
+ */
+typedef struct MbedtlsPkcs11Profile MbedtlsPkcs11Profile_t;
+
 /**
  * @brief Context containing state for the MbedTLS and corePKCS11 based
  * transport interface implementation.
@@ -97,20 +233,26 @@
  */
 typedef struct MbedtlsPkcs11Context
 {
-    mbedtls_net_context socketContext;    /**< @brief MbedTLS socket context. */
-    mbedtls_ssl_config config;            /**< @brief SSL connection configuration. */
-    mbedtls_ssl_context context;          /**< @brief SSL connection context */
-    mbedtls_x509_crt_profile certProfile; /**< @brief Certificate security profile for this connection. */
-    mbedtls_x509_crt rootCa;              /**< @brief Root CA certificate context. */
-    mbedtls_x509_crt clientCert;          /**< @brief Client certificate context. */
-    mbedtls_pk_context privKey;           /**< @brief Client private key context. */
-    mbedtls_pk_info_t privKeyInfo;        /**< @brief Client private key info. */
-
-    /* PKCS #11. */
-    CK_FUNCTION_LIST_PTR pP11FunctionList; /**< @brief PKCS #11 function list. */
-    CK_SESSION_HANDLE p11Session;          /**< @brief PKCS #11 session. */
-    CK_OBJECT_HANDLE p11PrivateKey;        /**< @brief PKCS #11 handle for the private key to use for client authentication. */
-    CK_KEY_TYPE keyType;                   /**< @brief PKCS #11 key type corresponding to #p11PrivateKey. */
+    mbedtls_net_context socketContext; /**< @brief MbedTLS socket context. */
+    mbedtls_ssl_context context;       /**< @brief SSL connection context */
+    MbedtlsPkcs11Profile_t * pProfile; /**< @brief TLS client profile holding the SSL configuration of the connection. */
+
+    /* Write combining. */
+    uint8_t writeBuffer[ MBEDTLS_PKCS11_WRITE_BUFFER_SIZE ]; /**< @brief Data waiting to be sent in one TLS record. */
+    size_t writeBufferLength;                                /**< @brief Number of bytes in #writeBuffer. */
+    uint64_t writeBufferStartUs;                             /**< @brief Time the oldest byte in #writeBuffer was written. */
+    int32_t writeStatus;                                     /**< @brief Error of a failed flush, returned by the later operations; zero otherwise. */
+
+    /* Non-blocking mode. */
+    bool nonBlocking;       /**< @brief Use a non-blocking socket and wait for readiness with poll. */
+    int wakeupFd;           /**< @brief File descriptor that ends a waiting receive when readable. -1 if not used. */
+    uint32_t recvTimeoutMs; /**< @brief Maximum time to wait for socket readiness. */
+
+    MbedtlsPkcs11WaitFunction_t waitFunction; /**< @brief Function waiting for readiness. NULL selects poll. */
+    void * pWaitContext;                      /**< @brief Context passed to #waitFunction. */
+
+    MbedtlsPkcs11ConnectTiming_t connectTiming; /**< @brief Duration of the phases of the last connect. */
+    MbedtlsPkcs11MemoryAccount_t memoryAccount; /**< @brief MbedTLS heap memory of the connection. */
 } MbedtlsPkcs11Context_t;
 
 /**
@@ -124,7 +266,8 @@ typedef enum MbedtlsPkcs11Status
     MBEDTLS_PKCS11_INVALID_CREDENTIALS, /**< Provided credentials were invalid. */
     MBEDTLS_PKCS11_HANDSHAKE_FAILED,    /**< Performing TLS handshake with server failed. */
     MBEDTLS_PKCS11_INTERNAL_ERROR,      /**< A call to a system API resulted in an internal error. */
-    MBEDTLS_PKCS11_CONNECT_FAILURE      /**< Initial connection to the server failed. */
+    MBEDTLS_PKCS11_CONNECT_FAILURE,     /**< Initial connection to the server failed. */
+    MBEDTLS_PKCS11_CERTIFICATE_REJECTED /**< The server rejected the client certificate with a fatal TLS alert. */
 } MbedtlsPkcs11Status_t;
 
 /**
@@ -151,6 +294,12 @@ typedef struct MbedtlsPkcs11Credentials
     char * pClientCertLabel;      /**< @brief String representing the PKCS #11 label for the client certificate. */
     char * pPrivateKeyLabel;      /**< @brief String representing the PKCS #11 label for the private key. */
     CK_SESSION_HANDLE p11Session; /**< @brief PKCS #11 session handle. */
+
+    /**
+     * @brief Maximum fragment length requested from the server: 512, 1024, 2048
+     * or 4096 bytes. Zero selects #MBEDTLS_PKCS11_DEFAULT_MAX_FRAGMENT_LENGTH.
+     */
+    uint16_t maxFragmentLength;
 } MbedtlsPkcs11Credentials_t;
 
 /* Each compilation unit must define the NetworkContext struct. */
@@ -164,6 +313,11 @@ struct NetworkContext
  * connection using the MbedTLS library for TLS and the corePKCS11 library for
  * credential management.
  *
+ * The session of the last handshake with the same server and credentials is
+ * offered for resumption with a session ticket or session ID. A resumed
+ * handshake takes one round trip and skips the certificate verification and the
+ * PKCS #11 signature.
+ *
  * @param[out] pNetworkContext The output parameter to return the created network context.
  * @param[in] pHostName The hostname of the remote endpoint.
  * @param[in] port The destination port.
@@ -173,9 +327,14 @@ struct NetworkContext
  * @note #recvTimeoutMs sets the maximum blocking time of the #Mbedtls_Pkcs11_Recv function.
  *
  * @return #MBEDTLS_PKCS11_SUCCESS on success;
- * #MBEDTLS_PKCS11_INSUFFICIENT_MEMORY, #MBEDTLS_PKCS11_INVALID_CREDENTIALS,
+ * #MBEDTLS_PKCS11_INVALID_PARAMETER, #MBEDTLS_PKCS11_INSUFFICIENT_MEMORY, #MBEDTLS_PKCS11_INVALID_CREDENTIALS,
  * #MBEDTLS_PKCS11_HANDSHAKE_FAILED, #MBEDTLS_PKCS11_INTERNAL_ERROR,
- * or #MBEDTLS_PKCS11_CONNECT_FAILURE on failure.
+ * #MBEDTLS_PKCS11_CONNECT_FAILURE, or #MBEDTLS_PKCS11_CERTIFICATE_REJECTED on failure.
+ * #MBEDTLS_PKCS11_CERTIFICATE_REJECTED is only returned for a fatal alert of the
+ * server about the client certificate, such as bad_certificate or
+ * certificate_revoked. Other handshake errors, including timeouts, closed
+ * connections and a failed verification of the server, are
+ * #MBEDTLS_PKCS11_HANDSHAKE_FAILED.
  */
 MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext,
                                               const char * pHostName,
@@ -183,6 +342,79 @@ MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext
                                               const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
                                               uint32_t recvTimeoutMs );
 
+/**
+ * @brief Select the non-blocking mode of a connection. It must be called before
+ * #Mbedtls_Pkcs11_Connect.
+ *
+ * In non-blocking mode the socket is set to non-blocking after the TCP connection
+ * is established, and the transport waits for the socket readiness with poll. A
+ * receive returns as soon as data is available, the receive timeout expires, or
+ * the wakeup file descriptor becomes readable. Selecting the mode clears the wakeup
+ * file descriptor.
+ *
+ * @param[in] pNetworkContext Network context.
+ * @param[in] nonBlocking true to select the non-blocking mode.
+ */
+void Mbedtls_Pkcs11_SetNonBlocking( NetworkContext_t * pNetworkContext,
+                                    bool nonBlocking );
+
+/**
+ * @brief Set the file descriptor waited together with the socket in non-blocking
+ * mode. A waiting #Mbedtls_Pkcs11_Recv returns zero when it becomes readable, so the
+ * caller can handle other work, e.g. commands posted to a queue.
+ *
+ * @param[in] pNetworkContext Network context.
+ * @param[in] wakeupFd File descriptor to wait for, or -1 to wait for the socket only.
+ */
+void Mbedtls_Pkcs11_SetWakeupFd( NetworkContext_t * pNetworkContext,
+                                 int wakeupFd );
+
+/**
+ * @brief Set the function used to wait for the readiness of a non-blocking
+ * connection. It is kept when the connection is reconnected. With a wait
+ * function, the blocking steps of the connect run on worker threads, see
+ * #Mbedtls_Pkcs11_RunBlocking.
+ *
+ * @param[in] pNetworkContext Network context.
+ * @param[in] waitFunction Function to wait with, or NULL to use poll.
+ * @param[in] pWaitContext Context passed to waitFunction.
+ */
+void Mbedtls_Pkcs11_SetWaitFunction( NetworkContext_t * pNetworkContext,
+                                     MbedtlsPkcs11WaitFunction_t waitFunction,
+                                     void * pWaitContext );
+
+/**
+ * @brief Get the duration of the phases of the last connect of a connection,
+ * successful or not.
+ *
+ * @param[in] pNetworkContext Network context.
+ * @param[out] pTiming Duration of the phases.
+ */
+void Mbedtls_Pkcs11_GetConnectTiming( const NetworkContext_t * pNetworkContext,
+                                      MbedtlsPkcs11ConnectTiming_t * pTiming );
+
+/**
+ * @brief Get the record lengths and the MbedTLS heap memory of a connection.
+ * The memory is only counted after #Mbedtls_Pkcs11_MemoryInit.
+ *
+ * @param[in] pNetworkContext Network context.
+ * @param[out] pStats TLS memory of the connection.
+ */
+void Mbedtls_Pkcs11_GetMemoryStats( const NetworkContext_t * pNetworkContext,
+                                    MbedtlsPkcs11MemoryStats_t * pStats );
+
+/**
+ * @brief Get a copy of the connect phase histograms of all the connections.
+ *
+ * @param[out] pHistogram Copy of the histograms.
+ */
+void Mbedtls_Pkcs11_GetConnectHistogram( MbedtlsPkcs11ConnectHistogram_t * pHistogram );
+
+/**
+ * @brief Reset the connect phase histograms, e.g. after they are reported.
+ */
+void Mbedtls_Pkcs11_ResetConnectHistogram( void );
+
 /**
  * @brief Gracefully disconnect an established TLS connection.
  *
@@ -200,6 +432,10 @@ void Mbedtls_Pkcs11_Disconnect( NetworkContext_t * pNetworkContext );
  * @param[out] pBuffer Buffer to receive network data into.
  * @param[in] bytesToRecv Number of bytes requested from the network.
  *
+ * @note Data waiting in the write-combining buffer is sent before reading when
+ * it is due, see #MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US. A flush failure is
+ * returned by the receive.
+ *
  * @return Number of bytes received if successful; negative value to indicate failure.
  * A return value of zero represents that the receive operation can be retried.
  */
@@ -211,7 +447,8 @@ int32_t Mbedtls_Pkcs11_Recv( NetworkContext_t * pNetworkContext,
  * @brief Sends data over an established TLS session using the MbedTLS API.
  *
  * This function can be used as the #TransportInterface.send implementation of
- * the transport interface to send data over the network.
+ * the transport interface to send data over the network. The data is collected
+ * in the write-combining buffer in the same way as #Mbedtls_Pkcs11_Writev.
  *
  * @param[in] pNetworkContext The network context created using Mbedtls_Pkcs11_Connect API.
  * @param[in] pBuffer Buffer containing the bytes to send over the network stack.
@@ -226,6 +463,40 @@ int32_t Mbedtls_Pkcs11_Send( NetworkContext_t * pNetworkContext,
                              const void * pBuffer,
                              size_t bytesToSend );
 
+/**
+ * @brief Sends an array of buffers over an established TLS session.
+ *
+ * This function can be used as the #TransportInterface.writev implementation of
+ * the transport interface. The buffers are collected in the write-combining
+ * buffer together with the data of previous calls. The buffer is flushed when it
+ * reaches #MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD, when the oldest data is older than
+ * #MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US and on disconnect.
+ *
+ * Once a flush fails, the data in the buffer is lost and the connection is not
+ * usable anymore: the error is returned by the failed call and by all the later
+ * sends, receives and flushes of the connection, so that data reported as sent
+ * is not dropped silently.
+ *
+ * @param[in] pNetworkContext The network context created using Mbedtls_Pkcs11_Connect API.
+ * @param[in] pIoVec Array of buffers to send.
+ * @param[in] ioVecCount Number of buffers in @p pIoVec.
+ *
+ * @return Number of bytes sent if successful; negative value on error.
+ */
+int32_t Mbedtls_Pkcs11_Writev( NetworkContext_t * pNetworkContext,
+                               TransportOutVector_t * pIoVec,
+                               size_t ioVecCount );
+
+/**
+ * @brief Sends the data collected in the write-combining buffer.
+ *
+ * @param[in] pNetworkContext The network context created using Mbedtls_Pkcs11_Connect API.
+ *
+ * @return Zero if successful; negative value on error, including the error of
+ * an earlier failed flush.
+ */
+int32_t Mbedtls_Pkcs11_Flush( NetworkContext_t * pNetworkContext );
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
     }
@@ -0,0 +1,141 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_RANDOM_H_
+#define MBEDTLS_PKCS11_RANDOM_H_
+
+/**
+ * @file mbedtls_pkcs11_random.h
+ *
+ * @brief Random number generator of the MbedTLS and corePKCS11 transport. A
+ * CTR-DRBG seeded from C_GenerateRandom serves the random bytes requested by
+ * MbedTLS from memory, so that a handshake does not call the PKCS #11 module for
+ * each nonce and padding.
+ *
+ * The DRBG output is generated in blocks of #MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE
+ * bytes. The DRBG is reseeded from the PKCS #11 module after
+ * #MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL blocks.
+ *
+ * A child process inherits the DRBG state of its parent, so the first request
+ * of the child after fork() drops the buffered output and mixes bytes read
+ * from getrandom() and the pid of the child into the DRBG state, so that the
+ * parent and child streams differ. The PKCS #11 module is not called for it:
+ * the child cannot use the sessions opened by its parent. A child that keeps
+ * generating past the reseed interval must initialize its own PKCS #11 module
+ * and session pool, like any other PKCS #11 use in a child.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* MbedTLS includes. */
+#include "mbedtls/ctr_drbg.h"
+
+/* PKCS #11 includes. */
+#include "core_pkcs11.h"
+
+/**
+ * @brief Number of random bytes generated by the DRBG at once. Smaller requests
+ * are served from the generated block. It must not be larger than
+ * MBEDTLS_CTR_DRBG_MAX_REQUEST.
+ */
+#ifndef MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE
+    #define MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE    ( 256U )
+#endif
+
+/**
+ * @brief Number of DRBG generate calls after which the DRBG is reseeded from the
+ * PKCS #11 module.
+ */
+#ifndef MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL
+    #define MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL    ( 1024U )
+#endif
+
+/**
+ * @brief Random number generator state.
+ */
+typedef struct MbedtlsPkcs11Random
+{
+    mbedtls_ctr_drbg_context drbg;         /**< @brief CTR-DRBG serving the requests. */
+    CK_FUNCTION_LIST_PTR pP11FunctionList; /**< @brief PKCS #11 function list. */
+    CK_SLOT_ID p11SlotId;                  /**< @brief Slot on which a session is leased to seed the DRBG. */
+    pid_t seedPid;                         /**< @brief Process that last seeded the DRBG. */
+    uint32_t generateCount;                /**< @brief DRBG generate calls since the last seeding. */
+    pthread_mutex_t mutex;                 /**< @brief Serializes the requests. */
+
+    uint8_t buffer[ MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE ]; /**< @brief Block of DRBG output. */
+    size_t bufferOffset;                                 /**< @brief Offset of the first unused byte of #buffer. */
+} MbedtlsPkcs11Random_t;
+
+/**
+ * @brief Initialize a random number generator and seed it from the PKCS #11 module.
+ *
+ * @param[out] pRandom Random number generator to initialize.
+ * @param[in] pP11FunctionList PKCS #11 function list.
+ * @param[in] p11SlotId Slot of the PKCS #11 module seeding the DRBG. Each seeding
+ * is made on a session leased from the session pool, so that it does not run on
+ * a session in use by another thread.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure. The generator
+ * must be freed with #Mbedtls_Pkcs11_RandomFree in both cases.
+ */
+int32_t Mbedtls_Pkcs11_RandomInit( MbedtlsPkcs11Random_t * pRandom,
+                                   CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                   CK_SLOT_ID p11SlotId );
+
+/**
+ * @brief Free a random number generator.
+ *
+ * @param[in] pRandom Random number generator to free.
+ */
+void Mbedtls_Pkcs11_RandomFree( MbedtlsPkcs11Random_t * pRandom );
+
+/**
+ * @brief Generate random bytes. It has the signature of an MbedTLS RNG callback
+ * and can be called from any thread.
+ *
+ * @param[in] pCtx Random number generator.
+ * @param[out] pOutput Buffer to fill with random bytes.
+ * @param[in] outputLength Number of bytes to generate.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure.
+ */
+int Mbedtls_Pkcs11_RandomGenerate( void * pCtx,
+                                   unsigned char * pOutput,
+                                   size_t outputLength );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_RANDOM_H_ */
@@ -0,0 +1,111 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_SECURE_ARENA_H_
+#define MBEDTLS_PKCS11_SECURE_ARENA_H_
+
+/**
+ * @file mbedtls_pkcs11_secure_arena.h
+ *
+ * @brief Memory arena of the credential material handled outside the PKCS #11
+ * module, such as the private keys being imported and the provisioning buffers.
+ *
+ * The arena is mapped once by #Mbedtls_Pkcs11_SecureArenaInit and locked in
+ * RAM, so that the credentials are not swapped out, and it is excluded from core
+ * dumps where the system allows it. Its memory is handed out in blocks of
+ * #MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE bytes and wiped when it is freed, so
+ * the free blocks are always zero and the credentials do not outlive their use.
+ *
+ * The arena has a fixed size: an allocation that does not fit fails rather
+ * than growing the memory holding credentials.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Allocation unit of the arena. Allocations are aligned on it.
+ */
+#ifndef MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE
+    #define MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE    ( 64U )
+#endif
+
+/**
+ * @brief Map and lock the arena. Later calls do nothing until
+ * #Mbedtls_Pkcs11_SecureArenaDeinit.
+ *
+ * The arena is still used when it cannot be locked, for example because of
+ * RLIMIT_MEMLOCK, and a warning is logged.
+ *
+ * @param[in] size Size of the arena in bytes. It is rounded up to whole pages.
+ *
+ * @return true if the arena is mapped; false otherwise.
+ */
+bool Mbedtls_Pkcs11_SecureArenaInit( size_t size );
+
+/**
+ * @brief Wipe, unlock and unmap the arena. The memory allocated from it must
+ * not be used anymore.
+ */
+void Mbedtls_Pkcs11_SecureArenaDeinit( void );
+
+/**
+ * @brief Allocate zeroed memory from the arena. It can be called from any thread.
+ *
+ * @param[in] length Number of bytes to allocate.
+ *
+ * @return The memory; NULL if @p length is zero, if the arena is not mapped or
+ * if it has no free range large enough.
+ */
+void * Mbedtls_Pkcs11_SecureArenaAlloc( size_t length );
+
+/**
+ * @brief Wipe memory allocated from the arena and return it to the arena.
+ *
+ * @param[in] pMemory Memory returned by #Mbedtls_Pkcs11_SecureArenaAlloc, or NULL.
+ */
+void Mbedtls_Pkcs11_SecureArenaFree( void * pMemory );
+
+/**
+ * @brief Read the usage of the arena.
+ *
+ * @param[out] pUsedBytes Bytes of the allocated blocks. May be NULL.
+ * @param[out] pPeakBytes Largest value of @p pUsedBytes since the arena was
+ * mapped. May be NULL.
+ */
+void Mbedtls_Pkcs11_SecureArenaRead( size_t * pUsedBytes,
+                                     size_t * pPeakBytes );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_SECURE_ARENA_H_ */
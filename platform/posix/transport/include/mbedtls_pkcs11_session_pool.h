@@ -0,0 +1,96 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_SESSION_POOL_H_
+#define MBEDTLS_PKCS11_SESSION_POOL_H_
+
+/**
+ * @file mbedtls_pkcs11_session_pool.h
+ *
+ * @brief Process-wide pool of PKCS #11 sessions. A PKCS #11 session holds the
+ * state of one cryptographic operation at a time, so operations that may run
+ * concurrently, such as the signatures of parallel TLS handshakes, each lease a
+ * session from the pool and return it when the operation is complete.
+ *
+ * Sessions are opened on demand, up to #MBEDTLS_PKCS11_SESSION_POOL_SIZE, and are
+ * kept open for the next lease. When all of them are leased, a lease waits until
+ * a session is returned. An operation must be completed or cancelled before its
+ * session is returned.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stdbool.h>
+
+/* PKCS #11 includes. */
+#include "core_pkcs11.h"
+
+/**
+ * @brief Maximum number of sessions opened by the pool. Together with the
+ * sessions of the application, it must not exceed the session limit of the
+ * PKCS #11 module.
+ */
+#ifndef MBEDTLS_PKCS11_SESSION_POOL_SIZE
+    #define MBEDTLS_PKCS11_SESSION_POOL_SIZE    ( 4U )
+#endif
+
+/**
+ * @brief Lease a session on a slot. An idle session of the slot is reused, or a
+ * new one is opened. The call blocks while all the sessions of the pool are
+ * leased.
+ *
+ * @param[in] slotId PKCS #11 slot of the session.
+ * @param[out] pSession Leased session.
+ *
+ * @return CKR_OK on success; PKCS #11 error code of C_OpenSession otherwise.
+ */
+CK_RV Mbedtls_Pkcs11_SessionPoolLease( CK_SLOT_ID slotId,
+                                       CK_SESSION_HANDLE_PTR pSession );
+
+/**
+ * @brief Return a leased session to the pool.
+ *
+ * @param[in] session Session returned by #Mbedtls_Pkcs11_SessionPoolLease.
+ * @param[in] discard Close the session instead of keeping it for the next lease,
+ * e.g. when an operation failed and its state is unknown.
+ */
+void Mbedtls_Pkcs11_SessionPoolReturn( CK_SESSION_HANDLE session,
+                                       bool discard );
+
+/**
+ * @brief Close the idle sessions of the pool. The leased sessions are closed when
+ * they are returned. It must be called before the PKCS #11 module is finalized.
+ */
+void Mbedtls_Pkcs11_SessionPoolClose( void );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_SESSION_POOL_H_ */
@@ -0,0 +1,80 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef MBEDTLS_PKCS11_SIGN_H_
+#define MBEDTLS_PKCS11_SIGN_H_
+
+/**
+ * @file mbedtls_pkcs11_sign.h
+ *
+ * @brief Signature of the TLS handshakes of the MbedTLS and corePKCS11
+ * transport with the private key of a PKCS #11 token. Each signature is made
+ * on a session leased from the session pool, so concurrent handshakes do not
+ * wait for each other.
+ */
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    extern "C" {
+#endif
+/* *INDENT-ON* */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <stdint.h>
+
+/* PKCS #11 includes. */
+#include "core_pkcs11.h"
+
+/**
+ * @brief Sign a SHA-256 hash with a PKCS #11 private key, in the format MbedTLS
+ * expects from the sign function of a private key.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list.
+ * @param[in] p11SlotId Slot of the token holding the key.
+ * @param[in] p11PrivateKey Handle of the private key.
+ * @param[in] keyType PKCS #11 type of the key, CKK_RSA or CKK_EC.
+ * @param[in] pHash Hash to sign.
+ * @param[in] hashLen Length of the hash.
+ * @param[out] pSig Buffer of the signature, DER encoded for an EC key.
+ * @param[out] pSigLen Length of the signature.
+ *
+ * @return 0 on success; MBEDTLS_ERR_PK_BAD_INPUT_DATA for an unsupported key
+ * type or hash length; MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE if no session could
+ * be leased or the token failed to sign.
+ */
+int32_t Mbedtls_Pkcs11_Sign( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                             CK_SLOT_ID p11SlotId,
+                             CK_OBJECT_HANDLE p11PrivateKey,
+                             CK_KEY_TYPE keyType,
+                             const unsigned char * pHash,
+                             size_t hashLen,
+                             unsigned char * pSig,
+                             size_t * pSigLen );
+
+/* *INDENT-OFF* */
+#ifdef __cplusplus
+    }
+#endif
+/* *INDENT-ON* */
+
+#endif /* ifndef MBEDTLS_PKCS11_SIGN_H_ */
@@ -0,0 +1,936 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the credential cache. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Credential cache header. */
+#include "mbedtls_pkcs11_credential_cache.h"
+
+/* PKCS #11 includes. */
+#include "core_pkcs11_config.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Source of a cached chain.
+ */
+typedef enum CredentialSource
+{
+    CREDENTIAL_SOURCE_FILE = 0,
+    CREDENTIAL_SOURCE_PKCS11
+} CredentialSource_t;
+
+/**
+ * @brief A cached chain. The chain is the first member, so that a chain returned
+ * to the caller can be converted back to its entry.
+ */
+typedef struct CredentialCacheEntry
+{
+    mbedtls_x509_crt chain;
+    CredentialSource_t source;
+    char * pKey;
+    uint32_t refCount;
+    bool invalidated;
+
+    /* Identity of the file of a CREDENTIAL_SOURCE_FILE entry. */
+    dev_t fileDevice;
+    ino_t fileInode;
+    off_t fileSize;
+    struct timespec fileModifiedTime;
+
+    /* Slot and object of a CREDENTIAL_SOURCE_PKCS11 entry. */
+    CK_SLOT_ID slotId;
+    CK_OBJECT_HANDLE objectHandle;
+
+    struct CredentialCacheEntry * pNext;
+} CredentialCacheEntry_t;
+
+/**
+ * @brief A cached PKCS #11 object handle.
+ */
+typedef struct ObjectCacheEntry
+{
+    CK_SLOT_ID slotId;
+    char * pLabel;
+    CK_OBJECT_CLASS objectClass;
+    CK_OBJECT_HANDLE handle;
+    CK_KEY_TYPE keyType; /* Only set for CKO_PRIVATE_KEY. */
+    struct ObjectCacheEntry * pNext;
+} ObjectCacheEntry_t;
+
+/**
+ * @brief Valid entries of the cache. Invalidated entries are removed from the
+ * list and freed when their last reference is released.
+ */
+static CredentialCacheEntry_t * pCacheEntries = NULL;
+
+/**
+ * @brief Cached object handles.
+ */
+static ObjectCacheEntry_t * pObjectEntries = NULL;
+
+/**
+ * @brief Number of invalidations. A handle found on the token is only cached if
+ * no invalidation happened during the search.
+ */
+static uint32_t invalidationCount = 0U;
+
+/**
+ * @brief Mutex protecting the lists and the reference counts.
+ */
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Allocate an entry with an initialized chain.
+ *
+ * @param[in] source Source of the chain.
+ * @param[in] pKey Path or label of the chain.
+ *
+ * @return The entry with one reference; NULL on failure.
+ */
+static CredentialCacheEntry_t * entryCreate( CredentialSource_t source,
+                                             const char * pKey );
+
+/**
+ * @brief Free an entry and its chain.
+ *
+ * @param[in] pEntry The entry to free.
+ */
+static void entryFree( CredentialCacheEntry_t * pEntry );
+
+/**
+ * @brief Remove an entry from the list and free it if it is not referenced.
+ * Must be called with the cache mutex held.
+ *
+ * @param[in] pEntry The entry to invalidate.
+ */
+static void entryInvalidate( CredentialCacheEntry_t * pEntry );
+
+/**
+ * @brief Find a valid entry. Must be called with the cache mutex held.
+ *
+ * @param[in] source Source of the chain.
+ * @param[in] slotId PKCS #11 slot of a CREDENTIAL_SOURCE_PKCS11 chain; zero
+ * for a file.
+ * @param[in] pKey Path or label of the chain.
+ *
+ * @return The entry; NULL if not cached.
+ */
+static CredentialCacheEntry_t * entryFind( CredentialSource_t source,
+                                           CK_SLOT_ID slotId,
+                                           const char * pKey );
+
+/**
+ * @brief Add a new entry to the cache, unless another thread cached an entry
+ * for the same key that is still current. Must be called with the cache mutex
+ * held.
+ *
+ * @param[in] pNewEntry The entry parsed by the calling thread.
+ * @param[in] pCurrentEntry A current entry found for the same key, or NULL.
+ *
+ * @return The entry returned to the caller.
+ */
+static CredentialCacheEntry_t * entryInsert( CredentialCacheEntry_t * pNewEntry,
+                                             CredentialCacheEntry_t * pCurrentEntry );
+
+/**
+ * @brief Check whether a file entry matches the status of its file.
+ *
+ * @param[in] pEntry The entry.
+ * @param[in] pFileStatus Status of the file.
+ *
+ * @return true if the file is unchanged.
+ */
+static bool fileMatches( const CredentialCacheEntry_t * pEntry,
+                         const struct stat * pFileStatus );
+
+/**
+ * @brief Get the slot of a PKCS #11 session. The cached objects are kept per
+ * slot, as the same labels are used on each token.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list, or NULL to get it.
+ * @param[in] p11Session PKCS #11 session.
+ * @param[out] pSlotId Slot of the session.
+ *
+ * @return CKR_OK on success.
+ */
+static CK_RV getSessionSlot( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                             CK_SESSION_HANDLE p11Session,
+                             CK_SLOT_ID * pSlotId );
+
+/**
+ * @brief Find a cached object handle. Must be called with the cache mutex held.
+ *
+ * @param[in] slotId Slot of the object.
+ * @param[in] pLabel PKCS #11 label of the object.
+ * @param[in] objectClass PKCS #11 class of the object.
+ *
+ * @return The entry; NULL if not cached.
+ */
+static ObjectCacheEntry_t * objectEntryFind( CK_SLOT_ID slotId,
+                                             const char * pLabel,
+                                             CK_OBJECT_CLASS objectClass );
+
+/**
+ * @brief Get the handle and key type of an object from the cache or the token.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list. Only used for private keys.
+ * @param[in] p11Session PKCS #11 session.
+ * @param[in] slotId Slot of @p p11Session.
+ * @param[in] pLabel PKCS #11 label of the object.
+ * @param[in] objectClass PKCS #11 class of the object.
+ * @param[out] pHandle Handle of the object; CK_INVALID_HANDLE if it is not found.
+ * @param[out] pKeyType Key type of a private key. NULL for other classes.
+ *
+ * @return CKR_OK if the search succeeded.
+ */
+static CK_RV findObject( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                         CK_SESSION_HANDLE p11Session,
+                         CK_SLOT_ID slotId,
+                         const char * pLabel,
+                         CK_OBJECT_CLASS objectClass,
+                         CK_OBJECT_HANDLE_PTR pHandle,
+                         CK_KEY_TYPE * pKeyType );
+
+/**
+ * @brief Remove the cached handles of a label. Must be called with the cache
+ * mutex held.
+ *
+ * @param[in] pLabel PKCS #11 label, or NULL to remove all the handles.
+ */
+static void objectEntriesRemove( const char * pLabel );
+
+/**
+ * @brief Export a certificate object and parse it into a chain.
+ *
+ * @param[in] pP11FunctionList PKCS #11 function list.
+ * @param[in] p11Session PKCS #11 session.
+ * @param[in] certificateHandle Handle of the certificate object.
+ * @param[out] pChain Chain to parse the certificate into.
+ *
+ * @return true on success.
+ */
+static bool readCertificateObject( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                   CK_SESSION_HANDLE p11Session,
+                                   CK_OBJECT_HANDLE certificateHandle,
+                                   mbedtls_x509_crt * pChain );
+
+/*-----------------------------------------------------------*/
+
+static CredentialCacheEntry_t * entryCreate( CredentialSource_t source,
+                                             const char * pKey )
+{
+    CredentialCacheEntry_t * pEntry = NULL;
+    size_t keyLength = strlen( pKey );
+
+    pEntry = malloc( sizeof( CredentialCacheEntry_t ) );
+
+    if( pEntry != NULL )
+    {
+        memset( pEntry, 0, sizeof( CredentialCacheEntry_t ) );
+        pEntry->pKey = malloc( keyLength + 1U );
+
+        if( pEntry->pKey == NULL )
+        {
+            free( pEntry );
+            pEntry = NULL;
+        }
+    }
+
+    if( pEntry != NULL )
+    {
+        memcpy( pEntry->pKey, pKey, keyLength + 1U );
+        mbedtls_x509_crt_init( &( pEntry->chain ) );
+        pEntry->source = source;
+        pEntry->refCount = 1U;
+    }
+    else
+    {
+        LogError( ( "Failed to allocate a credential cache entry for %s.", pKey ) );
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static void entryFree( CredentialCacheEntry_t * pEntry )
+{
+    mbedtls_x509_crt_free( &( pEntry->chain ) );
+    free( pEntry->pKey );
+    free( pEntry );
+}
+
+/*-----------------------------------------------------------*/
+
+static void entryInvalidate( CredentialCacheEntry_t * pEntry )
+{
+    CredentialCacheEntry_t ** ppLink = &pCacheEntries;
+
+    while( ( *ppLink != NULL ) && ( *ppLink != pEntry ) )
+    {
+        ppLink = &( ( *ppLink )->pNext );
+    }
+
+    if( *ppLink == pEntry )
+    {
+        *ppLink = pEntry->pNext;
+    }
+
+    pEntry->pNext = NULL;
+    pEntry->invalidated = true;
+
+    if( pEntry->refCount == 0U )
+    {
+        entryFree( pEntry );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static CredentialCacheEntry_t * entryFind( CredentialSource_t source,
+                                           CK_SLOT_ID slotId,
+                                           const char * pKey )
+{
+    CredentialCacheEntry_t * pEntry = pCacheEntries;
+
+    while( ( pEntry != NULL ) &&
+           ( ( pEntry->source != source ) ||
+             ( pEntry->slotId != slotId ) ||
+             ( strcmp( pEntry->pKey, pKey ) != 0 ) ) )
+    {
+        pEntry = pEntry->pNext;
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static CredentialCacheEntry_t * entryInsert( CredentialCacheEntry_t * pNewEntry,
+                                             CredentialCacheEntry_t * pCurrentEntry )
+{
+    CredentialCacheEntry_t * pEntry = pNewEntry;
+    CredentialCacheEntry_t * pOldEntry;
+
+    if( pCurrentEntry != NULL )
+    {
+        /* Another thread parsed the same credential first. */
+        pCurrentEntry->refCount++;
+        pNewEntry->refCount = 0U;
+        entryFree( pNewEntry );
+        pEntry = pCurrentEntry;
+    }
+    else
+    {
+        pOldEntry = entryFind( pNewEntry->source, pNewEntry->slotId, pNewEntry->pKey );
+
+        if( pOldEntry != NULL )
+        {
+            entryInvalidate( pOldEntry );
+        }
+
+        pNewEntry->pNext = pCacheEntries;
+        pCacheEntries = pNewEntry;
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool fileMatches( const CredentialCacheEntry_t * pEntry,
+                         const struct stat * pFileStatus )
+{
+    return ( pEntry->fileDevice == pFileStatus->st_dev ) &&
+           ( pEntry->fileInode == pFileStatus->st_ino ) &&
+           ( pEntry->fileSize == pFileStatus->st_size ) &&
+           ( pEntry->fileModifiedTime.tv_sec == pFileStatus->st_mtim.tv_sec ) &&
+           ( pEntry->fileModifiedTime.tv_nsec == pFileStatus->st_mtim.tv_nsec );
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV getSessionSlot( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                             CK_SESSION_HANDLE p11Session,
+                             CK_SLOT_ID * pSlotId )
+{
+    CK_RV pkcs11Ret = CKR_OK;
+    CK_FUNCTION_LIST_PTR pFunctionList = pP11FunctionList;
+    CK_SESSION_INFO sessionInfo = { 0 };
+
+    if( pFunctionList == NULL )
+    {
+        pkcs11Ret = C_GetFunctionList( &pFunctionList );
+    }
+
+    if( pkcs11Ret == CKR_OK )
+    {
+        pkcs11Ret = pFunctionList->C_GetSessionInfo( p11Session, &sessionInfo );
+    }
+
+    if( pkcs11Ret == CKR_OK )
+    {
+        *pSlotId = sessionInfo.slotID;
+    }
+    else
+    {
+        LogError( ( "Failed to get the PKCS #11 session info with error code %lu.",
+                    ( unsigned long ) pkcs11Ret ) );
+    }
+
+    return pkcs11Ret;
+}
+
+/*-----------------------------------------------------------*/
+
+static ObjectCacheEntry_t * objectEntryFind( CK_SLOT_ID slotId,
+                                             const char * pLabel,
+                                             CK_OBJECT_CLASS objectClass )
+{
+    ObjectCacheEntry_t * pEntry = pObjectEntries;
+
+    while( ( pEntry != NULL ) &&
+           ( ( pEntry->slotId != slotId ) ||
+             ( pEntry->objectClass != objectClass ) ||
+             ( strcmp( pEntry->pLabel, pLabel ) != 0 ) ) )
+    {
+        pEntry = pEntry->pNext;
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+static CK_RV findObject( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                         CK_SESSION_HANDLE p11Session,
+                         CK_SLOT_ID slotId,
+                         const char * pLabel,
+                         CK_OBJECT_CLASS objectClass,
+                         CK_OBJECT_HANDLE_PTR pHandle,
+                         CK_KEY_TYPE * pKeyType )
+{
+    CK_RV pkcs11Ret = CKR_OK;
+    ObjectCacheEntry_t * pEntry = NULL;
+    ObjectCacheEntry_t * pCurrentEntry = NULL;
+    CK_ATTRIBUTE template = { 0 };
+    CK_KEY_TYPE keyType = 0;
+    uint32_t searchInvalidationCount;
+    size_t labelLength = strlen( pLabel );
+
+    *pHandle = CK_INVALID_HANDLE;
+
+    pthread_mutex_lock( &cacheMutex );
+    pEntry = objectEntryFind( slotId, pLabel, objectClass );
+
+    if( pEntry != NULL )
+    {
+        *pHandle = pEntry->handle;
+        keyType = pEntry->keyType;
+    }
+
+    searchInvalidationCount = invalidationCount;
+    pthread_mutex_unlock( &cacheMutex );
+
+    /* Search the token without holding the mutex. */
+    if( *pHandle == CK_INVALID_HANDLE )
+    {
+        pkcs11Ret = xFindObjectWithLabelAndClass( p11Session,
+                                                  ( char * ) pLabel,
+                                                  labelLength,
+                                                  objectClass,
+                                                  pHandle );
+
+        if( ( pkcs11Ret == CKR_OK ) && ( *pHandle != CK_INVALID_HANDLE ) && ( objectClass == CKO_PRIVATE_KEY ) )
+        {
+            template.type = CKA_KEY_TYPE;
+            template.pValue = &keyType;
+            template.ulValueLen = sizeof( keyType );
+            pkcs11Ret = pP11FunctionList->C_GetAttributeValue( p11Session,
+                                                               *pHandle,
+                                                               &template,
+                                                               1 );
+        }
+
+        if( ( pkcs11Ret == CKR_OK ) && ( *pHandle != CK_INVALID_HANDLE ) )
+        {
+            pEntry = malloc( sizeof( ObjectCacheEntry_t ) );
+
+            if( pEntry != NULL )
+            {
+                pEntry->pLabel = malloc( labelLength + 1U );
+
+                if( pEntry->pLabel == NULL )
+                {
+                    free( pEntry );
+                    pEntry = NULL;
+                }
+            }
+        }
+
+        /* The handle is still returned if it cannot be cached. */
+        if( pEntry != NULL )
+        {
+            memcpy( pEntry->pLabel, pLabel, labelLength + 1U );
+            pEntry->slotId = slotId;
+            pEntry->objectClass = objectClass;
+            pEntry->handle = *pHandle;
+            pEntry->keyType = keyType;
+
+            pthread_mutex_lock( &cacheMutex );
+
+            /* Another thread may have cached the handle during the search. The
+             * first handle is kept, so that the list holds one entry per
+             * object. */
+            if( searchInvalidationCount == invalidationCount )
+            {
+                pCurrentEntry = objectEntryFind( slotId, pLabel, objectClass );
+
+                if( pCurrentEntry == NULL )
+                {
+                    pEntry->pNext = pObjectEntries;
+                    pObjectEntries = pEntry;
+                    pEntry = NULL;
+                }
+                else
+                {
+                    *pHandle = pCurrentEntry->handle;
+                    keyType = pCurrentEntry->keyType;
+                }
+            }
+
+            pthread_mutex_unlock( &cacheMutex );
+
+            if( pEntry != NULL )
+            {
+                free( pEntry->pLabel );
+                free( pEntry );
+            }
+        }
+    }
+
+    if( pKeyType != NULL )
+    {
+        *pKeyType = keyType;
+    }
+
+    return pkcs11Ret;
+}
+
+/*-----------------------------------------------------------*/
+
+static void objectEntriesRemove( const char * pLabel )
+{
+    ObjectCacheEntry_t ** ppLink = &pObjectEntries;
+    ObjectCacheEntry_t * pEntry;
+
+    while( *ppLink != NULL )
+    {
+        pEntry = *ppLink;
+
+        if( ( pLabel == NULL ) || ( strcmp( pEntry->pLabel, pLabel ) == 0 ) )
+        {
+            *ppLink = pEntry->pNext;
+            free( pEntry->pLabel );
+            free( pEntry );
+        }
+        else
+        {
+            ppLink = &( pEntry->pNext );
+        }
+    }
+
+    invalidationCount++;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool readCertificateObject( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                   CK_SESSION_HANDLE p11Session,
+                                   CK_OBJECT_HANDLE certificateHandle,
+                                   mbedtls_x509_crt * pChain )
+{
+    CK_RV pkcs11Ret = CKR_OK;
+    CK_ATTRIBUTE template = { 0 };
+    int32_t mbedtlsRet = -1;
+
+    /* Query the certificate size. */
+    template.type = CKA_VALUE;
+    template.ulValueLen = 0;
+    template.pValue = NULL;
+    pkcs11Ret = pP11FunctionList->C_GetAttributeValue( p11Session,
+                                                       certificateHandle,
+                                                       &template,
+                                                       1 );
+
+    /* Create a buffer for the certificate. */
+    if( pkcs11Ret == CKR_OK )
+    {
+        template.pValue = malloc( template.ulValueLen );
+
+        if( NULL == template.pValue )
+        {
+            LogError( ( "Failed to allocate %lu bytes of memory for certificate buffer.",
+                        template.ulValueLen ) );
+            pkcs11Ret = CKR_HOST_MEMORY;
+        }
+    }
+
+    /* Export the certificate. */
+    if( pkcs11Ret == CKR_OK )
+    {
+        pkcs11Ret = pP11FunctionList->C_GetAttributeValue( p11Session,
+                                                           certificateHandle,
+                                                           &template,
+                                                           1 );
+    }
+
+    /* Decode the certificate. */
+    if( pkcs11Ret == CKR_OK )
+    {
+        mbedtlsRet = mbedtls_x509_crt_parse( pChain,
+                                             ( const unsigned char * ) template.pValue,
+                                             template.ulValueLen );
+    }
+
+    /* Free memory. */
+    free( template.pValue );
+
+    return( mbedtlsRet == 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+mbedtls_x509_crt * Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( const char * pRootCaPath )
+{
+    CredentialCacheEntry_t * pEntry = NULL;
+    CredentialCacheEntry_t * pNewEntry = NULL;
+    struct stat fileStatus;
+    int32_t mbedtlsError = 0;
+
+    assert( pRootCaPath != NULL );
+
+    if( stat( pRootCaPath, &fileStatus ) != 0 )
+    {
+        LogError( ( "Failed to get the status of root CA file %s with errno %d.", pRootCaPath, errno ) );
+    }
+    else
+    {
+        pthread_mutex_lock( &cacheMutex );
+        pEntry = entryFind( CREDENTIAL_SOURCE_FILE, 0U, pRootCaPath );
+
+        if( ( pEntry != NULL ) && ( fileMatches( pEntry, &fileStatus ) == true ) )
+        {
+            pEntry->refCount++;
+        }
+        else
+        {
+            pEntry = NULL;
+        }
+
+        pthread_mutex_unlock( &cacheMutex );
+
+        /* Parse the file without holding the mutex. */
+        if( pEntry == NULL )
+        {
+            pNewEntry = entryCreate( CREDENTIAL_SOURCE_FILE, pRootCaPath );
+        }
+    }
+
+    if( pNewEntry != NULL )
+    {
+        pNewEntry->fileDevice = fileStatus.st_dev;
+        pNewEntry->fileInode = fileStatus.st_ino;
+        pNewEntry->fileSize = fileStatus.st_size;
+        pNewEntry->fileModifiedTime = fileStatus.st_mtim;
+
+        mbedtlsError = mbedtls_x509_crt_parse_file( &( pNewEntry->chain ), pRootCaPath );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to parse server root CA certificate %s with error %d.", pRootCaPath, mbedtlsError ) );
+            entryFree( pNewEntry );
+        }
+        else
+        {
+            pthread_mutex_lock( &cacheMutex );
+            pEntry = entryFind( CREDENTIAL_SOURCE_FILE, 0U, pRootCaPath );
+
+            if( ( pEntry != NULL ) && ( fileMatches( pEntry, &fileStatus ) != true ) )
+            {
+                pEntry = NULL;
+            }
+
+            pEntry = entryInsert( pNewEntry, pEntry );
+            pthread_mutex_unlock( &cacheMutex );
+        }
+    }
+
+    return ( pEntry != NULL ) ? &( pEntry->chain ) : NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+CK_RV Mbedtls_Pkcs11_CredentialCacheFindObject( CK_SESSION_HANDLE p11Session,
+                                                const char * pLabel,
+                                                CK_OBJECT_CLASS objectClass,
+                                                CK_OBJECT_HANDLE_PTR pHandle )
+{
+    CK_RV pkcs11Ret;
+    CK_SLOT_ID slotId = 0U;
+
+    assert( pLabel != NULL );
+    assert( pHandle != NULL );
+
+    *pHandle = CK_INVALID_HANDLE;
+    pkcs11Ret = getSessionSlot( NULL, p11Session, &slotId );
+
+    if( pkcs11Ret == CKR_OK )
+    {
+        pkcs11Ret = findObject( NULL, p11Session, slotId, pLabel, objectClass, pHandle, NULL );
+    }
+
+    return pkcs11Ret;
+}
+
+/*-----------------------------------------------------------*/
+
+CK_RV Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                                    CK_SESSION_HANDLE p11Session,
+                                                    const char * pLabel,
+                                                    CK_OBJECT_HANDLE_PTR pHandle,
+                                                    CK_KEY_TYPE * pKeyType )
+{
+    CK_RV pkcs11Ret;
+    CK_SLOT_ID slotId = 0U;
+
+    assert( pP11FunctionList != NULL );
+    assert( pLabel != NULL );
+    assert( pHandle != NULL );
+    assert( pKeyType != NULL );
+
+    *pHandle = CK_INVALID_HANDLE;
+    *pKeyType = 0;
+    pkcs11Ret = getSessionSlot( pP11FunctionList, p11Session, &slotId );
+
+    if( pkcs11Ret == CKR_OK )
+    {
+        pkcs11Ret = findObject( pP11FunctionList, p11Session, slotId, pLabel, CKO_PRIVATE_KEY, pHandle, pKeyType );
+    }
+
+    return pkcs11Ret;
+}
+
+/*-----------------------------------------------------------*/
+
+mbedtls_x509_crt * Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                                                     CK_SESSION_HANDLE p11Session,
+                                                                     const char * pLabel )
+{
+    CredentialCacheEntry_t * pEntry = NULL;
+    CredentialCacheEntry_t * pNewEntry = NULL;
+    CK_OBJECT_HANDLE certificateHandle = CK_INVALID_HANDLE;
+    CK_SLOT_ID slotId = 0U;
+    CK_RV pkcs11Ret;
+    uint32_t readInvalidationCount = 0U;
+
+    assert( pP11FunctionList != NULL );
+    assert( pLabel != NULL );
+
+    /* The handle is normally cached, and detects a certificate object that was
+     * replaced. */
+    pkcs11Ret = getSessionSlot( pP11FunctionList, p11Session, &slotId );
+
+    if( pkcs11Ret == CKR_OK )
+    {
+        pkcs11Ret = findObject( pP11FunctionList,
+                                p11Session,
+                                slotId,
+                                pLabel,
+                                CKO_CERTIFICATE,
+                                &certificateHandle,
+                                NULL );
+    }
+
+    if( ( pkcs11Ret != CKR_OK ) || ( certificateHandle == CK_INVALID_HANDLE ) )
+    {
+        LogError( ( "Could not find certificate %s.", pLabel ) );
+    }
+    else
+    {
+        pthread_mutex_lock( &cacheMutex );
+        pEntry = entryFind( CREDENTIAL_SOURCE_PKCS11, slotId, pLabel );
+
+        if( ( pEntry != NULL ) && ( pEntry->objectHandle == certificateHandle ) )
+        {
+            pEntry->refCount++;
+        }
+        else
+        {
+            pEntry = NULL;
+        }
+
+        readInvalidationCount = invalidationCount;
+        pthread_mutex_unlock( &cacheMutex );
+
+        if( pEntry == NULL )
+        {
+            pNewEntry = entryCreate( CREDENTIAL_SOURCE_PKCS11, pLabel );
+        }
+    }
+
+    if( pNewEntry != NULL )
+    {
+        pNewEntry->slotId = slotId;
+        pNewEntry->objectHandle = certificateHandle;
+
+        if( readCertificateObject( pP11FunctionList, p11Session, certificateHandle, &( pNewEntry->chain ) ) != true )
+        {
+            LogError( ( "Failed to read certificate %s from the PKCS #11 module.", pLabel ) );
+            entryFree( pNewEntry );
+
+            /* The cached handle may be stale. Search the token on the next attempt. */
+            pthread_mutex_lock( &cacheMutex );
+            objectEntriesRemove( pLabel );
+            pthread_mutex_unlock( &cacheMutex );
+        }
+        else
+        {
+            pthread_mutex_lock( &cacheMutex );
+
+            if( readInvalidationCount != invalidationCount )
+            {
+                /* The certificate was replaced during the read. The chain is
+                 * returned to the caller but not cached, and is freed when it
+                 * is released. */
+                pNewEntry->invalidated = true;
+                pEntry = pNewEntry;
+            }
+            else
+            {
+                pEntry = entryFind( CREDENTIAL_SOURCE_PKCS11, slotId, pLabel );
+
+                if( ( pEntry != NULL ) && ( pEntry->objectHandle != certificateHandle ) )
+                {
+                    pEntry = NULL;
+                }
+
+                pEntry = entryInsert( pNewEntry, pEntry );
+            }
+
+            pthread_mutex_unlock( &cacheMutex );
+        }
+    }
+
+    return ( pEntry != NULL ) ? &( pEntry->chain ) : NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_CredentialCacheRelease( mbedtls_x509_crt * pCertificate )
+{
+    CredentialCacheEntry_t * pEntry = ( CredentialCacheEntry_t * ) pCertificate;
+
+    if( pEntry != NULL )
+    {
+        pthread_mutex_lock( &cacheMutex );
+
+        assert( pEntry->refCount > 0U );
+        pEntry->refCount--;
+
+        /* Valid entries stay cached for the next connection. */
+        if( ( pEntry->refCount == 0U ) && ( pEntry->invalidated == true ) )
+        {
+            entryFree( pEntry );
+        }
+
+        pthread_mutex_unlock( &cacheMutex );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_CredentialCacheInvalidate( const char * pLabel )
+{
+    CredentialCacheEntry_t * pEntry;
+    CredentialCacheEntry_t * pNextEntry;
+
+    assert( pLabel != NULL );
+
+    /* The label is invalidated on all the slots. */
+    pthread_mutex_lock( &cacheMutex );
+    pEntry = pCacheEntries;
+
+    while( pEntry != NULL )
+    {
+        pNextEntry = pEntry->pNext;
+
+        if( ( pEntry->source == CREDENTIAL_SOURCE_PKCS11 ) &&
+            ( strcmp( pEntry->pKey, pLabel ) == 0 ) )
+        {
+            entryInvalidate( pEntry );
+        }
+
+        pEntry = pNextEntry;
+    }
+
+    objectEntriesRemove( pLabel );
+    pthread_mutex_unlock( &cacheMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_CredentialCacheClear( void )
+{
+    pthread_mutex_lock( &cacheMutex );
+
+    while( pCacheEntries != NULL )
+    {
+        entryInvalidate( pCacheEntries );
+    }
+
+    objectEntriesRemove( NULL );
+
+    pthread_mutex_unlock( &cacheMutex );
+}
@@ -0,0 +1,271 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the memory accounting. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Memory accounting header. */
+#include "mbedtls_pkcs11_memory.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/platform.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Header stored before each MbedTLS allocation. The union keeps the
+ * allocation aligned for any type.
+ */
+typedef union AllocationHeader
+{
+    struct
+    {
+        MbedtlsPkcs11MemoryAccount_t * pAccount; /**< @brief Account of the allocation; NULL if not counted. */
+        size_t size;                             /**< @brief Size requested by MbedTLS. */
+    } info;
+    long double alignment; /**< @brief Alignment of the allocation. */
+    void * pAlignment;     /**< @brief Alignment of the allocation. */
+} AllocationHeader_t;
+
+/**
+ * @brief Thread-specific key of the selected account.
+ */
+static pthread_key_t accountKey;
+
+/**
+ * @brief Initialization of #accountKey and of the MbedTLS allocation functions.
+ */
+static pthread_once_t memoryOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief The accounting functions are installed in MbedTLS.
+ */
+static bool memoryInitialized = false;
+
+/**
+ * @brief Mutex protecting the members of the accounts.
+ */
+static pthread_mutex_t accountMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Create #accountKey and install the accounting functions in MbedTLS.
+ */
+static void memoryInit( void );
+
+#if defined( MBEDTLS_PLATFORM_MEMORY )
+
+/**
+ * @brief MbedTLS calloc function counting the allocation in the selected account.
+ *
+ * @param[in] count Number of elements.
+ * @param[in] size Size of an element.
+ *
+ * @return Zeroed memory; NULL on failure.
+ */
+    static void * accountingCalloc( size_t count,
+                                    size_t size );
+
+/**
+ * @brief MbedTLS free function removing the allocation from its account.
+ *
+ * @param[in] pMemory Memory returned by #accountingCalloc, or NULL.
+ */
+    static void accountingFree( void * pMemory );
+
+#endif /* if defined( MBEDTLS_PLATFORM_MEMORY ) */
+
+/*-----------------------------------------------------------*/
+
+static void memoryInit( void )
+{
+    #if defined( MBEDTLS_PLATFORM_MEMORY )
+        if( pthread_key_create( &accountKey, NULL ) == 0 )
+        {
+            ( void ) mbedtls_platform_set_calloc_free( accountingCalloc, accountingFree );
+            memoryInitialized = true;
+        }
+        else
+        {
+            LogError( ( "Failed to create the memory account key." ) );
+        }
+    #else
+        LogWarn( ( "MbedTLS is built without MBEDTLS_PLATFORM_MEMORY: TLS memory is not counted." ) );
+    #endif
+}
+
+/*-----------------------------------------------------------*/
+
+#if defined( MBEDTLS_PLATFORM_MEMORY )
+
+static void * accountingCalloc( size_t count,
+                                size_t size )
+{
+    AllocationHeader_t * pHeader = NULL;
+    MbedtlsPkcs11MemoryAccount_t * pAccount = NULL;
+    void * pMemory = NULL;
+    size_t length = 0U;
+
+    if( ( size == 0U ) || ( count <= ( ( SIZE_MAX - sizeof( AllocationHeader_t ) ) / size ) ) )
+    {
+        length = count * size;
+        pHeader = calloc( 1U, sizeof( AllocationHeader_t ) + length );
+    }
+
+    if( pHeader != NULL )
+    {
+        pAccount = pthread_getspecific( accountKey );
+        pHeader->info.pAccount = pAccount;
+        pHeader->info.size = length;
+
+        if( pAccount != NULL )
+        {
+            pthread_mutex_lock( &accountMutex );
+            pAccount->currentBytes += length;
+
+            if( pAccount->currentBytes > pAccount->peakBytes )
+            {
+                pAccount->peakBytes = pAccount->currentBytes;
+            }
+
+            pthread_mutex_unlock( &accountMutex );
+        }
+
+        pMemory = &( pHeader[ 1 ] );
+    }
+
+    return pMemory;
+}
+
+/*-----------------------------------------------------------*/
+
+static void accountingFree( void * pMemory )
+{
+    AllocationHeader_t * pHeader = NULL;
+
+    if( pMemory != NULL )
+    {
+        pHeader = &( ( ( AllocationHeader_t * ) pMemory )[ -1 ] );
+
+        if( pHeader->info.pAccount != NULL )
+        {
+            pthread_mutex_lock( &accountMutex );
+            pHeader->info.pAccount->currentBytes -= pHeader->info.size;
+            pthread_mutex_unlock( &accountMutex );
+        }
+
+        free( pHeader );
+    }
+}
+
+#endif /* if defined( MBEDTLS_PLATFORM_MEMORY ) */
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_MemoryInit( void )
+{
+    ( void ) pthread_once( &memoryOnce, memoryInit );
+}
+
+/*-----------------------------------------------------------*/
+
+MbedtlsPkcs11MemoryAccount_t * Mbedtls_Pkcs11_MemorySetAccount( MbedtlsPkcs11MemoryAccount_t * pAccount )
+{
+    MbedtlsPkcs11MemoryAccount_t * pPrevious = NULL;
+
+    if( memoryInitialized == true )
+    {
+        pPrevious = pthread_getspecific( accountKey );
+        ( void ) pthread_setspecific( accountKey, pAccount );
+    }
+
+    return pPrevious;
+}
+
+/*-----------------------------------------------------------*/
+
+int Mbedtls_Pkcs11_MemorySwapContext( ucontext_t * pCurrentContext,
+                                      const ucontext_t * pNextContext )
+{
+    MbedtlsPkcs11MemoryAccount_t * pAccount;
+    int ret;
+
+    /* The account stays with the coroutine, which may be in the middle of a
+     * handshake, rather than with the thread. */
+    pAccount = Mbedtls_Pkcs11_MemorySetAccount( NULL );
+    ret = swapcontext( pCurrentContext, pNextContext );
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pAccount );
+
+    return ret;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_MemoryRead( const MbedtlsPkcs11MemoryAccount_t * pAccount,
+                                size_t * pCurrentBytes,
+                                size_t * pPeakBytes )
+{
+    assert( pAccount != NULL );
+
+    pthread_mutex_lock( &accountMutex );
+
+    if( pCurrentBytes != NULL )
+    {
+        *pCurrentBytes = pAccount->currentBytes;
+    }
+
+    if( pPeakBytes != NULL )
+    {
+        *pPeakBytes = pAccount->peakBytes;
+    }
+
+    pthread_mutex_unlock( &accountMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_MemoryResetPeak( MbedtlsPkcs11MemoryAccount_t * pAccount )
+{
+    assert( pAccount != NULL );
+
+    pthread_mutex_lock( &accountMutex );
+    pAccount->peakBytes = pAccount->currentBytes;
+    pthread_mutex_unlock( &accountMutex );
+}
@@ -0,0 +1,183 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the blocking calls. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Blocking call header. */
+#include "mbedtls_pkcs11_offload.h"
+
+/* Memory accounting header. */
+#include "mbedtls_pkcs11_memory.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Blocking call handed to a worker thread.
+ */
+typedef struct OffloadedCall
+{
+    MbedtlsPkcs11BlockingCall_t blockingCall; /**< @brief Call to run. */
+    void * pArgument;                         /**< @brief Argument of the call. */
+    MbedtlsPkcs11MemoryAccount_t * pAccount;  /**< @brief Account selected by the caller. */
+    int eventFd;                              /**< @brief Event file descriptor written when the call completes. */
+} OffloadedCall_t;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Worker thread running a blocking call.
+ *
+ * @param[in] pOffloadedCall The #OffloadedCall_t to run.
+ *
+ * @return NULL.
+ */
+static void * offloadThread( void * pOffloadedCall );
+
+/**
+ * @brief Wait for the completion of a call with the wait function of the caller.
+ *
+ * @param[in] waitFunction Wait function of the caller.
+ * @param[in] pWaitContext Context passed to waitFunction.
+ * @param[in] eventFd Event file descriptor written when the call completes.
+ */
+static void waitForCompletion( MbedtlsPkcs11WaitFunction_t waitFunction,
+                               void * pWaitContext,
+                               int eventFd );
+
+/*-----------------------------------------------------------*/
+
+static void * offloadThread( void * pOffloadedCall )
+{
+    OffloadedCall_t * pCall = ( OffloadedCall_t * ) pOffloadedCall;
+    uint64_t completion = 1U;
+
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pCall->pAccount );
+    pCall->blockingCall( pCall->pArgument );
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( NULL );
+
+    if( write( pCall->eventFd, &completion, sizeof( completion ) ) != ( ssize_t ) sizeof( completion ) )
+    {
+        LogError( ( "Failed to signal the completion of a blocking call with errno %d.", errno ) );
+    }
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+static void waitForCompletion( MbedtlsPkcs11WaitFunction_t waitFunction,
+                               void * pWaitContext,
+                               int eventFd )
+{
+    struct pollfd pollFd;
+    int pollStatus;
+    uint64_t completion = 0U;
+
+    do
+    {
+        pollFd.fd = eventFd;
+        pollFd.events = POLLIN;
+        pollFd.revents = 0;
+        pollStatus = waitFunction( pWaitContext, &pollFd, 1U, -1 );
+    } while( ( pollStatus == 0 ) || ( ( pollStatus < 0 ) && ( errno == EINTR ) ) );
+
+    /* The call uses the memory of the caller, so it is waited for even if the
+     * wait function fails. */
+    if( pollStatus < 0 )
+    {
+        LogWarn( ( "Failed to wait for a blocking call with errno %d. Blocking the thread.", errno ) );
+    }
+
+    while( ( read( eventFd, &completion, sizeof( completion ) ) < 0 ) && ( errno == EINTR ) )
+    {
+        /* Retry on signals. */
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_RunBlocking( MbedtlsPkcs11WaitFunction_t waitFunction,
+                                 void * pWaitContext,
+                                 MbedtlsPkcs11BlockingCall_t blockingCall,
+                                 void * pArgument )
+{
+    OffloadedCall_t call;
+    pthread_t thread;
+    bool offloaded = false;
+
+    if( waitFunction != NULL )
+    {
+        call.blockingCall = blockingCall;
+        call.pArgument = pArgument;
+        call.eventFd = eventfd( 0U, EFD_CLOEXEC );
+
+        /* The worker counts its allocations in the account of the caller. */
+        call.pAccount = Mbedtls_Pkcs11_MemorySetAccount( NULL );
+        ( void ) Mbedtls_Pkcs11_MemorySetAccount( call.pAccount );
+
+        if( call.eventFd < 0 )
+        {
+            LogWarn( ( "Failed to create an event file descriptor with errno %d.", errno ) );
+        }
+        else if( pthread_create( &thread, NULL, offloadThread, &call ) != 0 )
+        {
+            LogWarn( ( "Failed to create a thread for a blocking call." ) );
+            ( void ) close( call.eventFd );
+        }
+        else
+        {
+            offloaded = true;
+        }
+    }
+
+    if( offloaded == true )
+    {
+        waitForCompletion( waitFunction, pWaitContext, call.eventFd );
+
+        /* The thread has signalled its completion, so it is about to exit. */
+        ( void ) pthread_join( thread, NULL );
+        ( void ) close( call.eventFd );
+    }
+    else
+    {
+        blockingCall( pArgument );
+    }
+}
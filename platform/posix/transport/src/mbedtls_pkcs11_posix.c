@@ -21,19 +21,26 @@
  */
 
 /* Standard includes. */
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 
 /* TLS transport header. */
 #include "mbedtls_pkcs11_posix.h"
+#include "mbedtls_pkcs11_credential_cache.h"
+#include "mbedtls_pkcs11_random.h"
+#include "mbedtls_pkcs11_session_pool.h"
+#include "mbedtls_pkcs11_offload.h"
+#include "mbedtls_pkcs11_sign.h"
 
 /* MbedTLS includes. */
 #include "mbedtls/debug.h"
 #include "mbedtls/error.h"
 
-/* PKCS #11 includes. */
-#include "core_pki_utils.h"
-
 /*-----------------------------------------------------------*/
 
 /**
@@ -64,6 +71,106 @@ static const char * pNoLowLevelMbedTlsCodeStr = "<No-Low-Level-Code>";
     ( mbedtls_low_level_strerr( mbedTlsCode ) != NULL ) ? \
     mbedtls_low_level_strerr( mbedTlsCode ) : pNoLowLevelMbedTlsCodeStr
 
+/**
+ * @brief Flags returned by #waitForReadiness.
+ */
+#define SOCKET_READY_FLAG    ( 1 )
+#define WAKEUP_READY_FLAG    ( 2 )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief TLS client profile. The MbedTLS SSL configuration of a profile is built
+ * once and shared by all the connections using the same credentials; only the
+ * SSL context is set up for each connection. A profile is reference counted by
+ * the connections using it.
+ */
+struct MbedtlsPkcs11Profile
+{
+    mbedtls_ssl_config config;            /**< @brief SSL connection configuration. */
+    mbedtls_x509_crt_profile certProfile; /**< @brief Certificate security profile. */
+    mbedtls_x509_crt * pRootCa;           /**< @brief Root CA certificate chain shared through the credential cache. */
+    mbedtls_x509_crt * pClientCert;       /**< @brief Client certificate shared through the credential cache. */
+    mbedtls_pk_context privKey;           /**< @brief Client private key context. */
+    mbedtls_pk_info_t privKeyInfo;        /**< @brief Client private key info. */
+
+    /* PKCS #11. */
+    CK_FUNCTION_LIST_PTR pP11FunctionList; /**< @brief PKCS #11 function list. */
+    CK_SESSION_HANDLE p11Session;          /**< @brief PKCS #11 session of the credentials, giving #p11SlotId. */
+    CK_SLOT_ID p11SlotId;                  /**< @brief Slot of #p11Session, on which the sessions of the profile are leased. */
+    CK_OBJECT_HANDLE p11PrivateKey;        /**< @brief PKCS #11 handle for the private key to use for client authentication. */
+    CK_KEY_TYPE keyType;                   /**< @brief PKCS #11 key type corresponding to #p11PrivateKey. */
+    MbedtlsPkcs11Random_t random;          /**< @brief Random number generator seeded from #p11SlotId. */
+
+    /* Credentials the profile was created for. */
+    char * pRootCaPath;        /**< @brief Path of the root CA. */
+    char * pClientCertLabel;   /**< @brief PKCS #11 label of the client certificate. */
+    char * pPrivateKeyLabel;   /**< @brief PKCS #11 label of the private key. */
+    const char ** pAlpnProtos; /**< @brief ALPN list referenced by #config. */
+    uint32_t recvTimeoutMs;    /**< @brief Receive timeout configured in #config. */
+    uint8_t mflCode;           /**< @brief Maximum fragment length code configured in #config. */
+
+    /* Session resumption. */
+    pthread_mutex_t resumptionMutex;       /**< @brief Protects the saved session. */
+    mbedtls_ssl_session resumptionSession; /**< @brief Session of the last handshake with #pResumptionHost. */
+    char * pResumptionHost;                /**< @brief Server of #resumptionSession; NULL if no session is saved. */
+    uint16_t resumptionPort;               /**< @brief Port of #pResumptionHost. */
+
+    uint32_t refCount;                    /**< @brief Number of connections using the profile. */
+    bool building;                        /**< @brief The profile is in #pProfiles but its configuration is being built. */
+    bool invalidated;                     /**< @brief The profile is no longer in #pProfiles. */
+    struct MbedtlsPkcs11Profile * pNext;  /**< @brief Next profile in #pProfiles. */
+};
+
+/**
+ * @brief Ciphersuites offered to the server, in order of preference. The AEAD
+ * suites come first, as AES-GCM encrypts and authenticates a record in one pass
+ * and uses the CPU AES and carry-less multiplication instructions where
+ * available. The CBC suites are kept for servers without AES-GCM. Suites that
+ * are not enabled in the MbedTLS configuration are ignored.
+ */
+static const int ciphersuites[] =
+{
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA,
+    0
+};
+
+/**
+ * @brief Current profiles. A profile with changed credentials is removed from the
+ * list and freed when its last connection is closed.
+ */
+static MbedtlsPkcs11Profile_t * pProfiles = NULL;
+
+/**
+ * @brief Mutex protecting #pProfiles and the reference counts of the profiles.
+ * It is not held while a profile is built or checked.
+ */
+static pthread_mutex_t profilesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signalled when a profile of #pProfiles is built or removed.
+ */
+static pthread_cond_t profilesCond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Connect phase histograms of all the connections.
+ */
+static MbedtlsPkcs11ConnectHistogram_t connectHistogram;
+
+/**
+ * @brief Mutex protecting #connectHistogram.
+ */
+static pthread_mutex_t histogramMutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*-----------------------------------------------------------*/
 
 /**
@@ -98,86 +205,198 @@ static MbedtlsPkcs11Status_t configureMbedtls( MbedtlsPkcs11Context_t * pMbedtls
                                                uint32_t recvTimeoutMs );
 
 /**
- * @brief Configure the client and Root CA in the MbedTLS SSL context.
+ * @brief Get the shared TLS client profile of a set of credentials. The profile
+ * is created on the first use, and created again when the root CA, the client
+ * certificate or the private key of the credentials changed.
  *
- * @param[in] pMbedtlsPkcs11Context Network context.
+ * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
+ * @param[in] recvTimeoutMs Receive timeout for network socket.
+ * @param[out] ppProfile The profile, which must be released with #profileRelease.
+ *
+ * @return #MBEDTLS_PKCS11_SUCCESS, #MBEDTLS_PKCS11_INSUFFICIENT_MEMORY,
+ * #MBEDTLS_PKCS11_INVALID_CREDENTIALS or #MBEDTLS_PKCS11_INTERNAL_ERROR.
+ */
+static MbedtlsPkcs11Status_t profileAcquire( const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                             uint32_t recvTimeoutMs,
+                                             MbedtlsPkcs11Profile_t ** ppProfile );
+
+/**
+ * @brief Release a profile returned by #profileAcquire.
+ *
+ * @param[in] pProfile The profile to release. NULL is ignored.
+ */
+static void profileRelease( MbedtlsPkcs11Profile_t * pProfile );
+
+/**
+ * @brief Create a profile holding the credentials it is for, to be built with
+ * #profileBuild. It does not call the PKCS #11 module.
+ *
+ * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
+ * @param[in] recvTimeoutMs Receive timeout for network socket.
+ * @param[out] ppProfile The profile with one reference, marked as building.
+ *
+ * @return #MBEDTLS_PKCS11_SUCCESS or #MBEDTLS_PKCS11_INSUFFICIENT_MEMORY.
+ */
+static MbedtlsPkcs11Status_t profileCreate( const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                            uint32_t recvTimeoutMs,
+                                            MbedtlsPkcs11Profile_t ** ppProfile );
+
+/**
+ * @brief Build the MbedTLS SSL configuration of a profile.
+ *
+ * @param[in] pProfile The profile returned by #profileCreate.
+ * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
+ *
+ * @return #MBEDTLS_PKCS11_SUCCESS, #MBEDTLS_PKCS11_INSUFFICIENT_MEMORY,
+ * #MBEDTLS_PKCS11_INVALID_CREDENTIALS or #MBEDTLS_PKCS11_INTERNAL_ERROR.
+ */
+static MbedtlsPkcs11Status_t profileBuild( MbedtlsPkcs11Profile_t * pProfile,
+                                           const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials );
+
+/**
+ * @brief Remove a profile from #pProfiles, if it is still there. The connections
+ * using it keep it until they are closed. Called with #profilesMutex held.
+ *
+ * @param[in] pProfile The profile to remove.
+ */
+static void profileDetach( MbedtlsPkcs11Profile_t * pProfile );
+
+/**
+ * @brief Free a profile and the MbedTLS structures in it.
+ *
+ * @param[in] pProfile The profile to free.
+ */
+static void profileFree( MbedtlsPkcs11Profile_t * pProfile );
+
+/**
+ * @brief Check whether a profile was created for a set of credentials.
+ *
+ * @param[in] pProfile The profile.
+ * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
+ * @param[in] recvTimeoutMs Receive timeout for network socket.
+ *
+ * @return true if the profile can be used for the credentials.
+ */
+static bool profileMatches( const MbedtlsPkcs11Profile_t * pProfile,
+                            const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                            uint32_t recvTimeoutMs );
+
+/**
+ * @brief Check whether the root CA, the client certificate and the private key
+ * of a profile are still current.
+ *
+ * @param[in] pProfile The profile.
+ *
+ * @return true if none of the credentials changed.
+ */
+static bool profileIsCurrent( MbedtlsPkcs11Profile_t * pProfile );
+
+/**
+ * @brief Configure the client and Root CA in the MbedTLS SSL configuration of a
+ * profile.
+ *
+ * @param[in] pProfile The profile.
  * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
  *
  * @return #MBEDTLS_PKCS11_SUCCESS on success,
  * #MBEDTLS_PKCS11_INVALID_CREDENTIALS on error.
  */
-static MbedtlsPkcs11Status_t configureMbedtlsCertificates( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
+static MbedtlsPkcs11Status_t configureMbedtlsCertificates( MbedtlsPkcs11Profile_t * pProfile,
                                                            const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials );
 
 /**
- * @brief Configure the SNI and ALPN in the MbedTLS SSL context.
+ * @brief Configure the ALPN in the MbedTLS SSL configuration of a profile.
+ *
+ * @param[in] pProfile The profile.
+ * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
+ *
+ * @return #MBEDTLS_PKCS11_SUCCESS on success,
+ * #MBEDTLS_PKCS11_INTERNAL_ERROR on error.
+ */
+static MbedtlsPkcs11Status_t configureMbedtlsAlpn( MbedtlsPkcs11Profile_t * pProfile,
+                                                   const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials );
+
+/**
+ * @brief Configure the SNI in the MbedTLS SSL context.
  *
  * @param[in] pMbedtlsPkcs11Context Network context.
  * @param[in] pMbedtlsPkcs11Credentials TLS setup parameters.
  * @param[in] pHostName Remote host name, used for server name indication.
  *
  * @return #MBEDTLS_PKCS11_SUCCESS on success,
- * #MBEDTLS_PKCS11_INVALID_CREDENTIALS on error.
+ * #MBEDTLS_PKCS11_INTERNAL_ERROR on error.
  */
-static MbedtlsPkcs11Status_t configureMbedtlsSniAlpn( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
-                                                      const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
-                                                      const char * pHostName );
+static MbedtlsPkcs11Status_t configureMbedtlsSni( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
+                                                  const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                                  const char * pHostName );
 
 /**
- * @brief Configure the Maximum Fragment Length in the MbedTLS SSL context.
+ * @brief Configure the Maximum Fragment Length of #MbedtlsPkcs11Profile::mflCode
+ * in the MbedTLS SSL configuration of a profile.
  *
- * @param[in] pMbedtlsPkcs11Context Network context.
+ * @param[in] pProfile The profile.
  *
  * @return #MBEDTLS_PKCS11_SUCCESS on success,
- * #MBEDTLS_PKCS11_INVALID_CREDENTIALS on error.
+ * #MBEDTLS_PKCS11_INTERNAL_ERROR on error.
  */
-static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context );
+static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Profile_t * pProfile );
 
 /**
- * @brief Callback that wraps PKCS #11 for pseudo-random number generation. This
- * is passed to MbedTLS.
+ * @brief Get the MbedTLS code of a maximum fragment length.
  *
- * @param[in] pCtx Caller context.
- * @param[in] pRandom Byte array to fill with random data.
- * @param[in] randomLength Length of byte array.
+ * @param[in] maxFragmentLength Maximum fragment length in bytes; zero selects
+ * #MBEDTLS_PKCS11_DEFAULT_MAX_FRAGMENT_LENGTH.
+ * @param[out] pMflCode MbedTLS code of the length.
  *
- * @return Zero on success.
+ * @return true if the length can be negotiated; false otherwise.
  */
-static int32_t generateRandomBytes( void * pCtx,
-                                    unsigned char * pRandom,
-                                    size_t randomLength );
+static bool getMflCode( uint16_t maxFragmentLength,
+                        uint8_t * pMflCode );
 
 /**
- * @brief Helper for reading the specified certificate object, if present,
- * out of storage, into RAM, and then into an mbedTLS certificate context
- * object.
+ * @brief Offer the session saved in the profile of a connection for resumption,
+ * if it was established with the same server.
  *
- * @param[in] pContext Caller TLS context.
- * @param[in] pLabelName PKCS #11 certificate object label.
- * @param[out] pCertificateContext Certificate context.
+ * @param[in] pContext The connection, set up with its profile.
+ * @param[in] pHostName The server.
+ * @param[in] port The server port.
+ */
+static void resumptionLoad( MbedtlsPkcs11Context_t * pContext,
+                            const char * pHostName,
+                            uint16_t port );
+
+/**
+ * @brief Save the session of a completed handshake in the profile of the
+ * connection, or drop the saved session of the server after a failed handshake.
  *
- * @return True on success.
+ * @param[in] pContext The connection.
+ * @param[in] pHostName The server.
+ * @param[in] port The server port.
+ * @param[in] success The handshake succeeded.
  */
-static bool readCertificateIntoContext( MbedtlsPkcs11Context_t * pContext,
-                                        char * pLabelName,
-                                        mbedtls_x509_crt * pCertificateContext );
+static void resumptionSave( MbedtlsPkcs11Context_t * pContext,
+                            const char * pHostName,
+                            uint16_t port,
+                            bool success );
 
 /**
  * @brief Helper for configuring MbedTLS to use client private key from PKCS #11.
  *
- * @param pContext Caller context.
+ * @param pProfile The profile.
+ * @param p11Session PKCS #11 session on which the key is searched.
  * @param pPrivateKeyLabel PKCS #11 label for the private key.
  *
  * @return True on success.
  */
-static bool initializeClientKeys( MbedtlsPkcs11Context_t * pContext,
+static bool initializeClientKeys( MbedtlsPkcs11Profile_t * pProfile,
+                                  CK_SESSION_HANDLE p11Session,
                                   const char * pPrivateKeyLabel );
 
 /**
  * @brief Sign a cryptographic hash with the private key. This is passed as a
  * callback to MbedTLS.
  *
- * @param[in] pContext Crypto context.
+ * @param[in] pContext Profile of the connection.
  * @param[in] mdAlg Unused.
  * @param[in] pHash Length in bytes of hash to be signed.
  * @param[in] hashLen Byte array of hash to be signed.
@@ -197,6 +416,152 @@ static int32_t privateKeySigningCallback( void * pContext,
                                           int32_t ( * pRng )( void *, unsigned char *, size_t ),
                                           void * pRngContext );
 
+/**
+ * @brief Get the value of the monotonic clock in microseconds.
+ *
+ * @return Time in microseconds.
+ */
+static uint64_t getTimeUs( void );
+
+/**
+ * @brief Tell whether a failed handshake ended with a fatal alert of the server
+ * rejecting the client certificate.
+ *
+ * @param[in] pSslContext SSL context of the handshake.
+ * @param[in] mbedtlsError Error of the handshake.
+ *
+ * @return true if the server rejected the client certificate; false otherwise.
+ */
+static bool isCertificateRejected( const mbedtls_ssl_context * pSslContext,
+                                   int mbedtlsError );
+
+/**
+ * @brief Get the connect phase of a handshake state. The state is the step about
+ * to be performed.
+ *
+ * @param[in] handshakeState MbedTLS handshake state.
+ *
+ * @return The phase the step is counted in.
+ */
+static MbedtlsPkcs11ConnectPhase_t handshakePhase( int handshakeState );
+
+/**
+ * @brief Arguments and results of the steps of a connect that can block, run
+ * with #Mbedtls_Pkcs11_RunBlocking.
+ */
+typedef struct ConnectStep
+{
+    MbedtlsPkcs11Context_t * pContext;                /**< @brief Connection being established. */
+    const char * pHostName;                           /**< @brief Server host name. */
+    const char * pPortStr;                            /**< @brief Server port as a string. */
+    const MbedtlsPkcs11Credentials_t * pCredentials; /**< @brief Credentials of the connection. */
+    uint32_t recvTimeoutMs;                           /**< @brief Receive timeout of the connection. */
+    MbedtlsPkcs11Status_t status;                     /**< @brief Result of #configureStep. */
+    int32_t mbedtlsError;                             /**< @brief Result of #tcpConnectStep and #handshakeStep. */
+} ConnectStep_t;
+
+/**
+ * @brief Configure MbedTLS for a connection. Building the shared profile can wait
+ * for the PKCS #11 token and for the other connections.
+ *
+ * @param[in,out] pConnectStep The #ConnectStep_t of the connection.
+ */
+static void configureStep( void * pConnectStep );
+
+/**
+ * @brief Resolve the host name and connect the socket.
+ *
+ * @param[in,out] pConnectStep The #ConnectStep_t of the connection.
+ */
+static void tcpConnectStep( void * pConnectStep );
+
+/**
+ * @brief Perform one step of the handshake. Used for the step signing with the
+ * PKCS #11 private key, which can wait for a session of the pool and for the token.
+ *
+ * @param[in,out] pConnectStep The #ConnectStep_t of the connection.
+ */
+static void handshakeStep( void * pConnectStep );
+
+/**
+ * @brief Add the phases of a connect to the histograms.
+ *
+ * @param[in] pTiming Duration of the phases.
+ * @param[in] success The connect succeeded. Only the failure is counted otherwise.
+ */
+static void recordConnectTiming( const MbedtlsPkcs11ConnectTiming_t * pTiming,
+                                 bool success );
+
+/**
+ * @brief Wait until the socket of a non-blocking connection is ready, or the
+ * wakeup file descriptor is readable.
+ *
+ * @param[in] pContext The SSL context to wait for.
+ * @param[in] mbedtlsStatus MBEDTLS_ERR_SSL_WANT_READ or MBEDTLS_ERR_SSL_WANT_WRITE.
+ * @param[in] useWakeupFd Also wait for the wakeup file descriptor.
+ * @param[in] timeoutMs Maximum time to wait.
+ *
+ * @return Combination of #SOCKET_READY_FLAG and #WAKEUP_READY_FLAG; zero on
+ * timeout; negative value on error.
+ */
+static int32_t waitForReadiness( MbedtlsPkcs11Context_t * pContext,
+                                 int32_t mbedtlsStatus,
+                                 bool useWakeupFd,
+                                 uint32_t timeoutMs );
+
+/**
+ * @brief Write all the bytes of a buffer to the TLS session. The data is split
+ * into records by MbedTLS.
+ *
+ * @param[in] pContext The SSL context to write to.
+ * @param[in] pData Data to write.
+ * @param[in] dataLength Length of @p pData.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure.
+ */
+static int32_t writeAll( MbedtlsPkcs11Context_t * pContext,
+                         const uint8_t * pData,
+                         size_t dataLength );
+
+/**
+ * @brief Send the data collected in the write-combining buffer. A failure is
+ * kept in #MbedtlsPkcs11Context_t.writeStatus.
+ *
+ * @param[in] pContext The SSL context to flush.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure, or the error
+ * of an earlier failed flush.
+ */
+static int32_t flushWriteBuffer( MbedtlsPkcs11Context_t * pContext );
+
+/**
+ * @brief Time left before the write-combining buffer must be flushed.
+ *
+ * @param[in] pContext The SSL context to check.
+ * @param[in] nowUs Current time from #getTimeUs.
+ *
+ * @return Zero if the buffer reached #MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD or
+ * #MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US; the time left in microseconds
+ * otherwise. UINT64_MAX if the buffer is empty.
+ */
+static uint64_t writeBufferTimeLeftUs( const MbedtlsPkcs11Context_t * pContext,
+                                       uint64_t nowUs );
+
+/**
+ * @brief Collect an array of buffers in the write-combining buffer. The buffer is
+ * flushed when it is full, when it reaches #MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD or
+ * when its oldest data is older than #MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US.
+ *
+ * @param[in] pContext The SSL context to write to.
+ * @param[in] pIoVec Array of buffers to write.
+ * @param[in] ioVecCount Number of buffers in @p pIoVec.
+ *
+ * @return Number of bytes written on success; negative MbedTLS error code on failure.
+ */
+static int32_t writeCombined( MbedtlsPkcs11Context_t * pContext,
+                              const TransportOutVector_t * pIoVec,
+                              size_t ioVecCount );
+
 /*-----------------------------------------------------------*/
 
 static void contextInit( MbedtlsPkcs11Context_t * pContext )
@@ -205,11 +570,10 @@ static void contextInit( MbedtlsPkcs11Context_t * pContext )
 
     mbedtls_net_init( &( pContext->socketContext ) );
     mbedtls_ssl_init( &( pContext->context ) );
-    mbedtls_ssl_config_init( &( pContext->config ) );
-    mbedtls_x509_crt_init( &( pContext->rootCa ) );
-    mbedtls_x509_crt_init( &( pContext->clientCert ) );
-
-    C_GetFunctionList( &( pContext->pP11FunctionList ) );
+    pContext->pProfile = NULL;
+    pContext->writeBufferLength = 0U;
+    pContext->writeStatus = 0;
+    memset( &( pContext->memoryAccount ), 0, sizeof( pContext->memoryAccount ) );
 }
 /*-----------------------------------------------------------*/
 
@@ -219,9 +583,9 @@ static void contextFree( MbedtlsPkcs11Context_t * pContext )
     {
         mbedtls_net_free( &( pContext->socketContext ) );
         mbedtls_ssl_free( &( pContext->context ) );
-        mbedtls_ssl_config_free( &( pContext->config ) );
-        mbedtls_x509_crt_free( &( pContext->rootCa ) );
-        mbedtls_x509_crt_free( &( pContext->clientCert ) );
+        /* The profile is shared with other connections. */
+        profileRelease( pContext->pProfile );
+        pContext->pProfile = NULL;
     }
 }
 
@@ -250,6 +614,7 @@ static MbedtlsPkcs11Status_t configureMbedtls( MbedtlsPkcs11Context_t * pMbedtls
                                                uint32_t recvTimeoutMs )
 {
     MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    MbedtlsPkcs11MemoryAccount_t * pPreviousAccount = NULL;
     int32_t mbedtlsError = 0;
 
     assert( pMbedtlsPkcs11Context != NULL );
@@ -259,48 +624,22 @@ static MbedtlsPkcs11Status_t configureMbedtls( MbedtlsPkcs11Context_t * pMbedtls
 
     /* Initialize the MbedTLS context structures. */
     contextInit( pMbedtlsPkcs11Context );
-    pMbedtlsPkcs11Context->p11Session = pMbedtlsPkcs11Credentials->p11Session;
-
-    mbedtlsError = mbedtls_ssl_config_defaults( &( pMbedtlsPkcs11Context->config ),
-                                                MBEDTLS_SSL_IS_CLIENT,
-                                                MBEDTLS_SSL_TRANSPORT_STREAM,
-                                                MBEDTLS_SSL_PRESET_DEFAULT );
-
-    if( mbedtlsError != 0 )
-    {
-        LogError( ( "Failed to set default SSL configuration: mbedTLSError= %s : %s.",
-                    mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                    mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
-
-        /* Per MbedTLS docs, mbedtls_ssl_config_defaults only fails on memory allocation. */
-        returnStatus = MBEDTLS_PKCS11_INSUFFICIENT_MEMORY;
-    }
-    else
-    {
-        /* Set up the certificate security profile, starting from the default value. */
-        pMbedtlsPkcs11Context->certProfile = mbedtls_x509_crt_profile_default;
+    pMbedtlsPkcs11Context->recvTimeoutMs = recvTimeoutMs;
 
-        /* Set SSL authmode and the RNG context. */
-        mbedtls_ssl_conf_authmode( &( pMbedtlsPkcs11Context->config ), MBEDTLS_SSL_VERIFY_REQUIRED );
-        mbedtls_ssl_conf_rng( &( pMbedtlsPkcs11Context->config ), generateRandomBytes, pMbedtlsPkcs11Context );
-        mbedtls_ssl_conf_cert_profile( &( pMbedtlsPkcs11Context->config ), &( pMbedtlsPkcs11Context->certProfile ) );
-        mbedtls_ssl_conf_read_timeout( &( pMbedtlsPkcs11Context->config ), recvTimeoutMs );
-        mbedtls_ssl_conf_dbg( &pMbedtlsPkcs11Context->config, mbedtlsDebugPrint, NULL );
-        mbedtls_debug_set_threshold( MBEDTLS_DEBUG_LOG_LEVEL );
-
-        returnStatus = configureMbedtlsCertificates( pMbedtlsPkcs11Context, pMbedtlsPkcs11Credentials );
-    }
+    /* Get the SSL configuration shared by the connections with these credentials. */
+    returnStatus = profileAcquire( pMbedtlsPkcs11Credentials,
+                                   recvTimeoutMs,
+                                   &( pMbedtlsPkcs11Context->pProfile ) );
 
-    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
-    {
-        returnStatus = configureMbedtlsSniAlpn( pMbedtlsPkcs11Context, pMbedtlsPkcs11Credentials, pHostName );
-    }
+    /* The memory of the SSL context is counted in the connection. The profile is
+     * shared, so it is not. */
+    pPreviousAccount = Mbedtls_Pkcs11_MemorySetAccount( &( pMbedtlsPkcs11Context->memoryAccount ) );
 
     if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
     {
         /* Initialize the MbedTLS secured connection context. */
         mbedtlsError = mbedtls_ssl_setup( &( pMbedtlsPkcs11Context->context ),
-                                          &( pMbedtlsPkcs11Context->config ) );
+                                          &( pMbedtlsPkcs11Context->pProfile->config ) );
 
         if( mbedtlsError != 0 )
         {
@@ -313,14 +652,20 @@ static MbedtlsPkcs11Status_t configureMbedtls( MbedtlsPkcs11Context_t * pMbedtls
 
     if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
     {
-        /* Set the underlying IO for the TLS connection. */
+        returnStatus = configureMbedtlsSni( pMbedtlsPkcs11Context, pMbedtlsPkcs11Credentials, pHostName );
+    }
+
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pPreviousAccount );
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        /* Set the underlying IO for the TLS connection. A non-blocking connection
+         * waits for the socket readiness in this transport instead of MbedTLS. */
         mbedtls_ssl_set_bio( &( pMbedtlsPkcs11Context->context ),
                              ( void * ) &( pMbedtlsPkcs11Context->socketContext ),
                              mbedtls_net_send,
                              mbedtls_net_recv,
-                             mbedtls_net_recv_timeout );
-
-        returnStatus = configureMbedtlsFragmentLength( pMbedtlsPkcs11Context );
+                             ( pMbedtlsPkcs11Context->nonBlocking == true ) ? NULL : mbedtls_net_recv_timeout );
     }
 
     if( returnStatus != MBEDTLS_PKCS11_SUCCESS )
@@ -337,125 +682,544 @@ static MbedtlsPkcs11Status_t configureMbedtls( MbedtlsPkcs11Context_t * pMbedtls
 
 /*-----------------------------------------------------------*/
 
-static MbedtlsPkcs11Status_t configureMbedtlsCertificates( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
-                                                           const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials )
-
+static MbedtlsPkcs11Status_t profileAcquire( const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                             uint32_t recvTimeoutMs,
+                                             MbedtlsPkcs11Profile_t ** ppProfile )
 {
     MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
-    int32_t mbedtlsError = 0;
-    bool result;
+    MbedtlsPkcs11Profile_t * pProfile = NULL;
+    bool acquired = false;
+    bool building = false;
+    bool isCurrent = false;
 
-    assert( pMbedtlsPkcs11Context != NULL );
     assert( pMbedtlsPkcs11Credentials != NULL );
-    assert( pMbedtlsPkcs11Credentials->pRootCaPath != NULL );
+    assert( ppProfile != NULL );
 
-    /* Parse the server root CA certificate into the SSL context. */
-    mbedtlsError = mbedtls_x509_crt_parse_file( &( pMbedtlsPkcs11Context->rootCa ),
-                                                pMbedtlsPkcs11Credentials->pRootCaPath );
+    pthread_mutex_lock( &profilesMutex );
 
-    if( mbedtlsError != 0 )
-    {
-        LogError( ( "Failed to parse server root CA certificate: mbedTLSError= %s : %s.",
-                    mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                    mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
-        returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
-    }
-    else
+    while( ( acquired == false ) && ( returnStatus == MBEDTLS_PKCS11_SUCCESS ) )
     {
-        mbedtls_ssl_conf_ca_chain( &( pMbedtlsPkcs11Context->config ),
-                                   &( pMbedtlsPkcs11Context->rootCa ),
-                                   NULL );
-        /* Setup the client private key. */
-        result = initializeClientKeys( pMbedtlsPkcs11Context,
-                                       pMbedtlsPkcs11Credentials->pPrivateKeyLabel );
+        pProfile = pProfiles;
 
-        if( result == false )
+        while( ( pProfile != NULL ) &&
+               ( profileMatches( pProfile, pMbedtlsPkcs11Credentials, recvTimeoutMs ) == false ) )
         {
-            LogError( ( "Failed to setup key handling by PKCS #11." ) );
-            returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+            pProfile = pProfile->pNext;
+        }
+
+        if( pProfile == NULL )
+        {
+            /* The profile is listed before it is built, so that the connections
+             * started at the same time wait for it instead of building their own. */
+            returnStatus = profileCreate( pMbedtlsPkcs11Credentials, recvTimeoutMs, &pProfile );
+
+            if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+            {
+                pProfile->pNext = pProfiles;
+                pProfiles = pProfile;
+                building = true;
+                acquired = true;
+            }
+        }
+        else if( pProfile->building == true )
+        {
+            ( void ) pthread_cond_wait( &profilesCond, &profilesMutex );
+        }
+        else
+        {
+            /* The credentials are checked without the mutex, as the check can read
+             * the root CA file and call the PKCS #11 module. */
+            pProfile->refCount++;
+            pthread_mutex_unlock( &profilesMutex );
+            isCurrent = profileIsCurrent( pProfile );
+            pthread_mutex_lock( &profilesMutex );
+
+            /* Another connection may have found the credentials changed meanwhile. */
+            if( ( isCurrent == true ) && ( pProfile->invalidated == false ) )
+            {
+                acquired = true;
+            }
+            else
+            {
+                LogDebug( ( "Credentials of TLS profile for %s changed.", pProfile->pClientCertLabel ) );
+                profileDetach( pProfile );
+                pProfile->refCount--;
+
+                if( pProfile->refCount == 0U )
+                {
+                    profileFree( pProfile );
+                }
+
+                pProfile = NULL;
+            }
         }
     }
 
-    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    pthread_mutex_unlock( &profilesMutex );
+
+    if( building == true )
     {
-        /* Setup the client certificate. */
-        result = readCertificateIntoContext( pMbedtlsPkcs11Context,
-                                             pMbedtlsPkcs11Credentials->pClientCertLabel,
-                                             &( pMbedtlsPkcs11Context->clientCert ) );
+        returnStatus = profileBuild( pProfile, pMbedtlsPkcs11Credentials );
 
-        if( result == false )
+        pthread_mutex_lock( &profilesMutex );
+
+        if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
         {
-            LogError( ( "Failed to get certificate from PKCS #11 module." ) );
-            returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+            pProfile->building = false;
+        }
+        else
+        {
+            /* Only this connection references a profile being built. */
+            profileDetach( pProfile );
         }
-    }
 
-    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
-    {
-        ( void ) mbedtls_ssl_conf_own_cert( &( pMbedtlsPkcs11Context->config ),
-                                            &( pMbedtlsPkcs11Context->clientCert ),
-                                            &( pMbedtlsPkcs11Context->privKey ) );
+        ( void ) pthread_cond_broadcast( &profilesCond );
+        pthread_mutex_unlock( &profilesMutex );
+
+        if( returnStatus != MBEDTLS_PKCS11_SUCCESS )
+        {
+            profileFree( pProfile );
+            pProfile = NULL;
+        }
     }
 
+    *ppProfile = pProfile;
+
     return returnStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static MbedtlsPkcs11Status_t configureMbedtlsSniAlpn( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
-                                                      const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
-                                                      const char * pHostName )
+static void profileRelease( MbedtlsPkcs11Profile_t * pProfile )
 {
-    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
-    int32_t mbedtlsError = 0;
-
-    assert( pMbedtlsPkcs11Context != NULL );
-    assert( pHostName != NULL );
-    assert( pMbedtlsPkcs11Credentials != NULL );
-    assert( pMbedtlsPkcs11Credentials->pRootCaPath != NULL );
-
-    if( pMbedtlsPkcs11Credentials->pAlpnProtos != NULL )
+    if( pProfile != NULL )
     {
-        /* Include an application protocol list in the TLS ClientHello message. */
-        mbedtlsError = mbedtls_ssl_conf_alpn_protocols( &( pMbedtlsPkcs11Context->config ),
-                                                        pMbedtlsPkcs11Credentials->pAlpnProtos );
+        pthread_mutex_lock( &profilesMutex );
 
-        if( mbedtlsError != 0 )
+        assert( pProfile->refCount > 0U );
+        pProfile->refCount--;
+
+        /* Current profiles stay in the list for the next connection. */
+        if( ( pProfile->refCount == 0U ) && ( pProfile->invalidated == true ) )
         {
-            LogError( ( "Failed to configure ALPN protocol in MbedTLS: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
-            returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+            profileFree( pProfile );
         }
+
+        pthread_mutex_unlock( &profilesMutex );
     }
+}
 
-    /* Enable SNI if requested. */
-    if( ( returnStatus == MBEDTLS_PKCS11_SUCCESS ) &&
-        ( pMbedtlsPkcs11Credentials->disableSni == false ) )
-    {
-        mbedtlsError = mbedtls_ssl_set_hostname( &( pMbedtlsPkcs11Context->context ),
-                                                 pHostName );
+/*-----------------------------------------------------------*/
 
-        if( mbedtlsError != 0 )
+static MbedtlsPkcs11Status_t profileCreate( const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                            uint32_t recvTimeoutMs,
+                                            MbedtlsPkcs11Profile_t ** ppProfile )
+{
+    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    MbedtlsPkcs11Profile_t * pProfile = NULL;
+
+    assert( pMbedtlsPkcs11Credentials != NULL );
+    assert( ppProfile != NULL );
+
+    pProfile = malloc( sizeof( MbedtlsPkcs11Profile_t ) );
+
+    if( pProfile == NULL )
+    {
+        LogError( ( "Failed to allocate a TLS profile." ) );
+        returnStatus = MBEDTLS_PKCS11_INSUFFICIENT_MEMORY;
+    }
+    else
+    {
+        memset( pProfile, 0, sizeof( MbedtlsPkcs11Profile_t ) );
+        mbedtls_ssl_config_init( &( pProfile->config ) );
+        mbedtls_ssl_session_init( &( pProfile->resumptionSession ) );
+        ( void ) pthread_mutex_init( &( pProfile->resumptionMutex ), NULL );
+        C_GetFunctionList( &( pProfile->pP11FunctionList ) );
+        pProfile->p11Session = pMbedtlsPkcs11Credentials->p11Session;
+        pProfile->pAlpnProtos = pMbedtlsPkcs11Credentials->pAlpnProtos;
+        pProfile->recvTimeoutMs = recvTimeoutMs;
+        pProfile->refCount = 1U;
+        pProfile->building = true;
+        ( void ) getMflCode( pMbedtlsPkcs11Credentials->maxFragmentLength, &( pProfile->mflCode ) );
+
+        pProfile->pRootCaPath = strdup( pMbedtlsPkcs11Credentials->pRootCaPath );
+        pProfile->pClientCertLabel = strdup( pMbedtlsPkcs11Credentials->pClientCertLabel );
+        pProfile->pPrivateKeyLabel = strdup( pMbedtlsPkcs11Credentials->pPrivateKeyLabel );
+
+        if( ( pProfile->pRootCaPath == NULL ) ||
+            ( pProfile->pClientCertLabel == NULL ) ||
+            ( pProfile->pPrivateKeyLabel == NULL ) )
         {
-            LogError( ( "Failed to set server name: mbedTLSError= %s : %s.",
-                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
-                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
-            returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+            LogError( ( "Failed to allocate the credentials of a TLS profile." ) );
+            returnStatus = MBEDTLS_PKCS11_INSUFFICIENT_MEMORY;
+            profileFree( pProfile );
+            pProfile = NULL;
         }
     }
 
+    *ppProfile = pProfile;
+
     return returnStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context )
+static MbedtlsPkcs11Status_t profileBuild( MbedtlsPkcs11Profile_t * pProfile,
+                                           const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials )
+{
+    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    int32_t mbedtlsError = 0;
+    CK_SESSION_INFO sessionInfo = { 0 };
+    CK_RV xResult = CKR_OK;
+
+    assert( pProfile != NULL );
+    assert( pMbedtlsPkcs11Credentials != NULL );
+
+    /* The signatures are made on sessions leased from the pool, on the slot
+     * of the session of the credentials. */
+    xResult = pProfile->pP11FunctionList->C_GetSessionInfo( pProfile->p11Session, &sessionInfo );
+
+    if( xResult == CKR_OK )
+    {
+        pProfile->p11SlotId = sessionInfo.slotID;
+    }
+    else
+    {
+        LogError( ( "Failed to get the PKCS #11 session info with error code %lu.",
+                    ( unsigned long ) xResult ) );
+        returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+    }
+
+    /* The handshakes draw their random bytes from a DRBG seeded from the
+     * PKCS #11 module instead of calling the module for each request. The
+     * seeds are read on sessions leased on the same slot. */
+    mbedtlsError = Mbedtls_Pkcs11_RandomInit( &( pProfile->random ),
+                                              pProfile->pP11FunctionList,
+                                              pProfile->p11SlotId );
+
+    if( ( returnStatus == MBEDTLS_PKCS11_SUCCESS ) && ( mbedtlsError != 0 ) )
+    {
+        LogError( ( "Failed to seed the random number generator: mbedTLSError= %s : %s.",
+                    mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                    mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+        returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        mbedtlsError = mbedtls_ssl_config_defaults( &( pProfile->config ),
+                                                    MBEDTLS_SSL_IS_CLIENT,
+                                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                                    MBEDTLS_SSL_PRESET_DEFAULT );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to set default SSL configuration: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+
+            /* Per MbedTLS docs, mbedtls_ssl_config_defaults only fails on memory allocation. */
+            returnStatus = MBEDTLS_PKCS11_INSUFFICIENT_MEMORY;
+        }
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        /* Set up the certificate security profile, starting from the default value. */
+        pProfile->certProfile = mbedtls_x509_crt_profile_default;
+
+        /* Set SSL authmode and the RNG context. */
+        mbedtls_ssl_conf_authmode( &( pProfile->config ), MBEDTLS_SSL_VERIFY_REQUIRED );
+        mbedtls_ssl_conf_rng( &( pProfile->config ), Mbedtls_Pkcs11_RandomGenerate, &( pProfile->random ) );
+        mbedtls_ssl_conf_cert_profile( &( pProfile->config ), &( pProfile->certProfile ) );
+        mbedtls_ssl_conf_ciphersuites( &( pProfile->config ), ciphersuites );
+        mbedtls_ssl_conf_read_timeout( &( pProfile->config ), pProfile->recvTimeoutMs );
+        mbedtls_ssl_conf_dbg( &( pProfile->config ), mbedtlsDebugPrint, NULL );
+        #if defined( MBEDTLS_SSL_SESSION_TICKETS )
+            mbedtls_ssl_conf_session_tickets( &( pProfile->config ), MBEDTLS_SSL_SESSION_TICKETS_ENABLED );
+        #endif
+        mbedtls_debug_set_threshold( MBEDTLS_DEBUG_LOG_LEVEL );
+
+        returnStatus = configureMbedtlsCertificates( pProfile, pMbedtlsPkcs11Credentials );
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        returnStatus = configureMbedtlsAlpn( pProfile, pMbedtlsPkcs11Credentials );
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        returnStatus = configureMbedtlsFragmentLength( pProfile );
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        LogDebug( ( "Created TLS profile for %s.", pMbedtlsPkcs11Credentials->pClientCertLabel ) );
+    }
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static void profileFree( MbedtlsPkcs11Profile_t * pProfile )
+{
+    assert( pProfile != NULL );
+
+    mbedtls_ssl_config_free( &( pProfile->config ) );
+    /* The chains are shared through the credential cache, so they are released
+     * after the configuration using them. */
+    Mbedtls_Pkcs11_CredentialCacheRelease( pProfile->pRootCa );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pProfile->pClientCert );
+    Mbedtls_Pkcs11_RandomFree( &( pProfile->random ) );
+    mbedtls_ssl_session_free( &( pProfile->resumptionSession ) );
+    ( void ) pthread_mutex_destroy( &( pProfile->resumptionMutex ) );
+    free( pProfile->pResumptionHost );
+    free( pProfile->pRootCaPath );
+    free( pProfile->pClientCertLabel );
+    free( pProfile->pPrivateKeyLabel );
+    free( pProfile );
+}
+
+/*-----------------------------------------------------------*/
+
+static void profileDetach( MbedtlsPkcs11Profile_t * pProfile )
+{
+    MbedtlsPkcs11Profile_t ** ppLink = &pProfiles;
+
+    while( ( *ppLink != NULL ) && ( *ppLink != pProfile ) )
+    {
+        ppLink = &( ( *ppLink )->pNext );
+    }
+
+    if( *ppLink != NULL )
+    {
+        *ppLink = pProfile->pNext;
+        pProfile->pNext = NULL;
+        pProfile->invalidated = true;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool profileMatches( const MbedtlsPkcs11Profile_t * pProfile,
+                            const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                            uint32_t recvTimeoutMs )
+{
+    uint8_t mflCode = 0U;
+
+    /* The ALPN list is referenced by the SSL configuration, so it is compared by
+     * address. The server name is set in the SSL context of each connection. */
+    return ( pProfile->p11Session == pMbedtlsPkcs11Credentials->p11Session ) &&
+           ( pProfile->pAlpnProtos == pMbedtlsPkcs11Credentials->pAlpnProtos ) &&
+           ( pProfile->recvTimeoutMs == recvTimeoutMs ) &&
+           ( getMflCode( pMbedtlsPkcs11Credentials->maxFragmentLength, &mflCode ) == true ) &&
+           ( pProfile->mflCode == mflCode ) &&
+           ( strcmp( pProfile->pRootCaPath, pMbedtlsPkcs11Credentials->pRootCaPath ) == 0 ) &&
+           ( strcmp( pProfile->pClientCertLabel, pMbedtlsPkcs11Credentials->pClientCertLabel ) == 0 ) &&
+           ( strcmp( pProfile->pPrivateKeyLabel, pMbedtlsPkcs11Credentials->pPrivateKeyLabel ) == 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool profileIsCurrent( MbedtlsPkcs11Profile_t * pProfile )
+{
+    mbedtls_x509_crt * pRootCa = NULL;
+    mbedtls_x509_crt * pClientCert = NULL;
+    CK_OBJECT_HANDLE privateKey = CK_INVALID_HANDLE;
+    CK_KEY_TYPE keyType = 0;
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+    CK_RV ret = CKR_OK;
+    bool isCurrent;
+
+    /* The credential cache returns the chains and key handle of the profile as
+     * long as the root CA file and the PKCS #11 objects are unchanged. None of
+     * the checks searches the token when the handles are cached. The profile is
+     * checked by each connection using it, so the token is searched on a leased
+     * session rather than on the session of the credentials. */
+    pRootCa = Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( pProfile->pRootCaPath );
+
+    ret = Mbedtls_Pkcs11_SessionPoolLease( pProfile->p11SlotId, &p11Session );
+
+    if( ret == CKR_OK )
+    {
+        pClientCert = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( pProfile->pP11FunctionList,
+                                                                        p11Session,
+                                                                        pProfile->pClientCertLabel );
+
+        ret = Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( pProfile->pP11FunctionList,
+                                                            p11Session,
+                                                            pProfile->pPrivateKeyLabel,
+                                                            &privateKey,
+                                                            &keyType );
+
+        /* A failed search may still be active on the session. */
+        Mbedtls_Pkcs11_SessionPoolReturn( p11Session, ( ret != CKR_OK ) );
+    }
+    else
+    {
+        LogError( ( "Failed to lease a PKCS #11 session with error code %lu.",
+                    ( unsigned long ) ret ) );
+    }
+
+    isCurrent = ( pRootCa == pProfile->pRootCa ) &&
+                ( pClientCert == pProfile->pClientCert ) &&
+                ( ret == CKR_OK ) &&
+                ( privateKey == pProfile->p11PrivateKey ) &&
+                ( keyType == pProfile->keyType );
+
+    Mbedtls_Pkcs11_CredentialCacheRelease( pRootCa );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pClientCert );
+
+    return isCurrent;
+}
+
+/*-----------------------------------------------------------*/
+
+static MbedtlsPkcs11Status_t configureMbedtlsCertificates( MbedtlsPkcs11Profile_t * pProfile,
+                                                           const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials )
+
+{
+    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+    bool result;
+
+    assert( pProfile != NULL );
+    assert( pMbedtlsPkcs11Credentials != NULL );
+    assert( pMbedtlsPkcs11Credentials->pRootCaPath != NULL );
+
+    /* Get the parsed server root CA certificate from the credential cache. */
+    pProfile->pRootCa = Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( pMbedtlsPkcs11Credentials->pRootCaPath );
+
+    if( pProfile->pRootCa == NULL )
+    {
+        LogError( ( "Failed to parse server root CA certificate %s.",
+                    pMbedtlsPkcs11Credentials->pRootCaPath ) );
+        returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+    }
+    else if( Mbedtls_Pkcs11_SessionPoolLease( pProfile->p11SlotId, &p11Session ) != CKR_OK )
+    {
+        /* The profiles are built outside of the profile lock, so the token is
+         * searched on a leased session like in #profileIsCurrent. */
+        LogError( ( "Failed to lease a PKCS #11 session." ) );
+        returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+    }
+    else
+    {
+        mbedtls_ssl_conf_ca_chain( &( pProfile->config ),
+                                   pProfile->pRootCa,
+                                   NULL );
+        /* Setup the client private key. */
+        result = initializeClientKeys( pProfile,
+                                       p11Session,
+                                       pMbedtlsPkcs11Credentials->pPrivateKeyLabel );
+
+        if( result == false )
+        {
+            LogError( ( "Failed to setup key handling by PKCS #11." ) );
+            returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+        }
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        /* Get the parsed client certificate from the credential cache. */
+        pProfile->pClientCert = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( pProfile->pP11FunctionList,
+                                                                                p11Session,
+                                                                                pMbedtlsPkcs11Credentials->pClientCertLabel );
+
+        if( pProfile->pClientCert == NULL )
+        {
+            LogError( ( "Failed to get certificate from PKCS #11 module." ) );
+            returnStatus = MBEDTLS_PKCS11_INVALID_CREDENTIALS;
+        }
+    }
+
+    if( p11Session != CK_INVALID_HANDLE )
+    {
+        /* A failed search may still be active on the session. */
+        Mbedtls_Pkcs11_SessionPoolReturn( p11Session, ( returnStatus != MBEDTLS_PKCS11_SUCCESS ) );
+    }
+
+    if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
+    {
+        ( void ) mbedtls_ssl_conf_own_cert( &( pProfile->config ),
+                                            pProfile->pClientCert,
+                                            &( pProfile->privKey ) );
+    }
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static MbedtlsPkcs11Status_t configureMbedtlsAlpn( MbedtlsPkcs11Profile_t * pProfile,
+                                                   const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials )
+{
+    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    int32_t mbedtlsError = 0;
+
+    assert( pProfile != NULL );
+    assert( pMbedtlsPkcs11Credentials != NULL );
+
+    if( pMbedtlsPkcs11Credentials->pAlpnProtos != NULL )
+    {
+        /* Include an application protocol list in the TLS ClientHello message. */
+        mbedtlsError = mbedtls_ssl_conf_alpn_protocols( &( pProfile->config ),
+                                                        pMbedtlsPkcs11Credentials->pAlpnProtos );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to configure ALPN protocol in MbedTLS: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+            returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+        }
+    }
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static MbedtlsPkcs11Status_t configureMbedtlsSni( MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context,
+                                                  const MbedtlsPkcs11Credentials_t * pMbedtlsPkcs11Credentials,
+                                                  const char * pHostName )
 {
     MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
     int32_t mbedtlsError = 0;
 
     assert( pMbedtlsPkcs11Context != NULL );
+    assert( pHostName != NULL );
+    assert( pMbedtlsPkcs11Credentials != NULL );
+
+    /* Enable SNI if requested. */
+    if( pMbedtlsPkcs11Credentials->disableSni == false )
+    {
+        mbedtlsError = mbedtls_ssl_set_hostname( &( pMbedtlsPkcs11Context->context ),
+                                                 pHostName );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to set server name: mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                        mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+            returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+        }
+    }
+
+    return returnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Profile_t * pProfile )
+{
+    MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
+    int32_t mbedtlsError = 0;
+
+    assert( pProfile != NULL );
 
     /* Set Maximum Fragment Length if enabled. */
     #ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
@@ -463,9 +1227,10 @@ static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Contex
         /* Enable the max fragment extension. 4096 bytes is currently the largest fragment size permitted.
          * See RFC 6066 https://tools.ietf.org/html/rfc6066#page-8 for more information.
          *
-         * Smaller values can be found in "mbedtls/include/ssl.h".
+         * With MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH, the record buffers of a connection
+         * are shrunk to the negotiated length after the handshake.
          */
-        mbedtlsError = mbedtls_ssl_conf_max_frag_len( &( pMbedtlsPkcs11Context->config ), MBEDTLS_SSL_MAX_FRAG_LEN_4096 );
+        mbedtlsError = mbedtls_ssl_conf_max_frag_len( &( pProfile->config ), pProfile->mflCode );
 
         if( mbedtlsError != 0 )
         {
@@ -480,143 +1245,159 @@ static MbedtlsPkcs11Status_t configureMbedtlsFragmentLength( MbedtlsPkcs11Contex
 
 /*-----------------------------------------------------------*/
 
-static int32_t generateRandomBytes( void * pCtx,
-                                    unsigned char * pRandom,
-                                    size_t randomLength )
+static bool getMflCode( uint16_t maxFragmentLength,
+                        uint8_t * pMflCode )
 {
-    /* Must cast from void pointer to conform to MbedTLS API. */
-    MbedtlsPkcs11Context_t * pContext = ( MbedtlsPkcs11Context_t * ) pCtx;
-    CK_RV xResult;
-
-    assert( pCtx != NULL );
-    assert( pRandom != NULL );
+    bool valid = true;
 
-    xResult = pContext->pP11FunctionList->C_GenerateRandom( pContext->p11Session, pRandom, randomLength );
-
-    if( xResult != CKR_OK )
+    switch( ( maxFragmentLength == 0U ) ? MBEDTLS_PKCS11_DEFAULT_MAX_FRAGMENT_LENGTH : maxFragmentLength )
     {
-        LogError( ( "Failed to generate random bytes from the PKCS #11 module." ) );
+        case 512U:
+            *pMflCode = MBEDTLS_SSL_MAX_FRAG_LEN_512;
+            break;
+
+        case 1024U:
+            *pMflCode = MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+            break;
+
+        case 2048U:
+            *pMflCode = MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+            break;
+
+        case 4096U:
+            *pMflCode = MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+            break;
+
+        default:
+            *pMflCode = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+            valid = false;
+            break;
     }
 
-    return ( int32_t ) xResult;
+    return valid;
 }
 
-/*----------------------------------------------------------*/
+/*-----------------------------------------------------------*/
 
-static bool readCertificateIntoContext( MbedtlsPkcs11Context_t * pContext,
-                                        char * pLabelName,
-                                        mbedtls_x509_crt * pCertificateContext )
+static void resumptionLoad( MbedtlsPkcs11Context_t * pContext,
+                            const char * pHostName,
+                            uint16_t port )
 {
-    CK_RV pkcs11Ret = CKR_OK;
-    CK_ATTRIBUTE template = { 0 };
-    CK_OBJECT_HANDLE certificateHandle = 0;
-    int32_t mbedtlsRet = -1;
-
-    assert( pContext != NULL );
-    assert( pLabelName != NULL );
-    assert( pCertificateContext != NULL );
+    MbedtlsPkcs11Profile_t * pProfile = pContext->pProfile;
+    int32_t mbedtlsError = 0;
 
-    /* Get the handle of the certificate. */
-    pkcs11Ret = xFindObjectWithLabelAndClass( pContext->p11Session,
-                                              pLabelName,
-                                              strlen( pLabelName ),
-                                              CKO_CERTIFICATE,
-                                              &certificateHandle );
+    pthread_mutex_lock( &( pProfile->resumptionMutex ) );
 
-    if( ( pkcs11Ret == CKR_OK ) && ( certificateHandle == CK_INVALID_HANDLE ) )
+    if( ( pProfile->pResumptionHost != NULL ) &&
+        ( pProfile->resumptionPort == port ) &&
+        ( strcmp( pProfile->pResumptionHost, pHostName ) == 0 ) )
     {
-        pkcs11Ret = CKR_OBJECT_HANDLE_INVALID;
-    }
+        /* The session is copied into the SSL context. The server decides whether
+         * it is resumed or a full handshake is made. */
+        mbedtlsError = mbedtls_ssl_set_session( &( pContext->context ),
+                                                &( pProfile->resumptionSession ) );
 
-    /* Query the certificate size. */
-    if( pkcs11Ret == CKR_OK )
-    {
-        template.type = CKA_VALUE;
-        template.ulValueLen = 0;
-        template.pValue = NULL;
-        pkcs11Ret = pContext->pP11FunctionList->C_GetAttributeValue( pContext->p11Session,
-                                                                     certificateHandle,
-                                                                     &template,
-                                                                     1 );
+        if( mbedtlsError != 0 )
+        {
+            LogWarn( ( "Failed to set the session to resume: mbedTLSError= %s : %s.",
+                       mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
+                       mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
+        }
     }
 
-    /* Create a buffer for the certificate. */
-    if( pkcs11Ret == CKR_OK )
+    pthread_mutex_unlock( &( pProfile->resumptionMutex ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static void resumptionSave( MbedtlsPkcs11Context_t * pContext,
+                            const char * pHostName,
+                            uint16_t port,
+                            bool success )
+{
+    MbedtlsPkcs11Profile_t * pProfile = pContext->pProfile;
+    mbedtls_ssl_session session;
+    char * pHostCopy = NULL;
+    int32_t mbedtlsError = 0;
+    bool sameServer;
+
+    mbedtls_ssl_session_init( &session );
+
+    if( success == true )
     {
-        template.pValue = malloc( template.ulValueLen );
+        mbedtlsError = mbedtls_ssl_get_session( &( pContext->context ), &session );
+        pHostCopy = ( mbedtlsError == 0 ) ? strdup( pHostName ) : NULL;
 
-        if( NULL == template.pValue )
+        if( pHostCopy == NULL )
         {
-            LogError( ( "Failed to allocate %lu bytes of memory for certificate buffer.",
-                        template.ulValueLen ) );
-            pkcs11Ret = CKR_HOST_MEMORY;
+            LogWarn( ( "Failed to save the TLS session for resumption." ) );
         }
     }
 
-    /* Export the certificate. */
-    if( pkcs11Ret == CKR_OK )
+    pthread_mutex_lock( &( pProfile->resumptionMutex ) );
+
+    sameServer = ( pProfile->pResumptionHost != NULL ) &&
+                 ( pProfile->resumptionPort == port ) &&
+                 ( strcmp( pProfile->pResumptionHost, pHostName ) == 0 );
+
+    if( pHostCopy != NULL )
     {
-        pkcs11Ret = pContext->pP11FunctionList->C_GetAttributeValue( pContext->p11Session,
-                                                                     certificateHandle,
-                                                                     &template,
-                                                                     1 );
+        /* The last session replaces the saved one, which may belong to another
+         * server. The session is moved, so only the replaced one is freed. */
+        mbedtls_ssl_session_free( &( pProfile->resumptionSession ) );
+        free( pProfile->pResumptionHost );
+        pProfile->resumptionSession = session;
+        pProfile->pResumptionHost = pHostCopy;
+        pProfile->resumptionPort = port;
+        mbedtls_ssl_session_init( &session );
     }
-
-    /* Decode the certificate. */
-    if( pkcs11Ret == CKR_OK )
+    else if( sameServer == true )
+    {
+        /* The saved session may be the cause of the failure. */
+        mbedtls_ssl_session_free( &( pProfile->resumptionSession ) );
+        free( pProfile->pResumptionHost );
+        pProfile->pResumptionHost = NULL;
+    }
+    else
     {
-        mbedtlsRet = mbedtls_x509_crt_parse( pCertificateContext,
-                                             ( const unsigned char * ) template.pValue,
-                                             template.ulValueLen );
+        /* Empty else marker. */
     }
 
-    /* Free memory. */
-    free( template.pValue );
+    pthread_mutex_unlock( &( pProfile->resumptionMutex ) );
 
-    return( mbedtlsRet == 0 );
+    mbedtls_ssl_session_free( &session );
 }
 
 /*-----------------------------------------------------------*/
 
-static bool initializeClientKeys( MbedtlsPkcs11Context_t * pContext,
+static bool initializeClientKeys( MbedtlsPkcs11Profile_t * pProfile,
+                                  CK_SESSION_HANDLE p11Session,
                                   const char * pPrivateKeyLabel )
 {
     CK_RV ret = CKR_OK;
-    CK_ATTRIBUTE template[ 2 ] = { 0 };
     mbedtls_pk_type_t keyAlgo = 0;
 
-    assert( pContext != NULL );
+    assert( pProfile != NULL );
     assert( pPrivateKeyLabel != NULL );
 
-    /* Get the handle of the device private key. */
-    ret = xFindObjectWithLabelAndClass( pContext->p11Session,
-                                        ( char * ) pPrivateKeyLabel,
-                                        strlen( pPrivateKeyLabel ),
-                                        CKO_PRIVATE_KEY,
-                                        &pContext->p11PrivateKey );
+    /* Get the handle and type of the device private key. They are only read from
+     * the token on the first connection with the key. */
+    ret = Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( pProfile->pP11FunctionList,
+                                                        p11Session,
+                                                        pPrivateKeyLabel,
+                                                        &pProfile->p11PrivateKey,
+                                                        &pProfile->keyType );
 
-    if( ( ret == CKR_OK ) && ( pContext->p11PrivateKey == CK_INVALID_HANDLE ) )
+    if( ( ret == CKR_OK ) && ( pProfile->p11PrivateKey == CK_INVALID_HANDLE ) )
     {
         ret = CK_INVALID_HANDLE;
         LogError( ( "Could not find private key." ) );
     }
 
-    /* Query the device private key type. */
-    if( ret == CKR_OK )
-    {
-        template[ 0 ].type = CKA_KEY_TYPE;
-        template[ 0 ].pValue = &pContext->keyType;
-        template[ 0 ].ulValueLen = sizeof( &pContext->keyType );
-        ret = pContext->pP11FunctionList->C_GetAttributeValue( pContext->p11Session,
-                                                               pContext->p11PrivateKey,
-                                                               template,
-                                                               1 );
-    }
-
     /* Map the PKCS #11 key type to an mbedTLS algorithm. */
     if( ret == CKR_OK )
     {
-        switch( pContext->keyType )
+        switch( pProfile->keyType )
         {
             case CKK_RSA:
                 keyAlgo = MBEDTLS_PK_RSA;
@@ -635,11 +1416,11 @@ static bool initializeClientKeys( MbedtlsPkcs11Context_t * pContext,
     /* Map the mbedTLS algorithm to its internal metadata. */
     if( ret == CKR_OK )
     {
-        memcpy( &pContext->privKeyInfo, mbedtls_pk_info_from_type( keyAlgo ), sizeof( mbedtls_pk_info_t ) );
+        memcpy( &pProfile->privKeyInfo, mbedtls_pk_info_from_type( keyAlgo ), sizeof( mbedtls_pk_info_t ) );
 
-        pContext->privKeyInfo.sign_func = privateKeySigningCallback;
-        pContext->privKey.pk_info = &pContext->privKeyInfo;
-        pContext->privKey.pk_ctx = pContext;
+        pProfile->privKeyInfo.sign_func = privateKeySigningCallback;
+        pProfile->privKey.pk_info = &pProfile->privKeyInfo;
+        pProfile->privKey.pk_ctx = pProfile;
     }
 
     return( ret == CKR_OK );
@@ -658,13 +1439,7 @@ static int32_t privateKeySigningCallback( void * pContext,
                                                               size_t ),
                                           void * pRngContext )
 {
-    CK_RV ret = CKR_OK;
-    int32_t result = 0;
-    MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context = ( MbedtlsPkcs11Context_t * ) pContext;
-    CK_MECHANISM mech = { 0 };
-    /* Buffer big enough to hold data to be signed. */
-    CK_BYTE toBeSigned[ 256 ];
-    CK_ULONG toBeSignedLen = sizeof( toBeSigned );
+    MbedtlsPkcs11Profile_t * pProfile = ( MbedtlsPkcs11Profile_t * ) pContext;
 
     /* Unreferenced parameters. */
     ( void ) ( pRng );
@@ -672,77 +1447,406 @@ static int32_t privateKeySigningCallback( void * pContext,
     ( void ) ( mdAlg );
 
     assert( pContext != NULL );
-    assert( pHash != NULL );
-    assert( pSigLen != NULL );
 
-    /* Sanity check buffer length. */
-    if( hashLen > sizeof( toBeSigned ) )
+    return Mbedtls_Pkcs11_Sign( pProfile->pP11FunctionList,
+                                pProfile->p11SlotId,
+                                pProfile->p11PrivateKey,
+                                pProfile->keyType,
+                                pHash,
+                                hashLen,
+                                pSig,
+                                pSigLen );
+}
+
+/*-----------------------------------------------------------*/
+
+static uint64_t getTimeUs( void )
+{
+    struct timespec timeSpec;
+
+    ( void ) clock_gettime( CLOCK_MONOTONIC, &timeSpec );
+
+    return ( ( uint64_t ) timeSpec.tv_sec * 1000000ULL ) + ( ( uint64_t ) timeSpec.tv_nsec / 1000ULL );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool isCertificateRejected( const mbedtls_ssl_context * pSslContext,
+                                   int mbedtlsError )
+{
+    bool rejected = false;
+
+    /* MbedTLS returns MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE with the received
+     * alert still in the input buffer: the level, then the description. */
+    if( ( mbedtlsError == MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE ) &&
+        ( pSslContext->in_msgtype == MBEDTLS_SSL_MSG_ALERT ) &&
+        ( pSslContext->in_msg != NULL ) )
     {
-        ret = CKR_ARGUMENTS_BAD;
+        switch( pSslContext->in_msg[ 1 ] )
+        {
+            case MBEDTLS_SSL_ALERT_MSG_BAD_CERT:
+            case MBEDTLS_SSL_ALERT_MSG_UNSUPPORTED_CERT:
+            case MBEDTLS_SSL_ALERT_MSG_CERT_REVOKED:
+            case MBEDTLS_SSL_ALERT_MSG_CERT_EXPIRED:
+            case MBEDTLS_SSL_ALERT_MSG_CERT_UNKNOWN:
+            case MBEDTLS_SSL_ALERT_MSG_UNKNOWN_CA:
+            case MBEDTLS_SSL_ALERT_MSG_ACCESS_DENIED:
+                rejected = true;
+                break;
+
+            default:
+                rejected = false;
+                break;
+        }
     }
 
-    /* Format the hash data to be signed. */
-    if( pMbedtlsPkcs11Context->keyType == CKK_RSA )
-    {
-        mech.mechanism = CKM_RSA_PKCS;
+    return rejected;
+}
+
+/*-----------------------------------------------------------*/
 
-        /* mbedTLS expects hashed data without padding, but PKCS #11 C_Sign function performs a hash
-         * & sign if hash algorithm is specified.  This helper function applies padding
-         * indicating data was hashed with SHA-256 while still allowing pre-hashed data to
-         * be provided. */
-        ret = vAppendSHA256AlgorithmIdentifierSequence( ( const uint8_t * ) pHash, toBeSigned );
-        toBeSignedLen = pkcs11RSA_SIGNATURE_INPUT_LENGTH;
+static MbedtlsPkcs11ConnectPhase_t handshakePhase( int handshakeState )
+{
+    MbedtlsPkcs11ConnectPhase_t phase;
+
+    switch( handshakeState )
+    {
+        case MBEDTLS_SSL_HELLO_REQUEST:
+        case MBEDTLS_SSL_CLIENT_HELLO:
+        case MBEDTLS_SSL_SERVER_HELLO:
+            phase = MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_HELLO;
+            break;
+
+        case MBEDTLS_SSL_SERVER_CERTIFICATE:
+            phase = MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_CERTIFICATE;
+            break;
+
+        case MBEDTLS_SSL_SERVER_KEY_EXCHANGE:
+        case MBEDTLS_SSL_CERTIFICATE_REQUEST:
+        case MBEDTLS_SSL_SERVER_HELLO_DONE:
+        case MBEDTLS_SSL_CLIENT_CERTIFICATE:
+        case MBEDTLS_SSL_CLIENT_KEY_EXCHANGE:
+            phase = MBEDTLS_PKCS11_CONNECT_PHASE_KEY_EXCHANGE;
+            break;
+
+        case MBEDTLS_SSL_CERTIFICATE_VERIFY:
+            phase = MBEDTLS_PKCS11_CONNECT_PHASE_SIGN;
+            break;
+
+        default:
+            phase = MBEDTLS_PKCS11_CONNECT_PHASE_FINISHED;
+            break;
     }
-    else if( pMbedtlsPkcs11Context->keyType == CKK_EC )
+
+    return phase;
+}
+
+/*-----------------------------------------------------------*/
+
+static void recordConnectTiming( const MbedtlsPkcs11ConnectTiming_t * pTiming,
+                                 bool success )
+{
+    uint64_t durationMs;
+    uint32_t bucket;
+    size_t phase;
+
+    pthread_mutex_lock( &histogramMutex );
+
+    if( success == true )
     {
-        mech.mechanism = CKM_ECDSA;
-        memcpy( toBeSigned, pHash, hashLen );
-        toBeSignedLen = hashLen;
+        connectHistogram.connects++;
+
+        if( pTiming->resumed == true )
+        {
+            connectHistogram.resumptions++;
+        }
+
+        for( phase = 0; phase < MBEDTLS_PKCS11_CONNECT_PHASE_COUNT; phase++ )
+        {
+            /* Bucket 0 is below 1 ms; bucket i starts at 2^(i-1) ms. */
+            durationMs = pTiming->phaseUs[ phase ] / 1000ULL;
+
+            for( bucket = 0U; ( durationMs > 0ULL ) && ( bucket < ( MBEDTLS_PKCS11_CONNECT_HISTOGRAM_BUCKETS - 1U ) ); bucket++ )
+            {
+                durationMs >>= 1;
+            }
+
+            connectHistogram.counts[ phase ][ bucket ]++;
+        }
     }
     else
     {
-        ret = CKR_ARGUMENTS_BAD;
+        connectHistogram.failures++;
     }
 
-    if( ret == CKR_OK )
+    pthread_mutex_unlock( &histogramMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+static void configureStep( void * pConnectStep )
+{
+    ConnectStep_t * pStep = ( ConnectStep_t * ) pConnectStep;
+
+    pStep->status = configureMbedtls( pStep->pContext,
+                                      pStep->pHostName,
+                                      pStep->pCredentials,
+                                      pStep->recvTimeoutMs );
+}
+
+/*-----------------------------------------------------------*/
+
+static void tcpConnectStep( void * pConnectStep )
+{
+    ConnectStep_t * pStep = ( ConnectStep_t * ) pConnectStep;
+
+    pStep->mbedtlsError = mbedtls_net_connect( &( pStep->pContext->socketContext ),
+                                               pStep->pHostName,
+                                               pStep->pPortStr,
+                                               MBEDTLS_NET_PROTO_TCP );
+}
+
+/*-----------------------------------------------------------*/
+
+static void handshakeStep( void * pConnectStep )
+{
+    ConnectStep_t * pStep = ( ConnectStep_t * ) pConnectStep;
+
+    pStep->mbedtlsError = mbedtls_ssl_handshake_step( &( pStep->pContext->context ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t waitForReadiness( MbedtlsPkcs11Context_t * pContext,
+                                 int32_t mbedtlsStatus,
+                                 bool useWakeupFd,
+                                 uint32_t timeoutMs )
+{
+    struct pollfd pollFds[ 2 ];
+    nfds_t pollFdCount = 1U;
+    int pollStatus;
+    int32_t readyFlags = 0;
+
+    pollFds[ 0 ].fd = pContext->socketContext.fd;
+    pollFds[ 0 ].events = ( mbedtlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) ? POLLOUT : POLLIN;
+    pollFds[ 0 ].revents = 0;
+
+    if( ( useWakeupFd == true ) && ( pContext->wakeupFd >= 0 ) )
     {
-        /* Use the PKCS #11 module to sign. */
-        ret = pMbedtlsPkcs11Context->pP11FunctionList->C_SignInit( pMbedtlsPkcs11Context->p11Session,
-                                                                   &mech,
-                                                                   pMbedtlsPkcs11Context->p11PrivateKey );
+        pollFds[ 1 ].fd = pContext->wakeupFd;
+        pollFds[ 1 ].events = POLLIN;
+        pollFds[ 1 ].revents = 0;
+        pollFdCount = 2U;
     }
 
-    if( ret == CKR_OK )
+    do
     {
-        *pSigLen = sizeof( toBeSigned );
-        ret = pMbedtlsPkcs11Context->pP11FunctionList->C_Sign( pMbedtlsPkcs11Context->p11Session,
-                                                               toBeSigned,
-                                                               toBeSignedLen,
-                                                               pSig,
-                                                               ( CK_ULONG_PTR ) pSigLen );
+        if( pContext->waitFunction != NULL )
+        {
+            pollStatus = pContext->waitFunction( pContext->pWaitContext,
+                                                 pollFds,
+                                                 pollFdCount,
+                                                 ( int ) timeoutMs );
+        }
+        else
+        {
+            pollStatus = poll( pollFds, pollFdCount, ( int ) timeoutMs );
+        }
+    } while( ( pollStatus < 0 ) && ( errno == EINTR ) );
+
+    if( pollStatus < 0 )
+    {
+        LogError( ( "Failed to poll the socket with errno %d.", errno ) );
+        readyFlags = -1;
     }
+    else
+    {
+        /* Errors and hang-ups are reported by the next MbedTLS call on the socket. */
+        if( pollFds[ 0 ].revents != 0 )
+        {
+            readyFlags |= SOCKET_READY_FLAG;
+        }
+
+        if( ( pollFdCount > 1U ) && ( pollFds[ 1 ].revents != 0 ) )
+        {
+            readyFlags |= WAKEUP_READY_FLAG;
+        }
+    }
+
+    return readyFlags;
+}
 
-    if( ( ret == CKR_OK ) && ( pMbedtlsPkcs11Context->keyType == CKK_EC ) )
+/*-----------------------------------------------------------*/
+
+static int32_t writeAll( MbedtlsPkcs11Context_t * pContext,
+                         const uint8_t * pData,
+                         size_t dataLength )
+{
+    int32_t tlsStatus = 0;
+    size_t bytesSent = 0U;
+    int32_t readyFlags;
+    uint32_t retries = 0U;
+
+    while( ( bytesSent < dataLength ) && ( tlsStatus >= 0 ) )
     {
-        /* PKCS #11 for P256 returns a 64-byte signature with 32 bytes for R and 32 bytes for S.
-         * This must be converted to an ASN.1 encoded array. */
-        if( *pSigLen != pkcs11ECDSA_P256_SIGNATURE_LENGTH )
+        tlsStatus = ( int32_t ) mbedtls_ssl_write( &( pContext->context ),
+                                                   &( pData[ bytesSent ] ),
+                                                   dataLength - bytesSent );
+
+        if( ( tlsStatus == MBEDTLS_ERR_SSL_TIMEOUT ) ||
+            ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
+            ( tlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) )
+        {
+            LogDebug( ( "Failed to send data. However, send can be retried on this error. "
+                        "mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( tlsStatus ),
+                        mbedtlsLowLevelCodeOrDefault( tlsStatus ) ) );
+
+            /* The buffered data has been accepted by the caller already, so
+             * retry with the same arguments as required by MbedTLS. A non-blocking
+             * connection waits for the socket first. A peer that does not read
+             * fails the write after #MBEDTLS_PKCS11_WRITE_MAX_RETRIES retries. */
+            retries++;
+
+            if( retries > MBEDTLS_PKCS11_WRITE_MAX_RETRIES )
+            {
+                LogError( ( "Failed to send data after %u retries.", ( unsigned int ) MBEDTLS_PKCS11_WRITE_MAX_RETRIES ) );
+                tlsStatus = MBEDTLS_ERR_SSL_TIMEOUT;
+            }
+            else if( ( pContext->nonBlocking == true ) && ( tlsStatus != MBEDTLS_ERR_SSL_TIMEOUT ) )
+            {
+                readyFlags = waitForReadiness( pContext, tlsStatus, false, pContext->recvTimeoutMs );
+
+                if( readyFlags <= 0 )
+                {
+                    LogError( ( "Socket is not ready for sending." ) );
+                    tlsStatus = ( readyFlags == 0 ) ? MBEDTLS_ERR_SSL_TIMEOUT : MBEDTLS_ERR_NET_SEND_FAILED;
+                }
+                else
+                {
+                    tlsStatus = 0;
+                }
+            }
+            else
+            {
+                tlsStatus = 0;
+            }
+        }
+        else if( tlsStatus < 0 )
+        {
+            LogError( ( "Failed to send data:  mbedTLSError= %s : %s.",
+                        mbedtlsHighLevelCodeOrDefault( tlsStatus ),
+                        mbedtlsLowLevelCodeOrDefault( tlsStatus ) ) );
+        }
+        else
         {
-            ret = CKR_FUNCTION_FAILED;
+            bytesSent += ( size_t ) tlsStatus;
+            retries = 0U;
         }
+    }
+
+    return ( tlsStatus < 0 ) ? tlsStatus : 0;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t flushWriteBuffer( MbedtlsPkcs11Context_t * pContext )
+{
+    if( ( pContext->writeStatus == 0 ) && ( pContext->writeBufferLength > 0U ) )
+    {
+        /* The data can not be sent again after a failure, since MbedTLS may have
+         * sent a part of it. The connection is not usable anymore, so the error
+         * is kept and returned by the later operations instead of dropping the
+         * data reported as sent silently. */
+        pContext->writeStatus = writeAll( pContext, pContext->writeBuffer, pContext->writeBufferLength );
+        pContext->writeBufferLength = 0U;
+    }
+
+    return pContext->writeStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static uint64_t writeBufferTimeLeftUs( const MbedtlsPkcs11Context_t * pContext,
+                                       uint64_t nowUs )
+{
+    uint64_t timeLeftUs = UINT64_MAX;
+    uint64_t ageUs;
 
-        if( ret == CKR_OK )
+    if( pContext->writeBufferLength >= MBEDTLS_PKCS11_WRITE_FLUSH_THRESHOLD )
+    {
+        timeLeftUs = 0U;
+    }
+    else if( pContext->writeBufferLength > 0U )
+    {
+        ageUs = nowUs - pContext->writeBufferStartUs;
+        timeLeftUs = ( ageUs >= MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US ) ? 0U :
+                     ( MBEDTLS_PKCS11_WRITE_FLUSH_DEADLINE_US - ageUs );
+    }
+    else
+    {
+        /* Empty else marker. */
+    }
+
+    return timeLeftUs;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t writeCombined( MbedtlsPkcs11Context_t * pContext,
+                              const TransportOutVector_t * pIoVec,
+                              size_t ioVecCount )
+{
+    int32_t tlsStatus = 0;
+    size_t totalBytes = 0U;
+    size_t i;
+    const uint8_t * pData;
+    size_t dataLength;
+    size_t copyLength;
+
+    /* Nothing is accepted by a connection whose flush failed. */
+    tlsStatus = pContext->writeStatus;
+
+    for( i = 0U; ( i < ioVecCount ) && ( tlsStatus == 0 ); i++ )
+    {
+        pData = ( const uint8_t * ) pIoVec[ i ].iov_base;
+        dataLength = pIoVec[ i ].iov_len;
+
+        while( ( dataLength > 0U ) && ( tlsStatus == 0 ) )
         {
-            PKI_pkcs11SignatureTombedTLSSignature( pSig, pSigLen );
+            if( pContext->writeBufferLength == 0U )
+            {
+                pContext->writeBufferStartUs = getTimeUs();
+            }
+
+            copyLength = MBEDTLS_PKCS11_WRITE_BUFFER_SIZE - pContext->writeBufferLength;
+
+            if( copyLength > dataLength )
+            {
+                copyLength = dataLength;
+            }
+
+            memcpy( &( pContext->writeBuffer[ pContext->writeBufferLength ] ), pData, copyLength );
+            pContext->writeBufferLength += copyLength;
+            pData = &( pData[ copyLength ] );
+            dataLength -= copyLength;
+
+            /* A full buffer is sent as one record. */
+            if( pContext->writeBufferLength == MBEDTLS_PKCS11_WRITE_BUFFER_SIZE )
+            {
+                tlsStatus = flushWriteBuffer( pContext );
+            }
         }
+
+        totalBytes += pIoVec[ i ].iov_len;
     }
 
-    if( ret != CKR_OK )
+    if( ( tlsStatus == 0 ) && ( writeBufferTimeLeftUs( pContext, getTimeUs() ) == 0U ) )
     {
-        LogError( ( "Failed to sign message using PKCS #11 with error code %lu.", ( unsigned long ) ret ) );
+        tlsStatus = flushWriteBuffer( pContext );
     }
 
-    return result;
+    return ( tlsStatus == 0 ) ? ( int32_t ) totalBytes : tlsStatus;
 }
 
 /*-----------------------------------------------------------*/
@@ -757,6 +1861,13 @@ MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext
     MbedtlsPkcs11Status_t returnStatus = MBEDTLS_PKCS11_SUCCESS;
     int32_t mbedtlsError = 0;
     char portStr[ 6 ] = { 0 };
+    MbedtlsPkcs11ConnectTiming_t timing = { { 0 }, false };
+    MbedtlsPkcs11ConnectPhase_t phase;
+    uint64_t connectStartUs = getTimeUs();
+    uint64_t phaseStartUs = connectStartUs;
+    MbedtlsPkcs11MemoryAccount_t * pPreviousAccount = NULL;
+    uint8_t mflCode = 0U;
+    ConnectStep_t step = { 0 };
 
     if( ( pNetworkContext == NULL ) ||
         ( pNetworkContext->pParams == NULL ) ||
@@ -773,46 +1884,148 @@ MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext
                     ( const void * ) pMbedtlsPkcs11Credentials ) );
         returnStatus = MBEDTLS_PKCS11_INVALID_PARAMETER;
     }
+    else if( getMflCode( pMbedtlsPkcs11Credentials->maxFragmentLength, &mflCode ) == false )
+    {
+        LogError( ( "Invalid maximum fragment length %u: it must be 512, 1024, 2048 or 4096.",
+                    ( unsigned int ) pMbedtlsPkcs11Credentials->maxFragmentLength ) );
+        returnStatus = MBEDTLS_PKCS11_INVALID_PARAMETER;
+    }
     else
     {
         snprintf( portStr, sizeof( portStr ), "%u", port );
         pMbedtlsPkcs11Context = pNetworkContext->pParams;
 
-        /* Configure MbedTLS. */
-        returnStatus = configureMbedtls( pMbedtlsPkcs11Context, pHostName, pMbedtlsPkcs11Credentials, recvTimeoutMs );
+        step.pContext = pMbedtlsPkcs11Context;
+        step.pHostName = pHostName;
+        step.pPortStr = portStr;
+        step.pCredentials = pMbedtlsPkcs11Credentials;
+        step.recvTimeoutMs = recvTimeoutMs;
+
+        /* Configure MbedTLS. The steps that can block run on a worker thread when
+         * the connection is served by an event loop. */
+        Mbedtls_Pkcs11_RunBlocking( pMbedtlsPkcs11Context->waitFunction,
+                                    pMbedtlsPkcs11Context->pWaitContext,
+                                    configureStep,
+                                    &step );
+        returnStatus = step.status;
+        timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_SETUP ] = getTimeUs() - phaseStartUs;
     }
 
     /* Establish a TCP connection with the server. */
     if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
     {
-        mbedtlsError = mbedtls_net_connect( &( pMbedtlsPkcs11Context->socketContext ),
-                                            pHostName,
-                                            portStr,
-                                            MBEDTLS_NET_PROTO_TCP );
+        /* mbedtls_net_connect resolves the host name and connects in one call,
+         * so both are counted in the TCP connect phase. */
+        phaseStartUs = getTimeUs();
+        Mbedtls_Pkcs11_RunBlocking( pMbedtlsPkcs11Context->waitFunction,
+                                    pMbedtlsPkcs11Context->pWaitContext,
+                                    tcpConnectStep,
+                                    &step );
+        mbedtlsError = step.mbedtlsError;
 
         if( mbedtlsError != 0 )
         {
             LogError( ( "Failed to connect to %s with error %d.", pHostName, mbedtlsError ) );
             returnStatus = MBEDTLS_PKCS11_CONNECT_FAILURE;
         }
+        else if( pMbedtlsPkcs11Context->nonBlocking == true )
+        {
+            mbedtlsError = mbedtls_net_set_nonblock( &( pMbedtlsPkcs11Context->socketContext ) );
+
+            if( mbedtlsError != 0 )
+            {
+                LogError( ( "Failed to set the socket to non-blocking with error %d.", mbedtlsError ) );
+                returnStatus = MBEDTLS_PKCS11_INTERNAL_ERROR;
+            }
+        }
+        else
+        {
+            /* Empty else marker. */
+        }
+
+        timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_TCP_CONNECT ] = getTimeUs() - phaseStartUs;
     }
 
     if( returnStatus == MBEDTLS_PKCS11_SUCCESS )
     {
-        /* Perform the TLS handshake. */
+        /* The handshake memory is counted in the connection, except the session
+         * saved in the shared profile afterwards. */
+        pPreviousAccount = Mbedtls_Pkcs11_MemorySetAccount( &( pMbedtlsPkcs11Context->memoryAccount ) );
+        resumptionLoad( pMbedtlsPkcs11Context, pHostName, port );
+
+        /* Perform the TLS handshake one step at a time, so that the time of each
+         * step, including the wait for the server, is counted in its phase. */
         do
         {
-            mbedtlsError = mbedtls_ssl_handshake( &( pMbedtlsPkcs11Context->context ) );
-        } while( ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_READ ) ||
+            phase = handshakePhase( pMbedtlsPkcs11Context->context.state );
+            phaseStartUs = getTimeUs();
+
+            if( phase == MBEDTLS_PKCS11_CONNECT_PHASE_SIGN )
+            {
+                Mbedtls_Pkcs11_RunBlocking( pMbedtlsPkcs11Context->waitFunction,
+                                            pMbedtlsPkcs11Context->pWaitContext,
+                                            handshakeStep,
+                                            &step );
+                mbedtlsError = step.mbedtlsError;
+            }
+            else
+            {
+                mbedtlsError = mbedtls_ssl_handshake_step( &( pMbedtlsPkcs11Context->context ) );
+            }
+
+            /* A resumed handshake goes from the ServerHello to the server
+             * ChangeCipherSpec, without certificates or signature. */
+            if( ( phase == MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_HELLO ) &&
+                ( pMbedtlsPkcs11Context->context.state == MBEDTLS_SSL_SERVER_CHANGE_CIPHER_SPEC ) )
+            {
+                timing.resumed = true;
+            }
+
+            /* A non-blocking handshake waits for the socket within the receive timeout. */
+            if( ( pMbedtlsPkcs11Context->nonBlocking == true ) &&
+                ( ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_READ ) ||
+                  ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_WRITE ) ) &&
+                ( waitForReadiness( pMbedtlsPkcs11Context, mbedtlsError, false,
+                                    pMbedtlsPkcs11Context->recvTimeoutMs ) <= 0 ) )
+            {
+                mbedtlsError = MBEDTLS_ERR_SSL_TIMEOUT;
+            }
+
+            timing.phaseUs[ phase ] += getTimeUs() - phaseStartUs;
+        } while( ( ( mbedtlsError == 0 ) &&
+                   ( pMbedtlsPkcs11Context->context.state != MBEDTLS_SSL_HANDSHAKE_OVER ) ) ||
+                 ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_READ ) ||
                  ( mbedtlsError == MBEDTLS_ERR_SSL_WANT_WRITE ) );
 
-        if( ( mbedtlsError != 0 ) || ( mbedtls_ssl_get_verify_result( &( pMbedtlsPkcs11Context->context ) ) != 0U ) )
+        ( void ) Mbedtls_Pkcs11_MemorySetAccount( pPreviousAccount );
+
+        if( isCertificateRejected( &( pMbedtlsPkcs11Context->context ), mbedtlsError ) == true )
+        {
+            LogError( ( "The server rejected the client certificate with TLS alert %u.",
+                        ( unsigned int ) pMbedtlsPkcs11Context->context.in_msg[ 1 ] ) );
+            returnStatus = MBEDTLS_PKCS11_CERTIFICATE_REJECTED;
+        }
+        else if( ( mbedtlsError != 0 ) || ( mbedtls_ssl_get_verify_result( &( pMbedtlsPkcs11Context->context ) ) != 0U ) )
         {
             LogError( ( "Failed to perform TLS handshake: mbedTLSError= %s : %s.",
                         mbedtlsHighLevelCodeOrDefault( mbedtlsError ),
                         mbedtlsLowLevelCodeOrDefault( mbedtlsError ) ) );
             returnStatus = MBEDTLS_PKCS11_HANDSHAKE_FAILED;
         }
+        else
+        {
+            /* Empty else marker. */
+        }
+
+        resumptionSave( pMbedtlsPkcs11Context, pHostName, port, ( returnStatus == MBEDTLS_PKCS11_SUCCESS ) );
+    }
+
+    timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_TOTAL ] = getTimeUs() - connectStartUs;
+
+    if( pMbedtlsPkcs11Context != NULL )
+    {
+        pMbedtlsPkcs11Context->connectTiming = timing;
+        recordConnectTiming( &timing, ( returnStatus == MBEDTLS_PKCS11_SUCCESS ) );
     }
 
     /* Clean up on failure. */
@@ -822,7 +2035,20 @@ MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext
     }
     else
     {
-        LogInfo( ( "TLS Connection to %s established.", pHostName ) );
+        LogInfo( ( "TLS Connection to %s established in %lu ms%s, TLS memory peak %lu bytes.",
+                   pHostName,
+                   ( unsigned long ) ( timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_TOTAL ] / 1000ULL ),
+                   ( timing.resumed == true ) ? " with a resumed session" : "",
+                   ( unsigned long ) pMbedtlsPkcs11Context->memoryAccount.peakBytes ) );
+        LogDebug( ( "Connect phases in us: setup=%lu, tcp=%lu, server hello=%lu, certificate=%lu, "
+                    "key exchange=%lu, sign=%lu, finished=%lu.",
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_SETUP ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_TCP_CONNECT ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_HELLO ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_SERVER_CERTIFICATE ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_KEY_EXCHANGE ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_SIGN ],
+                    ( unsigned long ) timing.phaseUs[ MBEDTLS_PKCS11_CONNECT_PHASE_FINISHED ] ) );
     }
 
     return returnStatus;
@@ -830,6 +2056,97 @@ MbedtlsPkcs11Status_t Mbedtls_Pkcs11_Connect( NetworkContext_t * pNetworkContext
 
 /*-----------------------------------------------------------*/
 
+void Mbedtls_Pkcs11_SetNonBlocking( NetworkContext_t * pNetworkContext,
+                                    bool nonBlocking )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+
+    pNetworkContext->pParams->nonBlocking = nonBlocking;
+    pNetworkContext->pParams->wakeupFd = -1;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SetWakeupFd( NetworkContext_t * pNetworkContext,
+                                 int wakeupFd )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+
+    pNetworkContext->pParams->wakeupFd = wakeupFd;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SetWaitFunction( NetworkContext_t * pNetworkContext,
+                                     MbedtlsPkcs11WaitFunction_t waitFunction,
+                                     void * pWaitContext )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+
+    pNetworkContext->pParams->waitFunction = waitFunction;
+    pNetworkContext->pParams->pWaitContext = pWaitContext;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_GetConnectTiming( const NetworkContext_t * pNetworkContext,
+                                      MbedtlsPkcs11ConnectTiming_t * pTiming )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+    assert( pTiming != NULL );
+
+    *pTiming = pNetworkContext->pParams->connectTiming;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_GetMemoryStats( const NetworkContext_t * pNetworkContext,
+                                    MbedtlsPkcs11MemoryStats_t * pStats )
+{
+    const MbedtlsPkcs11Context_t * pContext = NULL;
+
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+    assert( pStats != NULL );
+
+    pContext = pNetworkContext->pParams;
+    memset( pStats, 0, sizeof( MbedtlsPkcs11MemoryStats_t ) );
+
+    if( pContext->pProfile != NULL )
+    {
+        #ifdef MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+            pStats->inRecordLength = mbedtls_ssl_get_input_max_frag_len( &( pContext->context ) );
+            pStats->outRecordLength = mbedtls_ssl_get_output_max_frag_len( &( pContext->context ) );
+        #else
+            pStats->inRecordLength = MBEDTLS_SSL_IN_CONTENT_LEN;
+            pStats->outRecordLength = MBEDTLS_SSL_OUT_CONTENT_LEN;
+        #endif
+    }
+
+    Mbedtls_Pkcs11_MemoryRead( &( pContext->memoryAccount ), &( pStats->currentBytes ), &( pStats->peakBytes ) );
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_GetConnectHistogram( MbedtlsPkcs11ConnectHistogram_t * pHistogram )
+{
+    assert( pHistogram != NULL );
+
+    pthread_mutex_lock( &histogramMutex );
+    *pHistogram = connectHistogram;
+    pthread_mutex_unlock( &histogramMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_ResetConnectHistogram( void )
+{
+    pthread_mutex_lock( &histogramMutex );
+    memset( &connectHistogram, 0, sizeof( connectHistogram ) );
+    pthread_mutex_unlock( &histogramMutex );
+}
+
+/*-----------------------------------------------------------*/
+
 void Mbedtls_Pkcs11_Disconnect( NetworkContext_t * pNetworkContext )
 {
     MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context = NULL;
@@ -838,6 +2155,11 @@ void Mbedtls_Pkcs11_Disconnect( NetworkContext_t * pNetworkContext )
     if( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) )
     {
         pMbedtlsPkcs11Context = pNetworkContext->pParams;
+
+        /* Send the packets that are still waiting in the write-combining buffer,
+         * e.g. the MQTT DISCONNECT. */
+        ( void ) flushWriteBuffer( pMbedtlsPkcs11Context );
+
         /* Attempting to terminate TLS connection. */
         tlsStatus = mbedtls_ssl_close_notify( &( pMbedtlsPkcs11Context->context ) );
 
@@ -874,13 +2196,72 @@ int32_t Mbedtls_Pkcs11_Recv( NetworkContext_t * pNetworkContext,
 {
     MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context = NULL;
     int32_t tlsStatus = 0;
+    int32_t readyFlags;
+    uint64_t timeLeftUs;
+    uint32_t timeoutMs;
 
     assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
 
     pMbedtlsPkcs11Context = pNetworkContext->pParams;
-    tlsStatus = ( int32_t ) mbedtls_ssl_read( &( pMbedtlsPkcs11Context->context ),
-                                              pBuffer,
-                                              bytesToRecv );
+
+    /* The peer can only respond to the buffered packets after they are sent. A
+     * blocking read can not wake up at the flush deadline, so the buffer is
+     * flushed first. A non-blocking connection keeps combining the packets written
+     * until its deadline, e.g. the acknowledgments of a burst of publishes. */
+    timeLeftUs = writeBufferTimeLeftUs( pMbedtlsPkcs11Context, getTimeUs() );
+
+    if( ( pMbedtlsPkcs11Context->nonBlocking == false ) || ( timeLeftUs == 0U ) )
+    {
+        tlsStatus = flushWriteBuffer( pMbedtlsPkcs11Context );
+        timeLeftUs = UINT64_MAX;
+    }
+    else
+    {
+        tlsStatus = pMbedtlsPkcs11Context->writeStatus;
+    }
+
+    if( tlsStatus == 0 )
+    {
+        tlsStatus = ( int32_t ) mbedtls_ssl_read( &( pMbedtlsPkcs11Context->context ),
+                                                  pBuffer,
+                                                  bytesToRecv );
+    }
+
+    /* Wait for the socket and the wakeup file descriptor at the same time, then
+     * read once more if the socket has data. The wait ends at the flush deadline
+     * of the buffered data, which is then sent; the receive can be retried. */
+    if( ( pMbedtlsPkcs11Context->nonBlocking == true ) &&
+        ( ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
+          ( tlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) ) )
+    {
+        timeoutMs = pMbedtlsPkcs11Context->recvTimeoutMs;
+
+        if( timeLeftUs < ( ( uint64_t ) timeoutMs * 1000ULL ) )
+        {
+            timeoutMs = ( uint32_t ) ( ( timeLeftUs + 999ULL ) / 1000ULL );
+        }
+
+        readyFlags = waitForReadiness( pMbedtlsPkcs11Context, tlsStatus, true, timeoutMs );
+
+        if( ( readyFlags == 0 ) && ( pMbedtlsPkcs11Context->writeBufferLength > 0U ) )
+        {
+            tlsStatus = flushWriteBuffer( pMbedtlsPkcs11Context );
+        }
+        else if( ( readyFlags > 0 ) && ( ( readyFlags & SOCKET_READY_FLAG ) != 0 ) )
+        {
+            tlsStatus = ( int32_t ) mbedtls_ssl_read( &( pMbedtlsPkcs11Context->context ),
+                                                      pBuffer,
+                                                      bytesToRecv );
+        }
+        else if( readyFlags < 0 )
+        {
+            tlsStatus = MBEDTLS_ERR_NET_RECV_FAILED;
+        }
+        else
+        {
+            /* Timeout or wakeup. The receive can be retried. */
+        }
+    }
 
     if( ( tlsStatus == MBEDTLS_ERR_SSL_TIMEOUT ) ||
         ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
@@ -915,40 +2296,34 @@ int32_t Mbedtls_Pkcs11_Send( NetworkContext_t * pNetworkContext,
                              const void * pBuffer,
                              size_t bytesToSend )
 {
-    MbedtlsPkcs11Context_t * pMbedtlsPkcs11Context = NULL;
-    int32_t tlsStatus = 0;
+    TransportOutVector_t ioVec;
 
     assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
 
-    pMbedtlsPkcs11Context = pNetworkContext->pParams;
-    tlsStatus = ( int32_t ) mbedtls_ssl_write( &( pMbedtlsPkcs11Context->context ),
-                                               pBuffer,
-                                               bytesToSend );
+    ioVec.iov_base = pBuffer;
+    ioVec.iov_len = bytesToSend;
 
-    if( ( tlsStatus == MBEDTLS_ERR_SSL_TIMEOUT ) ||
-        ( tlsStatus == MBEDTLS_ERR_SSL_WANT_READ ) ||
-        ( tlsStatus == MBEDTLS_ERR_SSL_WANT_WRITE ) )
-    {
-        LogDebug( ( "Failed to send data. However, send can be retried on this error. "
-                    "mbedTLSError= %s : %s.",
-                    mbedtlsHighLevelCodeOrDefault( tlsStatus ),
-                    mbedtlsLowLevelCodeOrDefault( tlsStatus ) ) );
+    return writeCombined( pNetworkContext->pParams, &ioVec, 1U );
+}
 
-        /* Mark these set of errors as a timeout. The libraries may retry send
-         * on these errors. */
-        tlsStatus = 0;
-    }
-    else if( tlsStatus < 0 )
-    {
-        LogError( ( "Failed to send data:  mbedTLSError= %s : %s.",
-                    mbedtlsHighLevelCodeOrDefault( tlsStatus ),
-                    mbedtlsLowLevelCodeOrDefault( tlsStatus ) ) );
-    }
-    else
-    {
-        /* Empty else marker. */
-    }
+/*-----------------------------------------------------------*/
 
-    return tlsStatus;
+int32_t Mbedtls_Pkcs11_Writev( NetworkContext_t * pNetworkContext,
+                               TransportOutVector_t * pIoVec,
+                               size_t ioVecCount )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+    assert( ( pIoVec != NULL ) || ( ioVecCount == 0U ) );
+
+    return writeCombined( pNetworkContext->pParams, pIoVec, ioVecCount );
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t Mbedtls_Pkcs11_Flush( NetworkContext_t * pNetworkContext )
+{
+    assert( ( pNetworkContext != NULL ) && ( pNetworkContext->pParams != NULL ) );
+
+    return flushWriteBuffer( pNetworkContext->pParams );
 }
 /*-----------------------------------------------------------*/
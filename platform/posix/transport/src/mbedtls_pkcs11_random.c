@@ -0,0 +1,354 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the random number generator. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Random number generator header. */
+#include "mbedtls_pkcs11_random.h"
+#include "mbedtls_pkcs11_session_pool.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/entropy.h"
+#include "mbedtls/platform_util.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Personalization string of the DRBG.
+ */
+#define RANDOM_PERSONALIZATION    "mbedtls_pkcs11_random"
+
+/**
+ * @brief Number of bytes read from getrandom() to reseed the DRBG after fork.
+ */
+#define RANDOM_FORK_SEED_LENGTH    ( 32U )
+
+#if ( MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE > MBEDTLS_CTR_DRBG_MAX_REQUEST )
+    #error "MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE must not be larger than MBEDTLS_CTR_DRBG_MAX_REQUEST."
+#endif
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Entropy callback of the DRBG. It reads the seed from the PKCS #11 module
+ * on a leased session.
+ *
+ * @param[in] pCtx Random number generator.
+ * @param[out] pEntropy Buffer to fill with entropy.
+ * @param[in] entropyLength Number of bytes requested.
+ *
+ * @return Zero on success; MBEDTLS_ERR_ENTROPY_SOURCE_FAILED on failure.
+ */
+static int entropyCallback( void * pCtx,
+                            unsigned char * pEntropy,
+                            size_t entropyLength );
+
+/**
+ * @brief Generate DRBG output, reseeding the DRBG first when the reseed interval
+ * is reached. Must be called with the mutex held.
+ *
+ * @param[in] pRandom Random number generator.
+ * @param[out] pOutput Buffer to fill.
+ * @param[in] outputLength Number of bytes, at most MBEDTLS_CTR_DRBG_MAX_REQUEST.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure.
+ */
+static int32_t drbgGenerate( MbedtlsPkcs11Random_t * pRandom,
+                             unsigned char * pOutput,
+                             size_t outputLength );
+
+/**
+ * @brief Read the seed of a child process from the kernel.
+ *
+ * @param[out] pSeed Buffer to fill.
+ * @param[in] seedLength Number of bytes requested.
+ *
+ * @return Zero on success; MBEDTLS_ERR_ENTROPY_SOURCE_FAILED on failure.
+ */
+static int32_t readForkSeed( unsigned char * pSeed,
+                             size_t seedLength );
+
+/**
+ * @brief Reseed the DRBG in a child process and drop the output generated by
+ * the parent. Must be called with the mutex held.
+ *
+ * @param[in] pRandom Random number generator.
+ *
+ * @return Zero on success; negative MbedTLS error code on failure.
+ */
+static int32_t checkFork( MbedtlsPkcs11Random_t * pRandom );
+
+/*-----------------------------------------------------------*/
+
+static int entropyCallback( void * pCtx,
+                            unsigned char * pEntropy,
+                            size_t entropyLength )
+{
+    MbedtlsPkcs11Random_t * pRandom = ( MbedtlsPkcs11Random_t * ) pCtx;
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+    CK_RV xResult;
+    int ret = 0;
+
+    /* The reseeds run during the handshakes of any connection of the profile,
+     * so the seed is not read on a session another thread may be using. */
+    xResult = Mbedtls_Pkcs11_SessionPoolLease( pRandom->p11SlotId, &p11Session );
+
+    if( xResult == CKR_OK )
+    {
+        xResult = pRandom->pP11FunctionList->C_GenerateRandom( p11Session,
+                                                               pEntropy,
+                                                               entropyLength );
+
+        Mbedtls_Pkcs11_SessionPoolReturn( p11Session, ( xResult != CKR_OK ) );
+    }
+
+    if( xResult != CKR_OK )
+    {
+        LogError( ( "Failed to generate random bytes from the PKCS #11 module." ) );
+        ret = MBEDTLS_ERR_ENTROPY_SOURCE_FAILED;
+    }
+
+    return ret;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t drbgGenerate( MbedtlsPkcs11Random_t * pRandom,
+                             unsigned char * pOutput,
+                             size_t outputLength )
+{
+    int32_t mbedtlsError = 0;
+
+    if( pRandom->generateCount >= MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL )
+    {
+        mbedtlsError = mbedtls_ctr_drbg_reseed( &( pRandom->drbg ), NULL, 0 );
+
+        if( mbedtlsError == 0 )
+        {
+            pRandom->generateCount = 0U;
+        }
+        else
+        {
+            LogError( ( "Failed to reseed the DRBG with error %d.", ( int ) mbedtlsError ) );
+        }
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_ctr_drbg_random( &( pRandom->drbg ), pOutput, outputLength );
+        pRandom->generateCount++;
+    }
+
+    return mbedtlsError;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t readForkSeed( unsigned char * pSeed,
+                             size_t seedLength )
+{
+    int32_t mbedtlsError = 0;
+    size_t offset = 0U;
+    ssize_t readLength;
+
+    while( ( mbedtlsError == 0 ) && ( offset < seedLength ) )
+    {
+        readLength = getrandom( &( pSeed[ offset ] ), seedLength - offset, 0 );
+
+        if( readLength > 0 )
+        {
+            offset += ( size_t ) readLength;
+        }
+        else if( ( readLength < 0 ) && ( errno == EINTR ) )
+        {
+            /* Empty else marker. */
+        }
+        else
+        {
+            LogError( ( "Failed to read the seed of the child process with errno %d.", errno ) );
+            mbedtlsError = MBEDTLS_ERR_ENTROPY_SOURCE_FAILED;
+        }
+    }
+
+    return mbedtlsError;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t checkFork( MbedtlsPkcs11Random_t * pRandom )
+{
+    unsigned char seed[ RANDOM_FORK_SEED_LENGTH + sizeof( pid_t ) ];
+    int32_t mbedtlsError = 0;
+    pid_t pid = getpid();
+
+    if( pid != pRandom->seedPid )
+    {
+        /* The child has a copy of the DRBG state and of the unused output of the
+         * parent. Both must be replaced before the child generates anything. */
+        mbedtls_platform_zeroize( pRandom->buffer, sizeof( pRandom->buffer ) );
+        pRandom->bufferOffset = sizeof( pRandom->buffer );
+
+        /* The PKCS #11 sessions of the parent cannot be used by the child, so the
+         * DRBG state is updated with kernel entropy and the pid instead of being
+         * reseeded from the module. */
+        mbedtlsError = readForkSeed( seed, RANDOM_FORK_SEED_LENGTH );
+
+        if( mbedtlsError == 0 )
+        {
+            memcpy( &( seed[ RANDOM_FORK_SEED_LENGTH ] ), &pid, sizeof( pid ) );
+            mbedtlsError = mbedtls_ctr_drbg_update_ret( &( pRandom->drbg ), seed, sizeof( seed ) );
+        }
+
+        mbedtls_platform_zeroize( seed, sizeof( seed ) );
+
+        if( mbedtlsError == 0 )
+        {
+            pRandom->seedPid = pid;
+            pRandom->generateCount = 0U;
+        }
+        else
+        {
+            LogError( ( "Failed to reseed the DRBG after fork with error %d.", ( int ) mbedtlsError ) );
+        }
+    }
+
+    return mbedtlsError;
+}
+
+/*-----------------------------------------------------------*/
+
+int32_t Mbedtls_Pkcs11_RandomInit( MbedtlsPkcs11Random_t * pRandom,
+                                   CK_FUNCTION_LIST_PTR pP11FunctionList,
+                                   CK_SLOT_ID p11SlotId )
+{
+    int32_t mbedtlsError = 0;
+
+    assert( pRandom != NULL );
+    assert( pP11FunctionList != NULL );
+
+    memset( pRandom, 0, sizeof( MbedtlsPkcs11Random_t ) );
+    ( void ) pthread_mutex_init( &( pRandom->mutex ), NULL );
+    mbedtls_ctr_drbg_init( &( pRandom->drbg ) );
+    pRandom->pP11FunctionList = pP11FunctionList;
+    pRandom->p11SlotId = p11SlotId;
+    pRandom->seedPid = getpid();
+    pRandom->bufferOffset = sizeof( pRandom->buffer );
+
+    mbedtlsError = mbedtls_ctr_drbg_seed( &( pRandom->drbg ),
+                                          entropyCallback,
+                                          pRandom,
+                                          ( const unsigned char * ) RANDOM_PERSONALIZATION,
+                                          sizeof( RANDOM_PERSONALIZATION ) - 1U );
+
+    if( mbedtlsError != 0 )
+    {
+        LogError( ( "Failed to seed the DRBG with error %d.", ( int ) mbedtlsError ) );
+    }
+
+    return mbedtlsError;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_RandomFree( MbedtlsPkcs11Random_t * pRandom )
+{
+    if( pRandom != NULL )
+    {
+        mbedtls_ctr_drbg_free( &( pRandom->drbg ) );
+        mbedtls_platform_zeroize( pRandom->buffer, sizeof( pRandom->buffer ) );
+        ( void ) pthread_mutex_destroy( &( pRandom->mutex ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+int Mbedtls_Pkcs11_RandomGenerate( void * pCtx,
+                                   unsigned char * pOutput,
+                                   size_t outputLength )
+{
+    MbedtlsPkcs11Random_t * pRandom = ( MbedtlsPkcs11Random_t * ) pCtx;
+    int32_t mbedtlsError = 0;
+    size_t copyLength;
+
+    assert( pCtx != NULL );
+    assert( ( pOutput != NULL ) || ( outputLength == 0U ) );
+
+    pthread_mutex_lock( &( pRandom->mutex ) );
+
+    mbedtlsError = checkFork( pRandom );
+
+    while( ( mbedtlsError == 0 ) && ( outputLength > 0U ) )
+    {
+        if( pRandom->bufferOffset < sizeof( pRandom->buffer ) )
+        {
+            /* Serve the request from the generated block. The used bytes are
+             * erased so that the output cannot be recovered from memory. */
+            copyLength = sizeof( pRandom->buffer ) - pRandom->bufferOffset;
+            copyLength = ( copyLength < outputLength ) ? copyLength : outputLength;
+
+            memcpy( pOutput, &( pRandom->buffer[ pRandom->bufferOffset ] ), copyLength );
+            mbedtls_platform_zeroize( &( pRandom->buffer[ pRandom->bufferOffset ] ), copyLength );
+            pRandom->bufferOffset += copyLength;
+            pOutput += copyLength;
+            outputLength -= copyLength;
+        }
+        else if( outputLength >= sizeof( pRandom->buffer ) )
+        {
+            /* A request of at least one block is generated in place. */
+            copyLength = ( outputLength < MBEDTLS_CTR_DRBG_MAX_REQUEST ) ? outputLength : MBEDTLS_CTR_DRBG_MAX_REQUEST;
+            mbedtlsError = drbgGenerate( pRandom, pOutput, copyLength );
+            pOutput += copyLength;
+            outputLength -= copyLength;
+        }
+        else
+        {
+            mbedtlsError = drbgGenerate( pRandom, pRandom->buffer, sizeof( pRandom->buffer ) );
+
+            if( mbedtlsError == 0 )
+            {
+                pRandom->bufferOffset = 0U;
+            }
+        }
+    }
+
+    pthread_mutex_unlock( &( pRandom->mutex ) );
+
+    return ( int ) mbedtlsError;
+}
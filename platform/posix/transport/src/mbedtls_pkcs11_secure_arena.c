@@ -0,0 +1,335 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* POSIX includes. */
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the secure arena. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Secure arena header. */
+#include "mbedtls_pkcs11_secure_arena.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/platform_util.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Page size used when the system does not report one.
+ */
+#define DEFAULT_PAGE_SIZE    ( 4096U )
+
+/**
+ * @brief Mapping of the arena; NULL when it is not mapped.
+ */
+static uint8_t * pArena = NULL;
+
+/**
+ * @brief Size of #pArena in bytes.
+ */
+static size_t arenaSize = 0U;
+
+/**
+ * @brief Number of blocks of #pArena.
+ */
+static size_t blockCount = 0U;
+
+/**
+ * @brief Number of blocks of the allocation starting at each block; zero for
+ * the other blocks.
+ */
+static size_t * pRunLengths = NULL;
+
+/**
+ * @brief #pArena is locked in RAM.
+ */
+static bool arenaLocked = false;
+
+/**
+ * @brief Bytes of the allocated blocks, and their largest value.
+ */
+static size_t usedBytes = 0U;
+static size_t peakBytes = 0U;
+
+/**
+ * @brief Mutex protecting the state of the arena.
+ */
+static pthread_mutex_t arenaMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Find free blocks for an allocation. Must be called with #arenaMutex
+ * held.
+ *
+ * @param[in] count Number of blocks to find.
+ *
+ * @return Index of the first of @p count free consecutive blocks; #blockCount
+ * if there are none.
+ */
+static size_t findFreeBlocks( size_t count );
+
+/*-----------------------------------------------------------*/
+
+static size_t findFreeBlocks( size_t count )
+{
+    size_t index = 0U;
+    size_t runStart = 0U;
+    size_t freeCount = 0U;
+
+    /* First fit. The blocks of an allocation are skipped at once. */
+    while( ( index < blockCount ) && ( freeCount < count ) )
+    {
+        if( pRunLengths[ index ] != 0U )
+        {
+            index += pRunLengths[ index ];
+            runStart = index;
+            freeCount = 0U;
+        }
+        else
+        {
+            index++;
+            freeCount++;
+        }
+    }
+
+    return ( freeCount == count ) ? runStart : blockCount;
+}
+
+/*-----------------------------------------------------------*/
+
+bool Mbedtls_Pkcs11_SecureArenaInit( size_t size )
+{
+    bool status;
+    long pageSize;
+    size_t mappingSize = 0U;
+    void * pMapping = MAP_FAILED;
+
+    pthread_mutex_lock( &arenaMutex );
+
+    if( pArena == NULL )
+    {
+        pageSize = sysconf( _SC_PAGESIZE );
+
+        if( pageSize <= 0 )
+        {
+            pageSize = ( long ) DEFAULT_PAGE_SIZE;
+        }
+
+        if( ( size > 0U ) && ( size <= ( SIZE_MAX - ( size_t ) pageSize ) ) )
+        {
+            mappingSize = ( ( size + ( size_t ) pageSize - 1U ) / ( size_t ) pageSize ) * ( size_t ) pageSize;
+            pMapping = mmap( NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        }
+
+        if( pMapping == MAP_FAILED )
+        {
+            LogError( ( "Failed to map the secure arena of %lu bytes. Error: %s.",
+                        ( unsigned long ) size,
+                        ( mappingSize == 0U ) ? "invalid size" : strerror( errno ) ) );
+        }
+        else
+        {
+            pRunLengths = calloc( mappingSize / MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE, sizeof( size_t ) );
+
+            if( pRunLengths == NULL )
+            {
+                LogError( ( "Failed to allocate the blocks of the secure arena." ) );
+                ( void ) munmap( pMapping, mappingSize );
+            }
+        }
+
+        if( pRunLengths != NULL )
+        {
+            #if defined( MADV_DONTDUMP )
+                ( void ) madvise( pMapping, mappingSize, MADV_DONTDUMP );
+            #endif
+
+            if( mlock( pMapping, mappingSize ) == 0 )
+            {
+                arenaLocked = true;
+            }
+            else
+            {
+                LogWarn( ( "Failed to lock the secure arena in memory, it may be swapped out. Error: %s.",
+                           strerror( errno ) ) );
+            }
+
+            pArena = ( uint8_t * ) pMapping;
+            arenaSize = mappingSize;
+            blockCount = mappingSize / MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE;
+            usedBytes = 0U;
+            peakBytes = 0U;
+        }
+    }
+
+    status = ( pArena != NULL );
+
+    pthread_mutex_unlock( &arenaMutex );
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SecureArenaDeinit( void )
+{
+    pthread_mutex_lock( &arenaMutex );
+
+    if( pArena != NULL )
+    {
+        mbedtls_platform_zeroize( pArena, arenaSize );
+
+        if( arenaLocked == true )
+        {
+            ( void ) munlock( pArena, arenaSize );
+        }
+
+        ( void ) munmap( pArena, arenaSize );
+        free( pRunLengths );
+
+        pArena = NULL;
+        arenaSize = 0U;
+        blockCount = 0U;
+        pRunLengths = NULL;
+        arenaLocked = false;
+        usedBytes = 0U;
+        peakBytes = 0U;
+    }
+
+    pthread_mutex_unlock( &arenaMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+void * Mbedtls_Pkcs11_SecureArenaAlloc( size_t length )
+{
+    void * pMemory = NULL;
+    size_t count;
+    size_t index;
+
+    pthread_mutex_lock( &arenaMutex );
+
+    if( pArena == NULL )
+    {
+        LogError( ( "The secure arena is not initialized." ) );
+    }
+    else if( ( length > 0U ) && ( length <= arenaSize ) )
+    {
+        count = ( length + MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE - 1U ) / MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE;
+        index = findFreeBlocks( count );
+
+        if( index < blockCount )
+        {
+            /* The free blocks are zero, as they are wiped when freed. */
+            pRunLengths[ index ] = count;
+            usedBytes += count * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE;
+
+            if( usedBytes > peakBytes )
+            {
+                peakBytes = usedBytes;
+            }
+
+            pMemory = &( pArena[ index * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE ] );
+        }
+    }
+    else
+    {
+        /* Empty else MISRA 15.7 */
+    }
+
+    if( ( pMemory == NULL ) && ( pArena != NULL ) && ( length > 0U ) )
+    {
+        LogError( ( "The secure arena has no free range of %lu bytes.",
+                    ( unsigned long ) length ) );
+    }
+
+    pthread_mutex_unlock( &arenaMutex );
+
+    return pMemory;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SecureArenaFree( void * pMemory )
+{
+    size_t index;
+    size_t length;
+
+    if( pMemory != NULL )
+    {
+        pthread_mutex_lock( &arenaMutex );
+
+        assert( pArena != NULL );
+        assert( ( ( uint8_t * ) pMemory >= pArena ) && ( ( uint8_t * ) pMemory < &( pArena[ arenaSize ] ) ) );
+
+        index = ( size_t ) ( ( uint8_t * ) pMemory - pArena ) / MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE;
+        assert( pRunLengths[ index ] != 0U );
+
+        length = pRunLengths[ index ] * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE;
+        mbedtls_platform_zeroize( pMemory, length );
+        pRunLengths[ index ] = 0U;
+        usedBytes -= length;
+
+        pthread_mutex_unlock( &arenaMutex );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SecureArenaRead( size_t * pUsedBytes,
+                                     size_t * pPeakBytes )
+{
+    pthread_mutex_lock( &arenaMutex );
+
+    if( pUsedBytes != NULL )
+    {
+        *pUsedBytes = usedBytes;
+    }
+
+    if( pPeakBytes != NULL )
+    {
+        *pPeakBytes = peakBytes;
+    }
+
+    pthread_mutex_unlock( &arenaMutex );
+}
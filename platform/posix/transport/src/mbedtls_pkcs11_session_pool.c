@@ -0,0 +1,300 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <assert.h>
+#include <pthread.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the session pool. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Session pool header. */
+#include "mbedtls_pkcs11_session_pool.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Session of the pool.
+ */
+typedef struct PoolEntry
+{
+    CK_SLOT_ID slotId;         /**< @brief Slot of #session. */
+    CK_SESSION_HANDLE session; /**< @brief Open session; CK_INVALID_HANDLE for a free entry. */
+    bool leased;               /**< @brief The entry is leased, or reserved while its session is opened. */
+    bool closeOnReturn;        /**< @brief The pool was closed while the entry was leased. */
+} PoolEntry_t;
+
+/**
+ * @brief Sessions of the pool.
+ */
+static PoolEntry_t poolEntries[ MBEDTLS_PKCS11_SESSION_POOL_SIZE ];
+
+/**
+ * @brief Mutex protecting #poolEntries.
+ */
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Signaled when an entry stops being leased.
+ */
+static pthread_cond_t poolCondition = PTHREAD_COND_INITIALIZER;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Close the session of an entry and make the entry free. Must be called
+ * with #poolMutex held.
+ *
+ * @param[in] pEntry Entry to close.
+ */
+static void closeEntry( PoolEntry_t * pEntry );
+
+/**
+ * @brief Find an entry to lease on a slot. Must be called with #poolMutex held.
+ *
+ * An idle session of the slot is preferred, then a free entry, then an idle
+ * session of another slot, which is closed.
+ *
+ * @param[in] slotId PKCS #11 slot of the lease.
+ *
+ * @return The entry; NULL if all the entries are leased.
+ */
+static PoolEntry_t * findEntry( CK_SLOT_ID slotId );
+
+/*-----------------------------------------------------------*/
+
+static void closeEntry( PoolEntry_t * pEntry )
+{
+    CK_FUNCTION_LIST_PTR pP11FunctionList = NULL;
+    CK_RV xResult;
+
+    if( pEntry->session != CK_INVALID_HANDLE )
+    {
+        xResult = C_GetFunctionList( &pP11FunctionList );
+
+        if( xResult == CKR_OK )
+        {
+            xResult = pP11FunctionList->C_CloseSession( pEntry->session );
+        }
+
+        if( xResult != CKR_OK )
+        {
+            LogWarn( ( "Failed to close a pooled PKCS #11 session with error code %lu.",
+                       ( unsigned long ) xResult ) );
+        }
+    }
+
+    pEntry->session = CK_INVALID_HANDLE;
+    pEntry->leased = false;
+    pEntry->closeOnReturn = false;
+}
+
+/*-----------------------------------------------------------*/
+
+static PoolEntry_t * findEntry( CK_SLOT_ID slotId )
+{
+    PoolEntry_t * pIdle = NULL;
+    PoolEntry_t * pFree = NULL;
+    PoolEntry_t * pOtherSlot = NULL;
+    PoolEntry_t * pEntry = NULL;
+    size_t i;
+
+    for( i = 0; ( i < MBEDTLS_PKCS11_SESSION_POOL_SIZE ) && ( pIdle == NULL ); i++ )
+    {
+        pEntry = &( poolEntries[ i ] );
+
+        if( pEntry->leased == true )
+        {
+            /* In use. */
+        }
+        else if( pEntry->session == CK_INVALID_HANDLE )
+        {
+            pFree = ( pFree == NULL ) ? pEntry : pFree;
+        }
+        else if( pEntry->slotId == slotId )
+        {
+            pIdle = pEntry;
+        }
+        else
+        {
+            pOtherSlot = ( pOtherSlot == NULL ) ? pEntry : pOtherSlot;
+        }
+    }
+
+    if( pIdle != NULL )
+    {
+        pEntry = pIdle;
+    }
+    else if( pFree != NULL )
+    {
+        pEntry = pFree;
+    }
+    else if( pOtherSlot != NULL )
+    {
+        closeEntry( pOtherSlot );
+        pEntry = pOtherSlot;
+    }
+    else
+    {
+        pEntry = NULL;
+    }
+
+    return pEntry;
+}
+
+/*-----------------------------------------------------------*/
+
+CK_RV Mbedtls_Pkcs11_SessionPoolLease( CK_SLOT_ID slotId,
+                                       CK_SESSION_HANDLE_PTR pSession )
+{
+    CK_FUNCTION_LIST_PTR pP11FunctionList = NULL;
+    PoolEntry_t * pEntry = NULL;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_RV xResult = CKR_OK;
+
+    assert( pSession != NULL );
+
+    pthread_mutex_lock( &poolMutex );
+
+    pEntry = findEntry( slotId );
+
+    while( pEntry == NULL )
+    {
+        pthread_cond_wait( &poolCondition, &poolMutex );
+        pEntry = findEntry( slotId );
+    }
+
+    pEntry->leased = true;
+    pEntry->slotId = slotId;
+    session = pEntry->session;
+
+    pthread_mutex_unlock( &poolMutex );
+
+    if( session == CK_INVALID_HANDLE )
+    {
+        /* The entry is reserved, so the session is opened without holding the
+         * mutex. */
+        xResult = C_GetFunctionList( &pP11FunctionList );
+
+        if( xResult == CKR_OK )
+        {
+            xResult = pP11FunctionList->C_OpenSession( slotId,
+                                                       CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                                                       NULL,
+                                                       NULL,
+                                                       &session );
+        }
+
+        pthread_mutex_lock( &poolMutex );
+
+        if( xResult == CKR_OK )
+        {
+            pEntry->session = session;
+        }
+        else
+        {
+            LogError( ( "Failed to open a pooled PKCS #11 session with error code %lu.",
+                        ( unsigned long ) xResult ) );
+            pEntry->leased = false;
+            pthread_cond_signal( &poolCondition );
+        }
+
+        pthread_mutex_unlock( &poolMutex );
+    }
+
+    *pSession = ( xResult == CKR_OK ) ? session : CK_INVALID_HANDLE;
+
+    return xResult;
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SessionPoolReturn( CK_SESSION_HANDLE session,
+                                       bool discard )
+{
+    PoolEntry_t * pEntry = NULL;
+    size_t i;
+
+    pthread_mutex_lock( &poolMutex );
+
+    for( i = 0; ( i < MBEDTLS_PKCS11_SESSION_POOL_SIZE ) && ( pEntry == NULL ); i++ )
+    {
+        if( ( poolEntries[ i ].leased == true ) && ( poolEntries[ i ].session == session ) )
+        {
+            pEntry = &( poolEntries[ i ] );
+        }
+    }
+
+    if( pEntry == NULL )
+    {
+        LogWarn( ( "Returned PKCS #11 session %lu is not leased from the pool.",
+                   ( unsigned long ) session ) );
+    }
+    else
+    {
+        if( ( discard == true ) || ( pEntry->closeOnReturn == true ) )
+        {
+            closeEntry( pEntry );
+        }
+        else
+        {
+            pEntry->leased = false;
+        }
+
+        pthread_cond_signal( &poolCondition );
+    }
+
+    pthread_mutex_unlock( &poolMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+void Mbedtls_Pkcs11_SessionPoolClose( void )
+{
+    size_t i;
+
+    pthread_mutex_lock( &poolMutex );
+
+    for( i = 0; i < MBEDTLS_PKCS11_SESSION_POOL_SIZE; i++ )
+    {
+        if( poolEntries[ i ].leased == true )
+        {
+            poolEntries[ i ].closeOnReturn = true;
+        }
+        else
+        {
+            closeEntry( &( poolEntries[ i ] ) );
+        }
+    }
+
+    pthread_mutex_unlock( &poolMutex );
+}
@@ -0,0 +1,163 @@
+/*
+ * AWS IoT Device SDK for Embedded C 202211.00
+ * Copyright (C) 2021 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Standard includes. */
+#include <string.h>
+#include <assert.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the signatures. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "Transport_MbedTLS_PKCS11"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+/* Signature header. */
+#include "mbedtls_pkcs11_sign.h"
+#include "mbedtls_pkcs11_session_pool.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/pk.h"
+
+/* PKCS #11 includes. */
+#include "core_pki_utils.h"
+
+/*-----------------------------------------------------------*/
+
+int32_t Mbedtls_Pkcs11_Sign( CK_FUNCTION_LIST_PTR pP11FunctionList,
+                             CK_SLOT_ID p11SlotId,
+                             CK_OBJECT_HANDLE p11PrivateKey,
+                             CK_KEY_TYPE keyType,
+                             const unsigned char * pHash,
+                             size_t hashLen,
+                             unsigned char * pSig,
+                             size_t * pSigLen )
+{
+    CK_RV ret = CKR_OK;
+    int32_t result = 0;
+    CK_MECHANISM mech = { 0 };
+    /* Buffer big enough to hold data to be signed. */
+    CK_BYTE toBeSigned[ 256 ];
+    CK_ULONG toBeSignedLen = sizeof( toBeSigned );
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+
+    assert( pP11FunctionList != NULL );
+    assert( pHash != NULL );
+    assert( pSigLen != NULL );
+
+    /* Sanity check buffer length, and format the hash data to be signed. */
+    if( hashLen > sizeof( toBeSigned ) )
+    {
+        ret = CKR_ARGUMENTS_BAD;
+    }
+    else if( keyType == CKK_RSA )
+    {
+        mech.mechanism = CKM_RSA_PKCS;
+
+        /* mbedTLS expects hashed data without padding, but PKCS #11 C_Sign function performs a hash
+         * & sign if hash algorithm is specified.  This helper function applies padding
+         * indicating data was hashed with SHA-256 while still allowing pre-hashed data to
+         * be provided. */
+        ret = vAppendSHA256AlgorithmIdentifierSequence( ( const uint8_t * ) pHash, toBeSigned );
+        toBeSignedLen = pkcs11RSA_SIGNATURE_INPUT_LENGTH;
+    }
+    else if( keyType == CKK_EC )
+    {
+        mech.mechanism = CKM_ECDSA;
+        memcpy( toBeSigned, pHash, hashLen );
+        toBeSignedLen = hashLen;
+    }
+    else
+    {
+        ret = CKR_ARGUMENTS_BAD;
+    }
+
+    if( ret != CKR_OK )
+    {
+        result = MBEDTLS_ERR_PK_BAD_INPUT_DATA;
+    }
+
+    /* The sign operation state is held by the session, so each signature is made
+     * on its own session and concurrent handshakes do not wait for each other. */
+    if( ret == CKR_OK )
+    {
+        ret = Mbedtls_Pkcs11_SessionPoolLease( p11SlotId, &p11Session );
+    }
+
+    if( ret == CKR_OK )
+    {
+        /* Use the PKCS #11 module to sign. */
+        ret = pP11FunctionList->C_SignInit( p11Session,
+                                            &mech,
+                                            p11PrivateKey );
+    }
+
+    if( ret == CKR_OK )
+    {
+        *pSigLen = sizeof( toBeSigned );
+        ret = pP11FunctionList->C_Sign( p11Session,
+                                        toBeSigned,
+                                        toBeSignedLen,
+                                        pSig,
+                                        ( CK_ULONG_PTR ) pSigLen );
+    }
+
+    if( p11Session != CK_INVALID_HANDLE )
+    {
+        /* A failed operation may still be active on the session. */
+        Mbedtls_Pkcs11_SessionPoolReturn( p11Session, ( ret != CKR_OK ) );
+    }
+
+    if( ( ret == CKR_OK ) && ( keyType == CKK_EC ) )
+    {
+        /* PKCS #11 for P256 returns a 64-byte signature with 32 bytes for R and 32 bytes for S.
+         * This must be converted to an ASN.1 encoded array. */
+        if( *pSigLen != pkcs11ECDSA_P256_SIGNATURE_LENGTH )
+        {
+            ret = CKR_FUNCTION_FAILED;
+        }
+
+        if( ret == CKR_OK )
+        {
+            PKI_pkcs11SignatureTombedTLSSignature( pSig, pSigLen );
+        }
+    }
+
+    if( ret != CKR_OK )
+    {
+        LogError( ( "Failed to sign message using PKCS #11 with error code %lu.", ( unsigned long ) ret ) );
+
+        /* MbedTLS aborts the handshake on a negative result. */
+        if( result == 0 )
+        {
+            result = MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fleet_provisioning_serializer.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief CBOR major types of the payloads built by the tests.
+ */
+#define CBOR_TEST_UNSIGNED_INTEGER    ( 0U )
+#define CBOR_TEST_BYTE_STRING         ( 2U )
+#define CBOR_TEST_TEXT_STRING         ( 3U )
+#define CBOR_TEST_ARRAY               ( 4U )
+#define CBOR_TEST_MAP                 ( 5U )
+
+/**
+ * @brief Initial byte of an indefinite length text string, and its end marker.
+ */
+#define CBOR_TEST_CHUNKED_TEXT        ( 0x7FU )
+#define CBOR_TEST_BREAK               ( 0xFFU )
+
+/**
+ * @brief Keys and values of the certificate responses built by the tests. The
+ * values are shorter than 24 bytes, so that they fit any length header.
+ */
+#define TEST_CERTIFICATE_PEM          "-----PEM-----"
+#define TEST_PRIVATE_KEY              "-----KEY-----"
+#define TEST_CERTIFICATE_ID           "0123456789abcdef"
+#define TEST_OWNERSHIP_TOKEN          "token"
+
+/**
+ * @brief Size of the payload buffer.
+ */
+#define TEST_PAYLOAD_SIZE             ( 512U )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Keys of a certificate response, in the order the tests write them.
+ */
+static const char * const responseKeys[] =
+{
+    "certificatePem",
+    "privateKey",
+    "certificateId",
+    "certificateOwnershipToken"
+};
+
+/**
+ * @brief Values of #responseKeys.
+ */
+static const char * const responseValues[] =
+{
+    TEST_CERTIFICATE_PEM,
+    TEST_PRIVATE_KEY,
+    TEST_CERTIFICATE_ID,
+    TEST_OWNERSHIP_TOKEN
+};
+
+/**
+ * @brief Number of entries of a complete certificate response.
+ */
+#define TEST_RESPONSE_KEY_COUNT    ( sizeof( responseKeys ) / sizeof( responseKeys[ 0 ] ) )
+
+/**
+ * @brief Payload under construction and its length.
+ */
+static uint8_t testPayload[ TEST_PAYLOAD_SIZE ];
+static size_t testPayloadLength = 0U;
+
+static CertificateResponse_t testResponse;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Append a byte to #testPayload.
+ */
+static void appendByte( uint8_t value )
+{
+    TEST_ASSERT_LESS_THAN( TEST_PAYLOAD_SIZE, testPayloadLength );
+    testPayload[ testPayloadLength ] = value;
+    testPayloadLength++;
+}
+
+/**
+ * @brief Append the initial byte of an item and its argument in big endian.
+ *
+ * @param[in] majorType CBOR major type.
+ * @param[in] value Argument: a length, a number of entries or an integer.
+ * @param[in] argumentLength 0 to store the argument in the initial byte, or
+ * 1, 2, 4 or 8 to follow the initial byte with that many bytes.
+ */
+static void appendHeader( uint8_t majorType,
+                          uint64_t value,
+                          size_t argumentLength )
+{
+    uint8_t additionalInfo;
+    size_t i;
+
+    switch( argumentLength )
+    {
+        case 0U:
+            TEST_ASSERT_LESS_THAN( 24U, value );
+            additionalInfo = ( uint8_t ) value;
+            break;
+
+        case 1U:
+            additionalInfo = 24U;
+            break;
+
+        case 2U:
+            additionalInfo = 25U;
+            break;
+
+        case 4U:
+            additionalInfo = 26U;
+            break;
+
+        default:
+            TEST_ASSERT_EQUAL( 8U, argumentLength );
+            additionalInfo = 27U;
+            break;
+    }
+
+    appendByte( ( uint8_t ) ( ( majorType << 5 ) | additionalInfo ) );
+
+    for( i = argumentLength; i > 0U; i-- )
+    {
+        appendByte( ( uint8_t ) ( value >> ( ( i - 1U ) * 8U ) ) );
+    }
+}
+
+/**
+ * @brief Append a text string with a length header of the given size.
+ */
+static void appendText( const char * pText,
+                        size_t argumentLength )
+{
+    size_t length = strlen( pText );
+
+    appendHeader( CBOR_TEST_TEXT_STRING, length, argumentLength );
+    TEST_ASSERT_LESS_OR_EQUAL( TEST_PAYLOAD_SIZE - testPayloadLength, length );
+    memcpy( &( testPayload[ testPayloadLength ] ), pText, length );
+    testPayloadLength += length;
+}
+
+/**
+ * @brief Append a key of the smallest encoding and a text value.
+ */
+static void appendEntry( const char * pKey,
+                         const char * pValue,
+                         size_t valueArgumentLength )
+{
+    appendText( pKey, ( strlen( pKey ) < 24U ) ? 0U : 1U );
+    appendText( pValue, valueArgumentLength );
+}
+
+/**
+ * @brief Write a certificate response in #testPayload.
+ *
+ * @param[in] pOmittedKey Key left out of the response, or NULL.
+ * @param[in] valueArgumentLength Size of the length headers of the values.
+ */
+static void buildResponse( const char * pOmittedKey,
+                           size_t valueArgumentLength )
+{
+    size_t i;
+
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_MAP,
+                  ( pOmittedKey == NULL ) ? TEST_RESPONSE_KEY_COUNT : TEST_RESPONSE_KEY_COUNT - 1U,
+                  0U );
+
+    for( i = 0; i < TEST_RESPONSE_KEY_COUNT; i++ )
+    {
+        if( ( pOmittedKey == NULL ) || ( strcmp( pOmittedKey, responseKeys[ i ] ) != 0 ) )
+        {
+            appendEntry( responseKeys[ i ], responseValues[ i ], valueArgumentLength );
+        }
+    }
+}
+
+/**
+ * @brief Check that a response string points into #testPayload and holds the
+ * expected text.
+ */
+static void assertResponseString( const char * pExpected,
+                                  const ResponseString_t * pString )
+{
+    TEST_ASSERT_NOT_NULL( pString->pString );
+    TEST_ASSERT_TRUE( ( const uint8_t * ) pString->pString >= testPayload );
+    TEST_ASSERT_TRUE( ( const uint8_t * ) ( pString->pString + pString->length ) <= &( testPayload[ testPayloadLength ] ) );
+    TEST_ASSERT_EQUAL( strlen( pExpected ), pString->length );
+    TEST_ASSERT_EQUAL_MEMORY( pExpected, pString->pString, pString->length );
+}
+
+/**
+ * @brief Parse #testPayload.
+ */
+static bool parseTestPayload( void )
+{
+    return parseCertificateResponse( testPayload, testPayloadLength, &testResponse );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the parsing of the certificate responses.
+ */
+TEST_GROUP( Full_FleetProvisioningSerializerTest );
+
+
+/**
+ * @brief Test setup function for the parsing of the certificate responses.
+ */
+TEST_SETUP( Full_FleetProvisioningSerializerTest )
+{
+    memset( testPayload, 0, sizeof( testPayload ) );
+    testPayloadLength = 0U;
+    memset( &testResponse, 0, sizeof( testResponse ) );
+}
+
+/**
+ * @brief Test tear down function for the parsing of the certificate responses.
+ */
+TEST_TEAR_DOWN( Full_FleetProvisioningSerializerTest )
+{
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_ValidResponseTest )
+{
+    buildResponse( NULL, 0U );
+
+    TEST_ASSERT_TRUE( parseTestPayload() );
+    assertResponseString( TEST_CERTIFICATE_PEM, &( testResponse.certificatePem ) );
+    assertResponseString( TEST_PRIVATE_KEY, &( testResponse.privateKey ) );
+    assertResponseString( TEST_CERTIFICATE_ID, &( testResponse.certificateId ) );
+    assertResponseString( TEST_OWNERSHIP_TOKEN, &( testResponse.certificateOwnershipToken ) );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_LengthHeaderTest )
+{
+    static const size_t argumentLengths[] = { 1U, 2U, 4U, 8U };
+    size_t i;
+
+    /* The strings are located after length headers of every size. */
+    for( i = 0; i < ( sizeof( argumentLengths ) / sizeof( argumentLengths[ 0 ] ) ); i++ )
+    {
+        memset( &testResponse, 0, sizeof( testResponse ) );
+        buildResponse( NULL, argumentLengths[ i ] );
+
+        TEST_ASSERT_TRUE_MESSAGE( parseTestPayload(), "Response with long length headers rejected." );
+        assertResponseString( TEST_CERTIFICATE_PEM, &( testResponse.certificatePem ) );
+        assertResponseString( TEST_PRIVATE_KEY, &( testResponse.privateKey ) );
+        assertResponseString( TEST_CERTIFICATE_ID, &( testResponse.certificateId ) );
+        assertResponseString( TEST_OWNERSHIP_TOKEN, &( testResponse.certificateOwnershipToken ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_TruncatedPayloadTest )
+{
+    static const size_t argumentLengths[] = { 0U, 1U, 8U };
+    size_t fullLength;
+    size_t length;
+    size_t i;
+
+    /* Every prefix of a response is cut in a header, a string or before an
+     * entry, and must be rejected. */
+    for( i = 0; i < ( sizeof( argumentLengths ) / sizeof( argumentLengths[ 0 ] ) ); i++ )
+    {
+        buildResponse( NULL, argumentLengths[ i ] );
+        fullLength = testPayloadLength;
+
+        for( length = 0; length < fullLength; length++ )
+        {
+            testPayloadLength = length;
+            TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Truncated response accepted." );
+        }
+
+        testPayloadLength = fullLength;
+        TEST_ASSERT_TRUE( parseTestPayload() );
+    }
+
+    /* A string longer than the rest of the payload. */
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_MAP, 1U, 0U );
+    appendText( "certificatePem", 0U );
+    appendHeader( CBOR_TEST_TEXT_STRING, 100U, 1U );
+    appendText( "short", 0U );
+
+    TEST_ASSERT_FALSE( parseTestPayload() );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_ChunkedStringTest )
+{
+    /* A chunked value is not contiguous and cannot be referenced in place. */
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_MAP, 3U, 0U );
+    appendText( "certificatePem", 0U );
+    appendByte( CBOR_TEST_CHUNKED_TEXT );
+    appendText( "-----", 0U );
+    appendText( "PEM-----", 0U );
+    appendByte( CBOR_TEST_BREAK );
+    appendEntry( "certificateId", TEST_CERTIFICATE_ID, 0U );
+    appendEntry( "certificateOwnershipToken", TEST_OWNERSHIP_TOKEN, 0U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Chunked value accepted." );
+
+    /* Nor a chunked key. */
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_MAP, 1U, 0U );
+    appendByte( CBOR_TEST_CHUNKED_TEXT );
+    appendText( "certificate", 0U );
+    appendText( "Pem", 0U );
+    appendByte( CBOR_TEST_BREAK );
+    appendText( TEST_CERTIFICATE_PEM, 0U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Chunked key accepted." );
+
+    /* The chunked value of an unknown key is skipped. */
+    buildResponse( NULL, 0U );
+    testPayload[ 0 ]++;
+    appendText( "unknown", 0U );
+    appendByte( CBOR_TEST_CHUNKED_TEXT );
+    appendText( "a", 0U );
+    appendText( "b", 0U );
+    appendByte( CBOR_TEST_BREAK );
+
+    TEST_ASSERT_TRUE_MESSAGE( parseTestPayload(), "Chunked value of an unknown key not skipped." );
+    assertResponseString( TEST_CERTIFICATE_PEM, &( testResponse.certificatePem ) );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_MissingKeyTest )
+{
+    size_t i;
+
+    for( i = 0; i < TEST_RESPONSE_KEY_COUNT; i++ )
+    {
+        buildResponse( responseKeys[ i ], 0U );
+
+        if( strcmp( responseKeys[ i ], "privateKey" ) == 0 )
+        {
+            /* The private key is only in CreateKeysAndCertificate responses. */
+            TEST_ASSERT_TRUE( parseTestPayload() );
+            TEST_ASSERT_NULL( testResponse.privateKey.pString );
+            assertResponseString( TEST_CERTIFICATE_PEM, &( testResponse.certificatePem ) );
+        }
+        else
+        {
+            TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), responseKeys[ i ] );
+        }
+    }
+
+    /* An empty map. */
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_MAP, 0U, 0U );
+
+    TEST_ASSERT_FALSE( parseTestPayload() );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_DuplicateKeyTest )
+{
+    size_t i;
+
+    /* Each known key repeated after a complete response. */
+    for( i = 0; i < TEST_RESPONSE_KEY_COUNT; i++ )
+    {
+        buildResponse( NULL, 0U );
+        testPayload[ 0 ]++;
+        appendEntry( responseKeys[ i ], "other", 0U );
+
+        TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), responseKeys[ i ] );
+    }
+
+    /* The repeated unknown keys are skipped like the others. */
+    buildResponse( NULL, 0U );
+    testPayload[ 0 ] += 2U;
+    appendEntry( "unknown", "a", 0U );
+    appendEntry( "unknown", "b", 0U );
+
+    TEST_ASSERT_TRUE( parseTestPayload() );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_NonTextValueTest )
+{
+    /* An integer value. */
+    buildResponse( "certificateId", 0U );
+    testPayload[ 0 ]++;
+    appendText( "certificateId", 0U );
+    appendHeader( CBOR_TEST_UNSIGNED_INTEGER, 42U, 1U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Integer value accepted." );
+
+    /* A byte string value. */
+    buildResponse( "certificatePem", 0U );
+    testPayload[ 0 ]++;
+    appendText( "certificatePem", 0U );
+    appendHeader( CBOR_TEST_BYTE_STRING, 3U, 0U );
+    appendByte( 'P' );
+    appendByte( 'E' );
+    appendByte( 'M' );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Byte string value accepted." );
+
+    /* A map value. */
+    buildResponse( "certificateOwnershipToken", 0U );
+    testPayload[ 0 ]++;
+    appendText( "certificateOwnershipToken", 1U );
+    appendHeader( CBOR_TEST_MAP, 0U, 0U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Map value accepted." );
+
+    /* A key that is not a text string. */
+    buildResponse( NULL, 0U );
+    testPayload[ 0 ]++;
+    appendHeader( CBOR_TEST_UNSIGNED_INTEGER, 1U, 0U );
+    appendText( "value", 0U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Integer key accepted." );
+
+    /* A payload that is not a map. */
+    testPayloadLength = 0U;
+    appendHeader( CBOR_TEST_ARRAY, 1U, 0U );
+    appendText( TEST_CERTIFICATE_PEM, 0U );
+
+    TEST_ASSERT_FALSE_MESSAGE( parseTestPayload(), "Array payload accepted." );
+
+    /* The non-text value of an unknown key is skipped. */
+    buildResponse( NULL, 0U );
+    testPayload[ 0 ]++;
+    appendText( "unknown", 0U );
+    appendHeader( CBOR_TEST_ARRAY, 2U, 0U );
+    appendHeader( CBOR_TEST_UNSIGNED_INTEGER, 1U, 0U );
+    appendText( "two", 0U );
+
+    TEST_ASSERT_TRUE_MESSAGE( parseTestPayload(), "Non-text value of an unknown key not skipped." );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the parsing of the certificate responses.
+ */
+TEST_GROUP_RUNNER( Full_FleetProvisioningSerializerTest )
+{
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_ValidResponseTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_LengthHeaderTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_TruncatedPayloadTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_ChunkedStringTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_MissingKeyTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_DuplicateKeyTest );
+    RUN_TEST_CASE( Full_FleetProvisioningSerializerTest, FleetProvisioningSerializer_NonTextValueTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunFleetProvisioningSerializerTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_FleetProvisioningSerializerTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunFleetProvisioningSerializerTest();
+}
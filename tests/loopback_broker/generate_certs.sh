@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Generate the credentials of the loopback broker benchmark:
+#   ca.crt, ca.key           Test CA signing the server and device certificates.
+#   server.crt, server.key   Broker certificate for localhost and 127.0.0.1.
+#   device.crt, device.key   Device certificate, loaded into the PKCS #11 token.
+#
+# Usage: generate_certs.sh <output directory> [openssl executable]
+
+set -e
+
+OUTPUT_DIR="${1:?Usage: $0 <output directory> [openssl executable]}"
+OPENSSL="${2:-openssl}"
+DAYS=3650
+
+mkdir -p "${OUTPUT_DIR}"
+cd "${OUTPUT_DIR}"
+
+# Test CA.
+"${OPENSSL}" ecparam -name prime256v1 -genkey -noout -out ca.key
+"${OPENSSL}" req -x509 -new -key ca.key -sha256 -days "${DAYS}" \
+    -subj "/CN=Loopback Broker Test CA" \
+    -addext "basicConstraints=critical,CA:TRUE" \
+    -addext "keyUsage=critical,keyCertSign,cRLSign" \
+    -out ca.crt
+
+# Broker certificate. The agent verifies the host name it connects to.
+"${OPENSSL}" ecparam -name prime256v1 -genkey -noout -out server.key
+"${OPENSSL}" req -new -key server.key -subj "/CN=localhost" -out server.csr
+printf '%s\n' \
+    "basicConstraints=CA:FALSE" \
+    "keyUsage=critical,digitalSignature" \
+    "extendedKeyUsage=serverAuth" \
+    "subjectAltName=DNS:localhost,IP:127.0.0.1" > server.ext
+"${OPENSSL}" x509 -req -in server.csr -CA ca.crt -CAkey ca.key -CAcreateserial \
+    -sha256 -days "${DAYS}" -extfile server.ext -out server.crt
+
+# Device certificate.
+"${OPENSSL}" ecparam -name prime256v1 -genkey -noout -out device.key
+"${OPENSSL}" req -new -key device.key -subj "/CN=loopback-benchmark" -out device.csr
+printf '%s\n' \
+    "basicConstraints=CA:FALSE" \
+    "keyUsage=critical,digitalSignature" \
+    "extendedKeyUsage=clientAuth" > device.ext
+"${OPENSSL}" x509 -req -in device.csr -CA ca.crt -CAkey ca.key -CAcreateserial \
+    -sha256 -days "${DAYS}" -extfile device.ext -out device.crt
+
+rm -f server.csr server.ext device.csr device.ext ca.srl
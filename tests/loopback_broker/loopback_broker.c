@@ -0,0 +1,1602 @@
+/* Standard includes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the loopback broker. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "LoopbackBroker"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+#include "loopback_broker.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#if defined( MBEDTLS_SSL_TICKET_C )
+    #include "mbedtls/ssl_ticket.h"
+#endif
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief MQTT control packet types, in the upper nibble of the first byte.
+ */
+#define MQTT_PACKET_CONNECT        ( 0x10U )
+#define MQTT_PACKET_CONNACK        ( 0x20U )
+#define MQTT_PACKET_PUBLISH        ( 0x30U )
+#define MQTT_PACKET_PUBACK         ( 0x40U )
+#define MQTT_PACKET_SUBSCRIBE      ( 0x80U )
+#define MQTT_PACKET_SUBACK         ( 0x90U )
+#define MQTT_PACKET_UNSUBSCRIBE    ( 0xA0U )
+#define MQTT_PACKET_UNSUBACK       ( 0xB0U )
+#define MQTT_PACKET_PINGREQ        ( 0xC0U )
+#define MQTT_PACKET_PINGRESP       ( 0xD0U )
+#define MQTT_PACKET_DISCONNECT     ( 0xE0U )
+
+/**
+ * @brief CONNACK return codes.
+ */
+#define MQTT_CONNACK_ACCEPTED                ( 0x00U )
+#define MQTT_CONNACK_IDENTIFIER_REJECTED     ( 0x02U )
+#define MQTT_CONNACK_SERVER_UNAVAILABLE      ( 0x03U )
+
+/**
+ * @brief Lifetime of the session tickets issued by the broker.
+ */
+#define BROKER_TICKET_LIFETIME_S    ( 86400U )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Record waiting to be sent to a client.
+ */
+typedef struct BrokerRecord
+{
+    struct BrokerRecord * pNext; /**< @brief Next record to send. */
+    uint64_t dueUs;              /**< @brief Time at which the record may be sent. */
+    size_t length;               /**< @brief Length of the record. */
+    size_t offset;               /**< @brief Number of bytes already sent. */
+    uint8_t * pData;             /**< @brief Record bytes, allocated after the structure. */
+} BrokerRecord_t;
+
+/**
+ * @brief Topic filter of a session.
+ */
+typedef struct BrokerSubscription
+{
+    bool inUse;                                          /**< @brief Whether the entry is used. */
+    uint8_t qos;                                         /**< @brief Granted QoS. */
+    char filter[ LOOPBACK_BROKER_MAX_TOPIC_LENGTH + 1U ]; /**< @brief Null terminated topic filter. */
+} BrokerSubscription_t;
+
+/**
+ * @brief MQTT session, kept across the connections of a client identifier.
+ */
+typedef struct BrokerSession
+{
+    bool inUse;                                                       /**< @brief Whether the entry is used. */
+    char clientId[ LOOPBACK_BROKER_MAX_CLIENT_ID_LENGTH + 1U ];       /**< @brief Null terminated client identifier. */
+    BrokerSubscription_t subscriptions[ LOOPBACK_BROKER_MAX_SUBSCRIPTIONS ]; /**< @brief Topic filters. */
+} BrokerSession_t;
+
+/**
+ * @brief Client connection.
+ */
+typedef struct BrokerClient
+{
+    bool inUse;                     /**< @brief Whether the entry is used. */
+    bool handshakeDone;             /**< @brief Whether the TLS handshake is complete. */
+    struct LoopbackBroker * pBroker; /**< @brief Broker of the client, for the send callback. */
+    mbedtls_net_context net;        /**< @brief Socket. */
+    mbedtls_ssl_context ssl;        /**< @brief TLS context. */
+    BrokerSession_t * pSession;     /**< @brief Session, NULL before CONNECT. */
+    uint16_t nextPacketId;          /**< @brief Packet identifier of the next QoS 1 PUBLISH. */
+
+    BrokerRecord_t * pRecordHead;   /**< @brief First record waiting to be sent. */
+    BrokerRecord_t * pRecordTail;   /**< @brief Last record waiting to be sent. */
+
+    uint8_t rxBuffer[ LOOPBACK_BROKER_MAX_PACKET_SIZE ]; /**< @brief Received bytes of incomplete packets. */
+    size_t rxLength;                                     /**< @brief Number of bytes in #rxBuffer. */
+} BrokerClient_t;
+
+/**
+ * @brief Loopback broker.
+ */
+struct LoopbackBroker
+{
+    pthread_t thread;      /**< @brief Broker thread. */
+    pthread_mutex_t mutex; /**< @brief Protects the broker state from the control functions. */
+    pthread_cond_t cond;   /**< @brief Signaled when a connection is accepted. */
+    int wakeFds[ 2 ];      /**< @brief Pipe waking the broker thread up. */
+    bool stop;             /**< @brief Set to stop the broker thread. */
+    bool dropClients;      /**< @brief Set to close all the connections. */
+
+    uint16_t port;         /**< @brief Listening port. */
+    uint32_t latencyMs;    /**< @brief Delay of every record. */
+    uint32_t lossPercent;  /**< @brief Probability of a record loss. */
+    uint32_t retransmitMs; /**< @brief Delay of a lost record. */
+    unsigned int lossSeed; /**< @brief State of the loss generator, fixed for reproducible runs. */
+
+    mbedtls_net_context listenNet;     /**< @brief Listening socket. */
+    mbedtls_entropy_context entropy;   /**< @brief Entropy source. */
+    mbedtls_ctr_drbg_context drbg;     /**< @brief Random number generator. */
+    mbedtls_x509_crt caCert;           /**< @brief CA of the client certificates. */
+    mbedtls_x509_crt serverCert;       /**< @brief Server certificate. */
+    mbedtls_pk_context serverKey;      /**< @brief Server private key. */
+    mbedtls_ssl_config sslConfig;      /**< @brief Server TLS configuration. */
+    #if defined( MBEDTLS_SSL_TICKET_C )
+        mbedtls_ssl_ticket_context ticket; /**< @brief Session ticket keys. */
+    #endif
+
+    LoopbackBrokerStats_t stats; /**< @brief Counters. */
+
+    LoopbackBrokerPublishHook_t publishHook; /**< @brief Hook of the received messages, or NULL. */
+    void * pPublishHookContext;              /**< @brief Context passed to #publishHook. */
+
+    BrokerSession_t sessions[ LOOPBACK_BROKER_MAX_SESSIONS ]; /**< @brief Sessions. */
+    BrokerClient_t clients[ LOOPBACK_BROKER_MAX_CLIENTS ];    /**< @brief Connections. */
+};
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Get the monotonic time.
+ *
+ * @return Time in microseconds.
+ */
+static uint64_t getTimeUs( void );
+
+/**
+ * @brief MbedTLS send callback of the clients. The record is queued with the
+ * injected delay and sent by #flushClient.
+ *
+ * @param[in] pCtx Client.
+ * @param[in] pBuffer Record to send.
+ * @param[in] length Length of the record.
+ *
+ * @return length on success; MBEDTLS_ERR_NET_SEND_FAILED when out of memory.
+ */
+static int delayedSend( void * pCtx,
+                        const unsigned char * pBuffer,
+                        size_t length );
+
+/**
+ * @brief MbedTLS receive callback of the clients.
+ *
+ * @param[in] pCtx Client.
+ * @param[out] pBuffer Buffer to fill.
+ * @param[in] length Length of the buffer.
+ *
+ * @return Number of bytes received; zero or negative MbedTLS error code.
+ */
+static int clientRecv( void * pCtx,
+                       unsigned char * pBuffer,
+                       size_t length );
+
+/**
+ * @brief Send the records of a client whose delay has expired.
+ *
+ * @param[in] pClient Client.
+ *
+ * @return false if the socket failed.
+ */
+static bool flushClient( BrokerClient_t * pClient );
+
+/**
+ * @brief Close a client connection and free its records.
+ *
+ * @param[in] pClient Client.
+ */
+static void closeClient( BrokerClient_t * pClient );
+
+/**
+ * @brief Accept the pending connections.
+ *
+ * @param[in] pBroker Broker.
+ */
+static void acceptClients( LoopbackBroker_t * pBroker );
+
+/**
+ * @brief Continue the handshake of a client, then read and handle its packets.
+ *
+ * @param[in] pBroker Broker.
+ * @param[in] pClient Client.
+ *
+ * @return false if the connection must be closed.
+ */
+static bool serviceClient( LoopbackBroker_t * pBroker,
+                           BrokerClient_t * pClient );
+
+/**
+ * @brief Handle a complete MQTT packet.
+ *
+ * @param[in] pBroker Broker.
+ * @param[in] pClient Client that sent the packet.
+ * @param[in] pPacket Packet, fixed header included.
+ * @param[in] headerLength Length of the fixed header.
+ * @param[in] packetLength Length of the packet.
+ *
+ * @return false if the connection must be closed.
+ */
+static bool handlePacket( LoopbackBroker_t * pBroker,
+                          BrokerClient_t * pClient,
+                          const uint8_t * pPacket,
+                          size_t headerLength,
+                          size_t packetLength );
+
+/**
+ * @brief Check whether a topic name matches a topic filter.
+ *
+ * @param[in] pFilter Null terminated topic filter.
+ * @param[in] pTopic Topic name.
+ * @param[in] topicLength Length of the topic name.
+ *
+ * @return true if the topic matches.
+ */
+static bool topicMatches( const char * pFilter,
+                          const char * pTopic,
+                          size_t topicLength );
+
+/**
+ * @brief Broker thread.
+ *
+ * @param[in] pArgument Broker.
+ *
+ * @return NULL.
+ */
+static void * brokerThread( void * pArgument );
+
+/*-----------------------------------------------------------*/
+
+static uint64_t getTimeUs( void )
+{
+    struct timespec now;
+
+    ( void ) clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return ( ( uint64_t ) now.tv_sec * 1000000U ) + ( ( uint64_t ) now.tv_nsec / 1000U );
+}
+
+/*-----------------------------------------------------------*/
+
+static int delayedSend( void * pCtx,
+                        const unsigned char * pBuffer,
+                        size_t length )
+{
+    BrokerClient_t * pClient = ( BrokerClient_t * ) pCtx;
+    LoopbackBroker_t * pBroker = pClient->pBroker;
+    BrokerRecord_t * pRecord;
+    int ret = ( int ) length;
+
+    pRecord = malloc( sizeof( BrokerRecord_t ) + length );
+
+    if( pRecord == NULL )
+    {
+        LogError( ( "Failed to allocate a record of %lu bytes.", ( unsigned long ) length ) );
+        ret = MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    else
+    {
+        pRecord->pNext = NULL;
+        pRecord->length = length;
+        pRecord->offset = 0U;
+        pRecord->pData = ( uint8_t * ) &( pRecord[ 1 ] );
+        memcpy( pRecord->pData, pBuffer, length );
+
+        pRecord->dueUs = getTimeUs() + ( ( uint64_t ) pBroker->latencyMs * 1000U );
+
+        if( ( pBroker->lossPercent > 0U ) &&
+            ( ( uint32_t ) ( rand_r( &( pBroker->lossSeed ) ) % 100 ) < pBroker->lossPercent ) )
+        {
+            pRecord->dueUs += ( uint64_t ) pBroker->retransmitMs * 1000U;
+            pBroker->stats.recordsLost++;
+        }
+
+        /* TCP delivers in order: a record cannot overtake a delayed one. */
+        if( pClient->pRecordTail == NULL )
+        {
+            pClient->pRecordHead = pRecord;
+        }
+        else
+        {
+            if( pRecord->dueUs < pClient->pRecordTail->dueUs )
+            {
+                pRecord->dueUs = pClient->pRecordTail->dueUs;
+            }
+
+            pClient->pRecordTail->pNext = pRecord;
+        }
+
+        pClient->pRecordTail = pRecord;
+    }
+
+    return ret;
+}
+
+/*-----------------------------------------------------------*/
+
+static int clientRecv( void * pCtx,
+                       unsigned char * pBuffer,
+                       size_t length )
+{
+    BrokerClient_t * pClient = ( BrokerClient_t * ) pCtx;
+
+    return mbedtls_net_recv( &( pClient->net ), pBuffer, length );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool flushClient( BrokerClient_t * pClient )
+{
+    BrokerRecord_t * pRecord;
+    uint64_t nowUs = getTimeUs();
+    ssize_t sent;
+    bool status = true;
+
+    while( ( status == true ) &&
+           ( pClient->pRecordHead != NULL ) &&
+           ( pClient->pRecordHead->dueUs <= nowUs ) )
+    {
+        pRecord = pClient->pRecordHead;
+        sent = send( pClient->net.fd,
+                     &( pRecord->pData[ pRecord->offset ] ),
+                     pRecord->length - pRecord->offset,
+                     MSG_NOSIGNAL );
+
+        if( sent > 0 )
+        {
+            pRecord->offset += ( size_t ) sent;
+
+            if( pRecord->offset == pRecord->length )
+            {
+                pClient->pRecordHead = pRecord->pNext;
+
+                if( pClient->pRecordHead == NULL )
+                {
+                    pClient->pRecordTail = NULL;
+                }
+
+                free( pRecord );
+            }
+        }
+        else if( ( sent < 0 ) && ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) || ( errno == EINTR ) ) )
+        {
+            /* The socket buffer is full. The rest is sent when it is writable. */
+            break;
+        }
+        else
+        {
+            status = false;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static void closeClient( BrokerClient_t * pClient )
+{
+    BrokerRecord_t * pRecord;
+
+    while( pClient->pRecordHead != NULL )
+    {
+        pRecord = pClient->pRecordHead;
+        pClient->pRecordHead = pRecord->pNext;
+        free( pRecord );
+    }
+
+    mbedtls_ssl_free( &( pClient->ssl ) );
+    mbedtls_net_free( &( pClient->net ) );
+
+    pClient->pRecordTail = NULL;
+    pClient->pSession = NULL;
+    pClient->rxLength = 0U;
+    pClient->handshakeDone = false;
+    pClient->inUse = false;
+}
+
+/*-----------------------------------------------------------*/
+
+static void acceptClients( LoopbackBroker_t * pBroker )
+{
+    mbedtls_net_context net;
+    BrokerClient_t * pClient;
+    int noDelay = 1;
+    int mbedtlsError = 0;
+    uint32_t i;
+
+    while( mbedtlsError == 0 )
+    {
+        mbedtls_net_init( &net );
+        mbedtlsError = mbedtls_net_accept( &( pBroker->listenNet ), &net, NULL, 0U, NULL );
+
+        if( mbedtlsError == 0 )
+        {
+            pClient = NULL;
+
+            for( i = 0; ( i < LOOPBACK_BROKER_MAX_CLIENTS ) && ( pClient == NULL ); i++ )
+            {
+                if( pBroker->clients[ i ].inUse == false )
+                {
+                    pClient = &( pBroker->clients[ i ] );
+                }
+            }
+
+            if( pClient == NULL )
+            {
+                LogWarn( ( "Connection refused: all the %u client entries are used.",
+                           ( unsigned int ) LOOPBACK_BROKER_MAX_CLIENTS ) );
+                mbedtls_net_free( &net );
+            }
+            else
+            {
+                /* The records are already delayed on purpose. */
+                ( void ) setsockopt( net.fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+                ( void ) mbedtls_net_set_nonblock( &net );
+
+                memset( pClient, 0, sizeof( BrokerClient_t ) );
+                pClient->inUse = true;
+                pClient->pBroker = pBroker;
+                pClient->net = net;
+                pClient->nextPacketId = 1U;
+                mbedtls_ssl_init( &( pClient->ssl ) );
+
+                if( mbedtls_ssl_setup( &( pClient->ssl ), &( pBroker->sslConfig ) ) != 0 )
+                {
+                    LogError( ( "Failed to set up the TLS context of a client." ) );
+                    closeClient( pClient );
+                }
+                else
+                {
+                    mbedtls_ssl_set_bio( &( pClient->ssl ), pClient, delayedSend, clientRecv, NULL );
+                }
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool topicMatches( const char * pFilter,
+                          const char * pTopic,
+                          size_t topicLength )
+{
+    size_t topicIndex = 0U;
+    bool matches = true;
+    bool done = false;
+
+    while( ( done == false ) && ( matches == true ) )
+    {
+        if( *pFilter == '\0' )
+        {
+            matches = ( topicIndex == topicLength );
+            done = true;
+        }
+        else if( *pFilter == '#' )
+        {
+            done = true;
+        }
+        else if( ( topicIndex == topicLength ) && ( strcmp( pFilter, "/#" ) == 0 ) )
+        {
+            /* "a/#" also matches the parent level "a". */
+            done = true;
+        }
+        else if( *pFilter == '+' )
+        {
+            while( ( topicIndex < topicLength ) && ( pTopic[ topicIndex ] != '/' ) )
+            {
+                topicIndex++;
+            }
+
+            pFilter++;
+        }
+        else if( ( topicIndex < topicLength ) && ( pTopic[ topicIndex ] == *pFilter ) )
+        {
+            topicIndex++;
+            pFilter++;
+        }
+        else
+        {
+            matches = false;
+        }
+    }
+
+    return matches;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Encode the fixed header of a packet.
+ *
+ * @param[out] pHeader Buffer of at least 5 bytes.
+ * @param[in] firstByte Packet type and flags.
+ * @param[in] remainingLength Length of the packet after the fixed header.
+ *
+ * @return Length of the fixed header.
+ */
+static size_t encodeFixedHeader( uint8_t * pHeader,
+                                 uint8_t firstByte,
+                                 size_t remainingLength )
+{
+    size_t length = 1U;
+
+    pHeader[ 0 ] = firstByte;
+
+    do
+    {
+        pHeader[ length ] = ( uint8_t ) ( remainingLength & 0x7FU );
+        remainingLength >>= 7;
+
+        if( remainingLength > 0U )
+        {
+            pHeader[ length ] |= 0x80U;
+        }
+
+        length++;
+    } while( remainingLength > 0U );
+
+    return length;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Decode the fixed header of a packet.
+ *
+ * @param[in] pBuffer Received bytes.
+ * @param[in] length Number of received bytes.
+ * @param[out] pHeaderLength Length of the fixed header.
+ * @param[out] pPacketLength Length of the packet.
+ *
+ * @return 1 if the fixed header is complete, 0 if more bytes are needed, -1 if
+ * it is malformed.
+ */
+static int decodeFixedHeader( const uint8_t * pBuffer,
+                              size_t length,
+                              size_t * pHeaderLength,
+                              size_t * pPacketLength )
+{
+    size_t remainingLength = 0U;
+    size_t index = 1U;
+    uint32_t shift = 0U;
+    int status = 0;
+
+    while( ( status == 0 ) && ( index < length ) )
+    {
+        remainingLength |= ( size_t ) ( pBuffer[ index ] & 0x7FU ) << shift;
+
+        if( ( pBuffer[ index ] & 0x80U ) == 0U )
+        {
+            *pHeaderLength = index + 1U;
+            *pPacketLength = *pHeaderLength + remainingLength;
+            status = 1;
+        }
+        else if( index == 4U )
+        {
+            status = -1;
+        }
+        else
+        {
+            shift += 7U;
+        }
+
+        index++;
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Send a packet to a client.
+ *
+ * @param[in] pClient Client.
+ * @param[in] pPacket Packet to send.
+ * @param[in] length Length of the packet.
+ *
+ * @return false on failure.
+ */
+static bool sendPacket( BrokerClient_t * pClient,
+                        const uint8_t * pPacket,
+                        size_t length )
+{
+    size_t written = 0U;
+    int ret = 0;
+
+    /* The send callback never blocks, so the records are queued at once. */
+    while( ( ret >= 0 ) && ( written < length ) )
+    {
+        ret = mbedtls_ssl_write( &( pClient->ssl ), &( pPacket[ written ] ), length - written );
+
+        if( ret > 0 )
+        {
+            written += ( size_t ) ret;
+        }
+    }
+
+    return( written == length );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Read a length prefixed string of a packet.
+ *
+ * @param[in] pPacket Packet.
+ * @param[in] packetLength Length of the packet.
+ * @param[in,out] pIndex Index of the string length, then of the following field.
+ * @param[out] ppString Start of the string.
+ * @param[out] pStringLength Length of the string.
+ *
+ * @return false if the string exceeds the packet.
+ */
+static bool readString( const uint8_t * pPacket,
+                        size_t packetLength,
+                        size_t * pIndex,
+                        const char ** ppString,
+                        size_t * pStringLength )
+{
+    bool status = false;
+
+    if( ( *pIndex + 2U ) <= packetLength )
+    {
+        *pStringLength = ( ( size_t ) pPacket[ *pIndex ] << 8 ) | pPacket[ *pIndex + 1U ];
+        *ppString = ( const char * ) &( pPacket[ *pIndex + 2U ] );
+
+        if( ( *pIndex + 2U + *pStringLength ) <= packetLength )
+        {
+            *pIndex += 2U + *pStringLength;
+            status = true;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Handle a CONNECT packet.
+ */
+static bool handleConnect( LoopbackBroker_t * pBroker,
+                           BrokerClient_t * pClient,
+                           const uint8_t * pPacket,
+                           size_t index,
+                           size_t packetLength )
+{
+    const char * pString = NULL;
+    size_t stringLength = 0U;
+    bool cleanSession = false;
+    bool sessionPresent = false;
+    uint8_t returnCode = MQTT_CONNACK_ACCEPTED;
+    uint8_t connack[ 4 ];
+    BrokerSession_t * pSession = NULL;
+    BrokerSession_t * pFreeSession = NULL;
+    uint32_t i;
+    bool status;
+
+    /* Protocol name, level, flags and keep alive, then the client identifier. */
+    status = readString( pPacket, packetLength, &index, &pString, &stringLength );
+
+    if( ( status == true ) && ( ( index + 4U ) <= packetLength ) )
+    {
+        cleanSession = ( ( pPacket[ index + 1U ] & 0x02U ) != 0U );
+        index += 4U;
+        status = readString( pPacket, packetLength, &index, &pString, &stringLength );
+    }
+    else
+    {
+        status = false;
+    }
+
+    if( ( status == true ) && ( pClient->pSession != NULL ) )
+    {
+        LogError( ( "Second CONNECT on a connection." ) );
+        status = false;
+    }
+
+    if( status == true )
+    {
+        if( ( stringLength == 0U ) || ( stringLength > LOOPBACK_BROKER_MAX_CLIENT_ID_LENGTH ) )
+        {
+            returnCode = MQTT_CONNACK_IDENTIFIER_REJECTED;
+        }
+        else
+        {
+            for( i = 0; ( i < LOOPBACK_BROKER_MAX_SESSIONS ) && ( pSession == NULL ); i++ )
+            {
+                if( pBroker->sessions[ i ].inUse == false )
+                {
+                    pFreeSession = ( pFreeSession == NULL ) ? &( pBroker->sessions[ i ] ) : pFreeSession;
+                }
+                else if( ( strlen( pBroker->sessions[ i ].clientId ) == stringLength ) &&
+                         ( memcmp( pBroker->sessions[ i ].clientId, pString, stringLength ) == 0 ) )
+                {
+                    pSession = &( pBroker->sessions[ i ] );
+                }
+            }
+
+            if( pSession != NULL )
+            {
+                /* A new connection of the client takes the session over. */
+                for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+                {
+                    if( ( pBroker->clients[ i ].inUse == true ) && ( pBroker->clients[ i ].pSession == pSession ) )
+                    {
+                        closeClient( &( pBroker->clients[ i ] ) );
+                    }
+                }
+
+                if( cleanSession == true )
+                {
+                    memset( pSession->subscriptions, 0, sizeof( pSession->subscriptions ) );
+                }
+                else
+                {
+                    sessionPresent = true;
+                }
+            }
+            else if( pFreeSession != NULL )
+            {
+                pSession = pFreeSession;
+                memset( pSession, 0, sizeof( BrokerSession_t ) );
+                pSession->inUse = true;
+                memcpy( pSession->clientId, pString, stringLength );
+            }
+            else
+            {
+                returnCode = MQTT_CONNACK_SERVER_UNAVAILABLE;
+            }
+        }
+
+        connack[ 0 ] = MQTT_PACKET_CONNACK;
+        connack[ 1 ] = 2U;
+        connack[ 2 ] = ( sessionPresent == true ) ? 1U : 0U;
+        connack[ 3 ] = returnCode;
+        status = sendPacket( pClient, connack, sizeof( connack ) ) && ( returnCode == MQTT_CONNACK_ACCEPTED );
+    }
+
+    if( status == true )
+    {
+        pClient->pSession = pSession;
+        pBroker->stats.connects++;
+        ( void ) pthread_cond_broadcast( &( pBroker->cond ) );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Handle a SUBSCRIBE or an UNSUBSCRIBE packet.
+ */
+static bool handleSubscribe( BrokerClient_t * pClient,
+                             bool subscribe,
+                             const uint8_t * pPacket,
+                             size_t index,
+                             size_t packetLength )
+{
+    uint8_t ack[ 4U + LOOPBACK_BROKER_MAX_SUBSCRIPTIONS ];
+    size_t ackLength = 4U;
+    BrokerSubscription_t * pSubscriptions = pClient->pSession->subscriptions;
+    BrokerSubscription_t * pEntry;
+    const char * pFilter = NULL;
+    size_t filterLength = 0U;
+    uint8_t qos = 0U;
+    uint32_t i;
+    bool status = ( ( index + 2U ) <= packetLength );
+
+    if( status == true )
+    {
+        ack[ 2 ] = pPacket[ index ];
+        ack[ 3 ] = pPacket[ index + 1U ];
+        index += 2U;
+    }
+
+    while( ( status == true ) && ( index < packetLength ) )
+    {
+        status = readString( pPacket, packetLength, &index, &pFilter, &filterLength );
+
+        if( ( status == true ) && ( subscribe == true ) )
+        {
+            status = ( index < packetLength ) && ( ackLength < sizeof( ack ) );
+
+            if( status == true )
+            {
+                qos = ( pPacket[ index ] > 1U ) ? 1U : pPacket[ index ];
+                index++;
+            }
+        }
+
+        if( ( status == true ) && ( ( filterLength == 0U ) || ( filterLength > LOOPBACK_BROKER_MAX_TOPIC_LENGTH ) ) )
+        {
+            LogError( ( "Invalid topic filter length %lu.", ( unsigned long ) filterLength ) );
+            status = false;
+        }
+
+        if( status == true )
+        {
+            pEntry = NULL;
+
+            for( i = 0; ( i < LOOPBACK_BROKER_MAX_SUBSCRIPTIONS ) && ( pEntry == NULL ); i++ )
+            {
+                if( ( pSubscriptions[ i ].inUse == true ) &&
+                    ( strlen( pSubscriptions[ i ].filter ) == filterLength ) &&
+                    ( memcmp( pSubscriptions[ i ].filter, pFilter, filterLength ) == 0 ) )
+                {
+                    pEntry = &( pSubscriptions[ i ] );
+                }
+            }
+
+            if( subscribe == false )
+            {
+                if( pEntry != NULL )
+                {
+                    pEntry->inUse = false;
+                }
+            }
+            else
+            {
+                for( i = 0; ( i < LOOPBACK_BROKER_MAX_SUBSCRIPTIONS ) && ( pEntry == NULL ); i++ )
+                {
+                    if( pSubscriptions[ i ].inUse == false )
+                    {
+                        pEntry = &( pSubscriptions[ i ] );
+                        memset( pEntry, 0, sizeof( BrokerSubscription_t ) );
+                        memcpy( pEntry->filter, pFilter, filterLength );
+                        pEntry->inUse = true;
+                    }
+                }
+
+                if( pEntry == NULL )
+                {
+                    LogWarn( ( "Subscription refused: all the %u entries of the session are used.",
+                               ( unsigned int ) LOOPBACK_BROKER_MAX_SUBSCRIPTIONS ) );
+                    ack[ ackLength ] = 0x80U;
+                }
+                else
+                {
+                    pEntry->qos = qos;
+                    ack[ ackLength ] = qos;
+                }
+
+                ackLength++;
+            }
+        }
+    }
+
+    if( status == true )
+    {
+        ack[ 0 ] = ( subscribe == true ) ? MQTT_PACKET_SUBACK : MQTT_PACKET_UNSUBACK;
+        ack[ 1 ] = ( uint8_t ) ( ackLength - 2U );
+        status = sendPacket( pClient, ack, ackLength );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Deliver a message to the matching sessions that are connected.
+ */
+static void deliverPublish( LoopbackBroker_t * pBroker,
+                            const char * pTopic,
+                            size_t topicLength,
+                            uint8_t qos,
+                            const uint8_t * pPayload,
+                            size_t payloadLength )
+{
+    uint8_t header[ 5 ];
+    uint8_t * pDelivery;
+    size_t index;
+    size_t headerLength;
+    size_t deliveryLength;
+    BrokerClient_t * pSubscriber;
+    int deliveryQos;
+    uint32_t i, j;
+
+    for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+    {
+        pSubscriber = &( pBroker->clients[ i ] );
+        deliveryQos = -1;
+
+        if( ( pSubscriber->inUse == true ) && ( pSubscriber->pSession != NULL ) )
+        {
+            for( j = 0; j < LOOPBACK_BROKER_MAX_SUBSCRIPTIONS; j++ )
+            {
+                if( ( pSubscriber->pSession->subscriptions[ j ].inUse == true ) &&
+                    ( topicMatches( pSubscriber->pSession->subscriptions[ j ].filter, pTopic, topicLength ) == true ) &&
+                    ( ( int ) pSubscriber->pSession->subscriptions[ j ].qos > deliveryQos ) )
+                {
+                    deliveryQos = ( int ) pSubscriber->pSession->subscriptions[ j ].qos;
+                }
+            }
+        }
+
+        if( deliveryQos >= 0 )
+        {
+            deliveryQos = ( deliveryQos < ( int ) qos ) ? deliveryQos : ( int ) qos;
+            deliveryLength = 2U + topicLength + ( ( deliveryQos > 0 ) ? 2U : 0U ) + payloadLength;
+            headerLength = encodeFixedHeader( header, ( uint8_t ) ( MQTT_PACKET_PUBLISH | ( deliveryQos << 1 ) ), deliveryLength );
+            pDelivery = malloc( headerLength + deliveryLength );
+
+            if( pDelivery == NULL )
+            {
+                LogError( ( "Failed to allocate a PUBLISH of %lu bytes.", ( unsigned long ) deliveryLength ) );
+            }
+            else
+            {
+                index = 0U;
+                memcpy( pDelivery, header, headerLength );
+                index += headerLength;
+                pDelivery[ index++ ] = ( uint8_t ) ( topicLength >> 8 );
+                pDelivery[ index++ ] = ( uint8_t ) topicLength;
+                memcpy( &( pDelivery[ index ] ), pTopic, topicLength );
+                index += topicLength;
+
+                if( deliveryQos > 0 )
+                {
+                    pDelivery[ index++ ] = ( uint8_t ) ( pSubscriber->nextPacketId >> 8 );
+                    pDelivery[ index++ ] = ( uint8_t ) pSubscriber->nextPacketId;
+                    pSubscriber->nextPacketId = ( pSubscriber->nextPacketId == UINT16_MAX ) ? 1U : ( pSubscriber->nextPacketId + 1U );
+                }
+
+                memcpy( &( pDelivery[ index ] ), pPayload, payloadLength );
+
+                if( sendPacket( pSubscriber, pDelivery, headerLength + deliveryLength ) == true )
+                {
+                    pBroker->stats.publishesDelivered++;
+                }
+
+                free( pDelivery );
+            }
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Handle a PUBLISH packet: acknowledge it, deliver it to the matching
+ * sessions that are connected, and pass it to the publish hook.
+ */
+static bool handlePublish( LoopbackBroker_t * pBroker,
+                           BrokerClient_t * pClient,
+                           const uint8_t * pPacket,
+                           size_t index,
+                           size_t packetLength )
+{
+    uint8_t qos = ( pPacket[ 0 ] >> 1 ) & 0x03U;
+    uint8_t puback[ 4 ];
+    const char * pTopic = NULL;
+    size_t topicLength = 0U;
+    const uint8_t * pPayload;
+    size_t payloadLength;
+    bool status = ( qos <= 1U );
+
+    status = status && readString( pPacket, packetLength, &index, &pTopic, &topicLength );
+
+    if( ( status == true ) && ( qos == 1U ) )
+    {
+        status = ( ( index + 2U ) <= packetLength );
+
+        if( status == true )
+        {
+            puback[ 0 ] = MQTT_PACKET_PUBACK;
+            puback[ 1 ] = 2U;
+            puback[ 2 ] = pPacket[ index ];
+            puback[ 3 ] = pPacket[ index + 1U ];
+            index += 2U;
+            status = sendPacket( pClient, puback, sizeof( puback ) );
+        }
+    }
+
+    if( status == true )
+    {
+        pBroker->stats.publishesReceived++;
+        pPayload = &( pPacket[ index ] );
+        payloadLength = packetLength - index;
+
+        deliverPublish( pBroker, pTopic, topicLength, qos, pPayload, payloadLength );
+
+        if( pBroker->publishHook != NULL )
+        {
+            pBroker->publishHook( pBroker->pPublishHookContext, pBroker, pTopic, topicLength, pPayload, payloadLength );
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool handlePacket( LoopbackBroker_t * pBroker,
+                          BrokerClient_t * pClient,
+                          const uint8_t * pPacket,
+                          size_t headerLength,
+                          size_t packetLength )
+{
+    uint8_t packetType = pPacket[ 0 ] & 0xF0U;
+    uint8_t pingresp[ 2 ] = { MQTT_PACKET_PINGRESP, 0U };
+    bool status = true;
+
+    if( ( pClient->pSession == NULL ) && ( packetType != MQTT_PACKET_CONNECT ) )
+    {
+        LogError( ( "Packet type 0x%02x received before CONNECT.", ( unsigned int ) packetType ) );
+        status = false;
+    }
+    else
+    {
+        switch( packetType )
+        {
+            case MQTT_PACKET_CONNECT:
+                status = handleConnect( pBroker, pClient, pPacket, headerLength, packetLength );
+                break;
+
+            case MQTT_PACKET_PUBLISH:
+                status = handlePublish( pBroker, pClient, pPacket, headerLength, packetLength );
+                break;
+
+            case MQTT_PACKET_PUBACK:
+                /* The broker does not retransmit, so the acknowledgments are not tracked. */
+                break;
+
+            case MQTT_PACKET_SUBSCRIBE:
+                status = handleSubscribe( pClient, true, pPacket, headerLength, packetLength );
+                break;
+
+            case MQTT_PACKET_UNSUBSCRIBE:
+                status = handleSubscribe( pClient, false, pPacket, headerLength, packetLength );
+                break;
+
+            case MQTT_PACKET_PINGREQ:
+                status = sendPacket( pClient, pingresp, sizeof( pingresp ) );
+                break;
+
+            case MQTT_PACKET_DISCONNECT:
+                status = false;
+                break;
+
+            default:
+                LogError( ( "Unsupported packet type 0x%02x.", ( unsigned int ) packetType ) );
+                status = false;
+                break;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool serviceClient( LoopbackBroker_t * pBroker,
+                           BrokerClient_t * pClient )
+{
+    size_t headerLength = 0U;
+    size_t packetLength = 0U;
+    int decodeStatus;
+    int ret = 0;
+    bool status = true;
+
+    if( pClient->handshakeDone == false )
+    {
+        ret = mbedtls_ssl_handshake( &( pClient->ssl ) );
+
+        if( ret == 0 )
+        {
+            pClient->handshakeDone = true;
+        }
+        else if( ( ret != MBEDTLS_ERR_SSL_WANT_READ ) && ( ret != MBEDTLS_ERR_SSL_WANT_WRITE ) )
+        {
+            LogError( ( "TLS handshake failed with error -0x%04x.", ( unsigned int ) -ret ) );
+            status = false;
+        }
+    }
+
+    while( ( status == true ) && ( pClient->handshakeDone == true ) && ( ret >= 0 ) )
+    {
+        if( pClient->rxLength == sizeof( pClient->rxBuffer ) )
+        {
+            LogError( ( "Packet larger than %u bytes.", ( unsigned int ) LOOPBACK_BROKER_MAX_PACKET_SIZE ) );
+            status = false;
+            break;
+        }
+
+        ret = mbedtls_ssl_read( &( pClient->ssl ),
+                                &( pClient->rxBuffer[ pClient->rxLength ] ),
+                                sizeof( pClient->rxBuffer ) - pClient->rxLength );
+
+        if( ret > 0 )
+        {
+            pClient->rxLength += ( size_t ) ret;
+
+            /* Handle the complete packets and keep the rest. */
+            while( status == true )
+            {
+                decodeStatus = decodeFixedHeader( pClient->rxBuffer, pClient->rxLength, &headerLength, &packetLength );
+
+                if( decodeStatus < 0 )
+                {
+                    LogError( ( "Malformed fixed header." ) );
+                    status = false;
+                }
+                else if( ( decodeStatus == 0 ) || ( packetLength > pClient->rxLength ) )
+                {
+                    break;
+                }
+                else
+                {
+                    status = handlePacket( pBroker, pClient, pClient->rxBuffer, headerLength, packetLength );
+
+                    if( status == true )
+                    {
+                        pClient->rxLength -= packetLength;
+                        memmove( pClient->rxBuffer, &( pClient->rxBuffer[ packetLength ] ), pClient->rxLength );
+                    }
+                }
+            }
+        }
+        else if( ( ret == MBEDTLS_ERR_SSL_WANT_READ ) || ( ret == MBEDTLS_ERR_SSL_WANT_WRITE ) )
+        {
+            /* Wait for more data. */
+        }
+        else
+        {
+            /* Zero, close notification or error. */
+            status = false;
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static void * brokerThread( void * pArgument )
+{
+    LoopbackBroker_t * pBroker = ( LoopbackBroker_t * ) pArgument;
+    struct pollfd pollFds[ 2U + LOOPBACK_BROKER_MAX_CLIENTS ];
+    BrokerClient_t * pPolledClients[ LOOPBACK_BROKER_MAX_CLIENTS ];
+    BrokerClient_t * pClient;
+    nfds_t pollFdCount;
+    uint64_t nowUs;
+    uint64_t nextDueUs;
+    int timeoutMs;
+    uint8_t drain[ 16 ];
+    uint32_t i;
+
+    pthread_mutex_lock( &( pBroker->mutex ) );
+
+    while( pBroker->stop == false )
+    {
+        pollFds[ 0 ].fd = pBroker->wakeFds[ 0 ];
+        pollFds[ 0 ].events = POLLIN;
+        pollFds[ 1 ].fd = pBroker->listenNet.fd;
+        pollFds[ 1 ].events = POLLIN;
+        pollFdCount = 2U;
+        nextDueUs = UINT64_MAX;
+
+        for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+        {
+            pClient = &( pBroker->clients[ i ] );
+
+            if( pClient->inUse == true )
+            {
+                pollFds[ pollFdCount ].fd = pClient->net.fd;
+                pollFds[ pollFdCount ].events = POLLIN;
+
+                if( pClient->pRecordHead != NULL )
+                {
+                    if( pClient->pRecordHead->offset > 0U )
+                    {
+                        pollFds[ pollFdCount ].events |= POLLOUT;
+                    }
+                    else if( pClient->pRecordHead->dueUs < nextDueUs )
+                    {
+                        nextDueUs = pClient->pRecordHead->dueUs;
+                    }
+                }
+
+                pPolledClients[ pollFdCount - 2U ] = pClient;
+                pollFdCount++;
+            }
+        }
+
+        nowUs = getTimeUs();
+
+        if( nextDueUs == UINT64_MAX )
+        {
+            timeoutMs = -1;
+        }
+        else if( nextDueUs <= nowUs )
+        {
+            timeoutMs = 0;
+        }
+        else
+        {
+            timeoutMs = ( int ) ( ( nextDueUs - nowUs + 999U ) / 1000U );
+        }
+
+        pthread_mutex_unlock( &( pBroker->mutex ) );
+        ( void ) poll( pollFds, pollFdCount, timeoutMs );
+        pthread_mutex_lock( &( pBroker->mutex ) );
+
+        if( ( pollFds[ 0 ].revents & POLLIN ) != 0 )
+        {
+            ( void ) read( pBroker->wakeFds[ 0 ], drain, sizeof( drain ) );
+        }
+
+        if( pBroker->dropClients == true )
+        {
+            for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+            {
+                if( pBroker->clients[ i ].inUse == true )
+                {
+                    closeClient( &( pBroker->clients[ i ] ) );
+                }
+            }
+
+            pBroker->dropClients = false;
+        }
+        else
+        {
+            for( i = 2U; i < pollFdCount; i++ )
+            {
+                pClient = pPolledClients[ i - 2U ];
+
+                /* A client may have been closed by the CONNECT of another one. */
+                if( ( pClient->inUse == true ) &&
+                    ( ( pollFds[ i ].revents & ( POLLIN | POLLERR | POLLHUP ) ) != 0 ) &&
+                    ( serviceClient( pBroker, pClient ) == false ) )
+                {
+                    closeClient( pClient );
+                }
+            }
+        }
+
+        if( ( pollFds[ 1 ].revents & POLLIN ) != 0 )
+        {
+            acceptClients( pBroker );
+        }
+
+        for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+        {
+            pClient = &( pBroker->clients[ i ] );
+
+            if( ( pClient->inUse == true ) && ( flushClient( pClient ) == false ) )
+            {
+                closeClient( pClient );
+            }
+        }
+    }
+
+    for( i = 0; i < LOOPBACK_BROKER_MAX_CLIENTS; i++ )
+    {
+        if( pBroker->clients[ i ].inUse == true )
+        {
+            closeClient( &( pBroker->clients[ i ] ) );
+        }
+    }
+
+    pthread_mutex_unlock( &( pBroker->mutex ) );
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Wake the broker thread up.
+ *
+ * @param[in] pBroker Broker.
+ */
+static void wakeBroker( LoopbackBroker_t * pBroker )
+{
+    uint8_t wake = 0U;
+
+    ( void ) write( pBroker->wakeFds[ 1 ], &wake, sizeof( wake ) );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Free the MbedTLS contexts and the pipe of a broker, and the broker.
+ *
+ * @param[in] pBroker Broker.
+ */
+static void freeBroker( LoopbackBroker_t * pBroker )
+{
+    #if defined( MBEDTLS_SSL_TICKET_C )
+        mbedtls_ssl_ticket_free( &( pBroker->ticket ) );
+    #endif
+    mbedtls_ssl_config_free( &( pBroker->sslConfig ) );
+    mbedtls_pk_free( &( pBroker->serverKey ) );
+    mbedtls_x509_crt_free( &( pBroker->serverCert ) );
+    mbedtls_x509_crt_free( &( pBroker->caCert ) );
+    mbedtls_ctr_drbg_free( &( pBroker->drbg ) );
+    mbedtls_entropy_free( &( pBroker->entropy ) );
+    mbedtls_net_free( &( pBroker->listenNet ) );
+
+    if( pBroker->wakeFds[ 0 ] >= 0 )
+    {
+        ( void ) close( pBroker->wakeFds[ 0 ] );
+        ( void ) close( pBroker->wakeFds[ 1 ] );
+    }
+
+    ( void ) pthread_cond_destroy( &( pBroker->cond ) );
+    ( void ) pthread_mutex_destroy( &( pBroker->mutex ) );
+    free( pBroker );
+}
+
+/*-----------------------------------------------------------*/
+
+LoopbackBroker_t * LoopbackBroker_Start( const LoopbackBrokerConfig_t * pConfig )
+{
+    LoopbackBroker_t * pBroker;
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof( address );
+    char port[ 6 ];
+    int mbedtlsError = 0;
+
+    pBroker = calloc( 1U, sizeof( LoopbackBroker_t ) );
+
+    if( pBroker == NULL )
+    {
+        LogError( ( "Failed to allocate the broker." ) );
+        return NULL;
+    }
+
+    ( void ) pthread_mutex_init( &( pBroker->mutex ), NULL );
+    ( void ) pthread_cond_init( &( pBroker->cond ), NULL );
+    pBroker->wakeFds[ 0 ] = -1;
+    pBroker->latencyMs = pConfig->latencyMs;
+    pBroker->lossPercent = pConfig->lossPercent;
+    pBroker->retransmitMs = ( pConfig->retransmitMs != 0U ) ? pConfig->retransmitMs : LOOPBACK_BROKER_RETRANSMIT_MS;
+    pBroker->lossSeed = 1U;
+    pBroker->publishHook = pConfig->publishHook;
+    pBroker->pPublishHookContext = pConfig->pPublishHookContext;
+
+    mbedtls_net_init( &( pBroker->listenNet ) );
+    mbedtls_entropy_init( &( pBroker->entropy ) );
+    mbedtls_ctr_drbg_init( &( pBroker->drbg ) );
+    mbedtls_x509_crt_init( &( pBroker->caCert ) );
+    mbedtls_x509_crt_init( &( pBroker->serverCert ) );
+    mbedtls_pk_init( &( pBroker->serverKey ) );
+    mbedtls_ssl_config_init( &( pBroker->sslConfig ) );
+    #if defined( MBEDTLS_SSL_TICKET_C )
+        mbedtls_ssl_ticket_init( &( pBroker->ticket ) );
+    #endif
+
+    if( pipe( pBroker->wakeFds ) != 0 )
+    {
+        LogError( ( "Failed to create the wakeup pipe." ) );
+        pBroker->wakeFds[ 0 ] = -1;
+        mbedtlsError = -1;
+    }
+    else
+    {
+        ( void ) fcntl( pBroker->wakeFds[ 0 ], F_SETFL, O_NONBLOCK );
+        ( void ) fcntl( pBroker->wakeFds[ 1 ], F_SETFL, O_NONBLOCK );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_ctr_drbg_seed( &( pBroker->drbg ), mbedtls_entropy_func, &( pBroker->entropy ), NULL, 0U );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509_crt_parse_file( &( pBroker->caCert ), pConfig->pCaCertPath );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509_crt_parse_file( &( pBroker->serverCert ), pConfig->pServerCertPath );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_pk_parse_keyfile( &( pBroker->serverKey ), pConfig->pServerKeyPath, NULL );
+    }
+
+    if( mbedtlsError != 0 )
+    {
+        LogError( ( "Failed to load the broker credentials with error -0x%04x.", ( unsigned int ) -mbedtlsError ) );
+    }
+    else
+    {
+        mbedtlsError = mbedtls_ssl_config_defaults( &( pBroker->sslConfig ),
+                                                    MBEDTLS_SSL_IS_SERVER,
+                                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                                    MBEDTLS_SSL_PRESET_DEFAULT );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtls_ssl_conf_rng( &( pBroker->sslConfig ), mbedtls_ctr_drbg_random, &( pBroker->drbg ) );
+        mbedtls_ssl_conf_authmode( &( pBroker->sslConfig ), MBEDTLS_SSL_VERIFY_REQUIRED );
+        mbedtls_ssl_conf_ca_chain( &( pBroker->sslConfig ), &( pBroker->caCert ), NULL );
+        mbedtlsError = mbedtls_ssl_conf_own_cert( &( pBroker->sslConfig ), &( pBroker->serverCert ), &( pBroker->serverKey ) );
+    }
+
+    #if defined( MBEDTLS_SSL_TICKET_C )
+        /* Issue session tickets so that the reconnections can be resumed. */
+        if( mbedtlsError == 0 )
+        {
+            mbedtlsError = mbedtls_ssl_ticket_setup( &( pBroker->ticket ),
+                                                     mbedtls_ctr_drbg_random,
+                                                     &( pBroker->drbg ),
+                                                     MBEDTLS_CIPHER_AES_256_GCM,
+                                                     BROKER_TICKET_LIFETIME_S );
+        }
+
+        if( mbedtlsError == 0 )
+        {
+            mbedtls_ssl_conf_session_tickets_cb( &( pBroker->sslConfig ),
+                                                 mbedtls_ssl_ticket_write,
+                                                 mbedtls_ssl_ticket_parse,
+                                                 &( pBroker->ticket ) );
+        }
+    #endif /* if defined( MBEDTLS_SSL_TICKET_C ) */
+
+    if( mbedtlsError == 0 )
+    {
+        ( void ) snprintf( port, sizeof( port ), "%u", ( unsigned int ) pConfig->port );
+        mbedtlsError = mbedtls_net_bind( &( pBroker->listenNet ), "127.0.0.1", port, MBEDTLS_NET_PROTO_TCP );
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to bind port %s with error -0x%04x.", port, ( unsigned int ) -mbedtlsError ) );
+        }
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        ( void ) mbedtls_net_set_nonblock( &( pBroker->listenNet ) );
+
+        if( getsockname( pBroker->listenNet.fd, ( struct sockaddr * ) &address, &addressLength ) == 0 )
+        {
+            pBroker->port = ntohs( address.sin_port );
+        }
+
+        if( pthread_create( &( pBroker->thread ), NULL, brokerThread, pBroker ) != 0 )
+        {
+            LogError( ( "Failed to create the broker thread." ) );
+            mbedtlsError = -1;
+        }
+    }
+
+    if( mbedtlsError != 0 )
+    {
+        freeBroker( pBroker );
+        pBroker = NULL;
+    }
+
+    return pBroker;
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackBroker_Stop( LoopbackBroker_t * pBroker )
+{
+    if( pBroker != NULL )
+    {
+        pthread_mutex_lock( &( pBroker->mutex ) );
+        pBroker->stop = true;
+        pthread_mutex_unlock( &( pBroker->mutex ) );
+
+        wakeBroker( pBroker );
+        ( void ) pthread_join( pBroker->thread, NULL );
+        freeBroker( pBroker );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+uint16_t LoopbackBroker_GetPort( LoopbackBroker_t * pBroker )
+{
+    return pBroker->port;
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackBroker_SetImpairment( LoopbackBroker_t * pBroker,
+                                   uint32_t latencyMs,
+                                   uint32_t lossPercent )
+{
+    pthread_mutex_lock( &( pBroker->mutex ) );
+    pBroker->latencyMs = latencyMs;
+    pBroker->lossPercent = lossPercent;
+    pthread_mutex_unlock( &( pBroker->mutex ) );
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackBroker_DropClients( LoopbackBroker_t * pBroker )
+{
+    pthread_mutex_lock( &( pBroker->mutex ) );
+    pBroker->dropClients = true;
+    pthread_mutex_unlock( &( pBroker->mutex ) );
+
+    wakeBroker( pBroker );
+}
+
+/*-----------------------------------------------------------*/
+
+bool LoopbackBroker_WaitForConnects( LoopbackBroker_t * pBroker,
+                                     uint32_t connects,
+                                     uint32_t timeoutMs )
+{
+    struct timespec deadline;
+    int ret = 0;
+
+    ( void ) clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += ( time_t ) ( timeoutMs / 1000U );
+    deadline.tv_nsec += ( long ) ( timeoutMs % 1000U ) * 1000000L;
+
+    if( deadline.tv_nsec >= 1000000000L )
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock( &( pBroker->mutex ) );
+
+    while( ( ret == 0 ) && ( pBroker->stats.connects < connects ) )
+    {
+        ret = pthread_cond_timedwait( &( pBroker->cond ), &( pBroker->mutex ), &deadline );
+    }
+
+    ret = ( pBroker->stats.connects >= connects ) ? 1 : 0;
+    pthread_mutex_unlock( &( pBroker->mutex ) );
+
+    return( ret == 1 );
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackBroker_Publish( LoopbackBroker_t * pBroker,
+                             const char * pTopic,
+                             size_t topicLength,
+                             const uint8_t * pPayload,
+                             size_t payloadLength )
+{
+    deliverPublish( pBroker, pTopic, topicLength, 1U, pPayload, payloadLength );
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackBroker_GetStats( LoopbackBroker_t * pBroker,
+                              LoopbackBrokerStats_t * pStats )
+{
+    pthread_mutex_lock( &( pBroker->mutex ) );
+    *pStats = pBroker->stats;
+    pthread_mutex_unlock( &( pBroker->mutex ) );
+}
@@ -0,0 +1,220 @@
+#ifndef LOOPBACK_BROKER_H_
+#define LOOPBACK_BROKER_H_
+
+/**
+ * @file loopback_broker.h
+ *
+ * @brief Minimal MQTT 3.1.1 broker over MbedTLS, listening on the loopback
+ * interface. It stands in for AWS IoT Core to measure the MQTT agent and the
+ * transport offline.
+ *
+ * The broker authenticates the clients with certificates signed by a test CA,
+ * and supports CONNECT with persistent sessions, SUBSCRIBE and UNSUBSCRIBE with
+ * the + and # wildcards, PUBLISH with QoS 0 and 1, PINGREQ and DISCONNECT.
+ * Retained messages, wills and the delivery of messages to offline sessions are
+ * not supported.
+ *
+ * The network impairments are injected on the TLS records sent by the broker,
+ * handshake included:
+ * - Every record is delayed by the configured latency, which adds to the round
+ *   trip time of each request of the client.
+ * - A record is lost with the configured probability. As the connection is TCP,
+ *   a lost record is delivered after the retransmission delay, and the records
+ *   following it wait for it.
+ */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Maximum number of concurrent client connections.
+ */
+#ifndef LOOPBACK_BROKER_MAX_CLIENTS
+    #define LOOPBACK_BROKER_MAX_CLIENTS    ( 8U )
+#endif
+
+/**
+ * @brief Maximum number of MQTT sessions, connected or not.
+ */
+#ifndef LOOPBACK_BROKER_MAX_SESSIONS
+    #define LOOPBACK_BROKER_MAX_SESSIONS    ( 8U )
+#endif
+
+/**
+ * @brief Maximum number of topic filters of a session.
+ */
+#ifndef LOOPBACK_BROKER_MAX_SUBSCRIPTIONS
+    #define LOOPBACK_BROKER_MAX_SUBSCRIPTIONS    ( 16U )
+#endif
+
+/**
+ * @brief Maximum length of a topic filter.
+ */
+#ifndef LOOPBACK_BROKER_MAX_TOPIC_LENGTH
+    #define LOOPBACK_BROKER_MAX_TOPIC_LENGTH    ( 128U )
+#endif
+
+/**
+ * @brief Maximum length of a client identifier.
+ */
+#ifndef LOOPBACK_BROKER_MAX_CLIENT_ID_LENGTH
+    #define LOOPBACK_BROKER_MAX_CLIENT_ID_LENGTH    ( 64U )
+#endif
+
+/**
+ * @brief Maximum size of an MQTT packet received by the broker. The connection
+ * of a client sending a larger packet is closed.
+ */
+#ifndef LOOPBACK_BROKER_MAX_PACKET_SIZE
+    #define LOOPBACK_BROKER_MAX_PACKET_SIZE    ( 16384U )
+#endif
+
+/**
+ * @brief Default delay of a lost record, i.e. the TCP retransmission timeout.
+ */
+#ifndef LOOPBACK_BROKER_RETRANSMIT_MS
+    #define LOOPBACK_BROKER_RETRANSMIT_MS    ( 200U )
+#endif
+
+/**
+ * @brief Loopback broker handle.
+ */
+typedef struct LoopbackBroker LoopbackBroker_t;
+
+/**
+ * @brief Hook called by the broker thread with each PUBLISH received from a
+ * client, after it is delivered to the subscribers. It stands in for the
+ * services of AWS IoT Core that answer requests on reserved topics, and can
+ * respond with #LoopbackBroker_Publish.
+ *
+ * @param[in] pHookContext Context given in the configuration of the broker.
+ * @param[in] pBroker Broker.
+ * @param[in] pTopic Topic name, not null terminated.
+ * @param[in] topicLength Length of the topic name.
+ * @param[in] pPayload Payload.
+ * @param[in] payloadLength Length of the payload.
+ */
+typedef void ( * LoopbackBrokerPublishHook_t )( void * pHookContext,
+                                                LoopbackBroker_t * pBroker,
+                                                const char * pTopic,
+                                                size_t topicLength,
+                                                const uint8_t * pPayload,
+                                                size_t payloadLength );
+
+/**
+ * @brief Parameters of a loopback broker. The paths must remain valid until the
+ * broker is started.
+ */
+typedef struct LoopbackBrokerConfig
+{
+    uint16_t port;                /**< @brief Port to listen on. Zero selects a free port. */
+    const char * pCaCertPath;     /**< @brief CA certificate verifying the client certificates. */
+    const char * pServerCertPath; /**< @brief Server certificate. */
+    const char * pServerKeyPath;  /**< @brief Private key of the server certificate. */
+    uint32_t latencyMs;           /**< @brief Delay of every record sent by the broker. */
+    uint32_t lossPercent;         /**< @brief Probability, in percent, that a record sent by the broker is lost. */
+    uint32_t retransmitMs;        /**< @brief Delay of a lost record. Zero selects LOOPBACK_BROKER_RETRANSMIT_MS. */
+
+    LoopbackBrokerPublishHook_t publishHook; /**< @brief Hook of the received messages. NULL if not used. */
+    void * pPublishHookContext;              /**< @brief Context passed to #publishHook. */
+} LoopbackBrokerConfig_t;
+
+/**
+ * @brief Counters of a loopback broker.
+ */
+typedef struct LoopbackBrokerStats
+{
+    uint32_t connects;           /**< @brief Number of accepted MQTT CONNECT packets. */
+    uint32_t publishesReceived;  /**< @brief Number of PUBLISH packets received from the clients. */
+    uint32_t publishesDelivered; /**< @brief Number of PUBLISH packets sent to the subscribers. */
+    uint32_t recordsLost;        /**< @brief Number of records delayed by a loss. */
+} LoopbackBrokerStats_t;
+
+/**
+ * @brief Start a loopback broker in its own thread.
+ *
+ * @param[in] pConfig Parameters of the broker.
+ *
+ * @return The broker on success; NULL if the credentials cannot be loaded or
+ * the port cannot be bound.
+ */
+LoopbackBroker_t * LoopbackBroker_Start( const LoopbackBrokerConfig_t * pConfig );
+
+/**
+ * @brief Stop a loopback broker, close its connections and free it.
+ *
+ * @param[in] pBroker Broker to stop.
+ */
+void LoopbackBroker_Stop( LoopbackBroker_t * pBroker );
+
+/**
+ * @brief Get the port the broker listens on.
+ *
+ * @param[in] pBroker Broker.
+ *
+ * @return The port.
+ */
+uint16_t LoopbackBroker_GetPort( LoopbackBroker_t * pBroker );
+
+/**
+ * @brief Change the network impairments. They apply to the records sent after
+ * the call.
+ *
+ * @param[in] pBroker Broker.
+ * @param[in] latencyMs Delay of every record sent by the broker.
+ * @param[in] lossPercent Probability, in percent, that a record is lost.
+ */
+void LoopbackBroker_SetImpairment( LoopbackBroker_t * pBroker,
+                                   uint32_t latencyMs,
+                                   uint32_t lossPercent );
+
+/**
+ * @brief Close all the client connections without DISCONNECT or TLS close
+ * notification, like a network failure. The sessions are kept.
+ *
+ * @param[in] pBroker Broker.
+ */
+void LoopbackBroker_DropClients( LoopbackBroker_t * pBroker );
+
+/**
+ * @brief Wait until the broker has accepted a number of MQTT connections since
+ * it was started.
+ *
+ * @param[in] pBroker Broker.
+ * @param[in] connects Number of connections to wait for.
+ * @param[in] timeoutMs Maximum time to wait.
+ *
+ * @return true if the connections were accepted; false on timeout.
+ */
+bool LoopbackBroker_WaitForConnects( LoopbackBroker_t * pBroker,
+                                     uint32_t connects,
+                                     uint32_t timeoutMs );
+
+/**
+ * @brief Deliver a message with QoS 1 to the connected subscribers of its topic.
+ * It may only be called by the publish hook, on the broker thread.
+ *
+ * @param[in] pBroker Broker.
+ * @param[in] pTopic Topic name, not null terminated.
+ * @param[in] topicLength Length of the topic name.
+ * @param[in] pPayload Payload.
+ * @param[in] payloadLength Length of the payload.
+ */
+void LoopbackBroker_Publish( LoopbackBroker_t * pBroker,
+                             const char * pTopic,
+                             size_t topicLength,
+                             const uint8_t * pPayload,
+                             size_t payloadLength );
+
+/**
+ * @brief Get the counters of the broker.
+ *
+ * @param[in] pBroker Broker.
+ * @param[out] pStats Copy of the counters.
+ */
+void LoopbackBroker_GetStats( LoopbackBroker_t * pBroker,
+                              LoopbackBrokerStats_t * pStats );
+
+#endif /* ifndef LOOPBACK_BROKER_H_ */
@@ -0,0 +1,1175 @@
+/* Standard includes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* MQTT includes. */
+#include "core_mqtt_serializer.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/ssl.h"
+
+/* corePKCS11 includes. */
+#include "core_pkcs11.h"
+#include "core_pkcs11_config.h"
+#include "pkcs11_operations.h"
+
+/* Transport includes. */
+#include "mbedtls_pkcs11_posix.h"
+#include "mbedtls_pkcs11_memory.h"
+#include "mbedtls_pkcs11_session_pool.h"
+#include "mbedtls_pkcs11_secure_arena.h"
+
+#include "mqtt_agent.h"
+#include "mqtt_agent_scheduler.h"
+
+/* Fleet Provisioning demo includes. */
+#include "demo_config.h"
+#include "fleet_provisioning_keys_cert_demo.h"
+
+#include "loopback_broker.h"
+#include "loopback_provisioning.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Directory of the credentials generated by generate_certs.sh.
+ */
+#ifndef LOOPBACK_BROKER_CERT_DIR
+    #define LOOPBACK_BROKER_CERT_DIR    "certificates"
+#endif
+
+#define BENCHMARK_CA_CERT_PATH        LOOPBACK_BROKER_CERT_DIR "/ca.crt"
+#define BENCHMARK_CA_KEY_PATH         LOOPBACK_BROKER_CERT_DIR "/ca.key"
+#define BENCHMARK_SERVER_CERT_PATH    LOOPBACK_BROKER_CERT_DIR "/server.crt"
+#define BENCHMARK_SERVER_KEY_PATH     LOOPBACK_BROKER_CERT_DIR "/server.key"
+#define BENCHMARK_DEVICE_CERT_PATH    LOOPBACK_BROKER_CERT_DIR "/device.crt"
+#define BENCHMARK_DEVICE_KEY_PATH     LOOPBACK_BROKER_CERT_DIR "/device.key"
+
+/**
+ * @brief The broker certificate is issued for localhost.
+ */
+#define BENCHMARK_ENDPOINT             "localhost"
+#define BENCHMARK_CLIENT_IDENTIFIER    "loopback-benchmark"
+
+/**
+ * @brief Client identifier of the connections made with the transport only. It
+ * differs from the agent's, so that the broker keeps the agent connected.
+ */
+#define BENCHMARK_TRANSPORT_CLIENT_IDENTIFIER    "loopback-benchmark-transport"
+
+/**
+ * @brief Serial number, and client identifier, of the devices provisioned by
+ * the provisioning benchmark, followed by the round number.
+ */
+#define BENCHMARK_PROVISIONING_SERIAL_PREFIX    "loopback-device-"
+
+/**
+ * @brief Size of the serial numbers. The demo sends at most 32 characters.
+ */
+#define BENCHMARK_SERIAL_NUMBER_SIZE    ( 33U )
+
+/**
+ * @brief Topics of the benchmark. Nobody subscribes to the throughput topic, so
+ * the publishes only wait for the PUBACK.
+ */
+#define BENCHMARK_THROUGHPUT_TOPIC    "loopback/benchmark/throughput"
+#define BENCHMARK_ECHO_TOPIC          "loopback/benchmark/echo"
+#define BENCHMARK_SUBSCRIBE_TOPIC     "loopback/benchmark/subscribe"
+#define BENCHMARK_TRANSPORT_TOPIC     "loopback/benchmark/transport"
+
+/**
+ * @brief Number of subscribe and unsubscribe round trips measured.
+ */
+#define BENCHMARK_SUBSCRIBE_COUNT    ( 20U )
+
+/**
+ * @brief Maximum time to wait for an operation of the agent or the broker.
+ */
+#define BENCHMARK_TIMEOUT_MS    ( 30000U )
+
+/**
+ * @brief Maximum payload length of the publishes.
+ */
+#define BENCHMARK_MAX_PAYLOAD_LENGTH    ( 8192U )
+
+/**
+ * @brief Size of the MQTT packet buffers of the transport benchmark: a PUBLISH
+ * of the largest payload with its header and topic.
+ */
+#define BENCHMARK_PACKET_BUFFER_SIZE    ( BENCHMARK_MAX_PAYLOAD_LENGTH + 256U )
+
+/**
+ * @brief Number of PUBLISH packets sent by the transport benchmark before their
+ * deliveries are received. It bounds the data buffered in the sockets, which
+ * the broker and the benchmark would otherwise both block on.
+ */
+#define BENCHMARK_TRANSPORT_WINDOW    ( 16U )
+
+/**
+ * @brief Receive timeout of the connections made with the transport only.
+ */
+#define BENCHMARK_RECV_TIMEOUT_MS    ( 1000U )
+
+/**
+ * @brief Size of the secure arena, which holds the buffers of the device
+ * credentials while they are imported, and the state of a provisioning.
+ */
+#define BENCHMARK_SECURE_ARENA_SIZE    ( ( 16U * 1024U ) + SECURE_ARENA_DEVICE_SIZE )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Parameters of a benchmark run.
+ */
+typedef struct BenchmarkParams
+{
+    uint32_t publishCount;   /**< @brief Number of publishes of the throughput test. */
+    uint32_t payloadLength;  /**< @brief Payload length of the publishes. */
+    uint32_t echoCount;      /**< @brief Number of publishes of the latency test. */
+    uint32_t reconnectCount; /**< @brief Number of reconnections. */
+    uint32_t transportCount; /**< @brief Number of publishes of the transport throughput test. */
+    uint32_t resumeCount;    /**< @brief Number of full and resumed handshakes of the resumption test. */
+    uint32_t provisionCount; /**< @brief Number of devices provisioned by the provisioning test. */
+    uint32_t latencyMs;      /**< @brief Latency injected by the broker. */
+    uint32_t lossPercent;    /**< @brief Record loss injected by the broker. */
+} BenchmarkParams_t;
+
+/**
+ * @brief Completions of the asynchronous publishes.
+ */
+typedef struct PublishCompletions
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint32_t completed;
+    uint32_t failed;
+} PublishCompletions_t;
+
+/**
+ * @brief Agent thread parameters.
+ */
+typedef struct AgentThreadParams
+{
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    CK_SESSION_HANDLE p11Session;
+} AgentThreadParams_t;
+
+/*-----------------------------------------------------------*/
+
+static PublishCompletions_t publishCompletions =
+{
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    0U,
+    0U
+};
+
+static uint8_t payloadBuffer[ BENCHMARK_MAX_PAYLOAD_LENGTH ];
+
+static uint8_t packetBuffer[ BENCHMARK_PACKET_BUFFER_SIZE ];
+
+/*-----------------------------------------------------------*/
+
+static uint64_t getTimeUs( void )
+{
+    struct timespec now;
+
+    ( void ) clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return ( ( uint64_t ) now.tv_sec * 1000000U ) + ( ( uint64_t ) now.tv_nsec / 1000U );
+}
+
+/*-----------------------------------------------------------*/
+
+static int compareSamples( const void * pLeft,
+                           const void * pRight )
+{
+    uint64_t left = *( const uint64_t * ) pLeft;
+    uint64_t right = *( const uint64_t * ) pRight;
+
+    return ( left > right ) - ( left < right );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Print the minimum, median, 99th percentile and maximum of samples in
+ * microseconds, as milliseconds.
+ */
+static void printSamples( const char * pName,
+                          uint64_t * pSamples,
+                          uint32_t count )
+{
+    if( count == 0U )
+    {
+        printf( "%s_ms: no samples\n", pName );
+    }
+    else
+    {
+        qsort( pSamples, count, sizeof( uint64_t ), compareSamples );
+        printf( "%s_ms: min %.3f p50 %.3f p99 %.3f max %.3f (%u samples)\n",
+                pName,
+                ( double ) pSamples[ 0 ] / 1000.0,
+                ( double ) pSamples[ count / 2U ] / 1000.0,
+                ( double ) pSamples[ ( ( count * 99U ) / 100U ) ] / 1000.0,
+                ( double ) pSamples[ count - 1U ] / 1000.0,
+                ( unsigned int ) count );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void publishCompleteCallback( void * pvPublishCompleteCallbackContext,
+                                     MQTTStatus_t xReturnStatus )
+{
+    ( void ) pvPublishCompleteCallbackContext;
+
+    pthread_mutex_lock( &( publishCompletions.mutex ) );
+
+    if( xReturnStatus == MQTTSuccess )
+    {
+        publishCompletions.completed++;
+    }
+    else
+    {
+        publishCompletions.failed++;
+    }
+
+    pthread_cond_broadcast( &( publishCompletions.cond ) );
+    pthread_mutex_unlock( &( publishCompletions.mutex ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static void * agentThread( void * pArgument )
+{
+    AgentThreadParams_t * pParams = ( AgentThreadParams_t * ) pArgument;
+
+    ( void ) iotshdDev_MQTTAgentThreadLoop( pParams->pInstance, pParams->p11Session );
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Publish QoS 1 messages without subscriber, as fast as the in-flight
+ * window allows.
+ */
+static bool benchmarkThroughput( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                 const BenchmarkParams_t * pParams )
+{
+    MQTTPublishInfo_t publishInfo;
+    struct timespec deadline;
+    uint64_t startUs;
+    uint64_t elapsedUs;
+    uint32_t i;
+    bool status = true;
+
+    memset( &publishInfo, 0, sizeof( publishInfo ) );
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = BENCHMARK_THROUGHPUT_TOPIC;
+    publishInfo.topicNameLength = ( uint16_t ) strlen( BENCHMARK_THROUGHPUT_TOPIC );
+    publishInfo.pPayload = payloadBuffer;
+    publishInfo.payloadLength = pParams->payloadLength;
+
+    publishCompletions.completed = 0U;
+    publishCompletions.failed = 0U;
+    startUs = getTimeUs();
+
+    for( i = 0; ( i < pParams->publishCount ) && ( status == true ); i++ )
+    {
+        status = ( iotshdDev_MQTTAgentPublishAsync( pInstance,
+                                                    &publishInfo,
+                                                    publishCompleteCallback,
+                                                    NULL,
+                                                    BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+    }
+
+    ( void ) clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += BENCHMARK_TIMEOUT_MS / 1000U;
+
+    pthread_mutex_lock( &( publishCompletions.mutex ) );
+
+    while( ( status == true ) &&
+           ( ( publishCompletions.completed + publishCompletions.failed ) < pParams->publishCount ) )
+    {
+        status = ( pthread_cond_timedwait( &( publishCompletions.cond ), &( publishCompletions.mutex ), &deadline ) == 0 );
+    }
+
+    status = status && ( publishCompletions.failed == 0U );
+    pthread_mutex_unlock( &( publishCompletions.mutex ) );
+
+    elapsedUs = getTimeUs() - startUs;
+
+    if( status == false )
+    {
+        printf( "publish_throughput: failed after %u completions and %u failures\n",
+                ( unsigned int ) publishCompletions.completed,
+                ( unsigned int ) publishCompletions.failed );
+    }
+    else
+    {
+        printf( "publish_throughput_msgs_per_s: %.1f\n",
+                ( double ) pParams->publishCount * 1000000.0 / ( double ) elapsedUs );
+        printf( "publish_throughput_kib_per_s: %.1f\n",
+                ( double ) pParams->publishCount * pParams->payloadLength * 1000000.0 / 1024.0 / ( double ) elapsedUs );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Measure the SUBSCRIBE and UNSUBSCRIBE round trips.
+ */
+static bool benchmarkSubscribe( iotshdDev_MQTTAgentInstance_t * pInstance,
+                                iotshdDev_MQTTAgentUserContext_t * pUserContext )
+{
+    uint64_t subscribeSamples[ BENCHMARK_SUBSCRIBE_COUNT ];
+    uint64_t unsubscribeSamples[ BENCHMARK_SUBSCRIBE_COUNT ];
+    uint16_t topicLength = ( uint16_t ) strlen( BENCHMARK_SUBSCRIBE_TOPIC );
+    uint64_t startUs;
+    uint32_t i;
+    bool status = true;
+
+    for( i = 0; ( i < BENCHMARK_SUBSCRIBE_COUNT ) && ( status == true ); i++ )
+    {
+        startUs = getTimeUs();
+        status = ( iotshdDev_MQTTAgentAddSubscriptionWithQueue( pInstance,
+                                                                pUserContext,
+                                                                BENCHMARK_SUBSCRIBE_TOPIC,
+                                                                topicLength,
+                                                                BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+        subscribeSamples[ i ] = getTimeUs() - startUs;
+
+        if( status == true )
+        {
+            startUs = getTimeUs();
+            status = ( iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( pInstance,
+                                                                       pUserContext,
+                                                                       BENCHMARK_SUBSCRIBE_TOPIC,
+                                                                       topicLength,
+                                                                       BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+            unsubscribeSamples[ i ] = getTimeUs() - startUs;
+        }
+    }
+
+    if( status == false )
+    {
+        printf( "subscribe_latency: failed at round trip %u\n", ( unsigned int ) i );
+    }
+    else
+    {
+        printSamples( "subscribe_latency", subscribeSamples, BENCHMARK_SUBSCRIBE_COUNT );
+        printSamples( "unsubscribe_latency", unsubscribeSamples, BENCHMARK_SUBSCRIBE_COUNT );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Measure the time from a publish to the delivery of the message back to
+ * the agent.
+ */
+static bool benchmarkEcho( iotshdDev_MQTTAgentInstance_t * pInstance,
+                           iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                           const BenchmarkParams_t * pParams )
+{
+    MQTTPublishInfo_t publishInfo;
+    iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
+    uint16_t topicLength = ( uint16_t ) strlen( BENCHMARK_ECHO_TOPIC );
+    uint64_t * pSamples;
+    uint64_t startUs;
+    uint32_t sequence = 0U;
+    uint32_t i;
+    bool status;
+
+    pSamples = malloc( sizeof( uint64_t ) * ( pParams->echoCount + 1U ) );
+    status = ( pSamples != NULL );
+
+    memset( &publishInfo, 0, sizeof( publishInfo ) );
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = BENCHMARK_ECHO_TOPIC;
+    publishInfo.topicNameLength = topicLength;
+    publishInfo.pPayload = payloadBuffer;
+    publishInfo.payloadLength = pParams->payloadLength;
+
+    status = status && ( iotshdDev_MQTTAgentAddSubscriptionWithQueue( pInstance,
+                                                                      pUserContext,
+                                                                      BENCHMARK_ECHO_TOPIC,
+                                                                      topicLength,
+                                                                      BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+
+    for( i = 0; ( i < pParams->echoCount ) && ( status == true ); i++ )
+    {
+        /* The payload starts with a sequence number identifying the message. */
+        memcpy( payloadBuffer, &i, sizeof( i ) );
+        startUs = getTimeUs();
+        status = ( iotshdDev_MQTTAgentPublish( pInstance, pUserContext, &publishInfo, BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+        pQueueItem = ( status == true ) ? iotshdDev_MQTTAgentDequeueIncommingPublish( pUserContext, BENCHMARK_TIMEOUT_MS ) : NULL;
+
+        if( pQueueItem == NULL )
+        {
+            status = false;
+        }
+        else
+        {
+            pSamples[ i ] = getTimeUs() - startUs;
+            memcpy( &sequence, pQueueItem->publishInfo.pPayload, sizeof( sequence ) );
+            status = ( sequence == i ) && ( pQueueItem->publishInfo.payloadLength == pParams->payloadLength );
+            iotshdDev_MQTTAgentFreeIncommingPublish( pUserContext, pQueueItem, false );
+        }
+    }
+
+    if( status == false )
+    {
+        printf( "publish_echo_latency: failed at message %u\n", ( unsigned int ) i );
+    }
+    else
+    {
+        printSamples( "publish_echo_latency", pSamples, pParams->echoCount );
+        status = ( iotshdDev_MQTTAgentRemoveSubscriptionWithQueue( pInstance,
+                                                                   pUserContext,
+                                                                   BENCHMARK_ECHO_TOPIC,
+                                                                   topicLength,
+                                                                   BENCHMARK_TIMEOUT_MS ) == MQTTSuccess );
+    }
+
+    free( pSamples );
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Drop the connection at the broker and measure the time until the agent
+ * is connected again.
+ */
+static bool benchmarkReconnect( LoopbackBroker_t * pBroker,
+                                const BenchmarkParams_t * pParams )
+{
+    LoopbackBrokerStats_t stats;
+    MbedtlsPkcs11ConnectHistogram_t histogram;
+    uint64_t * pSamples;
+    uint64_t startUs;
+    uint32_t i;
+    bool status;
+
+    pSamples = malloc( sizeof( uint64_t ) * ( pParams->reconnectCount + 1U ) );
+    status = ( pSamples != NULL );
+
+    Mbedtls_Pkcs11_ResetConnectHistogram();
+
+    for( i = 0; ( i < pParams->reconnectCount ) && ( status == true ); i++ )
+    {
+        LoopbackBroker_GetStats( pBroker, &stats );
+        startUs = getTimeUs();
+        LoopbackBroker_DropClients( pBroker );
+        status = LoopbackBroker_WaitForConnects( pBroker, stats.connects + 1U, BENCHMARK_TIMEOUT_MS );
+        pSamples[ i ] = getTimeUs() - startUs;
+    }
+
+    if( status == false )
+    {
+        printf( "reconnect_time: failed at reconnection %u\n", ( unsigned int ) i );
+    }
+    else
+    {
+        printSamples( "reconnect_time", pSamples, pParams->reconnectCount );
+        Mbedtls_Pkcs11_GetConnectHistogram( &histogram );
+        printf( "reconnect_tls: %u connects, %u resumed, %u failed\n",
+                ( unsigned int ) histogram.connects,
+                ( unsigned int ) histogram.resumptions,
+                ( unsigned int ) histogram.failures );
+    }
+
+    free( pSamples );
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Receive exactly a number of bytes with the transport.
+ *
+ * @param[in] pNetworkContext Connection to receive from.
+ * @param[out] pBuffer Buffer of the bytes, or NULL to discard them.
+ * @param[in] length Number of bytes to receive.
+ */
+static bool transportRecvAll( NetworkContext_t * pNetworkContext,
+                              uint8_t * pBuffer,
+                              size_t length )
+{
+    uint8_t discardBuffer[ 1024 ];
+    uint64_t deadlineUs = getTimeUs() + ( ( uint64_t ) BENCHMARK_TIMEOUT_MS * 1000U );
+    size_t received = 0U;
+    size_t chunkLength;
+    int32_t recvStatus = 0;
+
+    while( ( received < length ) && ( recvStatus >= 0 ) && ( getTimeUs() < deadlineUs ) )
+    {
+        if( pBuffer != NULL )
+        {
+            recvStatus = Mbedtls_Pkcs11_Recv( pNetworkContext, &( pBuffer[ received ] ), length - received );
+        }
+        else
+        {
+            chunkLength = length - received;
+            chunkLength = ( chunkLength < sizeof( discardBuffer ) ) ? chunkLength : sizeof( discardBuffer );
+            recvStatus = Mbedtls_Pkcs11_Recv( pNetworkContext, discardBuffer, chunkLength );
+        }
+
+        if( recvStatus > 0 )
+        {
+            received += ( size_t ) recvStatus;
+        }
+    }
+
+    return ( received == length );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Connect with the transport only and open an MQTT session subscribed
+ * to #BENCHMARK_TRANSPORT_TOPIC with QoS 0.
+ */
+static bool transportConnect( NetworkContext_t * pNetworkContext,
+                              uint16_t port,
+                              CK_SESSION_HANDLE p11Session )
+{
+    MbedtlsPkcs11Credentials_t credentials;
+    MQTTConnectInfo_t connectInfo;
+    MQTTSubscribeInfo_t subscription;
+    MQTTFixedBuffer_t fixedBuffer;
+    size_t remainingLength;
+    size_t packetSize;
+    bool status;
+
+    memset( &credentials, 0, sizeof( credentials ) );
+    credentials.pRootCaPath = BENCHMARK_CA_CERT_PATH;
+    credentials.pClientCertLabel = pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS;
+    credentials.pPrivateKeyLabel = pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS;
+    credentials.p11Session = p11Session;
+
+    fixedBuffer.pBuffer = packetBuffer;
+    fixedBuffer.size = sizeof( packetBuffer );
+
+    status = ( Mbedtls_Pkcs11_Connect( pNetworkContext,
+                                       BENCHMARK_ENDPOINT,
+                                       port,
+                                       &credentials,
+                                       BENCHMARK_RECV_TIMEOUT_MS ) == MBEDTLS_PKCS11_SUCCESS );
+
+    if( status == true )
+    {
+        memset( &connectInfo, 0, sizeof( connectInfo ) );
+        connectInfo.cleanSession = true;
+        connectInfo.pClientIdentifier = BENCHMARK_TRANSPORT_CLIENT_IDENTIFIER;
+        connectInfo.clientIdentifierLength = ( uint16_t ) strlen( BENCHMARK_TRANSPORT_CLIENT_IDENTIFIER );
+
+        status = ( MQTT_GetConnectPacketSize( &connectInfo, NULL, &remainingLength, &packetSize ) == MQTTSuccess ) &&
+                 ( MQTT_SerializeConnect( &connectInfo, NULL, remainingLength, &fixedBuffer ) == MQTTSuccess ) &&
+                 ( Mbedtls_Pkcs11_Send( pNetworkContext, packetBuffer, packetSize ) == ( int32_t ) packetSize ) &&
+                 ( Mbedtls_Pkcs11_Flush( pNetworkContext ) == 0 );
+
+        /* CONNACK: fixed header, flags and return code, which is zero. */
+        status = status && transportRecvAll( pNetworkContext, packetBuffer, 4U ) && ( packetBuffer[ 3 ] == 0U );
+
+        if( status == false )
+        {
+            Mbedtls_Pkcs11_Disconnect( pNetworkContext );
+        }
+    }
+
+    if( status == true )
+    {
+        memset( &subscription, 0, sizeof( subscription ) );
+        subscription.qos = MQTTQoS0;
+        subscription.pTopicFilter = BENCHMARK_TRANSPORT_TOPIC;
+        subscription.topicFilterLength = ( uint16_t ) strlen( BENCHMARK_TRANSPORT_TOPIC );
+
+        status = ( MQTT_GetSubscribePacketSize( &subscription, 1U, &remainingLength, &packetSize ) == MQTTSuccess ) &&
+                 ( MQTT_SerializeSubscribe( &subscription, 1U, 1U, remainingLength, &fixedBuffer ) == MQTTSuccess ) &&
+                 ( Mbedtls_Pkcs11_Send( pNetworkContext, packetBuffer, packetSize ) == ( int32_t ) packetSize ) &&
+                 ( Mbedtls_Pkcs11_Flush( pNetworkContext ) == 0 );
+
+        /* SUBACK: fixed header, packet identifier and the granted QoS. */
+        status = status && transportRecvAll( pNetworkContext, packetBuffer, 5U ) && ( packetBuffer[ 4 ] == 0U );
+
+        if( status == false )
+        {
+            Mbedtls_Pkcs11_Disconnect( pNetworkContext );
+        }
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Close an MQTT session opened by #transportConnect.
+ */
+static void transportDisconnect( NetworkContext_t * pNetworkContext )
+{
+    MQTTFixedBuffer_t fixedBuffer;
+    size_t packetSize;
+
+    fixedBuffer.pBuffer = packetBuffer;
+    fixedBuffer.size = sizeof( packetBuffer );
+
+    if( ( MQTT_GetDisconnectPacketSize( &packetSize ) == MQTTSuccess ) &&
+        ( MQTT_SerializeDisconnect( &fixedBuffer ) == MQTTSuccess ) )
+    {
+        ( void ) Mbedtls_Pkcs11_Send( pNetworkContext, packetBuffer, packetSize );
+    }
+
+    /* The DISCONNECT is flushed by the disconnect. */
+    Mbedtls_Pkcs11_Disconnect( pNetworkContext );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Measure the TLS record throughput of #Mbedtls_Pkcs11_Send and
+ * #Mbedtls_Pkcs11_Recv, without the MQTT agent. QoS 0 publishes are sent to a
+ * topic the connection is subscribed to, and the broker sends them back. The
+ * negotiated cipher suite is printed with the result, since the throughput
+ * mostly depends on its record encryption.
+ */
+static bool benchmarkTransport( LoopbackBroker_t * pBroker,
+                                CK_SESSION_HANDLE p11Session,
+                                const BenchmarkParams_t * pParams )
+{
+    MbedtlsPkcs11Context_t tlsContext;
+    NetworkContext_t networkContext;
+    MQTTPublishInfo_t publishInfo;
+    MQTTFixedBuffer_t fixedBuffer;
+    size_t remainingLength;
+    size_t packetSize = 0U;
+    uint64_t startUs;
+    uint64_t sendStartUs;
+    uint64_t sendUs = 0U;
+    uint64_t elapsedUs = 0U;
+    uint32_t sent = 0U;
+    uint32_t window;
+    uint32_t i;
+    bool status;
+
+    networkContext.pParams = &tlsContext;
+    status = transportConnect( &networkContext, LoopbackBroker_GetPort( pBroker ), p11Session );
+
+    if( status == true )
+    {
+        memset( &publishInfo, 0, sizeof( publishInfo ) );
+        publishInfo.qos = MQTTQoS0;
+        publishInfo.pTopicName = BENCHMARK_TRANSPORT_TOPIC;
+        publishInfo.topicNameLength = ( uint16_t ) strlen( BENCHMARK_TRANSPORT_TOPIC );
+        publishInfo.pPayload = payloadBuffer;
+        publishInfo.payloadLength = pParams->payloadLength;
+
+        fixedBuffer.pBuffer = packetBuffer;
+        fixedBuffer.size = sizeof( packetBuffer );
+
+        /* The deliveries of the broker are the same QoS 0 packet. */
+        status = ( MQTT_GetPublishPacketSize( &publishInfo, &remainingLength, &packetSize ) == MQTTSuccess ) &&
+                 ( MQTT_SerializePublish( &publishInfo, 0U, remainingLength, &fixedBuffer ) == MQTTSuccess );
+
+        startUs = getTimeUs();
+
+        while( ( status == true ) && ( sent < pParams->transportCount ) )
+        {
+            window = pParams->transportCount - sent;
+            window = ( window < BENCHMARK_TRANSPORT_WINDOW ) ? window : BENCHMARK_TRANSPORT_WINDOW;
+
+            for( i = 0; ( i < window ) && ( status == true ); i++ )
+            {
+                sendStartUs = getTimeUs();
+                status = ( Mbedtls_Pkcs11_Send( &networkContext, packetBuffer, packetSize ) == ( int32_t ) packetSize );
+                sendUs += getTimeUs() - sendStartUs;
+            }
+
+            status = status && ( Mbedtls_Pkcs11_Flush( &networkContext ) == 0 );
+            status = status && transportRecvAll( &networkContext, NULL, packetSize * window );
+            sent += window;
+        }
+
+        elapsedUs = getTimeUs() - startUs;
+        printf( "transport_ciphersuite: %s\n", mbedtls_ssl_get_ciphersuite( &( tlsContext.context ) ) );
+        transportDisconnect( &networkContext );
+    }
+
+    if( status == false )
+    {
+        printf( "transport_throughput: failed after %u packets\n", ( unsigned int ) sent );
+    }
+    else
+    {
+        /* Each payload is sent and received once. */
+        printf( "transport_send_kib_per_s: %.1f\n",
+                ( double ) sent * packetSize * 1000000.0 / 1024.0 / ( double ) ( ( sendUs > 0U ) ? sendUs : 1U ) );
+        printf( "transport_echo_kib_per_s: %.1f\n",
+                ( double ) sent * pParams->payloadLength * 1000000.0 / 1024.0 / ( double ) elapsedUs );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Duration of the last connect of a connection, from the TCP connect to
+ * the end of the handshake.
+ */
+static uint64_t connectDurationUs( const NetworkContext_t * pNetworkContext,
+                                   bool * pResumed )
+{
+    MbedtlsPkcs11ConnectTiming_t timing;
+    uint64_t durationUs = 0U;
+    uint32_t phase;
+
+    Mbedtls_Pkcs11_GetConnectTiming( pNetworkContext, &timing );
+
+    for( phase = 0; phase < MBEDTLS_PKCS11_CONNECT_PHASE_COUNT; phase++ )
+    {
+        durationUs += timing.phaseUs[ phase ];
+    }
+
+    *pResumed = timing.resumed;
+
+    return durationUs;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Compare the full and the resumed TLS handshakes. Each round starts a
+ * new broker, whose port and ticket keys are new, so that the first connection
+ * makes a full handshake and the second one can resume it with the session
+ * ticket.
+ */
+static bool benchmarkResumption( const LoopbackBrokerConfig_t * pBrokerConfig,
+                                 CK_SESSION_HANDLE p11Session,
+                                 const BenchmarkParams_t * pParams )
+{
+    MbedtlsPkcs11Context_t tlsContext;
+    NetworkContext_t networkContext;
+    LoopbackBroker_t * pBroker;
+    uint64_t * pFullSamples;
+    uint64_t * pResumedSamples;
+    uint32_t fullCount = 0U;
+    uint32_t resumedCount = 0U;
+    uint64_t durationUs;
+    bool resumed;
+    uint32_t round;
+    uint32_t i;
+    bool status;
+
+    pFullSamples = malloc( sizeof( uint64_t ) * ( pParams->resumeCount + 1U ) );
+    pResumedSamples = malloc( sizeof( uint64_t ) * ( pParams->resumeCount + 1U ) );
+    status = ( pFullSamples != NULL ) && ( pResumedSamples != NULL );
+    networkContext.pParams = &tlsContext;
+
+    for( round = 0; ( round < pParams->resumeCount ) && ( status == true ); round++ )
+    {
+        pBroker = LoopbackBroker_Start( pBrokerConfig );
+        status = ( pBroker != NULL );
+
+        for( i = 0; ( i < 2U ) && ( status == true ); i++ )
+        {
+            status = transportConnect( &networkContext, LoopbackBroker_GetPort( pBroker ), p11Session );
+
+            if( status == true )
+            {
+                durationUs = connectDurationUs( &networkContext, &resumed );
+                transportDisconnect( &networkContext );
+
+                /* A second connection that is not resumed is counted as a
+                 * full handshake. */
+                if( resumed == true )
+                {
+                    pResumedSamples[ resumedCount++ ] = durationUs;
+                }
+                else
+                {
+                    pFullSamples[ fullCount++ ] = durationUs;
+                }
+            }
+        }
+
+        LoopbackBroker_Stop( pBroker );
+    }
+
+    if( status == false )
+    {
+        printf( "resumption: failed at round %u\n", ( unsigned int ) round );
+    }
+    else
+    {
+        printSamples( "connect_full_handshake", pFullSamples, fullCount );
+        printSamples( "connect_resumed_handshake", pResumedSamples, resumedCount );
+        printf( "resumption: %u of %u reconnections resumed\n",
+                ( unsigned int ) resumedCount,
+                ( unsigned int ) pParams->resumeCount );
+    }
+
+    free( pFullSamples );
+    free( pResumedSamples );
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Provision devices with the Fleet Provisioning service of the broker,
+ * and report the durations measured by the demo. Each device connects a new
+ * agent instance with the claim credentials, which the demo switches to the
+ * issued certificate. The devices share the token, so each one replaces the
+ * device credentials of the previous one.
+ */
+static bool benchmarkProvisioning( LoopbackBroker_t * pBroker,
+                                   CK_SESSION_HANDLE p11Session,
+                                   const BenchmarkParams_t * pParams )
+{
+    iotshdDev_MQTTAgentConfig_t agentConfig;
+    iotshdDev_MQTTAgentInstance_t * pInstance;
+    AgentThreadParams_t agentThreadParams;
+    pthread_t agentThreadId;
+    LoopbackBrokerStats_t stats;
+    ProvisioningTiming_t timing;
+    char serialNumber[ BENCHMARK_SERIAL_NUMBER_SIZE ];
+    char templateName[] = PROVISIONING_TEMPLATE_NAME;
+    uint64_t * pConnectSamples;
+    uint64_t * pTotalSamples;
+    uint64_t * pCertificateSamples;
+    uint64_t * pRegisterThingSamples;
+    uint64_t * pSwitchSamples;
+    uint32_t attemptCount = 0U;
+    uint64_t startUs;
+    uint32_t i;
+    bool status;
+
+    pConnectSamples = malloc( sizeof( uint64_t ) * ( pParams->provisionCount + 1U ) );
+    pTotalSamples = malloc( sizeof( uint64_t ) * ( pParams->provisionCount + 1U ) );
+    pCertificateSamples = malloc( sizeof( uint64_t ) * ( pParams->provisionCount + 1U ) );
+    pRegisterThingSamples = malloc( sizeof( uint64_t ) * ( pParams->provisionCount + 1U ) );
+    pSwitchSamples = malloc( sizeof( uint64_t ) * ( pParams->provisionCount + 1U ) );
+    status = ( pConnectSamples != NULL ) && ( pTotalSamples != NULL ) && ( pCertificateSamples != NULL ) &&
+             ( pRegisterThingSamples != NULL ) && ( pSwitchSamples != NULL );
+
+    /* The device certificate, issued by the test CA, stands in for the claim
+     * certificate. */
+    status = status && loadClaimCredentials( p11Session,
+                                             BENCHMARK_DEVICE_CERT_PATH,
+                                             pkcs11configLABEL_CLAIM_CERTIFICATE,
+                                             BENCHMARK_DEVICE_KEY_PATH,
+                                             pkcs11configLABEL_CLAIM_PRIVATE_KEY );
+
+    for( i = 0; ( i < pParams->provisionCount ) && ( status == true ); i++ )
+    {
+        ( void ) snprintf( serialNumber, sizeof( serialNumber ), BENCHMARK_PROVISIONING_SERIAL_PREFIX "%u", ( unsigned int ) i );
+
+        memset( &agentConfig, 0, sizeof( agentConfig ) );
+        agentConfig.pEndpoint = BENCHMARK_ENDPOINT;
+        agentConfig.port = LoopbackBroker_GetPort( pBroker );
+        agentConfig.pRootCaPath = BENCHMARK_CA_CERT_PATH;
+        agentConfig.pClientIdentifier = serialNumber;
+        agentConfig.pClientCertLabel = pkcs11configLABEL_CLAIM_CERTIFICATE;
+        agentConfig.pPrivateKeyLabel = pkcs11configLABEL_CLAIM_PRIVATE_KEY;
+        pInstance = iotshdDev_MQTTAgentCreateInstance( &agentConfig );
+        status = ( pInstance != NULL );
+
+        if( status == true )
+        {
+            agentThreadParams.pInstance = pInstance;
+            agentThreadParams.p11Session = p11Session;
+            LoopbackBroker_GetStats( pBroker, &stats );
+            startUs = getTimeUs();
+            status = ( pthread_create( &agentThreadId, NULL, agentThread, &agentThreadParams ) == 0 );
+
+            if( status == true )
+            {
+                status = LoopbackBroker_WaitForConnects( pBroker, stats.connects + 1U, BENCHMARK_TIMEOUT_MS );
+                pConnectSamples[ i ] = getTimeUs() - startUs;
+
+                status = status && ( ProvisionDevicePKCS11WithFPTimed( pInstance, p11Session, serialNumber, templateName, &timing ) == 0 );
+
+                ( void ) iotshdDev_MQTTAgentStop( pInstance );
+                ( void ) pthread_join( agentThreadId, NULL );
+            }
+
+            iotshdDev_MQTTAgentDeleteInstance( pInstance );
+        }
+
+        if( status == true )
+        {
+            pTotalSamples[ i ] = ( uint64_t ) timing.totalMs * 1000U;
+            pCertificateSamples[ i ] = ( uint64_t ) timing.certificateMs * 1000U;
+            pRegisterThingSamples[ i ] = ( uint64_t ) timing.registerThingMs * 1000U;
+            pSwitchSamples[ i ] = ( uint64_t ) timing.switchCredentialsMs * 1000U;
+            attemptCount += ( uint32_t ) timing.attemptCount;
+        }
+    }
+
+    if( status == false )
+    {
+        printf( "provisioning: failed at device %u\n", ( unsigned int ) i );
+    }
+    else
+    {
+        printSamples( "provisioning_claim_connect", pConnectSamples, pParams->provisionCount );
+        printSamples( "provisioning_total", pTotalSamples, pParams->provisionCount );
+        printSamples( "provisioning_certificate", pCertificateSamples, pParams->provisionCount );
+        printSamples( "provisioning_register_thing", pRegisterThingSamples, pParams->provisionCount );
+        printSamples( "provisioning_switch_credentials", pSwitchSamples, pParams->provisionCount );
+        printf( "provisioning: %u devices in %u attempts\n",
+                ( unsigned int ) pParams->provisionCount,
+                ( unsigned int ) attemptCount );
+    }
+
+    free( pConnectSamples );
+    free( pTotalSamples );
+    free( pCertificateSamples );
+    free( pRegisterThingSamples );
+    free( pSwitchSamples );
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+static void printUsage( const char * pProgram )
+{
+    printf( "Usage: %s [-n publishes] [-s payload bytes] [-e echoes] [-r reconnects]\n"
+            "       [-t transport publishes] [-c resumption rounds] [-v provisionings]\n"
+            "       [-l latency ms] [-p loss percent]\n", pProgram );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool parseParams( int argc,
+                         char ** argv,
+                         BenchmarkParams_t * pParams )
+{
+    int option;
+    bool status = true;
+
+    pParams->publishCount = 1000U;
+    pParams->payloadLength = 64U;
+    pParams->echoCount = 100U;
+    pParams->reconnectCount = 10U;
+    pParams->transportCount = 1000U;
+    pParams->resumeCount = 10U;
+    pParams->provisionCount = 5U;
+    pParams->latencyMs = 0U;
+    pParams->lossPercent = 0U;
+
+    while( ( status == true ) && ( ( option = getopt( argc, argv, "n:s:e:r:t:c:v:l:p:" ) ) != -1 ) )
+    {
+        switch( option )
+        {
+            case 'n':
+                pParams->publishCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 's':
+                pParams->payloadLength = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'e':
+                pParams->echoCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'r':
+                pParams->reconnectCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 't':
+                pParams->transportCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'c':
+                pParams->resumeCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'v':
+                pParams->provisionCount = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'l':
+                pParams->latencyMs = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            case 'p':
+                pParams->lossPercent = ( uint32_t ) strtoul( optarg, NULL, 10 );
+                break;
+
+            default:
+                status = false;
+                break;
+        }
+    }
+
+    /* The payload carries a sequence number. */
+    if( ( pParams->payloadLength < sizeof( uint32_t ) ) ||
+        ( pParams->payloadLength > BENCHMARK_MAX_PAYLOAD_LENGTH ) ||
+        ( pParams->lossPercent > 100U ) )
+    {
+        status = false;
+    }
+
+    if( status == false )
+    {
+        printUsage( argv[ 0 ] );
+    }
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc,
+          char ** argv )
+{
+    BenchmarkParams_t params;
+    LoopbackBrokerConfig_t brokerConfig;
+    LoopbackBroker_t * pBroker = NULL;
+    LoopbackBrokerStats_t brokerStats;
+    LoopbackProvisioning_t * pProvisioning = NULL;
+    iotshdDev_MQTTAgentConfig_t agentConfig;
+    iotshdDev_MQTTAgentInstance_t * pInstance = NULL;
+    iotshdDev_MQTTAgentUserContext_t * pUserContext = NULL;
+    AgentThreadParams_t agentThreadParams;
+    pthread_t agentThreadId;
+    bool agentThreadStarted = false;
+    CK_SESSION_HANDLE p11Session = CK_INVALID_HANDLE;
+    uint64_t startUs;
+    bool status;
+
+    status = parseParams( argc, argv, &params );
+
+    /* Count the TLS memory of the connections. It must precede any MbedTLS
+     * allocation. The agent schedulers keep the account of each instance
+     * across their switches. */
+    Mbedtls_Pkcs11_MemoryInit();
+    iotshdDev_MQTTAgentSchedulerSetSwapFunction( Mbedtls_Pkcs11_MemorySwapContext );
+
+    if( status == true )
+    {
+        status = Mbedtls_Pkcs11_SecureArenaInit( BENCHMARK_SECURE_ARENA_SIZE );
+    }
+
+    if( status == true )
+    {
+        memset( payloadBuffer, 'x', sizeof( payloadBuffer ) );
+        memset( &brokerConfig, 0, sizeof( brokerConfig ) );
+        brokerConfig.pCaCertPath = BENCHMARK_CA_CERT_PATH;
+        brokerConfig.pServerCertPath = BENCHMARK_SERVER_CERT_PATH;
+        brokerConfig.pServerKeyPath = BENCHMARK_SERVER_KEY_PATH;
+        brokerConfig.latencyMs = params.latencyMs;
+        brokerConfig.lossPercent = params.lossPercent;
+
+        /* The broker answers the Fleet Provisioning requests. */
+        pProvisioning = LoopbackProvisioning_Create( BENCHMARK_CA_CERT_PATH, BENCHMARK_CA_KEY_PATH );
+        brokerConfig.publishHook = LoopbackProvisioning_PublishHook;
+        brokerConfig.pPublishHookContext = pProvisioning;
+
+        pBroker = ( pProvisioning != NULL ) ? LoopbackBroker_Start( &brokerConfig ) : NULL;
+        status = ( pBroker != NULL );
+    }
+
+    /* The software token of corePKCS11 keeps the device credentials. */
+    if( status == true )
+    {
+        status = ( xInitializePkcs11Session( &p11Session ) == CKR_OK ) &&
+                 loadClaimCredentials( p11Session,
+                                       BENCHMARK_DEVICE_CERT_PATH,
+                                       pkcs11configLABEL_DEVICE_CERTIFICATE_FOR_TLS,
+                                       BENCHMARK_DEVICE_KEY_PATH,
+                                       pkcs11configLABEL_DEVICE_PRIVATE_KEY_FOR_TLS );
+    }
+
+    if( status == true )
+    {
+        memset( &agentConfig, 0, sizeof( agentConfig ) );
+        agentConfig.pEndpoint = BENCHMARK_ENDPOINT;
+        agentConfig.port = LoopbackBroker_GetPort( pBroker );
+        agentConfig.pRootCaPath = BENCHMARK_CA_CERT_PATH;
+        agentConfig.pClientIdentifier = BENCHMARK_CLIENT_IDENTIFIER;
+        pInstance = iotshdDev_MQTTAgentCreateInstance( &agentConfig );
+        pUserContext = iotshdDev_MQTTAgentCreateUserContext( 10U );
+        status = ( pInstance != NULL ) && ( pUserContext != NULL );
+    }
+
+    if( status == true )
+    {
+        agentThreadParams.pInstance = pInstance;
+        agentThreadParams.p11Session = p11Session;
+        startUs = getTimeUs();
+        agentThreadStarted = ( pthread_create( &agentThreadId, NULL, agentThread, &agentThreadParams ) == 0 );
+        status = agentThreadStarted && LoopbackBroker_WaitForConnects( pBroker, 1U, BENCHMARK_TIMEOUT_MS );
+        printf( "connect_time_ms: %.3f\n", ( double ) ( getTimeUs() - startUs ) / 1000.0 );
+    }
+
+    status = status && benchmarkThroughput( pInstance, &params );
+    status = status && benchmarkSubscribe( pInstance, pUserContext );
+    status = status && benchmarkEcho( pInstance, pUserContext, &params );
+    status = status && benchmarkReconnect( pBroker, &params );
+    status = status && benchmarkTransport( pBroker, p11Session, &params );
+    status = status && benchmarkResumption( &brokerConfig, p11Session, &params );
+    status = status && benchmarkProvisioning( pBroker, p11Session, &params );
+
+    if( pBroker != NULL )
+    {
+        LoopbackBroker_GetStats( pBroker, &brokerStats );
+        printf( "broker: %u connects, %u publishes received, %u delivered, %u records lost\n",
+                ( unsigned int ) brokerStats.connects,
+                ( unsigned int ) brokerStats.publishesReceived,
+                ( unsigned int ) brokerStats.publishesDelivered,
+                ( unsigned int ) brokerStats.recordsLost );
+    }
+
+    if( agentThreadStarted == true )
+    {
+        ( void ) iotshdDev_MQTTAgentStop( pInstance );
+        ( void ) pthread_join( agentThreadId, NULL );
+    }
+
+    if( pUserContext != NULL )
+    {
+        iotshdDev_MQTTAgentDeleteUserContext( pUserContext );
+    }
+
+    if( pInstance != NULL )
+    {
+        iotshdDev_MQTTAgentDeleteInstance( pInstance );
+    }
+
+    if( p11Session != CK_INVALID_HANDLE )
+    {
+        /* Close the signing sessions opened by the transport first. */
+        Mbedtls_Pkcs11_SessionPoolClose();
+        ( void ) pkcs11CloseSession( p11Session );
+    }
+
+    LoopbackBroker_Stop( pBroker );
+    LoopbackProvisioning_Delete( pProvisioning );
+    Mbedtls_Pkcs11_SecureArenaDeinit();
+
+    printf( "benchmark: %s\n", ( status == true ) ? "PASSED" : "FAILED" );
+
+    return ( status == true ) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,630 @@
+/* Standard includes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* Include header that defines log levels. */
+#include "logging_levels.h"
+
+/* Logging configuration for the Fleet Provisioning service. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME     "LoopbackProvisioning"
+#endif
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_WARN
+#endif
+
+#include "logging_stack.h"
+
+#include "loopback_provisioning.h"
+
+/* Fleet Provisioning library include. */
+#include "fleet_provisioning.h"
+
+/* TinyCBOR library for CBOR encoding and decoding operations. */
+#include "cbor.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/bignum.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/ecp.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/x509_csr.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Size of the buffers of the PEM certificates, CSRs and private keys.
+ */
+#define PROVISIONING_PEM_SIZE         ( 2048U )
+
+/**
+ * @brief Size of the buffer of the responses.
+ */
+#define PROVISIONING_RESPONSE_SIZE    ( 4096U )
+
+/**
+ * @brief Size of the buffers of the response topics and of the short strings
+ * of the requests and responses.
+ */
+#define PROVISIONING_STRING_SIZE      ( 256U )
+
+/**
+ * @brief Length of a certificate Id, the hexadecimal SHA-256 of the certificate.
+ */
+#define PROVISIONING_CERTIFICATE_ID_LENGTH    ( 64U )
+
+/**
+ * @brief Subject of the certificates issued by CreateKeysAndCertificate.
+ */
+#define PROVISIONING_KEYS_SUBJECT_NAME    "CN=Loopback Provisioned Device"
+
+/**
+ * @brief Validity of the issued certificates, in the format of MbedTLS.
+ */
+#define PROVISIONING_NOT_BEFORE    "20240101000000"
+#define PROVISIONING_NOT_AFTER     "20491231235959"
+
+/**
+ * @brief Suffixes of the response topics.
+ */
+#define PROVISIONING_ACCEPTED_SUFFIX    "/accepted"
+#define PROVISIONING_REJECTED_SUFFIX    "/rejected"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Fleet Provisioning service. It is only used by the broker thread.
+ */
+struct LoopbackProvisioning
+{
+    mbedtls_x509_crt caCert;         /**< @brief Certificate of the issuing CA. */
+    mbedtls_pk_context caKey;        /**< @brief Private key of the issuing CA. */
+    mbedtls_entropy_context entropy; /**< @brief Entropy of #drbg. */
+    mbedtls_ctr_drbg_context drbg;   /**< @brief Random generator of the signatures and keys. */
+    uint32_t certificateCount;       /**< @brief Number of certificates issued, the serial of the last one. */
+
+    char csr[ PROVISIONING_PEM_SIZE ];         /**< @brief CSR of the request. */
+    char certificate[ PROVISIONING_PEM_SIZE ]; /**< @brief Issued certificate. */
+    char privateKey[ PROVISIONING_PEM_SIZE ];  /**< @brief Generated private key. */
+    uint8_t response[ PROVISIONING_RESPONSE_SIZE ];
+};
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Issue a certificate signed by the CA.
+ *
+ * @param[in] pProvisioning Service.
+ * @param[in] pSubjectKey Public key of the certificate.
+ * @param[in] pSubjectName Subject of the certificate.
+ * @param[out] pCertificateId Hexadecimal SHA-256 of the DER certificate,
+ * null terminated, as the certificate Ids of AWS IoT.
+ *
+ * @return true if the certificate is written to pProvisioning->certificate.
+ */
+static bool issueCertificate( LoopbackProvisioning_t * pProvisioning,
+                              mbedtls_pk_context * pSubjectKey,
+                              const char * pSubjectName,
+                              char * pCertificateId );
+
+/**
+ * @brief Handle a CreateCertificateFromCsr request.
+ *
+ * @return The length of the response in pProvisioning->response; zero if the
+ * request is rejected.
+ */
+static size_t createCertificateFromCsr( LoopbackProvisioning_t * pProvisioning,
+                                        const uint8_t * pPayload,
+                                        size_t payloadLength );
+
+/**
+ * @brief Handle a CreateKeysAndCertificate request.
+ *
+ * @return The length of the response in pProvisioning->response; zero on
+ * failure.
+ */
+static size_t createKeysAndCertificate( LoopbackProvisioning_t * pProvisioning );
+
+/**
+ * @brief Handle a RegisterThing request.
+ *
+ * @return The length of the response in pProvisioning->response; zero if the
+ * request is rejected.
+ */
+static size_t registerThing( LoopbackProvisioning_t * pProvisioning,
+                             const uint8_t * pPayload,
+                             size_t payloadLength );
+
+/**
+ * @brief Encode the response of a certificate request.
+ *
+ * @param[in] pProvisioning Service holding the certificate.
+ * @param[in] pCertificateId Certificate Id.
+ * @param[in] includePrivateKey Add the private key in pProvisioning->privateKey.
+ *
+ * @return The length of the response; zero on failure.
+ */
+static size_t encodeCertificateResponse( LoopbackProvisioning_t * pProvisioning,
+                                         const char * pCertificateId,
+                                         bool includePrivateKey );
+
+/**
+ * @brief Encode the error response of a rejected request.
+ *
+ * @return The length of the response; zero on failure.
+ */
+static size_t encodeRejectedResponse( LoopbackProvisioning_t * pProvisioning,
+                                      const char * pErrorMessage );
+
+/**
+ * @brief Copy a text string of a CBOR map.
+ *
+ * @param[in] pMap Map.
+ * @param[in] pKey Key of the string.
+ * @param[out] pBuffer Buffer receiving the null terminated string.
+ * @param[in] bufferSize Size of pBuffer.
+ *
+ * @return true if the key is found with a text string that fits.
+ */
+static bool copyMapString( const CborValue * pMap,
+                           const char * pKey,
+                           char * pBuffer,
+                           size_t bufferSize );
+
+/*-----------------------------------------------------------*/
+
+static bool issueCertificate( LoopbackProvisioning_t * pProvisioning,
+                              mbedtls_pk_context * pSubjectKey,
+                              const char * pSubjectName,
+                              char * pCertificateId )
+{
+    mbedtls_x509write_cert writer;
+    mbedtls_x509_crt issued;
+    mbedtls_mpi serial;
+    char issuerName[ PROVISIONING_STRING_SIZE ];
+    unsigned char hash[ 32 ];
+    int mbedtlsError;
+    size_t i;
+
+    mbedtls_x509write_crt_init( &writer );
+    mbedtls_x509_crt_init( &issued );
+    mbedtls_mpi_init( &serial );
+
+    pProvisioning->certificateCount++;
+
+    mbedtlsError = mbedtls_x509_dn_gets( issuerName, sizeof( issuerName ), &( pProvisioning->caCert.subject ) );
+
+    if( mbedtlsError >= 0 )
+    {
+        mbedtlsError = mbedtls_mpi_lset( &serial, ( mbedtls_mpi_sint ) pProvisioning->certificateCount );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtls_x509write_crt_set_version( &writer, MBEDTLS_X509_CRT_VERSION_3 );
+        mbedtls_x509write_crt_set_md_alg( &writer, MBEDTLS_MD_SHA256 );
+        mbedtls_x509write_crt_set_subject_key( &writer, pSubjectKey );
+        mbedtls_x509write_crt_set_issuer_key( &writer, &( pProvisioning->caKey ) );
+        mbedtlsError = mbedtls_x509write_crt_set_serial( &writer, &serial );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_set_subject_name( &writer, pSubjectName );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_set_issuer_name( &writer, issuerName );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_set_validity( &writer, PROVISIONING_NOT_BEFORE, PROVISIONING_NOT_AFTER );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_set_basic_constraints( &writer, 0, -1 );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_set_key_usage( &writer, MBEDTLS_X509_KU_DIGITAL_SIGNATURE );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509write_crt_pem( &writer,
+                                                  ( unsigned char * ) pProvisioning->certificate,
+                                                  sizeof( pProvisioning->certificate ),
+                                                  mbedtls_ctr_drbg_random,
+                                                  &( pProvisioning->drbg ) );
+    }
+
+    /* The Id is computed on the DER certificate, which is parsed back. */
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_x509_crt_parse( &issued,
+                                               ( const unsigned char * ) pProvisioning->certificate,
+                                               strlen( pProvisioning->certificate ) + 1U );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_sha256_ret( issued.raw.p, issued.raw.len, hash, 0 );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        for( i = 0; i < sizeof( hash ); i++ )
+        {
+            ( void ) snprintf( &( pCertificateId[ i * 2U ] ), 3U, "%02x", ( unsigned int ) hash[ i ] );
+        }
+    }
+    else
+    {
+        LogError( ( "Failed to issue a certificate with error -0x%04x.", ( unsigned int ) -mbedtlsError ) );
+    }
+
+    mbedtls_mpi_free( &serial );
+    mbedtls_x509_crt_free( &issued );
+    mbedtls_x509write_crt_free( &writer );
+
+    return( mbedtlsError == 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t createCertificateFromCsr( LoopbackProvisioning_t * pProvisioning,
+                                        const uint8_t * pPayload,
+                                        size_t payloadLength )
+{
+    mbedtls_x509_csr csr;
+    CborParser parser;
+    CborValue map;
+    char subjectName[ PROVISIONING_STRING_SIZE ];
+    char certificateId[ PROVISIONING_CERTIFICATE_ID_LENGTH + 1U ];
+    size_t responseLength = 0U;
+    bool status;
+
+    mbedtls_x509_csr_init( &csr );
+
+    status = ( cbor_parser_init( pPayload, payloadLength, 0, &parser, &map ) == CborNoError ) &&
+             ( cbor_value_is_map( &map ) == true ) &&
+             ( copyMapString( &map, "certificateSigningRequest", pProvisioning->csr, sizeof( pProvisioning->csr ) ) == true );
+
+    /* The length of a PEM CSR includes its terminator. */
+    status = status && ( mbedtls_x509_csr_parse( &csr,
+                                                 ( const unsigned char * ) pProvisioning->csr,
+                                                 strlen( pProvisioning->csr ) + 1U ) == 0 );
+    status = status && ( mbedtls_x509_dn_gets( subjectName, sizeof( subjectName ), &( csr.subject ) ) >= 0 );
+
+    if( status == false )
+    {
+        LogWarn( ( "Rejected a CreateCertificateFromCsr request without a valid CSR." ) );
+    }
+    else if( issueCertificate( pProvisioning, &( csr.pk ), subjectName, certificateId ) == true )
+    {
+        responseLength = encodeCertificateResponse( pProvisioning, certificateId, false );
+    }
+    else
+    {
+        /* Empty else marker. */
+    }
+
+    mbedtls_x509_csr_free( &csr );
+
+    return responseLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t createKeysAndCertificate( LoopbackProvisioning_t * pProvisioning )
+{
+    mbedtls_pk_context key;
+    char certificateId[ PROVISIONING_CERTIFICATE_ID_LENGTH + 1U ];
+    size_t responseLength = 0U;
+    int mbedtlsError;
+
+    mbedtls_pk_init( &key );
+
+    mbedtlsError = mbedtls_pk_setup( &key, mbedtls_pk_info_from_type( MBEDTLS_PK_ECKEY ) );
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_ecp_gen_key( MBEDTLS_ECP_DP_SECP256R1,
+                                            mbedtls_pk_ec( key ),
+                                            mbedtls_ctr_drbg_random,
+                                            &( pProvisioning->drbg ) );
+    }
+
+    if( mbedtlsError == 0 )
+    {
+        mbedtlsError = mbedtls_pk_write_key_pem( &key,
+                                                 ( unsigned char * ) pProvisioning->privateKey,
+                                                 sizeof( pProvisioning->privateKey ) );
+    }
+
+    if( mbedtlsError != 0 )
+    {
+        LogError( ( "Failed to generate a key with error -0x%04x.", ( unsigned int ) -mbedtlsError ) );
+    }
+    else if( issueCertificate( pProvisioning, &key, PROVISIONING_KEYS_SUBJECT_NAME, certificateId ) == true )
+    {
+        responseLength = encodeCertificateResponse( pProvisioning, certificateId, true );
+    }
+    else
+    {
+        /* Empty else marker. */
+    }
+
+    mbedtls_platform_zeroize( pProvisioning->privateKey, sizeof( pProvisioning->privateKey ) );
+    mbedtls_pk_free( &key );
+
+    return responseLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t registerThing( LoopbackProvisioning_t * pProvisioning,
+                             const uint8_t * pPayload,
+                             size_t payloadLength )
+{
+    CborParser parser;
+    CborValue map;
+    CborValue parameters;
+    CborEncoder encoder, mapEncoder, configurationEncoder;
+    char token[ PROVISIONING_STRING_SIZE ];
+    char serialNumber[ PROVISIONING_STRING_SIZE ];
+    size_t responseLength = 0U;
+    bool status;
+
+    status = ( cbor_parser_init( pPayload, payloadLength, 0, &parser, &map ) == CborNoError ) &&
+             ( cbor_value_is_map( &map ) == true ) &&
+             ( copyMapString( &map, "certificateOwnershipToken", token, sizeof( token ) ) == true ) &&
+             ( cbor_value_map_find_value( &map, "parameters", &parameters ) == CborNoError ) &&
+             ( cbor_value_is_map( &parameters ) == true ) &&
+             ( copyMapString( &parameters, "SerialNumber", serialNumber, sizeof( serialNumber ) ) == true );
+
+    if( status == false )
+    {
+        LogWarn( ( "Rejected a RegisterThing request without an ownership token and a serial number." ) );
+    }
+    else
+    {
+        /* The Thing is named after the serial number of the device. */
+        cbor_encoder_init( &encoder, pProvisioning->response, sizeof( pProvisioning->response ), 0 );
+        status = ( cbor_encoder_create_map( &encoder, &mapEncoder, 2 ) == CborNoError ) &&
+                 ( cbor_encode_text_stringz( &mapEncoder, "deviceConfiguration" ) == CborNoError ) &&
+                 ( cbor_encoder_create_map( &mapEncoder, &configurationEncoder, 0 ) == CborNoError ) &&
+                 ( cbor_encoder_close_container( &mapEncoder, &configurationEncoder ) == CborNoError ) &&
+                 ( cbor_encode_text_stringz( &mapEncoder, "thingName" ) == CborNoError ) &&
+                 ( cbor_encode_text_stringz( &mapEncoder, serialNumber ) == CborNoError ) &&
+                 ( cbor_encoder_close_container( &encoder, &mapEncoder ) == CborNoError );
+
+        if( status == true )
+        {
+            responseLength = cbor_encoder_get_buffer_size( &encoder, pProvisioning->response );
+        }
+    }
+
+    return responseLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t encodeCertificateResponse( LoopbackProvisioning_t * pProvisioning,
+                                         const char * pCertificateId,
+                                         bool includePrivateKey )
+{
+    CborEncoder encoder, mapEncoder;
+    char token[ PROVISIONING_STRING_SIZE ];
+    size_t responseLength = 0U;
+    bool status;
+
+    ( void ) snprintf( token, sizeof( token ), "loopback-token-%u", ( unsigned int ) pProvisioning->certificateCount );
+
+    cbor_encoder_init( &encoder, pProvisioning->response, sizeof( pProvisioning->response ), 0 );
+    status = ( cbor_encoder_create_map( &encoder, &mapEncoder, ( includePrivateKey == true ) ? 4 : 3 ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, "certificateId" ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, pCertificateId ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, "certificatePem" ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, pProvisioning->certificate ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, "certificateOwnershipToken" ) == CborNoError ) &&
+             ( cbor_encode_text_stringz( &mapEncoder, token ) == CborNoError );
+
+    if( includePrivateKey == true )
+    {
+        status = status &&
+                 ( cbor_encode_text_stringz( &mapEncoder, "privateKey" ) == CborNoError ) &&
+                 ( cbor_encode_text_stringz( &mapEncoder, pProvisioning->privateKey ) == CborNoError );
+    }
+
+    status = status && ( cbor_encoder_close_container( &encoder, &mapEncoder ) == CborNoError );
+
+    if( status == true )
+    {
+        responseLength = cbor_encoder_get_buffer_size( &encoder, pProvisioning->response );
+    }
+    else
+    {
+        LogError( ( "Cannot fit the certificate response into the response buffer." ) );
+    }
+
+    return responseLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t encodeRejectedResponse( LoopbackProvisioning_t * pProvisioning,
+                                      const char * pErrorMessage )
+{
+    CborEncoder encoder, mapEncoder;
+    size_t responseLength = 0U;
+
+    cbor_encoder_init( &encoder, pProvisioning->response, sizeof( pProvisioning->response ), 0 );
+
+    if( ( cbor_encoder_create_map( &encoder, &mapEncoder, 3 ) == CborNoError ) &&
+        ( cbor_encode_text_stringz( &mapEncoder, "statusCode" ) == CborNoError ) &&
+        ( cbor_encode_int( &mapEncoder, 400 ) == CborNoError ) &&
+        ( cbor_encode_text_stringz( &mapEncoder, "errorCode" ) == CborNoError ) &&
+        ( cbor_encode_text_stringz( &mapEncoder, "InvalidPayload" ) == CborNoError ) &&
+        ( cbor_encode_text_stringz( &mapEncoder, "errorMessage" ) == CborNoError ) &&
+        ( cbor_encode_text_stringz( &mapEncoder, pErrorMessage ) == CborNoError ) &&
+        ( cbor_encoder_close_container( &encoder, &mapEncoder ) == CborNoError ) )
+    {
+        responseLength = cbor_encoder_get_buffer_size( &encoder, pProvisioning->response );
+    }
+
+    return responseLength;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool copyMapString( const CborValue * pMap,
+                           const char * pKey,
+                           char * pBuffer,
+                           size_t bufferSize )
+{
+    CborValue value;
+    size_t length = bufferSize;
+
+    /* The copy is null terminated, and fails if the string does not fit. */
+    return( ( cbor_value_map_find_value( pMap, pKey, &value ) == CborNoError ) &&
+            ( cbor_value_is_text_string( &value ) == true ) &&
+            ( cbor_value_copy_text_string( &value, pBuffer, &length, NULL ) == CborNoError ) );
+}
+
+/*-----------------------------------------------------------*/
+
+LoopbackProvisioning_t * LoopbackProvisioning_Create( const char * pCaCertPath,
+                                                      const char * pCaKeyPath )
+{
+    LoopbackProvisioning_t * pProvisioning;
+    int mbedtlsError;
+
+    pProvisioning = calloc( 1U, sizeof( LoopbackProvisioning_t ) );
+
+    if( pProvisioning == NULL )
+    {
+        LogError( ( "Failed to allocate the Fleet Provisioning service." ) );
+    }
+    else
+    {
+        mbedtls_x509_crt_init( &( pProvisioning->caCert ) );
+        mbedtls_pk_init( &( pProvisioning->caKey ) );
+        mbedtls_entropy_init( &( pProvisioning->entropy ) );
+        mbedtls_ctr_drbg_init( &( pProvisioning->drbg ) );
+
+        mbedtlsError = mbedtls_ctr_drbg_seed( &( pProvisioning->drbg ), mbedtls_entropy_func, &( pProvisioning->entropy ), NULL, 0U );
+
+        if( mbedtlsError == 0 )
+        {
+            mbedtlsError = mbedtls_x509_crt_parse_file( &( pProvisioning->caCert ), pCaCertPath );
+        }
+
+        if( mbedtlsError == 0 )
+        {
+            mbedtlsError = mbedtls_pk_parse_keyfile( &( pProvisioning->caKey ), pCaKeyPath, NULL );
+        }
+
+        if( mbedtlsError != 0 )
+        {
+            LogError( ( "Failed to load the CA of the Fleet Provisioning service with error -0x%04x.",
+                        ( unsigned int ) -mbedtlsError ) );
+            LoopbackProvisioning_Delete( pProvisioning );
+            pProvisioning = NULL;
+        }
+    }
+
+    return pProvisioning;
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackProvisioning_Delete( LoopbackProvisioning_t * pProvisioning )
+{
+    if( pProvisioning != NULL )
+    {
+        mbedtls_ctr_drbg_free( &( pProvisioning->drbg ) );
+        mbedtls_entropy_free( &( pProvisioning->entropy ) );
+        mbedtls_pk_free( &( pProvisioning->caKey ) );
+        mbedtls_x509_crt_free( &( pProvisioning->caCert ) );
+        free( pProvisioning );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void LoopbackProvisioning_PublishHook( void * pHookContext,
+                                       LoopbackBroker_t * pBroker,
+                                       const char * pTopic,
+                                       size_t topicLength,
+                                       const uint8_t * pPayload,
+                                       size_t payloadLength )
+{
+    LoopbackProvisioning_t * pProvisioning = ( LoopbackProvisioning_t * ) pHookContext;
+    FleetProvisioningTopic_t api;
+    char responseTopic[ PROVISIONING_STRING_SIZE ];
+    const char * pErrorMessage = NULL;
+    size_t responseLength = 0U;
+    bool request = true;
+    int topicWritten;
+
+    if( ( topicLength > UINT16_MAX ) ||
+        ( FleetProvisioning_MatchTopic( pTopic, ( uint16_t ) topicLength, &api ) != FleetProvisioningSuccess ) )
+    {
+        request = false;
+    }
+    else if( api == FleetProvCborCreateCertFromCsrPublish )
+    {
+        responseLength = createCertificateFromCsr( pProvisioning, pPayload, payloadLength );
+        pErrorMessage = "Invalid certificate signing request.";
+    }
+    else if( api == FleetProvCborCreateKeysAndCertPublish )
+    {
+        responseLength = createKeysAndCertificate( pProvisioning );
+        pErrorMessage = "Failed to create the keys and the certificate.";
+    }
+    else if( api == FleetProvCborRegisterThingPublish )
+    {
+        responseLength = registerThing( pProvisioning, pPayload, payloadLength );
+        pErrorMessage = "Invalid RegisterThing request.";
+    }
+    else
+    {
+        /* The responses and the JSON requests are not served. */
+        request = false;
+    }
+
+    if( request == true )
+    {
+        if( responseLength == 0U )
+        {
+            responseLength = encodeRejectedResponse( pProvisioning, pErrorMessage );
+            topicWritten = snprintf( responseTopic, sizeof( responseTopic ), "%.*s" PROVISIONING_REJECTED_SUFFIX,
+                                     ( int ) topicLength, pTopic );
+        }
+        else
+        {
+            topicWritten = snprintf( responseTopic, sizeof( responseTopic ), "%.*s" PROVISIONING_ACCEPTED_SUFFIX,
+                                     ( int ) topicLength, pTopic );
+        }
+
+        if( ( topicWritten > 0 ) && ( ( size_t ) topicWritten < sizeof( responseTopic ) ) && ( responseLength > 0U ) )
+        {
+            LoopbackBroker_Publish( pBroker, responseTopic, ( size_t ) topicWritten, pProvisioning->response, responseLength );
+        }
+        else
+        {
+            LogError( ( "Failed to respond on %.*s.", ( int ) topicLength, pTopic ) );
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef LOOPBACK_PROVISIONING_H_
+#define LOOPBACK_PROVISIONING_H_
+
+/**
+ * @file loopback_provisioning.h
+ *
+ * @brief Fleet Provisioning service of the loopback broker. It answers the CBOR
+ * requests of the Fleet Provisioning workflow, so that the provisioning of a
+ * device can be measured offline:
+ * - CreateCertificateFromCsr: the CSR is signed by the test CA.
+ * - CreateKeysAndCertificate: a P-256 key is generated and its certificate is
+ *   signed by the test CA.
+ * - RegisterThing: the Thing name is the SerialNumber parameter.
+ *
+ * The certificates are signed by the CA of the client certificates of the
+ * broker, so the device can connect with them once provisioned. The response
+ * is published on the accepted topic of the request, or on its rejected topic
+ * if the request cannot be parsed.
+ */
+
+/* Standard includes. */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "loopback_broker.h"
+
+/**
+ * @brief Fleet Provisioning service handle.
+ */
+typedef struct LoopbackProvisioning LoopbackProvisioning_t;
+
+/**
+ * @brief Create a Fleet Provisioning service.
+ *
+ * @param[in] pCaCertPath Certificate of the CA issuing the device certificates.
+ * @param[in] pCaKeyPath Private key of the CA.
+ *
+ * @return The service on success; NULL if the CA cannot be loaded.
+ */
+LoopbackProvisioning_t * LoopbackProvisioning_Create( const char * pCaCertPath,
+                                                      const char * pCaKeyPath );
+
+/**
+ * @brief Free a Fleet Provisioning service. The broker using it must be stopped
+ * first.
+ *
+ * @param[in] pProvisioning Service to free, or NULL.
+ */
+void LoopbackProvisioning_Delete( LoopbackProvisioning_t * pProvisioning );
+
+/**
+ * @brief Publish hook of the broker answering the Fleet Provisioning requests.
+ * It is set in #LoopbackBrokerConfig_t with the service as the context. The
+ * other messages are ignored.
+ */
+void LoopbackProvisioning_PublishHook( void * pHookContext,
+                                       LoopbackBroker_t * pBroker,
+                                       const char * pTopic,
+                                       size_t topicLength,
+                                       const uint8_t * pPayload,
+                                       size_t payloadLength );
+
+#endif /* ifndef LOOPBACK_PROVISIONING_H_ */
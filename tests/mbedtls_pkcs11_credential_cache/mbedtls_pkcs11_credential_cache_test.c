@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mbedtls_pkcs11_credential_cache.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Slot of the sessions of the fake PKCS #11 module.
+ */
+#define CREDENTIAL_CACHE_TEST_SLOT           ( 3U )
+
+/**
+ * @brief Labels of the credentials.
+ */
+#define CREDENTIAL_CACHE_TEST_CERT_LABEL     "Device Cert"
+#define CREDENTIAL_CACHE_TEST_KEY_LABEL      "Device Priv TLS Key"
+
+/**
+ * @brief Handle of the first object found by the fake module. Each search
+ * finds the object under a new handle, so that the handles cached by
+ * different searches can be told apart.
+ */
+#define CREDENTIAL_CACHE_TEST_FIRST_HANDLE   ( 100U )
+
+/**
+ * @brief Time a thread waits for the other one at the rendezvous of the
+ * concurrent tests, in seconds.
+ */
+#define CREDENTIAL_CACHE_TEST_WAIT_S         ( 1 )
+
+/**
+ * @brief Self-signed P-256 certificate returned as the value of the
+ * certificate object and written to the root CA file.
+ */
+static const char testCertificatePem[] =
+    "-----BEGIN CERTIFICATE-----\n"
+    "MIIBmDCCAT2gAwIBAgIUL0adJIBj/8Qx/LDUBHNm+ND3y+MwCgYIKoZIzj0EAwIw\n"
+    "IDEeMBwGA1UEAwwVY3JlZGVudGlhbC1jYWNoZS10ZXN0MCAXDTI2MTAxOTEwMTQ0\n"
+    "M1oYDzIxMjYwOTI1MTAxNDQzWjAgMR4wHAYDVQQDDBVjcmVkZW50aWFsLWNhY2hl\n"
+    "LXRlc3QwWTATBgcqhkjOPQIBBggqhkjOPQMBBwNCAARQPv29XRs45FnqVt6sw/sA\n"
+    "Okhx1dTlJ6FgtZDC8H/OlHHq9ge5TKRlLQ0+BgBTL7OOg0pFtjQRJyZgCcuP3v3v\n"
+    "o1MwUTAdBgNVHQ4EFgQUi1o0GYR2JBQDbW60Alq8BZMICKswHwYDVR0jBBgwFoAU\n"
+    "i1o0GYR2JBQDbW60Alq8BZMICKswDwYDVR0TAQH/BAUwAwEB/zAKBggqhkjOPQQD\n"
+    "AgNJADBGAiEAy9bJOO9BBDdN43gxU5VMPlzdPpgVAvihJtk2vBovvucCIQC4VOW4\n"
+    "4T2LRit1/JzL+RNNkc+ALYIGcQh5pW4DuDJ6+w==\n"
+    "-----END CERTIFICATE-----\n";
+
+/*-----------------------------------------------------------*/
+
+static CK_FUNCTION_LIST testFunctionList;
+
+/**
+ * @brief Number of token searches and certificate reads of the fake module.
+ */
+static uint32_t findObjectCalls = 0U;
+static uint32_t readCertificateCalls = 0U;
+
+/**
+ * @brief Handle given to the next object found.
+ */
+static CK_OBJECT_HANDLE nextHandle = CREDENTIAL_CACHE_TEST_FIRST_HANDLE;
+
+/**
+ * @brief Make the searches, or the certificate reads, wait for each other so
+ * that two threads miss the cache together.
+ */
+static bool rendezvousSearches = false;
+static bool rendezvousReads = false;
+
+/**
+ * @brief Invalidate the certificate label while its value is read.
+ */
+static bool invalidateDuringRead = false;
+
+/**
+ * @brief Threads arrived at the rendezvous.
+ */
+static uint32_t rendezvousCount = 0U;
+static pthread_mutex_t rendezvousMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rendezvousCond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Path of the root CA file.
+ */
+static char rootCaPath[ 64 ];
+
+/**
+ * @brief Results of the threads of the concurrent tests.
+ */
+typedef struct LookupThreadResult
+{
+    CK_RV result;
+    CK_OBJECT_HANDLE handle;
+    CK_KEY_TYPE keyType;
+    mbedtls_x509_crt * pCertificate;
+} LookupThreadResult_t;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Wait until a second thread arrives, or until the wait times out.
+ */
+static void rendezvous( void )
+{
+    struct timespec deadline;
+
+    ( void ) clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += CREDENTIAL_CACHE_TEST_WAIT_S;
+
+    pthread_mutex_lock( &rendezvousMutex );
+    rendezvousCount++;
+    ( void ) pthread_cond_broadcast( &rendezvousCond );
+
+    while( rendezvousCount < 2U )
+    {
+        if( pthread_cond_timedwait( &rendezvousCond, &rendezvousMutex, &deadline ) != 0 )
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock( &rendezvousMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Fake object search. Each search finds the object under a new handle.
+ */
+CK_RV xFindObjectWithLabelAndClass( CK_SESSION_HANDLE xSession,
+                                    char * pcLabelName,
+                                    CK_ULONG ulLabelNameLen,
+                                    CK_OBJECT_CLASS xClass,
+                                    CK_OBJECT_HANDLE_PTR pxHandle )
+{
+    ( void ) xSession;
+    ( void ) pcLabelName;
+    ( void ) ulLabelNameLen;
+    ( void ) xClass;
+
+    pthread_mutex_lock( &rendezvousMutex );
+    findObjectCalls++;
+    *pxHandle = nextHandle;
+    nextHandle++;
+    pthread_mutex_unlock( &rendezvousMutex );
+
+    if( rendezvousSearches == true )
+    {
+        rendezvous();
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_GetSessionInfo. All the sessions are on one slot.
+ */
+static CK_RV fakeGetSessionInfo( CK_SESSION_HANDLE hSession,
+                                 CK_SESSION_INFO_PTR pInfo )
+{
+    ( void ) hSession;
+
+    memset( pInfo, 0, sizeof( CK_SESSION_INFO ) );
+    pInfo->slotID = CREDENTIAL_CACHE_TEST_SLOT;
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_GetAttributeValue. The private keys are EC keys, and the
+ * certificates hold #testCertificatePem.
+ */
+static CK_RV fakeGetAttributeValue( CK_SESSION_HANDLE hSession,
+                                    CK_OBJECT_HANDLE hObject,
+                                    CK_ATTRIBUTE_PTR pTemplate,
+                                    CK_ULONG ulCount )
+{
+    CK_RV result = CKR_OK;
+
+    ( void ) hSession;
+    ( void ) hObject;
+    ( void ) ulCount;
+
+    if( pTemplate->type == CKA_KEY_TYPE )
+    {
+        *( ( CK_KEY_TYPE * ) pTemplate->pValue ) = CKK_EC;
+    }
+    else if( pTemplate->type != CKA_VALUE )
+    {
+        result = CKR_ATTRIBUTE_TYPE_INVALID;
+    }
+    else if( pTemplate->pValue == NULL )
+    {
+        /* The PEM parser of MbedTLS needs the terminating null character. */
+        pTemplate->ulValueLen = sizeof( testCertificatePem );
+    }
+    else
+    {
+        pthread_mutex_lock( &rendezvousMutex );
+        readCertificateCalls++;
+        pthread_mutex_unlock( &rendezvousMutex );
+
+        memcpy( pTemplate->pValue, testCertificatePem, sizeof( testCertificatePem ) );
+
+        if( rendezvousReads == true )
+        {
+            rendezvous();
+        }
+
+        if( invalidateDuringRead == true )
+        {
+            Mbedtls_Pkcs11_CredentialCacheInvalidate( CREDENTIAL_CACHE_TEST_CERT_LABEL );
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Fake C_GetFunctionList returning the fake PKCS #11 module.
+ */
+CK_RV C_GetFunctionList( CK_FUNCTION_LIST_PTR_PTR ppFunctionList )
+{
+    *ppFunctionList = &testFunctionList;
+
+    return CKR_OK;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Thread looking up the private key.
+ */
+static void * findPrivateKeyThread( void * pArgument )
+{
+    LookupThreadResult_t * pResult = ( LookupThreadResult_t * ) pArgument;
+
+    pResult->result = Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList,
+                                                                    1U,
+                                                                    CREDENTIAL_CACHE_TEST_KEY_LABEL,
+                                                                    &( pResult->handle ),
+                                                                    &( pResult->keyType ) );
+
+    return NULL;
+}
+
+/**
+ * @brief Thread acquiring the certificate.
+ */
+static void * acquireCertificateThread( void * pArgument )
+{
+    LookupThreadResult_t * pResult = ( LookupThreadResult_t * ) pArgument;
+
+    pResult->pCertificate = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList,
+                                                                              1U,
+                                                                              CREDENTIAL_CACHE_TEST_CERT_LABEL );
+
+    return NULL;
+}
+
+/**
+ * @brief Run a lookup in two threads at once.
+ */
+static void runConcurrently( void * ( *pLookup )( void * ),
+                             LookupThreadResult_t * pResults )
+{
+    pthread_t threads[ 2 ];
+    size_t i;
+
+    memset( pResults, 0, 2U * sizeof( LookupThreadResult_t ) );
+
+    for( i = 0; i < 2U; i++ )
+    {
+        TEST_ASSERT_EQUAL_INT( 0, pthread_create( &threads[ i ], NULL, pLookup, &pResults[ i ] ) );
+    }
+
+    for( i = 0; i < 2U; i++ )
+    {
+        TEST_ASSERT_EQUAL_INT( 0, pthread_join( threads[ i ], NULL ) );
+    }
+}
+
+/**
+ * @brief Write the root CA file, with extra lines to change its size.
+ */
+static void writeRootCa( size_t extraLines )
+{
+    FILE * pFile = fopen( rootCaPath, "w" );
+    size_t i;
+
+    TEST_ASSERT_NOT_NULL( pFile );
+    TEST_ASSERT_EQUAL_INT( 1, ( int ) fwrite( testCertificatePem, strlen( testCertificatePem ), 1, pFile ) );
+
+    for( i = 0; i < extraLines; i++ )
+    {
+        fputc( '\n', pFile );
+    }
+
+    TEST_ASSERT_EQUAL_INT( 0, fclose( pFile ) );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the credential cache.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11CredentialCacheTest );
+
+
+/**
+ * @brief Test setup function for the credential cache.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11CredentialCacheTest )
+{
+    int fd;
+
+    memset( &testFunctionList, 0, sizeof( testFunctionList ) );
+    testFunctionList.C_GetSessionInfo = fakeGetSessionInfo;
+    testFunctionList.C_GetAttributeValue = fakeGetAttributeValue;
+    findObjectCalls = 0U;
+    readCertificateCalls = 0U;
+    nextHandle = CREDENTIAL_CACHE_TEST_FIRST_HANDLE;
+    rendezvousSearches = false;
+    rendezvousReads = false;
+    invalidateDuringRead = false;
+    rendezvousCount = 0U;
+
+    strcpy( rootCaPath, "/tmp/credential_cache_test_XXXXXX" );
+    fd = mkstemp( rootCaPath );
+    TEST_ASSERT_NOT_EQUAL( -1, fd );
+    close( fd );
+    writeRootCa( 0U );
+}
+
+/**
+ * @brief Test tear down function for the credential cache.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11CredentialCacheTest )
+{
+    Mbedtls_Pkcs11_CredentialCacheClear();
+    ( void ) unlink( rootCaPath );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_LookupTest )
+{
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;
+    CK_KEY_TYPE keyType = 0;
+    mbedtls_x509_crt * pFirst;
+    mbedtls_x509_crt * pSecond;
+
+    /* The private key is searched once. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    TEST_ASSERT_EQUAL( CREDENTIAL_CACHE_TEST_FIRST_HANDLE, handle );
+    TEST_ASSERT_EQUAL( CKK_EC, keyType );
+
+    handle = CK_INVALID_HANDLE;
+    keyType = 0;
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    TEST_ASSERT_EQUAL( CREDENTIAL_CACHE_TEST_FIRST_HANDLE, handle );
+    TEST_ASSERT_EQUAL( CKK_EC, keyType );
+    TEST_ASSERT_EQUAL_UINT32( 1U, findObjectCalls );
+
+    /* The certificate is searched and parsed once, and shared. */
+    pFirst = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    pSecond = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_EQUAL_PTR( pFirst, pSecond );
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+    TEST_ASSERT_EQUAL_UINT32( 1U, readCertificateCalls );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pFirst );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pSecond );
+
+    /* The root CA is parsed once while its file is unchanged. */
+    pFirst = Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( rootCaPath );
+    pSecond = Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( rootCaPath );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_EQUAL_PTR( pFirst, pSecond );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pSecond );
+
+    writeRootCa( 1U );
+    pSecond = Mbedtls_Pkcs11_CredentialCacheAcquireRootCa( rootCaPath );
+    TEST_ASSERT_NOT_NULL( pSecond );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( pFirst, pSecond, "A changed root CA file was not parsed again." );
+
+    /* The replaced chain stays usable until it is released. */
+    TEST_ASSERT_NOT_EQUAL( 0U, pFirst->raw.len );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pFirst );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pSecond );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_InvalidationTest )
+{
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;
+    CK_KEY_TYPE keyType = 0;
+    mbedtls_x509_crt * pFirst;
+    mbedtls_x509_crt * pSecond;
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    pFirst = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+
+    /* Invalidating the certificate leaves the private key cached. */
+    Mbedtls_Pkcs11_CredentialCacheInvalidate( CREDENTIAL_CACHE_TEST_CERT_LABEL );
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    TEST_ASSERT_EQUAL( CREDENTIAL_CACHE_TEST_FIRST_HANDLE, handle );
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+
+    /* The certificate is searched and parsed again. The previous chain stays
+     * usable until it is released. */
+    pSecond = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    TEST_ASSERT_NOT_NULL( pSecond );
+    TEST_ASSERT_NOT_EQUAL( pFirst, pSecond );
+    TEST_ASSERT_EQUAL_UINT32( 3U, findObjectCalls );
+    TEST_ASSERT_EQUAL_UINT32( 2U, readCertificateCalls );
+    TEST_ASSERT_EQUAL( pFirst->raw.len, pSecond->raw.len );
+    TEST_ASSERT_EQUAL_MEMORY( pFirst->raw.p, pSecond->raw.p, pFirst->raw.len );
+
+    Mbedtls_Pkcs11_CredentialCacheRelease( pFirst );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pSecond );
+
+    /* Clearing the cache drops the private key too. */
+    Mbedtls_Pkcs11_CredentialCacheClear();
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    TEST_ASSERT_EQUAL_UINT32( 4U, findObjectCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_InvalidationDuringReadTest )
+{
+    mbedtls_x509_crt * pFirst;
+    mbedtls_x509_crt * pSecond;
+
+    /* A chain read while its label is invalidated is returned but not cached. */
+    invalidateDuringRead = true;
+    pFirst = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    TEST_ASSERT_NOT_NULL( pFirst );
+
+    invalidateDuringRead = false;
+    pSecond = Mbedtls_Pkcs11_CredentialCacheAcquireCertificate( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_CERT_LABEL );
+    TEST_ASSERT_NOT_NULL( pSecond );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( pFirst, pSecond, "A chain read during an invalidation was cached." );
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+    TEST_ASSERT_EQUAL_UINT32( 2U, readCertificateCalls );
+
+    Mbedtls_Pkcs11_CredentialCacheRelease( pFirst );
+    Mbedtls_Pkcs11_CredentialCacheRelease( pSecond );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_ConcurrentMissTest )
+{
+    LookupThreadResult_t results[ 2 ];
+    CK_OBJECT_HANDLE handle = CK_INVALID_HANDLE;
+    CK_KEY_TYPE keyType = 0;
+
+    /* Both threads search the token, and both get the handle cached first. */
+    rendezvousSearches = true;
+    runConcurrently( findPrivateKeyThread, results );
+    rendezvousSearches = false;
+
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+    TEST_ASSERT_EQUAL( CKR_OK, results[ 0 ].result );
+    TEST_ASSERT_EQUAL( CKR_OK, results[ 1 ].result );
+    TEST_ASSERT_EQUAL_MESSAGE( results[ 0 ].handle, results[ 1 ].handle, "The threads got different handles." );
+    TEST_ASSERT_EQUAL( CKK_EC, results[ 0 ].keyType );
+    TEST_ASSERT_EQUAL( CKK_EC, results[ 1 ].keyType );
+
+    /* The cache kept that handle. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_CredentialCacheFindPrivateKey( &testFunctionList, 1U, CREDENTIAL_CACHE_TEST_KEY_LABEL, &handle, &keyType ) );
+    TEST_ASSERT_EQUAL( results[ 0 ].handle, handle );
+    TEST_ASSERT_EQUAL_UINT32( 2U, findObjectCalls );
+
+    /* Both threads read the certificate, and both get the chain cached first. */
+    rendezvousCount = 0U;
+    rendezvousReads = true;
+    runConcurrently( acquireCertificateThread, results );
+    rendezvousReads = false;
+
+    TEST_ASSERT_EQUAL_UINT32( 2U, readCertificateCalls );
+    TEST_ASSERT_NOT_NULL( results[ 0 ].pCertificate );
+    TEST_ASSERT_EQUAL_PTR_MESSAGE( results[ 0 ].pCertificate, results[ 1 ].pCertificate, "The threads got different chains." );
+    Mbedtls_Pkcs11_CredentialCacheRelease( results[ 0 ].pCertificate );
+    Mbedtls_Pkcs11_CredentialCacheRelease( results[ 1 ].pCertificate );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the credential cache.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11CredentialCacheTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_LookupTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_InvalidationTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_InvalidationDuringReadTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11CredentialCacheTest, MbedtlsPkcs11CredentialCache_ConcurrentMissTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11CredentialCacheTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11CredentialCacheTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11CredentialCacheTest();
+}
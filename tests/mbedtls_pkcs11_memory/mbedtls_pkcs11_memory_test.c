@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "mbedtls_pkcs11_memory.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Functions installed by #Mbedtls_Pkcs11_MemoryInit.
+ */
+static void * ( * installedCalloc )( size_t, size_t ) = NULL;
+static void ( * installedFree )( void * ) = NULL;
+
+static MbedtlsPkcs11MemoryAccount_t testAccount;
+
+/**
+ * @brief Stack size of the coroutines of the interleaving test.
+ */
+#define COROUTINE_STACK_SIZE    ( 64U * 1024U )
+
+/**
+ * @brief Coroutine of the interleaving test, with its own account.
+ */
+typedef struct Coroutine
+{
+    ucontext_t context;
+    unsigned char * pStack;
+    MbedtlsPkcs11MemoryAccount_t account;
+    size_t allocationSize;
+    void * pMemory[ 2 ];
+} Coroutine_t;
+
+static ucontext_t mainContext;
+static Coroutine_t coroutines[ 2 ];
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Replaces the MbedTLS function, so that the test calls the installed
+ * functions directly.
+ */
+int mbedtls_platform_set_calloc_free( void * ( *calloc_func )( size_t, size_t ),
+                                      void ( * free_func )( void * ) )
+{
+    installedCalloc = calloc_func;
+    installedFree = free_func;
+
+    return 0;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Thread freeing memory without a selected account.
+ */
+static void * freeThread( void * pMemory )
+{
+    installedFree( pMemory );
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Coroutine allocating before and after returning to the main context,
+ * as a handshake waiting for the network would.
+ */
+static void coroutineEntry( int index )
+{
+    Coroutine_t * pCoroutine = &coroutines[ index ];
+    MbedtlsPkcs11MemoryAccount_t * pPreviousAccount;
+
+    pPreviousAccount = Mbedtls_Pkcs11_MemorySetAccount( &pCoroutine->account );
+    pCoroutine->pMemory[ 0 ] = installedCalloc( 1U, pCoroutine->allocationSize );
+
+    ( void ) Mbedtls_Pkcs11_MemorySwapContext( &pCoroutine->context, &mainContext );
+
+    pCoroutine->pMemory[ 1 ] = installedCalloc( 1U, pCoroutine->allocationSize );
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pPreviousAccount );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Read the current and peak bytes of #testAccount.
+ */
+static void readAccount( size_t * pCurrentBytes,
+                         size_t * pPeakBytes )
+{
+    Mbedtls_Pkcs11_MemoryRead( &testAccount, pCurrentBytes, pPeakBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the TLS memory accounting.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11MemoryTest );
+
+
+/**
+ * @brief Test setup function for the TLS memory accounting.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11MemoryTest )
+{
+    Mbedtls_Pkcs11_MemoryInit();
+    memset( &testAccount, 0, sizeof( testAccount ) );
+}
+
+/**
+ * @brief Test tear down function for the TLS memory accounting.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11MemoryTest )
+{
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_CountTest )
+{
+    unsigned char * pFirst;
+    unsigned char * pSecond;
+    size_t currentBytes;
+    size_t peakBytes;
+
+    TEST_ASSERT_NOT_NULL( installedCalloc );
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_MemorySetAccount( &testAccount ) );
+
+    pFirst = installedCalloc( 10U, 10U );
+    pSecond = installedCalloc( 1U, 50U );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_NOT_NULL( pSecond );
+    TEST_ASSERT_EQUAL( 0, pFirst[ 99 ] );
+    readAccount( &currentBytes, &peakBytes );
+    TEST_ASSERT_EQUAL( 150U, currentBytes );
+    TEST_ASSERT_EQUAL( 150U, peakBytes );
+
+    /* The peak is kept when memory is freed. */
+    installedFree( pFirst );
+    readAccount( &currentBytes, &peakBytes );
+    TEST_ASSERT_EQUAL( 50U, currentBytes );
+    TEST_ASSERT_EQUAL( 150U, peakBytes );
+
+    Mbedtls_Pkcs11_MemoryResetPeak( &testAccount );
+    installedFree( pSecond );
+    installedFree( NULL );
+    readAccount( &currentBytes, &peakBytes );
+    TEST_ASSERT_EQUAL( 0U, currentBytes );
+    TEST_ASSERT_EQUAL( 50U, peakBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_NoAccountTest )
+{
+    void * pCounted;
+    void * pNotCounted;
+    size_t currentBytes;
+
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    pCounted = installedCalloc( 1U, 64U );
+
+    /* Allocations made without an account are not counted, and the counted
+     * memory is removed from its account whatever the selected account. */
+    TEST_ASSERT_EQUAL_PTR( &testAccount, Mbedtls_Pkcs11_MemorySetAccount( NULL ) );
+    pNotCounted = installedCalloc( 1U, 32U );
+    TEST_ASSERT_NOT_NULL( pNotCounted );
+    readAccount( &currentBytes, NULL );
+    TEST_ASSERT_EQUAL( 64U, currentBytes );
+
+    installedFree( pNotCounted );
+    installedFree( pCounted );
+    readAccount( &currentBytes, NULL );
+    TEST_ASSERT_EQUAL( 0U, currentBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_OtherThreadFreeTest )
+{
+    void * pMemory;
+    pthread_t thread;
+    size_t currentBytes;
+
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    pMemory = installedCalloc( 4U, 8U );
+
+    /* The account is selected per thread, but the memory is removed from the
+     * account it was counted in. */
+    TEST_ASSERT_EQUAL_INT( 0, pthread_create( &thread, NULL, freeThread, pMemory ) );
+    TEST_ASSERT_EQUAL_INT( 0, pthread_join( thread, NULL ) );
+    readAccount( &currentBytes, NULL );
+    TEST_ASSERT_EQUAL( 0U, currentBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_OverflowTest )
+{
+    size_t currentBytes;
+
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    TEST_ASSERT_NULL( installedCalloc( SIZE_MAX / 2U, 4U ) );
+    readAccount( &currentBytes, NULL );
+    TEST_ASSERT_EQUAL( 0U, currentBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_InterleavedCoroutinesTest )
+{
+    void * pMainMemory;
+    size_t currentBytes;
+    int i;
+
+    memset( coroutines, 0, sizeof( coroutines ) );
+    coroutines[ 0 ].allocationSize = 100U;
+    coroutines[ 1 ].allocationSize = 10U;
+
+    for( i = 0; i < 2; i++ )
+    {
+        coroutines[ i ].pStack = malloc( COROUTINE_STACK_SIZE );
+        TEST_ASSERT_NOT_NULL( coroutines[ i ].pStack );
+        TEST_ASSERT_EQUAL_INT( 0, getcontext( &coroutines[ i ].context ) );
+        coroutines[ i ].context.uc_stack.ss_sp = coroutines[ i ].pStack;
+        coroutines[ i ].context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+        coroutines[ i ].context.uc_link = &mainContext;
+        makecontext( &coroutines[ i ].context, ( void ( * )( void ) ) coroutineEntry, 1, i );
+    }
+
+    /* The thread has its own account while the coroutines run in turn, each
+     * one being switched out in the middle of its accounted section. */
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &coroutines[ 0 ].context ) );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &coroutines[ 1 ].context ) );
+    pMainMemory = installedCalloc( 1U, 1U );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &coroutines[ 0 ].context ) );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &coroutines[ 1 ].context ) );
+
+    TEST_ASSERT_EQUAL_PTR( &testAccount, Mbedtls_Pkcs11_MemorySetAccount( &testAccount ) );
+    readAccount( &currentBytes, NULL );
+    TEST_ASSERT_EQUAL( 1U, currentBytes );
+
+    for( i = 0; i < 2; i++ )
+    {
+        Mbedtls_Pkcs11_MemoryRead( &coroutines[ i ].account, &currentBytes, NULL );
+        TEST_ASSERT_EQUAL( 2U * coroutines[ i ].allocationSize, currentBytes );
+
+        installedFree( coroutines[ i ].pMemory[ 0 ] );
+        installedFree( coroutines[ i ].pMemory[ 1 ] );
+        Mbedtls_Pkcs11_MemoryRead( &coroutines[ i ].account, &currentBytes, NULL );
+        TEST_ASSERT_EQUAL( 0U, currentBytes );
+        free( coroutines[ i ].pStack );
+    }
+
+    installedFree( pMainMemory );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the TLS memory accounting.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11MemoryTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_CountTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_NoAccountTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_OtherThreadFreeTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_OverflowTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11MemoryTest, MbedtlsPkcs11Memory_InterleavedCoroutinesTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11MemoryTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11MemoryTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11MemoryTest();
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "mbedtls_pkcs11_offload.h"
+#include "mbedtls_pkcs11_memory.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Stack size of the coroutines.
+ */
+#define COROUTINE_STACK_SIZE        ( 64U * 1024U )
+
+/**
+ * @brief Maximum time the blocking call waits for the other coroutine.
+ */
+#define BLOCKING_CALL_TIMEOUT_S     ( 5 )
+
+/**
+ * @brief Coroutine served by the event loop of the test, standing for a
+ * connection served by the MQTT agent scheduler.
+ */
+typedef struct TestCoroutine
+{
+    ucontext_t context;
+    unsigned char * pStack;
+    struct pollfd * pPollFds;
+    nfds_t pollFdCount;
+    bool finished;
+} TestCoroutine_t;
+
+/**
+ * @brief Observations of the blocking call.
+ */
+typedef struct BlockingCallResult
+{
+    pthread_t thread;
+    MbedtlsPkcs11MemoryAccount_t * pAccount;
+    bool otherCoroutineRan;
+} BlockingCallResult_t;
+
+static ucontext_t mainContext;
+static TestCoroutine_t blockingCoroutine;
+static TestCoroutine_t otherCoroutine;
+static BlockingCallResult_t callResult;
+static MbedtlsPkcs11MemoryAccount_t testAccount;
+
+/**
+ * @brief The other coroutine has run, signalled with #otherCond.
+ */
+static bool otherRan = false;
+static pthread_mutex_t otherMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t otherCond = PTHREAD_COND_INITIALIZER;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Wait function returning to the event loop, as the scheduler does.
+ */
+static int testWait( void * pWaitContext,
+                     struct pollfd * pPollFds,
+                     nfds_t pollFdCount,
+                     int timeoutMs )
+{
+    TestCoroutine_t * pCoroutine = ( TestCoroutine_t * ) pWaitContext;
+
+    ( void ) timeoutMs;
+
+    pCoroutine->pPollFds = pPollFds;
+    pCoroutine->pollFdCount = pollFdCount;
+    ( void ) Mbedtls_Pkcs11_MemorySwapContext( &pCoroutine->context, &mainContext );
+    pCoroutine->pPollFds = NULL;
+
+    return poll( pPollFds, pollFdCount, 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Blocking call waiting until the other coroutine has run. It would wait
+ * for its timeout if it blocked the event loop.
+ */
+static void blockingCall( void * pArgument )
+{
+    BlockingCallResult_t * pResult = ( BlockingCallResult_t * ) pArgument;
+    struct timespec deadline;
+    int ret = 0;
+
+    pResult->thread = pthread_self();
+    pResult->pAccount = Mbedtls_Pkcs11_MemorySetAccount( NULL );
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pResult->pAccount );
+
+    ( void ) clock_gettime( CLOCK_REALTIME, &deadline );
+    deadline.tv_sec += BLOCKING_CALL_TIMEOUT_S;
+
+    pthread_mutex_lock( &otherMutex );
+
+    while( ( otherRan == false ) && ( ret == 0 ) )
+    {
+        ret = pthread_cond_timedwait( &otherCond, &otherMutex, &deadline );
+    }
+
+    pResult->otherCoroutineRan = otherRan;
+    pthread_mutex_unlock( &otherMutex );
+}
+
+/*-----------------------------------------------------------*/
+
+static void blockingCoroutineEntry( void )
+{
+    MbedtlsPkcs11MemoryAccount_t * pPreviousAccount;
+
+    pPreviousAccount = Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    Mbedtls_Pkcs11_RunBlocking( testWait, &blockingCoroutine, blockingCall, &callResult );
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( pPreviousAccount );
+
+    blockingCoroutine.finished = true;
+}
+
+/*-----------------------------------------------------------*/
+
+static void otherCoroutineEntry( void )
+{
+    pthread_mutex_lock( &otherMutex );
+    otherRan = true;
+    pthread_cond_broadcast( &otherCond );
+    pthread_mutex_unlock( &otherMutex );
+
+    otherCoroutine.finished = true;
+}
+
+/*-----------------------------------------------------------*/
+
+static void startCoroutine( TestCoroutine_t * pCoroutine,
+                            void ( * entry )( void ) )
+{
+    memset( pCoroutine, 0, sizeof( TestCoroutine_t ) );
+    pCoroutine->pStack = malloc( COROUTINE_STACK_SIZE );
+    TEST_ASSERT_NOT_NULL( pCoroutine->pStack );
+    TEST_ASSERT_EQUAL_INT( 0, getcontext( &pCoroutine->context ) );
+    pCoroutine->context.uc_stack.ss_sp = pCoroutine->pStack;
+    pCoroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    pCoroutine->context.uc_link = &mainContext;
+    makecontext( &pCoroutine->context, entry, 0 );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the blocking calls.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11OffloadTest );
+
+
+/**
+ * @brief Test setup function for the blocking calls.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11OffloadTest )
+{
+    Mbedtls_Pkcs11_MemoryInit();
+    memset( &callResult, 0, sizeof( callResult ) );
+    otherRan = false;
+}
+
+/**
+ * @brief Test tear down function for the blocking calls.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11OffloadTest )
+{
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11OffloadTest, MbedtlsPkcs11Offload_NoWaitFunctionTest )
+{
+    /* Without a wait function, the call runs on the calling thread. */
+    otherRan = true;
+    ( void ) Mbedtls_Pkcs11_MemorySetAccount( &testAccount );
+    Mbedtls_Pkcs11_RunBlocking( NULL, NULL, blockingCall, &callResult );
+
+    TEST_ASSERT_TRUE( pthread_equal( callResult.thread, pthread_self() ) );
+    TEST_ASSERT_EQUAL_PTR( &testAccount, callResult.pAccount );
+    TEST_ASSERT_TRUE( callResult.otherCoroutineRan );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11OffloadTest, MbedtlsPkcs11Offload_EventLoopTest )
+{
+    startCoroutine( &blockingCoroutine, blockingCoroutineEntry );
+    startCoroutine( &otherCoroutine, otherCoroutineEntry );
+
+    /* The blocking call suspends its coroutine instead of the event loop, so the
+     * other coroutine runs while the call is in progress. */
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &blockingCoroutine.context ) );
+    TEST_ASSERT_FALSE( blockingCoroutine.finished );
+    TEST_ASSERT_NOT_NULL( blockingCoroutine.pPollFds );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &otherCoroutine.context ) );
+    TEST_ASSERT_TRUE( otherCoroutine.finished );
+
+    while( blockingCoroutine.finished == false )
+    {
+        TEST_ASSERT_NOT_NULL( blockingCoroutine.pPollFds );
+        TEST_ASSERT_EQUAL_INT( 1, poll( blockingCoroutine.pPollFds,
+                                        blockingCoroutine.pollFdCount,
+                                        BLOCKING_CALL_TIMEOUT_S * 2000 ) );
+        TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_MemorySwapContext( &mainContext, &blockingCoroutine.context ) );
+    }
+
+    TEST_ASSERT_TRUE( callResult.otherCoroutineRan );
+    TEST_ASSERT_FALSE( pthread_equal( callResult.thread, pthread_self() ) );
+    TEST_ASSERT_EQUAL_PTR( &testAccount, callResult.pAccount );
+
+    free( blockingCoroutine.pStack );
+    free( otherCoroutine.pStack );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the blocking calls.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11OffloadTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11OffloadTest, MbedtlsPkcs11Offload_NoWaitFunctionTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11OffloadTest, MbedtlsPkcs11Offload_EventLoopTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11OffloadTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11OffloadTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11OffloadTest();
+}
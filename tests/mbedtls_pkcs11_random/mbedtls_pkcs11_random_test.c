@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "mbedtls_pkcs11_random.h"
+#include "mbedtls_pkcs11_session_pool.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Length of the outputs compared in the fork test.
+ */
+#define RANDOM_TEST_OUTPUT_LENGTH    ( 32U )
+
+/*-----------------------------------------------------------*/
+
+static MbedtlsPkcs11Random_t testRandom;
+static CK_FUNCTION_LIST testFunctionList;
+
+/**
+ * @brief Number of C_GenerateRandom calls, i.e. number of times the DRBG was seeded.
+ */
+static uint32_t generateRandomCalls = 0U;
+
+/**
+ * @brief Result returned by the fake C_GenerateRandom.
+ */
+static CK_RV generateRandomResult = CKR_OK;
+
+/**
+ * @brief Number of sessions opened and closed by the fake PKCS #11 module.
+ */
+static uint32_t openSessionCalls = 0U;
+static uint32_t closeSessionCalls = 0U;
+
+/**
+ * @brief Slot of the last opened session.
+ */
+static CK_SLOT_ID lastOpenedSlot = 0U;
+
+/**
+ * @brief Session of the last C_GenerateRandom call.
+ */
+static CK_SESSION_HANDLE lastRandomSession = CK_INVALID_HANDLE;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Fake C_GenerateRandom. The output depends on the process, like the
+ * output of a token shared by a parent and its child.
+ */
+static CK_RV fakeGenerateRandom( CK_SESSION_HANDLE hSession,
+                                 CK_BYTE_PTR pRandomData,
+                                 CK_ULONG ulRandomLen )
+{
+    static uint32_t counter = 0U;
+    uint32_t pid = ( uint32_t ) getpid();
+    CK_ULONG i;
+
+    generateRandomCalls++;
+    lastRandomSession = hSession;
+
+    for( i = 0; i < ulRandomLen; i++ )
+    {
+        counter++;
+        pRandomData[ i ] = ( CK_BYTE ) ( ( counter * 131U ) ^ ( pid >> ( ( i % 4U ) * 8U ) ) );
+    }
+
+    return generateRandomResult;
+}
+
+/**
+ * @brief Fake C_OpenSession. Each session has a new handle.
+ */
+static CK_RV fakeOpenSession( CK_SLOT_ID slotID,
+                              CK_FLAGS flags,
+                              CK_VOID_PTR pApplication,
+                              CK_NOTIFY notify,
+                              CK_SESSION_HANDLE_PTR phSession )
+{
+    static CK_SESSION_HANDLE nextSession = 1U;
+
+    ( void ) flags;
+    ( void ) pApplication;
+    ( void ) notify;
+
+    openSessionCalls++;
+    lastOpenedSlot = slotID;
+    *phSession = nextSession;
+    nextSession++;
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_CloseSession.
+ */
+static CK_RV fakeCloseSession( CK_SESSION_HANDLE hSession )
+{
+    ( void ) hSession;
+
+    closeSessionCalls++;
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_GetFunctionList returning the fake PKCS #11 module to the
+ * session pool.
+ */
+CK_RV C_GetFunctionList( CK_FUNCTION_LIST_PTR_PTR ppFunctionList )
+{
+    *ppFunctionList = &testFunctionList;
+
+    return CKR_OK;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Request random bytes one byte at a time.
+ */
+static void generateBytewise( size_t length )
+{
+    unsigned char randomByte;
+    size_t i;
+
+    for( i = 0; i < length; i++ )
+    {
+        TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomGenerate( &testRandom, &randomByte, 1U ) );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the transport random number generator.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11RandomTest );
+
+
+/**
+ * @brief Test setup function for the transport random number generator.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11RandomTest )
+{
+    memset( &testFunctionList, 0, sizeof( testFunctionList ) );
+    testFunctionList.C_GenerateRandom = fakeGenerateRandom;
+    testFunctionList.C_OpenSession = fakeOpenSession;
+    testFunctionList.C_CloseSession = fakeCloseSession;
+    generateRandomCalls = 0U;
+    generateRandomResult = CKR_OK;
+    openSessionCalls = 0U;
+    closeSessionCalls = 0U;
+    lastOpenedSlot = 0U;
+    lastRandomSession = CK_INVALID_HANDLE;
+}
+
+/**
+ * @brief Test tear down function for the transport random number generator.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11RandomTest )
+{
+    Mbedtls_Pkcs11_RandomFree( &testRandom );
+    Mbedtls_Pkcs11_SessionPoolClose();
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_SeedFailureTest )
+{
+    generateRandomResult = CKR_DEVICE_ERROR;
+
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ),
+                                   "Init should fail when the token fails." );
+    TEST_ASSERT_EQUAL_MESSAGE( openSessionCalls, closeSessionCalls,
+                               "The session of a failed seeding was kept." );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_LeasedSessionTest )
+{
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ) );
+
+    /* The seed is read on a session leased on the slot of the generator. */
+    TEST_ASSERT_EQUAL_UINT32( 1U, openSessionCalls );
+    TEST_ASSERT_EQUAL( 1U, lastOpenedSlot );
+    TEST_ASSERT_NOT_EQUAL( CK_INVALID_HANDLE, lastRandomSession );
+
+    /* The reseeds lease the idle session again instead of opening another. */
+    generateBytewise( ( MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE * MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL ) + 1U );
+    TEST_ASSERT_EQUAL_UINT32( 1U, testRandom.generateCount );
+    TEST_ASSERT_EQUAL_UINT32( 1U, openSessionCalls );
+    TEST_ASSERT_EQUAL_UINT32( 0U, closeSessionCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_BatchedRefillTest )
+{
+    uint32_t seedCalls;
+
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ) );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( 0U, generateRandomCalls, "The DRBG was not seeded from the token." );
+    seedCalls = generateRandomCalls;
+
+    /* Small requests within the reseed interval are served from memory. */
+    generateBytewise( MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE * MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL );
+    TEST_ASSERT_EQUAL_MESSAGE( seedCalls, generateRandomCalls, "The token was called within the reseed interval." );
+    TEST_ASSERT_EQUAL_UINT32( MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL, testRandom.generateCount );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_ReseedIntervalTest )
+{
+    uint32_t seedCalls;
+    uint32_t reseed;
+
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ) );
+    generateBytewise( MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE * MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL );
+
+    for( reseed = 0; reseed < 3U; reseed++ )
+    {
+        /* The first block after the interval is generated after a reseed. */
+        seedCalls = generateRandomCalls;
+        generateBytewise( 1U );
+        TEST_ASSERT_GREATER_THAN_MESSAGE( seedCalls, generateRandomCalls, "Not reseeded after the interval." );
+        TEST_ASSERT_EQUAL_UINT32( 1U, testRandom.generateCount );
+
+        /* The rest of the interval is served without reseeding. */
+        seedCalls = generateRandomCalls;
+        generateBytewise( ( MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE * MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL ) - 1U );
+        TEST_ASSERT_EQUAL_MESSAGE( seedCalls, generateRandomCalls, "Reseeded before the interval." );
+        TEST_ASSERT_EQUAL_UINT32( MBEDTLS_PKCS11_RANDOM_RESEED_INTERVAL, testRandom.generateCount );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_LargeRequestTest )
+{
+    unsigned char output[ MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE * 3U ];
+    unsigned char zero[ sizeof( output ) ];
+
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ) );
+
+    memset( output, 0, sizeof( output ) );
+    memset( zero, 0, sizeof( zero ) );
+
+    /* Unaligned request: part of a block, then whole blocks generated in place. */
+    generateBytewise( 3U );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomGenerate( &testRandom, output, sizeof( output ) ) );
+    TEST_ASSERT_NOT_EQUAL( 0, memcmp( output, zero, sizeof( output ) ) );
+    TEST_ASSERT_NOT_EQUAL( 0, memcmp( &output[ sizeof( output ) - 16U ], zero, 16U ) );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_ForkTest )
+{
+    unsigned char parentBuffered[ MBEDTLS_PKCS11_RANDOM_BUFFER_SIZE - 3U ];
+    unsigned char parentOutput[ RANDOM_TEST_OUTPUT_LENGTH ];
+    unsigned char childOutput[ RANDOM_TEST_OUTPUT_LENGTH + 1U ];
+    int pipeFds[ 2 ];
+    pid_t childPid;
+    int childStatus = 0;
+    ssize_t readLength;
+    uint32_t seedCalls;
+
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomInit( &testRandom, &testFunctionList, 1U ) );
+
+    /* Leave unused output in the buffer before forking. */
+    generateBytewise( 3U );
+    TEST_ASSERT_EQUAL_INT( 0, pipe( pipeFds ) );
+
+    childPid = fork();
+    TEST_ASSERT_NOT_EQUAL( -1, childPid );
+
+    if( childPid == 0 )
+    {
+        /* Child: report the output and whether the PKCS #11 module was called. */
+        seedCalls = generateRandomCalls;
+        memset( childOutput, 0, sizeof( childOutput ) );
+
+        if( Mbedtls_Pkcs11_RandomGenerate( &testRandom, childOutput, RANDOM_TEST_OUTPUT_LENGTH ) != 0 )
+        {
+            _exit( 1 );
+        }
+
+        childOutput[ RANDOM_TEST_OUTPUT_LENGTH ] = ( generateRandomCalls != seedCalls ) ? 1U : 0U;
+
+        if( write( pipeFds[ 1 ], childOutput, sizeof( childOutput ) ) != ( ssize_t ) sizeof( childOutput ) )
+        {
+            _exit( 1 );
+        }
+
+        _exit( 0 );
+    }
+
+    close( pipeFds[ 1 ] );
+
+    /* The parent keeps its DRBG state and buffer. It drains the buffer, then
+     * generates the next block, which the child would also generate if its
+     * DRBG state were not updated. */
+    seedCalls = generateRandomCalls;
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomGenerate( &testRandom, parentBuffered, sizeof( parentBuffered ) ) );
+    TEST_ASSERT_EQUAL_INT( 0, Mbedtls_Pkcs11_RandomGenerate( &testRandom, parentOutput, sizeof( parentOutput ) ) );
+    TEST_ASSERT_EQUAL_MESSAGE( seedCalls, generateRandomCalls, "The parent should not reseed." );
+
+    readLength = read( pipeFds[ 0 ], childOutput, sizeof( childOutput ) );
+    close( pipeFds[ 0 ] );
+    TEST_ASSERT_EQUAL( childPid, waitpid( childPid, &childStatus, 0 ) );
+    TEST_ASSERT_TRUE( WIFEXITED( childStatus ) );
+    TEST_ASSERT_EQUAL_INT( 0, WEXITSTATUS( childStatus ) );
+    TEST_ASSERT_EQUAL( ( ssize_t ) sizeof( childOutput ), readLength );
+
+    TEST_ASSERT_EQUAL_MESSAGE( 0U, childOutput[ RANDOM_TEST_OUTPUT_LENGTH ],
+                               "The child called the PKCS #11 module of its parent after fork." );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( 0, memcmp( parentBuffered, childOutput, RANDOM_TEST_OUTPUT_LENGTH ),
+                                   "The child generated the output buffered by the parent." );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( 0, memcmp( parentOutput, childOutput, sizeof( parentOutput ) ),
+                                   "The parent and the child generated the same bytes." );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the transport random number generator.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11RandomTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_SeedFailureTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_LeasedSessionTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_BatchedRefillTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_ReseedIntervalTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_LargeRequestTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11RandomTest, MbedtlsPkcs11Random_ForkTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11RandomTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11RandomTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11RandomTest();
+}
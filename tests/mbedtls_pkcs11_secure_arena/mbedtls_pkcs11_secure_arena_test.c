@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mbedtls_pkcs11_secure_arena.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Size of the arena of the tests. It is a multiple of the page size.
+ */
+#define TEST_ARENA_SIZE          ( 4096U )
+
+/**
+ * @brief Number of allocations made by each thread of the concurrency test.
+ */
+#define TEST_THREAD_ITERATIONS    ( 1000 )
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Check that memory is zero.
+ */
+static bool isZero( const uint8_t * pMemory,
+                    size_t length )
+{
+    size_t i;
+    bool zero = true;
+
+    for( i = 0U; i < length; i++ )
+    {
+        zero = zero && ( pMemory[ i ] == 0U );
+    }
+
+    return zero;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Thread allocating, filling and freeing memory of the arena.
+ */
+static void * allocThread( void * pParam )
+{
+    int i;
+    uint8_t * pMemory;
+    intptr_t failures = 0;
+
+    ( void ) pParam;
+
+    for( i = 0; i < TEST_THREAD_ITERATIONS; i++ )
+    {
+        pMemory = Mbedtls_Pkcs11_SecureArenaAlloc( 100U );
+
+        if( ( pMemory == NULL ) || ( isZero( pMemory, 100U ) == false ) )
+        {
+            failures++;
+        }
+        else
+        {
+            memset( pMemory, 0xA5, 100U );
+        }
+
+        Mbedtls_Pkcs11_SecureArenaFree( pMemory );
+    }
+
+    return ( void * ) failures;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the secure arena.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11SecureArenaTest );
+
+
+/**
+ * @brief Test setup function for the secure arena.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11SecureArenaTest )
+{
+    TEST_ASSERT_TRUE( Mbedtls_Pkcs11_SecureArenaInit( TEST_ARENA_SIZE ) );
+}
+
+/**
+ * @brief Test tear down function for the secure arena.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11SecureArenaTest )
+{
+    Mbedtls_Pkcs11_SecureArenaDeinit();
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_AllocTest )
+{
+    uint8_t * pFirst;
+    uint8_t * pSecond;
+    size_t usedBytes;
+    size_t peakBytes;
+
+    pFirst = Mbedtls_Pkcs11_SecureArenaAlloc( 1U );
+    pSecond = Mbedtls_Pkcs11_SecureArenaAlloc( MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE + 1U );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_NOT_NULL( pSecond );
+
+    /* The allocations are counted in whole blocks and do not overlap. */
+    TEST_ASSERT_EQUAL_PTR( pFirst + MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE, pSecond );
+    Mbedtls_Pkcs11_SecureArenaRead( &usedBytes, &peakBytes );
+    TEST_ASSERT_EQUAL( 3U * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE, usedBytes );
+    TEST_ASSERT_EQUAL( 3U * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE, peakBytes );
+
+    Mbedtls_Pkcs11_SecureArenaFree( pFirst );
+    Mbedtls_Pkcs11_SecureArenaFree( pSecond );
+    Mbedtls_Pkcs11_SecureArenaFree( NULL );
+    Mbedtls_Pkcs11_SecureArenaRead( &usedBytes, &peakBytes );
+    TEST_ASSERT_EQUAL( 0U, usedBytes );
+    TEST_ASSERT_EQUAL( 3U * MBEDTLS_PKCS11_SECURE_ARENA_BLOCK_SIZE, peakBytes );
+
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( 0U ) );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_WipeTest )
+{
+    uint8_t * pMemory;
+    uint8_t * pReused;
+
+    pMemory = Mbedtls_Pkcs11_SecureArenaAlloc( 200U );
+    TEST_ASSERT_NOT_NULL( pMemory );
+    TEST_ASSERT_TRUE( isZero( pMemory, 200U ) );
+    memset( pMemory, 0x5A, 200U );
+
+    /* The freed blocks are wiped, and reused by the next allocation. */
+    Mbedtls_Pkcs11_SecureArenaFree( pMemory );
+    TEST_ASSERT_TRUE( isZero( pMemory, 200U ) );
+
+    pReused = Mbedtls_Pkcs11_SecureArenaAlloc( 50U );
+    TEST_ASSERT_EQUAL_PTR( pMemory, pReused );
+    Mbedtls_Pkcs11_SecureArenaFree( pReused );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_FullTest )
+{
+    uint8_t * pFirst;
+    uint8_t * pSecond;
+    uint8_t * pMemory;
+
+    /* The arena does not grow. */
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( TEST_ARENA_SIZE + 1U ) );
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( SIZE_MAX ) );
+
+    pFirst = Mbedtls_Pkcs11_SecureArenaAlloc( TEST_ARENA_SIZE / 2U );
+    pSecond = Mbedtls_Pkcs11_SecureArenaAlloc( TEST_ARENA_SIZE / 2U );
+    TEST_ASSERT_NOT_NULL( pFirst );
+    TEST_ASSERT_NOT_NULL( pSecond );
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( 1U ) );
+
+    /* A free range is found between allocations. */
+    Mbedtls_Pkcs11_SecureArenaFree( pFirst );
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( ( TEST_ARENA_SIZE / 2U ) + 1U ) );
+    pMemory = Mbedtls_Pkcs11_SecureArenaAlloc( TEST_ARENA_SIZE / 4U );
+    TEST_ASSERT_EQUAL_PTR( pFirst, pMemory );
+
+    Mbedtls_Pkcs11_SecureArenaFree( pMemory );
+    Mbedtls_Pkcs11_SecureArenaFree( pSecond );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_DeinitTest )
+{
+    size_t usedBytes;
+
+    /* The arena is mapped once. */
+    TEST_ASSERT_TRUE( Mbedtls_Pkcs11_SecureArenaInit( 2U * TEST_ARENA_SIZE ) );
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( TEST_ARENA_SIZE + 1U ) );
+    TEST_ASSERT_NOT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( 10U ) );
+
+    Mbedtls_Pkcs11_SecureArenaDeinit();
+    TEST_ASSERT_NULL( Mbedtls_Pkcs11_SecureArenaAlloc( 10U ) );
+    Mbedtls_Pkcs11_SecureArenaRead( &usedBytes, NULL );
+    TEST_ASSERT_EQUAL( 0U, usedBytes );
+
+    TEST_ASSERT_FALSE( Mbedtls_Pkcs11_SecureArenaInit( 0U ) );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_ThreadsTest )
+{
+    pthread_t threads[ 4 ];
+    void * pFailures;
+    size_t usedBytes;
+    int i;
+
+    for( i = 0; i < 4; i++ )
+    {
+        TEST_ASSERT_EQUAL_INT( 0, pthread_create( &threads[ i ], NULL, allocThread, NULL ) );
+    }
+
+    for( i = 0; i < 4; i++ )
+    {
+        TEST_ASSERT_EQUAL_INT( 0, pthread_join( threads[ i ], &pFailures ) );
+        TEST_ASSERT_NULL( pFailures );
+    }
+
+    Mbedtls_Pkcs11_SecureArenaRead( &usedBytes, NULL );
+    TEST_ASSERT_EQUAL( 0U, usedBytes );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the secure arena.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11SecureArenaTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_AllocTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_WipeTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_FullTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_DeinitTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SecureArenaTest, MbedtlsPkcs11SecureArena_ThreadsTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11SecureArenaTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11SecureArenaTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11SecureArenaTest();
+}
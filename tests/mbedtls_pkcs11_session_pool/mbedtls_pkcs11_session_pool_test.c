@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mbedtls_pkcs11_session_pool.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Slots used by the tests.
+ */
+#define SESSION_POOL_TEST_SLOT          ( 1U )
+#define SESSION_POOL_TEST_OTHER_SLOT    ( 2U )
+
+/**
+ * @brief Time given to a blocked lease to return early, in microseconds.
+ */
+#define SESSION_POOL_TEST_WAIT_US       ( 50000U )
+
+/*-----------------------------------------------------------*/
+
+static CK_FUNCTION_LIST testFunctionList;
+
+/**
+ * @brief Number of sessions opened and closed by the fake PKCS #11 module.
+ */
+static uint32_t openSessionCalls = 0U;
+static uint32_t closeSessionCalls = 0U;
+
+/**
+ * @brief Slot of the last opened session.
+ */
+static CK_SLOT_ID lastOpenedSlot = 0U;
+
+/**
+ * @brief Result returned by the fake C_OpenSession.
+ */
+static CK_RV openSessionResult = CKR_OK;
+
+/**
+ * @brief Session leased by #leaseThread, and whether the lease returned.
+ */
+static CK_SESSION_HANDLE threadSession = CK_INVALID_HANDLE;
+static volatile bool threadLeased = false;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Fake C_OpenSession. Each session has a new handle.
+ */
+static CK_RV fakeOpenSession( CK_SLOT_ID slotID,
+                              CK_FLAGS flags,
+                              CK_VOID_PTR pApplication,
+                              CK_NOTIFY notify,
+                              CK_SESSION_HANDLE_PTR phSession )
+{
+    static CK_SESSION_HANDLE nextSession = 1U;
+
+    ( void ) flags;
+    ( void ) pApplication;
+    ( void ) notify;
+
+    openSessionCalls++;
+    lastOpenedSlot = slotID;
+    *phSession = nextSession;
+    nextSession++;
+
+    return openSessionResult;
+}
+
+/**
+ * @brief Fake C_CloseSession.
+ */
+static CK_RV fakeCloseSession( CK_SESSION_HANDLE hSession )
+{
+    ( void ) hSession;
+
+    closeSessionCalls++;
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_GetFunctionList returning the fake PKCS #11 module.
+ */
+CK_RV C_GetFunctionList( CK_FUNCTION_LIST_PTR_PTR ppFunctionList )
+{
+    *ppFunctionList = &testFunctionList;
+
+    return CKR_OK;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Thread leasing a session on #SESSION_POOL_TEST_SLOT.
+ */
+static void * leaseThread( void * pArgument )
+{
+    ( void ) pArgument;
+
+    if( Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &threadSession ) == CKR_OK )
+    {
+        threadLeased = true;
+    }
+
+    return NULL;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the PKCS #11 session pool.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11SessionPoolTest );
+
+
+/**
+ * @brief Test setup function for the PKCS #11 session pool.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11SessionPoolTest )
+{
+    memset( &testFunctionList, 0, sizeof( testFunctionList ) );
+    testFunctionList.C_OpenSession = fakeOpenSession;
+    testFunctionList.C_CloseSession = fakeCloseSession;
+    openSessionCalls = 0U;
+    closeSessionCalls = 0U;
+    lastOpenedSlot = 0U;
+    openSessionResult = CKR_OK;
+    threadSession = CK_INVALID_HANDLE;
+    threadLeased = false;
+}
+
+/**
+ * @brief Test tear down function for the PKCS #11 session pool.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11SessionPoolTest )
+{
+    Mbedtls_Pkcs11_SessionPoolClose();
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ReuseTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_NOT_EQUAL( CK_INVALID_HANDLE, firstSession );
+    TEST_ASSERT_EQUAL( SESSION_POOL_TEST_SLOT, lastOpenedSlot );
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+
+    /* The returned session is leased again without opening a new one. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    TEST_ASSERT_EQUAL( firstSession, secondSession );
+    TEST_ASSERT_EQUAL_UINT32( 1U, openSessionCalls );
+    TEST_ASSERT_EQUAL_UINT32( 0U, closeSessionCalls );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ConcurrentLeaseTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+
+    /* Sessions leased at the same time are distinct. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    TEST_ASSERT_NOT_EQUAL( firstSession, secondSession );
+    TEST_ASSERT_EQUAL_UINT32( 2U, openSessionCalls );
+
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ExhaustedTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+    pthread_t thread;
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+
+    /* A lease waits while all the sessions are leased. */
+    TEST_ASSERT_EQUAL_INT( 0, pthread_create( &thread, NULL, leaseThread, NULL ) );
+    usleep( SESSION_POOL_TEST_WAIT_US );
+    TEST_ASSERT_EQUAL_MESSAGE( false, threadLeased, "The lease did not wait for a returned session." );
+
+    /* It gets the session returned first. */
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+    TEST_ASSERT_EQUAL_INT( 0, pthread_join( thread, NULL ) );
+    TEST_ASSERT_TRUE( threadLeased );
+    TEST_ASSERT_EQUAL( secondSession, threadSession );
+    TEST_ASSERT_EQUAL_UINT32( 2U, openSessionCalls );
+
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+    Mbedtls_Pkcs11_SessionPoolReturn( threadSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_DiscardTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, true );
+    TEST_ASSERT_EQUAL_UINT32( 1U, closeSessionCalls );
+
+    /* A discarded session is not leased again. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    TEST_ASSERT_NOT_EQUAL( firstSession, secondSession );
+    TEST_ASSERT_EQUAL_UINT32( 2U, openSessionCalls );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_OtherSlotTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE otherSession = CK_INVALID_HANDLE;
+
+    /* Fill the pool with idle sessions of one slot. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+
+    /* An idle session of the first slot is closed for the other slot. */
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_OTHER_SLOT, &otherSession ) );
+    TEST_ASSERT_EQUAL( SESSION_POOL_TEST_OTHER_SLOT, lastOpenedSlot );
+    TEST_ASSERT_EQUAL_UINT32( 1U, closeSessionCalls );
+    TEST_ASSERT_NOT_EQUAL( firstSession, otherSession );
+    TEST_ASSERT_NOT_EQUAL( secondSession, otherSession );
+    Mbedtls_Pkcs11_SessionPoolReturn( otherSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_OpenFailureTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+
+    openSessionResult = CKR_DEVICE_ERROR;
+    TEST_ASSERT_EQUAL( CKR_DEVICE_ERROR, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CK_INVALID_HANDLE, firstSession );
+
+    /* The failed lease does not hold an entry of the pool. */
+    openSessionResult = CKR_OK;
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_CloseTest )
+{
+    CK_SESSION_HANDLE firstSession = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE secondSession = CK_INVALID_HANDLE;
+
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &firstSession ) );
+    TEST_ASSERT_EQUAL( CKR_OK, Mbedtls_Pkcs11_SessionPoolLease( SESSION_POOL_TEST_SLOT, &secondSession ) );
+    Mbedtls_Pkcs11_SessionPoolReturn( firstSession, false );
+
+    /* The idle session is closed at once, the leased one when it is returned. */
+    Mbedtls_Pkcs11_SessionPoolClose();
+    TEST_ASSERT_EQUAL_UINT32( 1U, closeSessionCalls );
+    Mbedtls_Pkcs11_SessionPoolReturn( secondSession, false );
+    TEST_ASSERT_EQUAL_UINT32( 2U, closeSessionCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the PKCS #11 session pool.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11SessionPoolTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ReuseTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ConcurrentLeaseTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_ExhaustedTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_DiscardTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_OtherSlotTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_OpenFailureTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SessionPoolTest, MbedtlsPkcs11SessionPool_CloseTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11SessionPoolTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11SessionPoolTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11SessionPoolTest();
+}
@@ -0,0 +1 @@
+#define UNITY_FIXTURE_NO_EXTRAS
\ No newline at end of file
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "mbedtls_pkcs11_sign.h"
+#include "mbedtls_pkcs11_session_pool.h"
+
+/* MbedTLS includes. */
+#include "mbedtls/pk.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Slot and key of the fake PKCS #11 module.
+ */
+#define SIGN_TEST_SLOT           ( 2U )
+#define SIGN_TEST_PRIVATE_KEY    ( 7U )
+
+/**
+ * @brief Length of a SHA-256 hash, and of the raw P-256 signature of the token.
+ */
+#define SIGN_TEST_HASH_LENGTH         ( 32U )
+#define SIGN_TEST_SIGNATURE_LENGTH    ( 64U )
+
+/*-----------------------------------------------------------*/
+
+static CK_FUNCTION_LIST testFunctionList;
+
+/**
+ * @brief Results returned by the fake PKCS #11 module.
+ */
+static CK_RV openSessionResult = CKR_OK;
+static CK_RV signResult = CKR_OK;
+
+/**
+ * @brief Number of calls to the fake PKCS #11 module.
+ */
+static uint32_t openSessionCalls = 0U;
+static uint32_t closeSessionCalls = 0U;
+static uint32_t signInitCalls = 0U;
+static uint32_t signCalls = 0U;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Fake C_OpenSession. Each session has a new handle.
+ */
+static CK_RV fakeOpenSession( CK_SLOT_ID slotID,
+                              CK_FLAGS flags,
+                              CK_VOID_PTR pApplication,
+                              CK_NOTIFY notify,
+                              CK_SESSION_HANDLE_PTR phSession )
+{
+    static CK_SESSION_HANDLE nextSession = 1U;
+
+    ( void ) slotID;
+    ( void ) flags;
+    ( void ) pApplication;
+    ( void ) notify;
+
+    openSessionCalls++;
+
+    if( openSessionResult == CKR_OK )
+    {
+        *phSession = nextSession;
+        nextSession++;
+    }
+
+    return openSessionResult;
+}
+
+/**
+ * @brief Fake C_CloseSession.
+ */
+static CK_RV fakeCloseSession( CK_SESSION_HANDLE hSession )
+{
+    ( void ) hSession;
+
+    closeSessionCalls++;
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_SignInit. Only the ECDSA mechanism with the test key is
+ * expected.
+ */
+static CK_RV fakeSignInit( CK_SESSION_HANDLE hSession,
+                           CK_MECHANISM_PTR pMechanism,
+                           CK_OBJECT_HANDLE hKey )
+{
+    ( void ) hSession;
+
+    signInitCalls++;
+
+    TEST_ASSERT_EQUAL( CKM_ECDSA, pMechanism->mechanism );
+    TEST_ASSERT_EQUAL( SIGN_TEST_PRIVATE_KEY, hKey );
+
+    return CKR_OK;
+}
+
+/**
+ * @brief Fake C_Sign returning a raw P-256 signature.
+ */
+static CK_RV fakeSign( CK_SESSION_HANDLE hSession,
+                       CK_BYTE_PTR pData,
+                       CK_ULONG ulDataLen,
+                       CK_BYTE_PTR pSignature,
+                       CK_ULONG_PTR pulSignatureLen )
+{
+    ( void ) hSession;
+    ( void ) pData;
+
+    signCalls++;
+
+    TEST_ASSERT_EQUAL( SIGN_TEST_HASH_LENGTH, ulDataLen );
+
+    if( signResult == CKR_OK )
+    {
+        memset( pSignature, 0x5A, SIGN_TEST_SIGNATURE_LENGTH );
+        *pulSignatureLen = SIGN_TEST_SIGNATURE_LENGTH;
+    }
+
+    return signResult;
+}
+
+/**
+ * @brief Fake C_GetFunctionList returning the fake PKCS #11 module to the
+ * session pool.
+ */
+CK_RV C_GetFunctionList( CK_FUNCTION_LIST_PTR_PTR ppFunctionList )
+{
+    *ppFunctionList = &testFunctionList;
+
+    return CKR_OK;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Sign a test hash with the EC test key.
+ */
+static int32_t signTestHash( unsigned char * pSig,
+                             size_t * pSigLen )
+{
+    unsigned char hash[ SIGN_TEST_HASH_LENGTH ];
+
+    memset( hash, 0x11, sizeof( hash ) );
+
+    return Mbedtls_Pkcs11_Sign( &testFunctionList,
+                                SIGN_TEST_SLOT,
+                                SIGN_TEST_PRIVATE_KEY,
+                                CKK_EC,
+                                hash,
+                                sizeof( hash ),
+                                pSig,
+                                pSigLen );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group for the PKCS #11 signatures of the transport.
+ */
+TEST_GROUP( Full_MbedtlsPkcs11SignTest );
+
+
+/**
+ * @brief Test setup function for the PKCS #11 signatures of the transport.
+ */
+TEST_SETUP( Full_MbedtlsPkcs11SignTest )
+{
+    memset( &testFunctionList, 0, sizeof( testFunctionList ) );
+    testFunctionList.C_OpenSession = fakeOpenSession;
+    testFunctionList.C_CloseSession = fakeCloseSession;
+    testFunctionList.C_SignInit = fakeSignInit;
+    testFunctionList.C_Sign = fakeSign;
+    openSessionResult = CKR_OK;
+    signResult = CKR_OK;
+    openSessionCalls = 0U;
+    closeSessionCalls = 0U;
+    signInitCalls = 0U;
+    signCalls = 0U;
+}
+
+/**
+ * @brief Test tear down function for the PKCS #11 signatures of the transport.
+ */
+TEST_TEAR_DOWN( Full_MbedtlsPkcs11SignTest )
+{
+    Mbedtls_Pkcs11_SessionPoolClose();
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_EcSignatureTest )
+{
+    unsigned char signature[ 256 ];
+    size_t signatureLength = 0U;
+
+    TEST_ASSERT_EQUAL_INT32( 0, signTestHash( signature, &signatureLength ) );
+    TEST_ASSERT_EQUAL_UINT32( 1U, signCalls );
+
+    /* The raw signature of the token is converted to an ASN.1 sequence. */
+    TEST_ASSERT_EQUAL_HEX8( 0x30, signature[ 0 ] );
+    TEST_ASSERT_EQUAL( signatureLength - 2U, signature[ 1 ] );
+
+    /* The session is kept for the next signature. */
+    TEST_ASSERT_EQUAL_UINT32( 0U, closeSessionCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_LeaseFailureTest )
+{
+    unsigned char signature[ 256 ];
+    size_t signatureLength = 0U;
+
+    openSessionResult = CKR_SESSION_COUNT;
+
+    TEST_ASSERT_EQUAL_INT32( MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE, signTestHash( signature, &signatureLength ) );
+    TEST_ASSERT_EQUAL_UINT32( 1U, openSessionCalls );
+    TEST_ASSERT_EQUAL_UINT32( 0U, signInitCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_SignFailureTest )
+{
+    unsigned char signature[ 256 ];
+    size_t signatureLength = 0U;
+
+    signResult = CKR_DEVICE_ERROR;
+
+    TEST_ASSERT_EQUAL_INT32( MBEDTLS_ERR_PK_FEATURE_UNAVAILABLE, signTestHash( signature, &signatureLength ) );
+    TEST_ASSERT_EQUAL_UINT32( 1U, signCalls );
+
+    /* The session of the failed operation is closed. */
+    TEST_ASSERT_EQUAL_UINT32( openSessionCalls, closeSessionCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_BadKeyTypeTest )
+{
+    unsigned char hash[ SIGN_TEST_HASH_LENGTH ] = { 0 };
+    unsigned char signature[ 256 ];
+    size_t signatureLength = 0U;
+
+    TEST_ASSERT_EQUAL_INT32( MBEDTLS_ERR_PK_BAD_INPUT_DATA,
+                             Mbedtls_Pkcs11_Sign( &testFunctionList,
+                                                  SIGN_TEST_SLOT,
+                                                  SIGN_TEST_PRIVATE_KEY,
+                                                  CKK_DSA,
+                                                  hash,
+                                                  sizeof( hash ),
+                                                  signature,
+                                                  &signatureLength ) );
+    TEST_ASSERT_EQUAL_UINT32( 0U, openSessionCalls );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the PKCS #11 signatures of the transport.
+ */
+TEST_GROUP_RUNNER( Full_MbedtlsPkcs11SignTest )
+{
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_EcSignatureTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_LeaseFailureTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_SignFailureTest );
+    RUN_TEST_CASE( Full_MbedtlsPkcs11SignTest, MbedtlsPkcs11Sign_BadKeyTypeTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMbedtlsPkcs11SignTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MbedtlsPkcs11SignTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMbedtlsPkcs11SignTest();
+}
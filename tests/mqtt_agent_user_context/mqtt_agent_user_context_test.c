@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mqtt_agent.h"
+
+/* Include for Unity framework. */
+#include "unity.h"
+#include "unity_fixture.h"
+
+/*-----------------------------------------------------------*/
+
+#define USER_CONTEXT_TEST_QUEUE_SIZE    4U
+
+#define USER_CONTEXT_TEST_TOPIC         "test/user/context"
+
+/**
+ * @brief Allocations of the agent not freed yet.
+ */
+static int32_t outstandingAllocations = 0;
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Callback of the agent enqueuing an incoming publish in the user
+ * context.
+ */
+extern void mqttAgentEnqueuePublishCallback( void * pCallbackContext,
+                                             MQTTPublishInfo_t * pPublsihInfo );
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Allocator of the agent, built with iotshdPal_Malloc=testMalloc.
+ */
+void * testMalloc( size_t size )
+{
+    void * pMemory = malloc( size );
+
+    if( pMemory != NULL )
+    {
+        outstandingAllocations++;
+    }
+
+    return pMemory;
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Deallocator of the agent, built with iotshdPal_Free=testFree.
+ */
+void testFree( void * pMemory )
+{
+    if( pMemory != NULL )
+    {
+        outstandingAllocations--;
+    }
+
+    free( pMemory );
+}
+
+/*-----------------------------------------------------------*/
+
+static void enqueuePublish( iotshdDev_MQTTAgentUserContext_t * pUserContext,
+                            uint32_t index )
+{
+    MQTTPublishInfo_t publishInfo;
+    char payload[ 32 ];
+
+    ( void ) snprintf( payload, sizeof( payload ), "payload %u", ( unsigned ) index );
+
+    memset( &publishInfo, 0, sizeof( publishInfo ) );
+    publishInfo.qos = MQTTQoS1;
+    publishInfo.pTopicName = USER_CONTEXT_TEST_TOPIC;
+    publishInfo.topicNameLength = ( uint16_t ) strlen( USER_CONTEXT_TEST_TOPIC );
+    publishInfo.pPayload = payload;
+    publishInfo.payloadLength = strlen( payload );
+
+    mqttAgentEnqueuePublishCallback( pUserContext, &publishInfo );
+}
+
+/*-----------------------------------------------------------*/
+
+TEST_GROUP( Full_MqttAgentUserContextTest );
+
+TEST_SETUP( Full_MqttAgentUserContextTest )
+{
+    outstandingAllocations = 0;
+}
+
+TEST_TEAR_DOWN( Full_MqttAgentUserContextTest )
+{
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Create a user context, fill its queue and delete it with the
+ * publishes still queued, one of them dequeued and not given back.
+ */
+TEST( Full_MqttAgentUserContextTest, MqttAgentUserContext_DeleteFilledTest )
+{
+    iotshdDev_MQTTAgentUserContext_t * pUserContext;
+    iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
+    uint32_t i;
+
+    pUserContext = iotshdDev_MQTTAgentCreateUserContext( USER_CONTEXT_TEST_QUEUE_SIZE );
+    TEST_ASSERT_NOT_NULL( pUserContext );
+
+    /* The last publish finds no free item and is dropped. */
+    for( i = 0; i <= USER_CONTEXT_TEST_QUEUE_SIZE; i++ )
+    {
+        enqueuePublish( pUserContext, i );
+    }
+
+    pQueueItem = iotshdDev_MQTTAgentDequeueIncommingPublish( pUserContext, 0U );
+    TEST_ASSERT_NOT_NULL( pQueueItem );
+    TEST_ASSERT_EQUAL( strlen( USER_CONTEXT_TEST_TOPIC ), pQueueItem->publishInfo.topicNameLength );
+    TEST_ASSERT_EQUAL_MEMORY( USER_CONTEXT_TEST_TOPIC,
+                              pQueueItem->publishInfo.pTopicName,
+                              pQueueItem->publishInfo.topicNameLength );
+
+    iotshdDev_MQTTAgentDeleteUserContext( pUserContext );
+
+    TEST_ASSERT_EQUAL_INT32( 0, outstandingAllocations );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Items given back keep their buffers for the next publishes, which are
+ * freed with the user context.
+ */
+TEST( Full_MqttAgentUserContextTest, MqttAgentUserContext_DeleteRecycledTest )
+{
+    iotshdDev_MQTTAgentUserContext_t * pUserContext;
+    iotshdDev_MQTTAgentQueueItem_t * pQueueItem;
+    uint32_t i;
+
+    pUserContext = iotshdDev_MQTTAgentCreateUserContext( USER_CONTEXT_TEST_QUEUE_SIZE );
+    TEST_ASSERT_NOT_NULL( pUserContext );
+
+    for( i = 0; i < USER_CONTEXT_TEST_QUEUE_SIZE; i++ )
+    {
+        enqueuePublish( pUserContext, i );
+        pQueueItem = iotshdDev_MQTTAgentDequeueIncommingPublish( pUserContext, 0U );
+        TEST_ASSERT_NOT_NULL( pQueueItem );
+        iotshdDev_MQTTAgentFreeIncommingPublish( pUserContext, pQueueItem, false );
+    }
+
+    enqueuePublish( pUserContext, i );
+
+    iotshdDev_MQTTAgentDeleteUserContext( pUserContext );
+
+    TEST_ASSERT_EQUAL_INT32( 0, outstandingAllocations );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief A user context without queue is created and deleted.
+ */
+TEST( Full_MqttAgentUserContextTest, MqttAgentUserContext_NoQueueTest )
+{
+    iotshdDev_MQTTAgentUserContext_t * pUserContext;
+
+    pUserContext = iotshdDev_MQTTAgentCreateUserContext( 0U );
+    TEST_ASSERT_NOT_NULL( pUserContext );
+    TEST_ASSERT_NULL( pUserContext->pIncommingPublishQueue );
+    TEST_ASSERT_NULL( pUserContext->pQueueItems );
+
+    iotshdDev_MQTTAgentDeleteUserContext( pUserContext );
+
+    TEST_ASSERT_EQUAL_INT32( 0, outstandingAllocations );
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Test group runner for the user context of the MQTT agent.
+ */
+TEST_GROUP_RUNNER( Full_MqttAgentUserContextTest )
+{
+    RUN_TEST_CASE( Full_MqttAgentUserContextTest, MqttAgentUserContext_DeleteFilledTest );
+    RUN_TEST_CASE( Full_MqttAgentUserContextTest, MqttAgentUserContext_DeleteRecycledTest );
+    RUN_TEST_CASE( Full_MqttAgentUserContextTest, MqttAgentUserContext_NoQueueTest );
+}
+
+/*-----------------------------------------------------------*/
+
+int RunMqttAgentUserContextTest( void )
+{
+    int status = -1;
+
+    /* Initialize unity. */
+    UnityFixture.Verbose = 1;
+    UnityFixture.GroupFilter = 0;
+    UnityFixture.NameFilter = 0;
+    UnityFixture.RepeatCount = 1;
+    UNITY_BEGIN();
+
+    /* Run the test group. */
+    RUN_TEST_GROUP( Full_MqttAgentUserContextTest );
+
+    status = UNITY_END();
+
+    return status;
+}
+
+/*-----------------------------------------------------------*/
+
+int main( int argc, char ** argv )
+{
+    ( void ) argc;
+    ( void ) argv;
+
+    return RunMqttAgentUserContextTest();
+}
@@ -1,3 +1,5 @@
+#include <poll.h>
+
 #include "pal_queue.h"
 
 /* Include for Unity framework. */
@@ -289,6 +291,54 @@ TEST( Full_PalSyncQueueTest, PalSyncQueue_MultipleProducers )
 
 /*-----------------------------------------------------------*/
 
+TEST( Full_PalSyncQueueTest, PalSyncQueue_WakeupFdTest )
+{
+    int i;
+    int receiveItem;
+    int wakeupFd;
+    bool retStatus;
+    struct pollfd pollFd;
+
+    pSyncQueue = iotshdPal_syncQueueCreate( PAL_SYNC_QUEUE_TEST_ITEMS, sizeof( int ) );
+    TEST_ASSERT_NOT_EQUAL_MESSAGE( NULL, pSyncQueue, "Can't create sync queue" ) ;
+
+    /* Items sent before the file descriptor is created are counted. */
+    i = 0;
+    retStatus = iotshdPal_syncQueueSend( pSyncQueue, &i, 100 );
+    TEST_ASSERT_EQUAL_MESSAGE( true, retStatus, "Queue send return error." );
+
+    wakeupFd = iotshdPal_syncQueueGetWakeupFd( pSyncQueue );
+    TEST_ASSERT_GREATER_OR_EQUAL_INT_MESSAGE( 0, wakeupFd, "Can't get wakeup file descriptor." );
+    TEST_ASSERT_EQUAL_MESSAGE( wakeupFd, iotshdPal_syncQueueGetWakeupFd( pSyncQueue ), "Wakeup file descriptor changed." );
+
+    pollFd.fd = wakeupFd;
+    pollFd.events = POLLIN;
+    for( i = 1; i < PAL_SYNC_QUEUE_TEST_ITEMS; i++ )
+    {
+        retStatus = iotshdPal_syncQueueSend( pSyncQueue, &i, 100 );
+        TEST_ASSERT_EQUAL_MESSAGE( true, retStatus, "Queue send return error." );
+    }
+
+    /* The file descriptor is readable until the last item is received. */
+    for( i = 0; i < PAL_SYNC_QUEUE_TEST_ITEMS; i++ )
+    {
+        pollFd.revents = 0;
+        TEST_ASSERT_EQUAL_MESSAGE( 1, poll( &pollFd, 1, 0 ), "Wakeup file descriptor is not readable." );
+
+        retStatus = iotshdPal_syncQueueReceive( pSyncQueue, &receiveItem, 100 );
+        TEST_ASSERT_EQUAL_MESSAGE( true, retStatus, "Queue receive return error." );
+        TEST_ASSERT_EQUAL_MESSAGE( i, receiveItem, "Send and receive item is not equal." );
+    }
+
+    pollFd.revents = 0;
+    TEST_ASSERT_EQUAL_MESSAGE( 0, poll( &pollFd, 1, 0 ), "Wakeup file descriptor is readable with empty queue." );
+
+    iotshdPal_syncQueueDelete( pSyncQueue );
+    pSyncQueue = NULL;
+}
+
+/*-----------------------------------------------------------*/
+
 /**
  * @brief Test group runner for transport interface test against echo server.
  */
@@ -301,6 +351,8 @@ TEST_GROUP_RUNNER( Full_PalSyncQueueTest )
     RUN_TEST_CASE( Full_PalSyncQueueTest, PalSyncQueue_SendTimeoutTest );
 
     RUN_TEST_CASE( Full_PalSyncQueueTest, PalSyncQueue_MultipleProducers );
+
+    RUN_TEST_CASE( Full_PalSyncQueueTest, PalSyncQueue_WakeupFdTest );
 }
 
 /*-----------------------------------------------------------*/